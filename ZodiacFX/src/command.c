@@ -39,8 +39,11 @@
 #include "flash.h"
 #include "openflow/openflow.h"
 #include "openflow/of_helper.h"
+#include "openflow/snapshot.h"
+#include "openflow/standalone.h"
 #include "lwip/def.h"
 #include "timers.h"
+#include "slab.h"
 #include "lwip/ip_addr.h"
 #include "lwip/tcp.h"
 
@@ -51,26 +54,28 @@ extern struct zodiac_config Zodiac_Config;
 extern bool debug_output;
 
 extern int charcount, charcount_last;
-extern struct ofp_flow_mod *flow_match10[MAX_FLOWS_10];
-extern struct ofp13_flow_mod *flow_match13[MAX_FLOWS_13];
-extern uint8_t *ofp13_oxm_match[MAX_FLOWS_13];
-extern uint8_t *ofp13_oxm_inst[MAX_FLOWS_13];
-extern uint16_t ofp13_oxm_inst_size[MAX_FLOWS_13];
-extern struct flows_counter flow_counters[MAX_FLOWS_13];
-extern struct flow_tbl_actions *flow_actions10[MAX_FLOWS_13];
+extern struct flow_entry13 **flow_match13;
+extern struct flows_counter *flow_counters;
+extern int max_flows;
 extern int iLastFlow;
+extern int flow_count;
 extern struct ofp10_port_stats phys10_port_stats[4];
 extern struct ofp13_port_stats phys13_port_stats[4];
 extern struct table_counter table_counters[MAX_TABLES];
 extern bool masterselect;
 extern bool stackenabled = false;
 extern bool trace = false;
-extern struct tcp_pcb *tcp_pcb;
 extern uint8_t port_status[4];
 extern int totaltime;
 extern int32_t ul_temp;
 extern int OF_Version;
 extern uint32_t uid_buf[4];
+extern struct slab flow_slab;
+extern struct slab packet_slab;
+extern struct slab ctrl_slab;
+extern struct of_controller controllers[MAX_CONTROLLERS];
+extern struct packet_in_stats packet_in_stats;
+extern struct standalone_stats standalone_stats;
 
 // Local Variables
 bool showintro = true;
@@ -87,6 +92,7 @@ void command_openflow(char *command, char *param1, char *param2, char *param3);
 void command_debug(char *command, char *param1, char *param2, char *param3);
 void printintro(void);
 void printhelp(void);
+void print_slab(const char *name, struct slab *s);
 
 
 /*
@@ -423,6 +429,21 @@ void command_root(char *command, char *param1, char *param2, char *param3)
 		// Force OpenFlow version
 		reset_config.of_version = 0;			// Force version disabled
 
+		// Flow snapshot
+		reset_config.flow_snapshot = 0;		// Flow snapshot disabled
+
+		// Packet-in rate limits
+		reset_config.packet_in_rate[0] = PACKET_IN_RATE_MISS;	// Table misses per second per port
+		reset_config.packet_in_rate[1] = PACKET_IN_RATE_ACTION;	// Output to controller actions per second per port
+
+		// Second controller
+		memset(&reset_config.OFIP_address2, 0, 4);	// No second controller
+		reset_config.OFPort2 = 6633;
+
+		// Controller liveness
+		reset_config.hb_interval = HB_INTERVAL;	// Echo request after 2 seconds without hearing from the controller
+		reset_config.hb_timeout = HB_TIMEOUT;	// Reset the connection after 6 seconds
+
 		memcpy(&reset_config.MAC_address, &Zodiac_Config.MAC_address, 6);		// Copy over existing MAC address so it is not reset
 		memcpy(&Zodiac_Config, &reset_config, sizeof(struct zodiac_config));
 		saveConfig();
@@ -501,10 +522,20 @@ void command_config(char *command, char *param1, char *param2, char *param3)
 		printf(" Gateway: %d.%d.%d.%d\r\n" , Zodiac_Config.gateway_address[0], Zodiac_Config.gateway_address[1], Zodiac_Config.gateway_address[2], Zodiac_Config.gateway_address[3]);
 		printf(" OpenFlow Controller: %d.%d.%d.%d\r\n" , Zodiac_Config.OFIP_address[0], Zodiac_Config.OFIP_address[1], Zodiac_Config.OFIP_address[2], Zodiac_Config.OFIP_address[3]);
 		printf(" OpenFlow Port: %d\r\n" , Zodiac_Config.OFPort);
+		if (Zodiac_Config.OFIP_address2[0] != 0 && Zodiac_Config.OFIP_address2[0] != 255)
+		{
+			printf(" OpenFlow Controller 2: %d.%d.%d.%d\r\n" , Zodiac_Config.OFIP_address2[0], Zodiac_Config.OFIP_address2[1], Zodiac_Config.OFIP_address2[2], Zodiac_Config.OFIP_address2[3]);
+			printf(" OpenFlow Port 2: %d\r\n" , Zodiac_Config.OFPort2);
+		} else {
+			printf(" OpenFlow Controller 2: None\r\n");
+		}
 		if (Zodiac_Config.OFEnabled == OF_ENABLED) printf(" Openflow Status: Enabled\r\n");
 		if (Zodiac_Config.OFEnabled == OF_DISABLED) printf(" Openflow Status: Disabled\r\n");
+		printf(" Heartbeat: echo after %d ms, reset after %d ms\r\n", (int)heartbeat_interval(), (int)heartbeat_timeout());
 		if (Zodiac_Config.failstate == 0) printf(" Failstate: Secure\r\n");
 		if (Zodiac_Config.failstate == 1) printf(" Failstate: Safe\r\n");
+		if (Zodiac_Config.failstate == FAILSTATE_STANDALONE) printf(" Failstate: Standalone\r\n");
+		if (Zodiac_Config.failstate == FAILSTATE_STANDALONE_HW) printf(" Failstate: Standalone (KSZ8795)\r\n");
 		if (Zodiac_Config.of_version == 1) {
 			printf(" Force OpenFlow version: 1.0 (0x01)\r\n");
 		} else if (Zodiac_Config.of_version == 4){
@@ -518,6 +549,14 @@ void command_config(char *command, char *param1, char *param2, char *param3)
 		if (stackenabled == false) printf(" Stacking Select: Disabled\r\n");
 		if (Zodiac_Config.ethtype_filter == 1) printf(" EtherType Filtering: Enabled\r\n");
 		if (Zodiac_Config.ethtype_filter != 1) printf(" EtherType Filtering: Disabled\r\n");
+		if (Zodiac_Config.flow_snapshot == 1) printf(" Flow Snapshot: Enabled\r\n");
+		if (Zodiac_Config.flow_snapshot != 1) printf(" Flow Snapshot: Disabled\r\n");
+		printf(" Packet-in Rate: %d table miss, %d action per second per port (0 = unlimited)\r\n", (int)packet_in_rate(OFPR_NO_MATCH), (int)packet_in_rate(OFPR_ACTION));
+		for (int i=0;i<4;i++)
+		{
+			if (Zodiac_Config.ingress_limit[i] != 0) printf(" Port %d Ingress Limit: %d kbps\r\n", i+1, ratelimit_decode(Zodiac_Config.ingress_limit[i]));
+			if (Zodiac_Config.egress_limit[i] != 0) printf(" Port %d Egress Limit: %d kbps\r\n", i+1, ratelimit_decode(Zodiac_Config.egress_limit[i]));
+		}
 		printf("\r\n-------------------------------------------------------------------------\r\n\n");
 		return;
 	}
@@ -646,6 +685,7 @@ void command_config(char *command, char *param1, char *param2, char *param3)
 				if(Zodiac_Config.vlan_list[x].portmap[port-1] == 0  || Zodiac_Config.vlan_list[x].portmap[port-1] > 1 ){
 					Zodiac_Config.vlan_list[x].portmap[port-1] = 1;
 					Zodiac_Config.of_port[port-1] = Zodiac_Config.vlan_list[x].uVlanType;
+					update_port_masks();
 					printf("Port %d is now assigned to VLAN %d\r\n", port, vlanid);
 					return;
 				}
@@ -672,6 +712,7 @@ void command_config(char *command, char *param1, char *param2, char *param3)
 			{
 				Zodiac_Config.vlan_list[x].portmap[port-1] = 0;
 				Zodiac_Config.of_port[port-1] = 0;
+				update_port_masks();
 				printf("Port %d has been removed from VLAN %d\r\n", port, Zodiac_Config.vlan_list[x].uVlanID);
 				return;
 			}
@@ -796,6 +837,50 @@ void command_config(char *command, char *param1, char *param2, char *param3)
 		return;
 	}
 
+	// Set the controller heartbeat
+	if (strcmp(command, "set")==0 && strcmp(param1, "heartbeat")==0)
+	{
+		int interval = -1;
+		int timeout = -1;
+		sscanf(param2, "%d", &interval);
+		sscanf(param3, "%d", &timeout);
+		if (interval < HB_MIN || interval > 60000 || timeout <= interval || timeout > 60000)
+		{
+			printf("Invalid value, usage: set heartbeat <interval ms> <timeout ms> (%d - 60000, timeout longer than interval)\r\n", HB_MIN);
+			return;
+		}
+		Zodiac_Config.hb_interval = interval;
+		Zodiac_Config.hb_timeout = timeout;
+		printf("Heartbeat set to an echo after %d ms, reset after %d ms\r\n", interval, timeout);
+		return;
+	}
+
+	// Set the second OpenFlow Controller IP Address, 0.0.0.0 for none
+	if (strcmp(command, "set")==0 && strcmp(param1, "of-controller2")==0)
+	{
+		int oc1,oc2,oc3,oc4;
+		if (strlen(param2) > 15 )
+		{
+			printf("incorrect format\r\n");
+			return;
+		}
+		sscanf(param2, "%d.%d.%d.%d", &oc1,&oc2,&oc3,&oc4);
+		Zodiac_Config.OFIP_address2[0] = oc1;
+		Zodiac_Config.OFIP_address2[1] = oc2;
+		Zodiac_Config.OFIP_address2[2] = oc3;
+		Zodiac_Config.OFIP_address2[3] = oc4;
+		printf("Second OpenFlow Server address set to %d.%d.%d.%d\r\n" , Zodiac_Config.OFIP_address2[0], Zodiac_Config.OFIP_address2[1], Zodiac_Config.OFIP_address2[2], Zodiac_Config.OFIP_address2[3]);
+		return;
+	}
+
+	// Set the second OpenFlow Controller Port
+	if (strcmp(command, "set")==0 && strcmp(param1, "of-port2")==0)
+	{
+		sscanf(param2, "%d", &Zodiac_Config.OFPort2);
+		printf("Second OpenFlow Port set to %d\r\n" , Zodiac_Config.OFPort2);
+		return;
+	}
+
 	// Reset the device to a basic configuration
 	if (strcmp(command, "factory")==0 && strcmp(param1, "reset")==0)
 	{
@@ -842,6 +927,21 @@ void command_config(char *command, char *param1, char *param2, char *param3)
 		// Force OpenFlow version
 		reset_config.of_version = 0;			// Force version disabled
 
+		// Flow snapshot
+		reset_config.flow_snapshot = 0;		// Flow snapshot disabled
+
+		// Packet-in rate limits
+		reset_config.packet_in_rate[0] = PACKET_IN_RATE_MISS;	// Table misses per second per port
+		reset_config.packet_in_rate[1] = PACKET_IN_RATE_ACTION;	// Output to controller actions per second per port
+
+		// Second controller
+		memset(&reset_config.OFIP_address2, 0, 4);	// No second controller
+		reset_config.OFPort2 = 6633;
+
+		// Controller liveness
+		reset_config.hb_interval = HB_INTERVAL;	// Echo request after 2 seconds without hearing from the controller
+		reset_config.hb_timeout = HB_TIMEOUT;	// Reset the connection after 6 seconds
+
 		memcpy(&reset_config.MAC_address, &Zodiac_Config.MAC_address, 6);		// Copy over existng MAC address so it is not reset
 		memcpy(&Zodiac_Config, &reset_config, sizeof(struct zodiac_config));
 		saveConfig();
@@ -857,6 +957,12 @@ void command_config(char *command, char *param1, char *param2, char *param3)
 		} else if (strcmp(param2, "safe")==0){
 			Zodiac_Config.failstate = 1;
 			printf("Failstate set to Safe\r\n");
+		} else if (strcmp(param2, "standalone")==0){
+			Zodiac_Config.failstate = FAILSTATE_STANDALONE;
+			printf("Failstate set to Standalone\r\n");
+		} else if (strcmp(param2, "standalone-hw")==0){
+			Zodiac_Config.failstate = FAILSTATE_STANDALONE_HW;
+			printf("Failstate set to Standalone, switched by the KSZ8795\r\n");
 		} else {
 			printf("Invalid failstate type\r\n");
 		}
@@ -898,6 +1004,65 @@ void command_config(char *command, char *param1, char *param2, char *param3)
 		}
 		return;
 	}
+
+	// Enable saving the flow table to flash
+	if (strcmp(command, "set")==0 && strcmp(param1, "flow-snapshot")==0)
+	{
+		if (strcmp(param2, "disable")==0){
+			Zodiac_Config.flow_snapshot = 0;
+			printf("Flow Snapshot Disabled\r\n");
+		} else if (strcmp(param2, "enable")==0){
+			Zodiac_Config.flow_snapshot = 1;
+			printf("Flow Snapshot Enabled\r\n");
+		} else {
+			printf("Invalid value\r\n");
+		}
+		return;
+	}
+
+	// Set packet-in rate limits
+	if (strcmp(command, "set")==0 && strcmp(param1, "packet-in-rate")==0)
+	{
+		int rate = -1;
+		sscanf(param3, "%d", &rate);
+		if (rate < 0 || rate > 65534 || (strcmp(param2, "miss") != 0 && strcmp(param2, "action") != 0))
+		{
+			printf("Invalid value, usage: set packet-in-rate <miss|action> <packets per second (0 = unlimited)>\r\n");
+			return;
+		}
+		Zodiac_Config.packet_in_rate[(strcmp(param2, "miss") == 0) ? 0 : 1] = rate;
+		printf("Packet-in %s rate set to %d per second\r\n", param2, rate);
+		return;
+	}
+
+	// Set port ingress and egress rate limits
+	if (strcmp(command, "set")==0 && (strcmp(param1, "ingress-limit")==0 || strcmp(param1, "egress-limit")==0))
+	{
+		int port = -1;
+		int kbps = -1;
+		sscanf(param2, "%d", &port);
+		sscanf(param3, "%d", &kbps);
+		if (port < 1 || port > 4 || kbps < 0)
+		{
+			printf("Invalid value, usage: set %s <port> <rate in kbps (0 = unlimited)>\r\n", param1);
+			return;
+		}
+		uint8_t code = ratelimit_encode(kbps);
+		if (strcmp(param1, "ingress-limit")==0)
+		{
+			Zodiac_Config.ingress_limit[port-1] = code;
+		} else {
+			Zodiac_Config.egress_limit[port-1] = code;
+		}
+		meter_sync13();	// Any meter offloaded to this port moves back to software
+		if (code == 0)
+		{
+			printf("Port %d %s removed\r\n", port, param1);
+		} else {
+			printf("Port %d %s set to %d kbps\r\n", port, param1, ratelimit_decode(code));
+		}
+		return;
+	}
 	
 	// Unknown Command
 	printf("Unknown command\r\n");
@@ -931,92 +1096,10 @@ void command_openflow(char *command, char *param1, char *param2, char *param3)
 	if (strcmp(command, "show") == 0 && strcmp(param1, "flows") == 0)
 	{
 		int i;
-		struct ofp_action_header * act_hdr;
-		if (iLastFlow > 0)
+		if (flow_count > 0)
 		{
-			// OpenFlow v1.0 (0x01) Flow Table
-			if( OF_Version == 1)
-			{
-				printf("\r\n-------------------------------------------------------------------------\r\n");
-				for (i=0;i<iLastFlow;i++)
-				{
-					printf("\r\nFlow %d\r\n",i+1);
-					printf(" Match:\r\n");
-					printf("  Incoming Port: %d\t\t\tEthernet Type: 0x%.4X\r\n",ntohs(flow_match10[i]->match.in_port), ntohs(flow_match10[i]->match.dl_type));
-					printf("  Source MAC: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X\t\tDestination MAC: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X\r\n",flow_match10[i]->match.dl_src[0], flow_match10[i]->match.dl_src[1], flow_match10[i]->match.dl_src[2], flow_match10[i]->match.dl_src[3], flow_match10[i]->match.dl_src[4], flow_match10[i]->match.dl_src[5] \
-					, flow_match10[i]->match.dl_dst[0], flow_match10[i]->match.dl_dst[1], flow_match10[i]->match.dl_dst[2], flow_match10[i]->match.dl_dst[3], flow_match10[i]->match.dl_dst[4], flow_match10[i]->match.dl_dst[5]);
-					if (ntohs(flow_match10[i]->match.dl_vlan) == 0xffff)
-					{
-						printf("  VLAN ID: N/A\t\t\t\tVLAN Priority: N/A\r\n");
-					} else {
-						printf("  VLAN ID: %d\t\t\t\tVLAN Priority: 0x%x\r\n",ntohs(flow_match10[i]->match.dl_vlan), flow_match10[i]->match.dl_vlan_pcp);
-					}
-					if ((ntohs(flow_match10[i]->match.dl_type) == 0x0800) || (ntohs(flow_match10[i]->match.dl_type) == 0x8100)) printf("  IP Protocol: %d\t\t\tIP ToS Bits: 0x%.2X\r\n",flow_match10[i]->match.nw_proto, flow_match10[i]->match.nw_tos);
-					if (flow_match10[i]->match.nw_proto == 7 || flow_match10[i]->match.nw_proto == 16)
-					{
-						printf("  TCP Source Address: %d.%d.%d.%d\r\n",ip4_addr1(&flow_match10[i]->match.nw_src), ip4_addr2(&flow_match10[i]->match.nw_src), ip4_addr3(&flow_match10[i]->match.nw_src), ip4_addr4(&flow_match10[i]->match.nw_src));
-						printf("  TCP Destination Address: %d.%d.%d.%d\r\n", ip4_addr1(&flow_match10[i]->match.nw_dst), ip4_addr2(&flow_match10[i]->match.nw_dst), ip4_addr3(&flow_match10[i]->match.nw_dst), ip4_addr4(&flow_match10[i]->match.nw_dst));
-						printf("  TCP/UDP Source Port: %d\t\tTCP/UDP Destination Port: %d\r\n",ntohs(flow_match10[i]->match.tp_src), ntohs(flow_match10[i]->match.tp_dst));
-					}
-					if (flow_match10[i]->match.nw_proto == 1)
-					{
-						printf("  ICMP Type: %d\t\t\t\tICMP Code: %d\r\n",ntohs(flow_match10[i]->match.tp_src), ntohs(flow_match10[i]->match.tp_dst));
-					}
-					printf("  Wildcards: 0x%.8x\t\t\tCookie: 0x%" PRIx64 "\r\n",ntohl(flow_match10[i]->match.wildcards), htonll(flow_match10[i]->cookie));
-					printf("\r Attributes:\r\n");
-					printf("  Priority: %d\t\t\tDuration: %d secs\r\n",ntohs(flow_match10[i]->priority), (totaltime/2) - flow_counters[i].duration);
-					printf("  Hard Timeout: %d secs\t\t\tIdle Timeout: %d secs\r\n",ntohs(flow_match10[i]->hard_timeout), ntohs(flow_match10[i]->idle_timeout));
-					printf("  Byte Count: %d\t\t\tPacket Count: %d\r\n",flow_counters[i].bytes, flow_counters[i].hitCount);
-					printf("\r\n Actions:\r\n");
-					for(int q=0;q<4;q++)
-					{
-						if(q == 0) act_hdr = flow_actions10[i]->action1;
-						if(q == 1) act_hdr = flow_actions10[i]->action2;
-						if(q == 2) act_hdr = flow_actions10[i]->action3;
-						if(q == 3) act_hdr = flow_actions10[i]->action4;
-
-						if(act_hdr->len == 0 && q == 0) printf("   DROP\r\n"); // No actions = DROP
-
-						if(act_hdr->len != 0 && ntohs(act_hdr->type) == OFPAT10_OUTPUT) // Output to port action
-						{
-							struct ofp_action_output * action_out = act_hdr;
-							printf("  Action %d:\r\n",q+1);
-							if (ntohs(action_out->port) <= 255) printf("   Output: %d\r\n", ntohs(action_out->port));
-							if (ntohs(action_out->port) == OFPP_IN_PORT) printf("   Output: IN_PORT\r\n");
-							if (ntohs(action_out->port) == OFPP_FLOOD) printf("   Output: FLOOD\r\n");
-							if (ntohs(action_out->port) == OFPP_ALL) printf("   Output: ALL\r\n");
-							if (ntohs(action_out->port) == OFPP_CONTROLLER) printf("   Output: CONTROLLER\r\n");
-						}
-						if(act_hdr->len != 0 && ntohs(act_hdr->type) == OFPAT10_SET_VLAN_VID) //
-						{
-							struct ofp_action_vlan_vid *action_vlanid = act_hdr;
-							printf("  Action %d:\r\n",q+1);
-							printf("   Set VLAN ID: %d\r\n", ntohs(action_vlanid->vlan_vid));
-						}
-
-						if(act_hdr->len != 0 && ntohs(act_hdr->type) == OFPAT10_SET_DL_DST) //
-						{
-							struct ofp_action_dl_addr *action_setdl = act_hdr;
-							printf("  Action %d:\r\n",q+1);
-							printf("   Set Destination MAC: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X\r\n", action_setdl->dl_addr[0],action_setdl->dl_addr[1],action_setdl->dl_addr[2],action_setdl->dl_addr[3],action_setdl->dl_addr[4],action_setdl->dl_addr[5]);
-						}
-						if(act_hdr->len != 0 && ntohs(act_hdr->type) == OFPAT10_SET_DL_SRC) //
-						{
-							struct ofp_action_dl_addr *action_setdl = act_hdr;
-							printf("  Action %d:\r\n",q+1);
-							printf("   Set Source MAC: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X\r\n", action_setdl->dl_addr[0],action_setdl->dl_addr[1],action_setdl->dl_addr[2],action_setdl->dl_addr[3],action_setdl->dl_addr[4],action_setdl->dl_addr[5]);
-						}
-						if(act_hdr->len != 0 && ntohs(act_hdr->type) == OFPAT10_STRIP_VLAN) //
-						{
-							printf("  Action %d:\r\n",q+1);
-							printf("   Strip VLAN tag\r\n");
-						}
-					}
-				}
-				printf("\r\n-------------------------------------------------------------------------\r\n\n");
-			}
-			// OpenFlow v1.3 (0x04) Flow Table
-			if( OF_Version == 4)
+			// OpenFlow v1.0 (0x01) and v1.3 (0x04) flows are kept in the same table
+			if( OF_Version == 1 || OF_Version == 4)
 			{
 				int match_size;
 				int inst_size;
@@ -1034,34 +1117,35 @@ void command_openflow(char *command, char *param1, char *param2, char *param3)
 				printf("\r\n-------------------------------------------------------------------------\r\n");
 				for (i=0;i<iLastFlow;i++)
 				{
+					if (flow_counters[i].active == false) continue;
 					printf("\r\nFlow %d\r\n",i+1);
 					printf(" Match:\r\n");
 					match_size = 0;
 
 					while (match_size < (ntohs(flow_match13[i]->match.length)-4))
 					{
-						memcpy(&oxm_header, ofp13_oxm_match[i] + match_size,4);
+						memcpy(&oxm_header, flow_match13[i]->match.oxm_fields + match_size,4);
 						bool has_mask = oxm_header.oxm_field & 1;
 						oxm_header.oxm_field = oxm_header.oxm_field >> 1;
 						switch(oxm_header.oxm_field)
 						{
 							case OFPXMT_OFB_IN_PORT:
-							memcpy(&oxm_value32, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 4);
+							memcpy(&oxm_value32, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 4);
 							printf("  In Port: %d\r\n",ntohl(oxm_value32));
 							break;
 
 							case OFPXMT_OFB_ETH_DST:
-							memcpy(&oxm_eth, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 6);
+							memcpy(&oxm_eth, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 6);
 							printf("  Destination MAC: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X\r\n", oxm_eth[0], oxm_eth[1], oxm_eth[2], oxm_eth[3], oxm_eth[4], oxm_eth[5]);
 							break;
 
 							case OFPXMT_OFB_ETH_SRC:
-							memcpy(&oxm_eth, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 6);
+							memcpy(&oxm_eth, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 6);
 							printf("  Source MAC: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X\r\n", oxm_eth[0], oxm_eth[1], oxm_eth[2], oxm_eth[3], oxm_eth[4], oxm_eth[5]);
 							break;
 
 							case OFPXMT_OFB_ETH_TYPE:
-							memcpy(&oxm_value16, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 2);
+							memcpy(&oxm_value16, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 2);
 							if (ntohs(oxm_value16) == 0x0806)printf("  ETH Type: ARP\r\n");
 							if (ntohs(oxm_value16) == 0x0800)printf("  ETH Type: IPv4\r\n");
 							if (ntohs(oxm_value16) == 0x86dd)printf("  ETH Type: IPv6\r\n");
@@ -1069,7 +1153,7 @@ void command_openflow(char *command, char *param1, char *param2, char *param3)
 							break;
 
 							case OFPXMT_OFB_IP_PROTO:
-							memcpy(&oxm_value8, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 1);
+							memcpy(&oxm_value8, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 1);
 							if (oxm_value8 == 1)printf("  IP Protocol: ICMP\r\n");
 							if (oxm_value8 == 6)printf("  IP Protocol: TCP\r\n");
 							if (oxm_value8 == 17)printf("  IP Protocol: UDP\r\n");
@@ -1078,10 +1162,10 @@ void command_openflow(char *command, char *param1, char *param2, char *param3)
 							case OFPXMT_OFB_IPV4_SRC:
 							if (has_mask)
 							{
-								memcpy(&oxm_ipv4, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 8);
+								memcpy(&oxm_ipv4, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 8);
 								printf("  Source IP:  %d.%d.%d.%d / %d.%d.%d.%d\r\n", oxm_ipv4[0], oxm_ipv4[1], oxm_ipv4[2], oxm_ipv4[3], oxm_ipv4[4], oxm_ipv4[5], oxm_ipv4[6], oxm_ipv4[7]);
 								} else {
-								memcpy(&oxm_ipv4, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 4);
+								memcpy(&oxm_ipv4, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 4);
 								printf("  Source IP:  %d.%d.%d.%d\r\n", oxm_ipv4[0], oxm_ipv4[1], oxm_ipv4[2], oxm_ipv4[3]);
 							}
 							break;
@@ -1089,46 +1173,46 @@ void command_openflow(char *command, char *param1, char *param2, char *param3)
 							case OFPXMT_OFB_IPV4_DST:
 							if (has_mask)
 							{
-								memcpy(&oxm_ipv4, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 8);
+								memcpy(&oxm_ipv4, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 8);
 								printf("  Destination IP:  %d.%d.%d.%d / %d.%d.%d.%d\r\n", oxm_ipv4[0], oxm_ipv4[1], oxm_ipv4[2], oxm_ipv4[3], oxm_ipv4[4], oxm_ipv4[5], oxm_ipv4[6], oxm_ipv4[7]);
 							} else {
-								memcpy(&oxm_ipv4, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 4);
+								memcpy(&oxm_ipv4, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 4);
 								printf("  Destination IP:  %d.%d.%d.%d\r\n", oxm_ipv4[0], oxm_ipv4[1], oxm_ipv4[2], oxm_ipv4[3]);
 							}
 							break;
 
 							case OFPXMT_OFB_IPV6_SRC:
-							memcpy(&oxm_ipv6, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 16);
+							memcpy(&oxm_ipv6, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 16);
 							printf("  Source IP: %.4X:%.4X:%.4X:%.4X:%.4X:%.4X:%.4X:%.4X\r\n", oxm_ipv6[0], oxm_ipv6[1], oxm_ipv6[2], oxm_ipv6[3], oxm_ipv6[4], oxm_ipv6[5], oxm_ipv6[6], oxm_ipv6[7]);
 							break;
 
 							case OFPXMT_OFB_IPV6_DST:
-							memcpy(&oxm_ipv6, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 16);
+							memcpy(&oxm_ipv6, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 16);
 							printf("  Destination IP:  %.4X:%.4X:%.4X:%.4X:%.4X:%.4X:%.4X:%.4X\r\n", oxm_ipv6[0], oxm_ipv6[1], oxm_ipv6[2], oxm_ipv6[3], oxm_ipv6[4], oxm_ipv6[5], oxm_ipv6[6], oxm_ipv6[7]);
 							break;
 
 							case OFPXMT_OFB_TCP_SRC:
-							memcpy(&oxm_value16, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 2);
+							memcpy(&oxm_value16, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 2);
 							printf("  Source TCP Port: %d\r\n",ntohs(oxm_value16));
 							break;
 
 							case OFPXMT_OFB_TCP_DST:
-							memcpy(&oxm_value16, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 2);
+							memcpy(&oxm_value16, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 2);
 							printf("  Destination TCP Port: %d\r\n",ntohs(oxm_value16));
 							break;
 
 							case OFPXMT_OFB_UDP_SRC:
-							memcpy(&oxm_value16, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 2);
+							memcpy(&oxm_value16, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 2);
 							printf("  Source UDP Port: %d\r\n",ntohs(oxm_value16));
 							break;
 
 							case OFPXMT_OFB_UDP_DST:
-							memcpy(&oxm_value16, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 2);
+							memcpy(&oxm_value16, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 2);
 							printf("  Destination UDP Port: %d\r\n",ntohs(oxm_value16));
 							break;
 
 							case OFPXMT_OFB_VLAN_VID:
-							memcpy(&oxm_value16, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 2);
+							memcpy(&oxm_value16, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 2);
 							if (oxm_value16 != 0) printf("  VLAN ID: %d\r\n",(ntohs(oxm_value16) - OFPVID_PRESENT));
 							break;
 
@@ -1147,10 +1231,10 @@ void command_openflow(char *command, char *param1, char *param2, char *param3)
 					int sec = t%60;
 					printf("  Last Match: %02d:%02d:%02d\r\n", hr, min, sec);
 					// Print instruction list
-					if (ofp13_oxm_inst[i] != NULL)
+					if (flow_match13[i]->inst->len > 0)
 					{
 						printf("\r Instructions:\r\n");
-						inst_ptr = (struct ofp13_instruction *) ofp13_oxm_inst[i];
+						inst_ptr = (struct ofp13_instruction *) flow_match13[i]->inst->data;
 						inst_size = ntohs(inst_ptr->len);
 						if(ntohs(inst_ptr->type) == OFPIT13_APPLY_ACTIONS)
 						{
@@ -1160,7 +1244,7 @@ void command_openflow(char *command, char *param1, char *param2, char *param3)
 							if (inst_size == sizeof(struct ofp13_instruction_actions)) printf("   DROP \r\n");	// No actions
 							while (act_size < (inst_size - sizeof(struct ofp13_instruction_actions)))
 							{
-								inst_actions  = ofp13_oxm_inst[i] + act_size;
+								inst_actions  = flow_match13[i]->inst->data + act_size;
 								act_hdr = &inst_actions->actions;
 								if (htons(act_hdr->type) == OFPAT13_OUTPUT)
 								{
@@ -1184,7 +1268,7 @@ void command_openflow(char *command, char *param1, char *param2, char *param3)
 									act_output = NULL;
 								}
 
-								if (htons(act_hdr->type) == OFPAT13_SET_FIELD)
+								if (htons(act_hdr->type) == OFPAT13_SET_FIELD || htons(act_hdr->type) == OFPAT13_SET_VLAN10)
 								{
 									struct ofp13_action_set_field *act_set_field = act_hdr;
 									memcpy(&oxm_header, act_set_field->field,4);
@@ -1312,10 +1396,10 @@ void command_openflow(char *command, char *param1, char *param2, char *param3)
 							continue;
 						}
 						// Is there more then one instruction?
-						if (ofp13_oxm_inst_size[i] > inst_size)
+						if (flow_match13[i]->inst->len > inst_size)
 						{
 							uint8_t *nxt_inst;
-							nxt_inst = ofp13_oxm_inst[i] + inst_size;
+							nxt_inst = flow_match13[i]->inst->data + inst_size;
 							inst_ptr = (struct ofp13_instruction *) nxt_inst;
 							inst_size = ntohs(inst_ptr->len);
 							if(ntohs(inst_ptr->type) == OFPIT13_GOTO_TABLE)
@@ -1345,10 +1429,10 @@ void command_openflow(char *command, char *param1, char *param2, char *param3)
 		if( OF_Version == 1)
 		{
 			printf("\r\n-------------------------------------------------------------------------\r\n");
-			if(iLastFlow > 0)
+			if(flow_count > 0)
 			{
 				printf("Table: 0\r\n");
-				printf(" Flows: %d\r\n",iLastFlow);
+				printf(" Flows: %d\r\n",flow_count);
 				printf(" Lookups: %d\r\n",table_counters[0].lookup_count);
 				printf(" Matches: %d\r\n",table_counters[0].matched_count);
 				printf(" Bytes: %d\r\n",table_counters[0].byte_count);
@@ -1359,22 +1443,22 @@ void command_openflow(char *command, char *param1, char *param2, char *param3)
 
 		if( OF_Version == 4)
 		{
-			int flow_count;
+			int table_flows;
 			printf("\r\n-------------------------------------------------------------------------\r\n");
 			for (int x=0;x<MAX_TABLES;x++)
 			{
-				flow_count = 0;
+				table_flows = 0;
 				for (int i=0;i<iLastFlow;i++)
 				{
-					if(flow_match13[i]->table_id == x)
+					if(flow_counters[i].active == true && flow_match13[i]->table_id == x)
 					{
-						flow_count++;
+						table_flows++;
 					}
 				}
-				if(flow_count > 0)
+				if(table_flows > 0)
 				{
 					printf("Table: %d\r\n",x);
-					printf(" Flows: %d\r\n",flow_count);
+					printf(" Flows: %d\r\n",table_flows);
 					printf(" Lookups: %d\r\n",table_counters[x].lookup_count);
 					printf(" Matches: %d\r\n",table_counters[x].matched_count);
 					printf(" Bytes: %d\r\n",table_counters[x].byte_count);
@@ -1391,36 +1475,38 @@ void command_openflow(char *command, char *param1, char *param2, char *param3)
 	{
 		printf("\r\n-------------------------------------------------------------------------\r\n");
 		printf("OpenFlow Status\r");
-		if (tcp_pcb->state != ESTABLISHED && Zodiac_Config.OFEnabled == OF_ENABLED) printf(" Status: Disconnected\r\n");
-		if (tcp_pcb->state == ESTABLISHED && Zodiac_Config.OFEnabled == OF_ENABLED) printf(" Status: Connected\r\n");
+		if (controllers_connected() == 0 && Zodiac_Config.OFEnabled == OF_ENABLED) printf(" Status: Disconnected\r\n");
+		if (controllers_connected() > 0 && Zodiac_Config.OFEnabled == OF_ENABLED) printf(" Status: Connected\r\n");
 		if (Zodiac_Config.OFEnabled == OF_DISABLED) printf(" Status: Disabled\r\n");
+		if (standalone_mode() == FAILSTATE_STANDALONE) printf(" Fail standalone: Active, %d MAC addresses learned\r\n", standalone_mac_count());
+		if (standalone_mode() == FAILSTATE_STANDALONE_HW) printf(" Fail standalone: Active, switched by the KSZ8795\r\n");
 		if (OF_Version == 1)
 		{
 			printf(" Version: 1.0 (0x01)\r\n");
 			printf(" No tables: 1\r\n");
-			printf(" No flows: %d\r\n", iLastFlow);
+			printf(" No flows: %d\r\n", flow_count);
 			printf(" Total Lookups: %d\r\n",table_counters[0].lookup_count);
 			printf(" Total Matches: %d\r\n",table_counters[0].matched_count);
 		}
 		if (OF_Version == 4)
 		{
-			int flow_count;
+			int table_flows;
 			int tables = 0;
 			for (int x=0;x<MAX_TABLES;x++)
 			{
-				flow_count = 0;
+				table_flows = 0;
 				for (int i=0;i<iLastFlow;i++)
 				{
-					if(flow_match13[i]->table_id == x)
+					if(flow_counters[i].active == true && flow_match13[i]->table_id == x)
 					{
-						flow_count++;
+						table_flows++;
 					}
 				}
-				if(flow_count > 0) tables++;
+				if(table_flows > 0) tables++;
 			}
 			printf(" Version: 1.3 (0x04)\r\n");
 			printf(" No tables: %d\r\n", tables);
-			printf(" No flows: %d\r\n", iLastFlow);
+			printf(" No flows: %d\r\n", flow_count);
 			// Total up all the table stats
 			int lookup_count = 0;
 			int matched_count = 0;
@@ -1432,6 +1518,38 @@ void command_openflow(char *command, char *param1, char *param2, char *param3)
 			printf(" Total Lookups: %d\r\n",lookup_count);
 			printf(" Total Matches: %d\r\n",matched_count);
 		}
+		for (int i=0;i<MAX_CONTROLLERS;i++)
+		{
+			struct of_controller *ctrl = &controllers[i];
+			if (ctrl->con_state != 2 && ctrl->tx_stats.queued == 0 && ctrl->tx_stats.dropped == 0) continue;
+			printf(" Controller %d: %s", i+1, (ctrl->con_state == 2) ? "Connected" : "Disconnected");
+			if (OF_Version == 4 && ctrl->role == OFPCR_ROLE_EQUAL) printf(", Equal");
+			if (OF_Version == 4 && ctrl->role == OFPCR_ROLE_MASTER) printf(", Master");
+			if (OF_Version == 4 && ctrl->role == OFPCR_ROLE_SLAVE) printf(", Slave");
+			printf("\r\n");
+			if (ctrl->rtt.count > 0)
+			{
+				printf("  Echo RTT: %d ms, mean %d ms, min %d ms, max %d ms (%d echoes)\r\n", ctrl->rtt.last, (int)(ctrl->rtt.total / ctrl->rtt.count), ctrl->rtt.min, ctrl->rtt.max, (int)ctrl->rtt.count);
+			}
+			if (ctrl->con_state == -1) printf("  Reconnecting in %d ms (backoff %d ms)\r\n", (int)(ctrl->retry_at - sys_get_ms()), (int)ctrl->backoff);
+			printf("  Controller queue: %d bytes (peak %d)\r\n", ctrl->tx_stats.depth, ctrl->tx_stats.high_water);
+			printf("  Messages queued: %d\t\tMessages dropped: %d\r\n", ctrl->tx_stats.queued, ctrl->tx_stats.dropped);
+			printf("  Replies batched: %d\t\tBatched segments: %d\r\n", ctrl->tx_stats.batched, ctrl->tx_stats.batches);
+		}
+		if (standalone_stats.learned != 0)
+		{
+			printf(" Standalone MACs learned: %d\tEvicted: %d\r\n", standalone_stats.learned, standalone_stats.evicted);
+			printf(" Standalone frames forwarded: %d\tFlooded: %d\r\n", standalone_stats.forwarded, standalone_stats.flooded);
+		}
+		printf(" Packet-ins held back by the controller queue: %d\r\n", packet_in_stats.backlog);
+		printf(" Packet-ins dropped by a full packet-in queue: %d\r\n", packet_in_stats.queue_full);
+		for (int i=0;i<4;i++)
+		{
+			if (packet_in_stats.rate_limited[i][0] != 0 || packet_in_stats.rate_limited[i][1] != 0)
+			{
+				printf(" Port %d packet-ins rate limited: %d table miss, %d action\r\n", i+1, packet_in_stats.rate_limited[i][0], packet_in_stats.rate_limited[i][1]);
+			}
+		}
 		printf("\r\n-------------------------------------------------------------------------\r\n");
 		return;
 	}
@@ -1458,10 +1576,23 @@ void command_openflow(char *command, char *param1, char *param2, char *param3)
 	// Clear the flow table
 	if (strcmp(command, "clear")==0 && strcmp(param1, "flows")==0)
 	{
-		printf("Clearing flow table, %d flow deleted.\r\n", iLastFlow);
+		printf("Clearing flow table, %d flow deleted.\r\n", flow_count);
 		clear_flows();
 		return;
 	}
+
+	// Save the flow table to flash now
+	if (strcmp(command, "save")==0 && strcmp(param1, "flows")==0)
+	{
+		int saved = snapshot_save();
+		if (saved < 0)
+		{
+			printf("Unable to save flows, the switch must be connected to a controller\r\n");
+		} else {
+			printf("Saved %d flows and meters to flash\r\n", saved);
+		}
+		return;
+	}
 	
 	// Unknown Command
 	printf("Unknown command\r\n");
@@ -1513,10 +1644,10 @@ void command_debug(char *command, char *param1, char *param2, char *param3)
 
 	if (strcmp(command, "mem")==0)
 	{
-		printf("mem total: %d\r\n", membag_get_total());
-		printf("mem free: %d\r\n", membag_get_total_free());
-		printf("Smallest available block: %d\r\n", membag_get_smallest_free_block_size());
-		printf("Largest available block: %d\r\n", membag_get_largest_free_block_size());		
+		printf("Flows: %d of %d, room for about %d more\r\n\n", flow_count, max_flows, flow_table_free());
+		print_slab("Flow table", &flow_slab);
+		print_slab("Packet buffers", &packet_slab);
+		print_slab("Controller messages", &ctrl_slab);
 		return;
 	}
 
@@ -1560,6 +1691,29 @@ void command_debug(char *command, char *param1, char *param2, char *param3)
 	printf("Unknown command\r\n");
 	return;
 }
+
+/*
+*	Print the usage of a memory arena
+*
+*	@param *name - name of the arena.
+*	@param *s - pointer to the slab.
+*
+*/
+void print_slab(const char *name, struct slab *s)
+{
+	struct slab_stats stats;
+	slab_get_stats(s, &stats);
+	printf("%s:\r\n", name);
+	printf(" Total: %d\r\n", stats.total);
+	printf(" Used: %d (%d blocks)\r\n", stats.used, stats.blocks);
+	printf(" High water: %d\r\n", stats.high_water);
+	printf(" Free: %d\r\n", stats.free);
+	printf(" Largest available block: %d\r\n", stats.largest_free);
+	printf(" Free areas: %d (%d%% fragmented)\r\n", stats.free_blocks, stats.fragmentation);
+	printf(" Failed allocations: %d\r\n\n", s->failures);
+	return;
+}
+
 /*
 *	Print the intro screen
 *	ASCII art generated from http://patorjk.com/software/taag/
@@ -1610,7 +1764,10 @@ void printhelp(void)
 	printf(" set gateway <gateway ip address>\r\n");
 	printf(" set of-controller <openflow controller ip address>\r\n");
 	printf(" set of-port <openflow controller tcp port>\r\n");
-	printf(" set failstate <secure|safe>\r\n");
+	printf(" set of-controller2 <second controller ip address (0.0.0.0 = none)>\r\n");
+	printf(" set of-port2 <second controller tcp port>\r\n");
+	printf(" set heartbeat <interval ms> <timeout ms>\r\n");
+	printf(" set failstate <secure|safe|standalone|standalone-hw>\r\n");
 	printf(" add vlan <vlan id> <vlan name>\r\n");
 	printf(" delete vlan <vlan id>\r\n");
 	printf(" set vlan-type <vlan id> <openflow|native>\r\n");
@@ -1619,6 +1776,10 @@ void printhelp(void)
 	printf(" factory reset\r\n");
 	printf(" set of-version <version(0|1|4)>\r\n");
 	printf(" set ethertype-filter <enable|disable>\r\n");
+	printf(" set flow-snapshot <enable|disable>\r\n");
+	printf(" set packet-in-rate <miss|action> <per second>\r\n");
+	printf(" set ingress-limit <port> <kbps>\r\n");
+	printf(" set egress-limit <port> <kbps>\r\n");
 	printf(" exit\r\n");
 	printf("\r\n");
 	printf("OpenFlow:\r\n");
@@ -1627,6 +1788,7 @@ void printhelp(void)
 	printf(" enable\r\n");
 	printf(" disable\r\n");
 	printf(" clear flows\r\n");
+	printf(" save flows\r\n");
 	printf(" exit\r\n");
 	printf("\r\n");
 	printf("Debug:\r\n");
@@ -39,6 +39,13 @@ enum of_status{
 	OF_ENABLED
 	};
 
+enum fail_state{
+	FAILSTATE_SECURE,		// Drop everything while no controller is connected
+	FAILSTATE_SAFE,			// Keep using the flows
+	FAILSTATE_STANDALONE,	// Learning bridge in software
+	FAILSTATE_STANDALONE_HW	// Learning bridge in the KSZ8795
+	};
+
 enum cli_context{
 	CLI_ROOT,
 	CLI_CONFIG,
@@ -72,6 +79,14 @@ struct zodiac_config {
 	uint8_t failstate;
 	uint8_t of_version;
 	uint8_t ethtype_filter;
+	uint8_t ingress_limit[4];	// KSZ8795 ingress rate limit code per port (0 = unlimited)
+	uint8_t egress_limit[4];	// KSZ8795 egress rate limit code per port (0 = unlimited)
+	uint8_t flow_snapshot;		// 1 to save the flow table to flash and restore it at boot
+	uint16_t packet_in_rate[2];	// Packet-ins per second allowed from each port for table misses and output actions (0 = unlimited)
+	uint8_t OFIP_address2[4];	// IP address of a second controller (0.0.0.0 = none)
+	int OFPort2;
+	uint16_t hb_interval;	// Milliseconds without hearing from a controller before an echo request is sent
+	uint16_t hb_timeout;	// Milliseconds without hearing from a controller before the connection is reset
 } PACK_STRUCT_STRUCT;
 PACK_STRUCT_END
 
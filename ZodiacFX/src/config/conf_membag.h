@@ -1,72 +0,0 @@
-/**
- * \file
- *
- * \brief Membag configuration header
- *
- * Copyright (c) 2014-2015 Atmel Corporation. All rights reserved.
- *
- * \asf_license_start
- *
- * \page License
- *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions are met:
- *
- * 1. Redistributions of source code must retain the above copyright notice,
- *    this list of conditions and the following disclaimer.
- *
- * 2. Redistributions in binary form must reproduce the above copyright notice,
- *    this list of conditions and the following disclaimer in the documentation
- *    and/or other materials provided with the distribution.
- *
- * 3. The name of Atmel may not be used to endorse or promote products derived
- *    from this software without specific prior written permission.
- *
- * 4. This software may only be redistributed and used in connection with an
- *    Atmel microcontroller product.
- *
- * THIS SOFTWARE IS PROVIDED BY ATMEL "AS IS" AND ANY EXPRESS OR IMPLIED
- * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
- * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT ARE
- * EXPRESSLY AND SPECIFICALLY DISCLAIMED. IN NO EVENT SHALL ATMEL BE LIABLE FOR
- * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
- * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
- * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
- * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
- * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
- * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
- * POSSIBILITY OF SUCH DAMAGE.
- *
- * \asf_license_stop
- *
- */
-/*
- * Support and FAQ: visit <a href="http://www.atmel.com/design-support/">Atmel Support</a>
- */
-
-#ifndef CONF_MEMBAG_H
-#define CONF_MEMBAG_H
-
-#include <membag.h>
-
-#define CONF_MEMBAG_ARRAY\
-	MEMBAG(16, 32), MEMBAG(16, 32), MEMBAG(16, 32), MEMBAG(16, 32),\
-	MEMBAG(24, 32), MEMBAG(24, 32), MEMBAG(24, 32), MEMBAG(24, 32),\
-	MEMBAG(24, 32), MEMBAG(24, 32), MEMBAG(24, 32), MEMBAG(24, 32),\	
-	MEMBAG(56, 32), MEMBAG(56, 32), MEMBAG(56, 32), MEMBAG(56, 32),\
-	MEMBAG(56, 32), MEMBAG(56, 32), MEMBAG(56, 32), MEMBAG(56, 32),\
-	MEMBAG(72, 32), MEMBAG(72, 32), MEMBAG(72, 32), MEMBAG(72, 32),\
-	MEMBAG(72, 32), MEMBAG(72, 32), MEMBAG(72, 32), MEMBAG(72, 32),\
-	MEMBAG(96, 32), MEMBAG(96, 32), MEMBAG(96, 32), MEMBAG(96, 32),
-
-#define CONF_MEMBAG_POOL_SIZE\
-	MEMBAG_SIZE(16, 32) + MEMBAG_SIZE(16, 32) + MEMBAG_SIZE(16, 32) + MEMBAG_SIZE(16, 32) +\
-	MEMBAG_SIZE(24, 32) + MEMBAG_SIZE(24, 32) + MEMBAG_SIZE(24, 32) + MEMBAG_SIZE(24, 32) +\
-	MEMBAG_SIZE(24, 32) + MEMBAG_SIZE(24, 32) + MEMBAG_SIZE(24, 32) + MEMBAG_SIZE(24, 32) +\
-	MEMBAG_SIZE(56, 32) + MEMBAG_SIZE(56, 32) + MEMBAG_SIZE(56, 32) + MEMBAG_SIZE(56, 32) +\
-	MEMBAG_SIZE(56, 32) + MEMBAG_SIZE(56, 32) + MEMBAG_SIZE(56, 32) + MEMBAG_SIZE(56, 32) +\
-	MEMBAG_SIZE(72, 32) + MEMBAG_SIZE(72, 32) + MEMBAG_SIZE(72, 32) + MEMBAG_SIZE(72, 32) +\
-	MEMBAG_SIZE(72, 32) + MEMBAG_SIZE(72, 32) + MEMBAG_SIZE(72, 32) + MEMBAG_SIZE(72, 32) +\
-	MEMBAG_SIZE(96, 32) + MEMBAG_SIZE(96, 32) + MEMBAG_SIZE(96, 32) + MEMBAG_SIZE(96, 32) 
-
-#endif /* CONF_MEMBAG_H */
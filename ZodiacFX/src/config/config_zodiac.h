@@ -35,15 +35,64 @@
 
 #define MAX_OFP_VERSION   0x04
 
-#define MAX_FLOWS_10	128		// Maximum number of flows for OpenFlow 1.0
-#define MAX_FLOWS_13	512		// Maximum number of flows for OpenFlow 1.3
+#define MAX_FLOWS_13	4096	// Upper limit on the number of flows for OpenFlow 1.0 and 1.3, the real number is sized from free SRAM at boot
+
+#define FLOW_RAM_RESERVE	8192	// Bytes of free SRAM left for the C library heap when sizing the flow table
+
+#define FLOW_RECORD_ESTIMATE	56	// Expected bytes of flow slab used by a small L2/L3 flow
 
 #define MAX_VLANS	4	// Maximum number of VLANS, default is 1 per port (4)
 
 #define MAX_TABLES	10	// Maximum number of tables for OpenFlow 1.3 and higher
 
-#define HB_INTERVAL	2	// Number of seconds between heartbeats
+#define MAX_METER_13	8	// Maximum number of meters for OpenFlow 1.3
+
+#define METER_RATE_MAX	1000000	// Highest meter rate and burst size, keeps the token bucket arithmetic from overflowing
+
+#define PACKET_HEADROOM	16	// Bytes reserved in front of received frames for pushing VLAN and MPLS tags
+
+#define MAX_BUFFERS	16	// Number of packets that can be buffered on the switch for packet ins
+
+#define PACKET_SLAB_SIZE	12288	// Bytes of memory shared by the buffered packets
+
+#define CTRL_SLAB_SIZE	8192	// Bytes of memory used for messages from the controller
+
+#define MAX_CONTROLLERS	2	// Number of controllers the switch is connected to at the same time
+
+#define TX_QUEUE_SIZE	6144	// Bytes of messages to each controller that can wait for room in the TCP send buffer
+
+#define PACKET_IN_QUEUE_SIZE	4096	// Bytes of packet-ins the datapath can queue between passes of the OpenFlow task
+
+#define PACKET_IN_RATE_MISS	100	// Default table miss packet-ins per second per port
+
+#define PACKET_IN_RATE_ACTION	200	// Default output to controller packet-ins per second per port
+
+#define STATS_PART_LEN	1024	// Largest flow stats reply, bigger tables are sent as several replies
+
+#define BUFFER_TIMEOUT	2	// Number of seconds a buffered packet is kept before the buffer can be reused
+
+#define HB_INTERVAL	2000	// Default milliseconds without hearing from the controller before an echo request is sent
+
+#define HB_TIMEOUT	6000	// Default milliseconds without hearing from the controller before the connection is reset
+
+#define HB_MIN	100		// Shortest heartbeat interval or timeout that can be set (ms)
+
+#define HANDSHAKE_TIMEOUT	2000	// Milliseconds the controller has to send a features request, not changed by the heartbeat settings
+
+#define CONNECT_TIMEOUT	6000	// Milliseconds a TCP connection to the controller has to complete
+
+#define RECONNECT_MIN	1000	// Reconnect backoff after the first failure (ms), doubled on each failure after that
+
+#define RECONNECT_MAX	32000	// Longest reconnect backoff (ms)
+
+#define STANDALONE_MAC_ENTRIES	256	// MAC addresses the fail standalone bridge can learn, a power of 2
+
+#define STANDALONE_MAC_AGE	300	// Seconds a learned MAC address is kept without being seen
+
+#define FLOW_SNAPSHOT_QUIET	30	// Seconds the flow table must be unchanged before it is saved to flash
+
+#define FLOW_SNAPSHOT_INTERVAL	300	// Minimum number of seconds between saving the flow table to flash
 
-#define HB_TIMEOUT	6	// Number of seconds to wait when there is no response from the controller
+#define FLOW_SNAPSHOT_GRACE	30	// Seconds a controller has to add restored flows again before they are removed
 
 #endif /* CONFIG_ZODIAC_H_ */
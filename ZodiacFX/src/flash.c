@@ -134,6 +134,48 @@ int flash_write_page(uint8_t *flash_page)
 	return 1;
 }
 
+/*
+*	Erase a sector of the flow table snapshot area
+*
+*	@param sector - the sector number within the snapshot area.
+*
+*/
+int snapshot_erase_sector(int sector)
+{
+	uint32_t erase_address = SNAPSHOT_BASE + (sector * ERASE_SECTOR_SIZE);
+
+	if (sector == 0)
+	{
+		ul_rc = flash_init(FLASH_ACCESS_MODE_128, 6);
+		if (ul_rc != FLASH_RC_OK) return 0;
+	}
+
+	ul_rc = flash_unlock(erase_address, erase_address + ERASE_SECTOR_SIZE - 1, 0, 0);
+	if (ul_rc != FLASH_RC_OK) return 0;
+
+	ul_rc = flash_erase_sector(erase_address);
+	if (ul_rc != FLASH_RC_OK) return 0;
+
+	return 1;
+}
+
+/*
+*	Write a page to the flow table snapshot area
+*
+*	@param offset - offset of the page from the start of the snapshot area.
+*	@param *page - pointer to the page to write.
+*
+*/
+int snapshot_write_page(uint32_t offset, uint8_t *page)
+{
+	if (offset > SNAPSHOT_SIZE - IFLASH_PAGE_SIZE) return 0;	// Out of the snapshot area
+
+	ul_rc = flash_write(SNAPSHOT_BASE + offset, page, IFLASH_PAGE_SIZE, 0);
+	if (ul_rc != FLASH_RC_OK) return 0;
+
+	return 1;
+}
+
 /*
 *	Handle firmware update through CLI
 *
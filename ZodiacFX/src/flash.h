@@ -35,6 +35,8 @@
 void get_serial(uint32_t *uid_buf);
 void cli_update(void);
 int flash_write_page(uint8_t *flash_page);
+int snapshot_erase_sector(int sector);
+int snapshot_write_page(uint32_t offset, uint8_t *page);
 int firmware_update_init(void);
 __no_inline RAMFUNC void firmware_update(void);
 int xmodem_xfer(void);
@@ -47,6 +49,8 @@ void xmodem_clear_padding(uint8_t *buff);
 #define ERASE_SECTOR_SIZE	8192
 #define NEW_FW_BASE			(IFLASH_ADDR + (5*IFLASH_NB_OF_PAGES/8)*IFLASH_PAGE_SIZE)
 #define NEW_FW_MAX_SIZE		196608
+#define SNAPSHOT_SIZE		(2*ERASE_SECTOR_SIZE)		// Flash kept for the flow table snapshot
+#define SNAPSHOT_BASE		(NEW_FW_BASE - SNAPSHOT_SIZE)	// Between the running firmware and the firmware update area
 
 
 #endif /* FLASH_H_ */
\ No newline at end of file
@@ -50,21 +50,17 @@ extern int32_t ul_temp;
 extern struct zodiac_config Zodiac_Config;
 extern uint8_t port_status[4];
 extern uint32_t uid_buf[4];	// Unique identifier
-extern struct tcp_pcb *tcp_pcb;
 extern int OF_Version;
 extern uint8_t shared_buffer[SHARED_BUFFER_LEN];	// SHARED_BUFFER_LEN must never be reduced below 2048
 
-extern struct ofp_flow_mod *flow_match10[MAX_FLOWS_10];
-extern struct ofp13_flow_mod *flow_match13[MAX_FLOWS_13];
-extern uint8_t *ofp13_oxm_match[MAX_FLOWS_13];
-extern uint8_t *ofp13_oxm_inst[MAX_FLOWS_13];
-extern uint16_t ofp13_oxm_inst_size[MAX_FLOWS_13];
-extern struct flows_counter flow_counters[MAX_FLOWS_13];
-extern struct flow_tbl_actions *flow_actions10[MAX_FLOWS_13];
+extern struct flow_entry13 **flow_match13;
+extern struct flows_counter *flow_counters;
 extern int iLastFlow;
+extern int flow_count;
 extern struct ofp10_port_stats phys10_port_stats[4];
 extern struct ofp13_port_stats phys13_port_stats[4];
 extern struct table_counter table_counters[MAX_TABLES];
+extern struct of_controller controllers[MAX_CONTROLLERS];
 
 extern int firmware_update_init(void);
 extern int flash_write_page(uint8_t *flash_page);
@@ -700,6 +696,18 @@ static err_t http_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err
 					// Force OpenFlow version
 					reset_config.of_version = 0;			// Force version disabled
 
+					// Packet-in rate limits
+					reset_config.packet_in_rate[0] = PACKET_IN_RATE_MISS;	// Table misses per second per port
+					reset_config.packet_in_rate[1] = PACKET_IN_RATE_ACTION;	// Output to controller actions per second per port
+
+					// Second controller
+					memset(&reset_config.OFIP_address2, 0, 4);	// No second controller
+					reset_config.OFPort2 = 6633;
+
+					// Controller liveness
+					reset_config.hb_interval = HB_INTERVAL;	// Echo request after 2 seconds without hearing from the controller
+					reset_config.hb_timeout = HB_TIMEOUT;	// Reset the connection after 6 seconds
+
 					memcpy(&reset_config.MAC_address, &Zodiac_Config.MAC_address, 6);		// Copy over existing MAC address so it is not reset
 					memcpy(&Zodiac_Config, &reset_config, sizeof(struct zodiac_config));
 					eeprom_write();
@@ -831,7 +839,7 @@ static err_t http_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err
 				else if(strcmp(http_msg,"btn_ofClear") == 0)
 				{
 					// Clear the flow table
-					TRACE("http.c: clearing flow table, %d flow deleted.\r\n", iLastFlow);
+					TRACE("http.c: clearing flow table, %d flow deleted.\r\n", flow_count);
 					clear_flows();
 
 					// Send updated page
@@ -1138,6 +1146,11 @@ static err_t http_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err
 							Zodiac_Config.failstate = 1;
 							TRACE("http.c: failstate set to Safe (1)");
 						}
+						else if(failstate == FAILSTATE_STANDALONE || failstate == FAILSTATE_STANDALONE_HW)
+						{
+							Zodiac_Config.failstate = failstate;
+							TRACE("http.c: failstate set to Standalone (%d)", failstate);
+						}
 						else
 						{
 							TRACE("http.c: unhandled failstate");
@@ -2206,11 +2219,11 @@ static uint8_t interfaceCreate_Display_OpenFlow(void)
 	// Status
 	char wi_ofStatus[15] = "";
 	
-	if (tcp_pcb->state != ESTABLISHED && Zodiac_Config.OFEnabled == OF_ENABLED)
+	if (controllers_connected() == 0 && Zodiac_Config.OFEnabled == OF_ENABLED)
 	{
 		snprintf(wi_ofStatus, 15, "Disconnected");
 	}
-	else if (tcp_pcb->state == ESTABLISHED && Zodiac_Config.OFEnabled == OF_ENABLED)
+	else if (controllers_connected() > 0 && Zodiac_Config.OFEnabled == OF_ENABLED)
 	{
 		snprintf(wi_ofStatus, 15, "Connected");
 	}
@@ -2234,27 +2247,27 @@ static uint8_t interfaceCreate_Display_OpenFlow(void)
 	{
 		snprintf(wi_ofVersion, 15, "1.0");
 		wi_ofTables  = 1;
-		wi_ofFlows   = iLastFlow;
+		wi_ofFlows   = flow_count;
 		wi_ofLookups = table_counters[0].lookup_count;
 		wi_ofMatches = table_counters[0].matched_count;
 	}
 	else if (OF_Version == 4)
 	{
-		int flow_count;
+		int table_flows;
 		for (int x=0;x<MAX_TABLES;x++)
 		{
-			flow_count = 0;
+			table_flows = 0;
 			for (int i=0;i<iLastFlow;i++)
 			{
-				if(flow_match13[i]->table_id == x)
+				if(flow_counters[i].active == true && flow_match13[i]->table_id == x)
 				{
-					flow_count++;
+					table_flows++;
 				}
 			}
-			if(flow_count > 0) wi_ofTables++;
+			if(table_flows > 0) wi_ofTables++;
 	}
 		snprintf(wi_ofVersion, 15, "1.3");
-		wi_ofFlows = iLastFlow;
+		wi_ofFlows = flow_count;
 		// Total up all the table stats
 		for (int x=0;x<MAX_TABLES;x++)
 		{
@@ -2266,6 +2279,15 @@ static uint8_t interfaceCreate_Display_OpenFlow(void)
 	{
 		snprintf(wi_ofVersion, 15, "Auto");
 	}
+
+	// Echo round trip times, mean (min - max) for each controller
+	char wi_ofRtt[64] = "";
+	for (int i=0;i<MAX_CONTROLLERS;i++)
+	{
+		struct echo_rtt *rtt = &controllers[i].rtt;
+		if (controllers[i].con_state != 2 || rtt->count == 0) continue;
+		snprintf(wi_ofRtt+strlen(wi_ofRtt), sizeof(wi_ofRtt)-strlen(wi_ofRtt), "%s%d: %d (%d - %d)", (wi_ofRtt[0] != 0) ? ", " : "", i+1, (int)(rtt->total / rtt->count), rtt->min, rtt->max);
+	}
 	
 	if( snprintf(shared_buffer, SHARED_BUFFER_LEN,\
 		"<!DOCTYPE html>"\
@@ -2299,12 +2321,14 @@ static uint8_t interfaceCreate_Display_OpenFlow(void)
 						"Table Lookups:<br>"\
 						"<input type=\"text\" name=\"wi_ofLk\" value=\"%d\" readonly><br><br>"\
 						"Table Matches:<br>"\
-						"<input type=\"text\" name=\"wi_ofMatch\" value=\"%d\" readonly><br>"\
+						"<input type=\"text\" name=\"wi_ofMatch\" value=\"%d\" readonly><br><br>"\
+						"Echo RTT ms, mean (min - max):<br>"\
+						"<input type=\"text\" name=\"wi_ofRtt\" value=\"%s\" readonly><br>"\
 					"</fieldset>"\
 				"</form>"\
 			"</body>"\
 		"</html>"\
-		, wi_ofStatus , wi_ofVersion , wi_ofTables , wi_ofFlows , wi_ofLookups , wi_ofMatches\
+		, wi_ofStatus , wi_ofVersion , wi_ofTables , wi_ofFlows , wi_ofLookups , wi_ofMatches , wi_ofRtt\
 	) < SHARED_BUFFER_LEN)
 	{
 		TRACE("http.c: html written to buffer");
@@ -2348,7 +2372,6 @@ static uint8_t interfaceCreate_Display_Flows(void)
 
 int i;
 uint8_t flowLimit;
-struct ofp_action_header * act_hdr;
 
 // Limit flows to fit in shared_buffer
 if(iLastFlow < 5)
@@ -2360,91 +2383,10 @@ else
 	flowLimit = 5;
 }
 
-if (iLastFlow > 0)
+if (flow_count > 0)
 {
-	// OpenFlow v1.0 (0x01) Flow Table
-	if( OF_Version == 1)
-	{
-		snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"\r\n-------\r\n");
-		for (i=0;i<flowLimit;i++)
-		{
-			snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"\r\nFlow %d\r\n",i+1);
-			snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer)," Match:\r\n");
-			snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Incoming Port: %d\t\t\tEthernet Type: 0x%.4X\r\n",ntohs(flow_match10[i]->match.in_port), ntohs(flow_match10[i]->match.dl_type));
-			snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Source MAC: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X\t\tDestination MAC: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X\r\n",flow_match10[i]->match.dl_src[0], flow_match10[i]->match.dl_src[1], flow_match10[i]->match.dl_src[2], flow_match10[i]->match.dl_src[3], flow_match10[i]->match.dl_src[4], flow_match10[i]->match.dl_src[5] \
-			, flow_match10[i]->match.dl_dst[0], flow_match10[i]->match.dl_dst[1], flow_match10[i]->match.dl_dst[2], flow_match10[i]->match.dl_dst[3], flow_match10[i]->match.dl_dst[4], flow_match10[i]->match.dl_dst[5]);
-			if (ntohs(flow_match10[i]->match.dl_vlan) == 0xffff)
-			{
-				snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  VLAN ID: N/A\t\t\t\tVLAN Priority: N/A\r\n");
-				} else {
-				snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  VLAN ID: %d\t\t\t\tVLAN Priority: 0x%x\r\n",ntohs(flow_match10[i]->match.dl_vlan), flow_match10[i]->match.dl_vlan_pcp);
-			}
-			if ((ntohs(flow_match10[i]->match.dl_type) == 0x0800) || (ntohs(flow_match10[i]->match.dl_type) == 0x8100)) snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  IP Protocol: %d\t\t\tIP ToS Bits: 0x%.2X\r\n",flow_match10[i]->match.nw_proto, flow_match10[i]->match.nw_tos);
-			if (flow_match10[i]->match.nw_proto == 7 || flow_match10[i]->match.nw_proto == 16)
-			{
-				snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  TCP Source Address: %d.%d.%d.%d\r\n",ip4_addr1(&flow_match10[i]->match.nw_src), ip4_addr2(&flow_match10[i]->match.nw_src), ip4_addr3(&flow_match10[i]->match.nw_src), ip4_addr4(&flow_match10[i]->match.nw_src));
-				snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  TCP Destination Address: %d.%d.%d.%d\r\n", ip4_addr1(&flow_match10[i]->match.nw_dst), ip4_addr2(&flow_match10[i]->match.nw_dst), ip4_addr3(&flow_match10[i]->match.nw_dst), ip4_addr4(&flow_match10[i]->match.nw_dst));
-				snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  TCP/UDP Source Port: %d\t\tTCP/UDP Destination Port: %d\r\n",ntohs(flow_match10[i]->match.tp_src), ntohs(flow_match10[i]->match.tp_dst));
-			}
-			if (flow_match10[i]->match.nw_proto == 1)
-			{
-				snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  ICMP Type: %d\t\t\t\tICMP Code: %d\r\n",ntohs(flow_match10[i]->match.tp_src), ntohs(flow_match10[i]->match.tp_dst));
-			}
-			snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Wildcards: 0x%.8x\t\t\tCookie: 0x%" PRIx64 "\r\n",ntohl(flow_match10[i]->match.wildcards), htonll(flow_match10[i]->cookie));
-			snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"\r Attributes:\r\n");
-			snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Priority: %d\t\t\tDuration: %d secs\r\n",ntohs(flow_match10[i]->priority), (totaltime/2) - flow_counters[i].duration);
-			snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Hard Timeout: %d secs\t\t\tIdle Timeout: %d secs\r\n",ntohs(flow_match10[i]->hard_timeout), ntohs(flow_match10[i]->idle_timeout));
-			snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Byte Count: %d\t\t\tPacket Count: %d\r\n",flow_counters[i].bytes, flow_counters[i].hitCount);
-			snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"\r\n Actions:\r\n");
-			for(int q=0;q<4;q++)
-			{
-				if(q == 0) act_hdr = flow_actions10[i]->action1;
-				if(q == 1) act_hdr = flow_actions10[i]->action2;
-				if(q == 2) act_hdr = flow_actions10[i]->action3;
-				if(q == 3) act_hdr = flow_actions10[i]->action4;
-
-				if(act_hdr->len == 0 && q == 0) snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"   DROP\r\n"); // No actions = DROP
-
-				if(act_hdr->len != 0 && ntohs(act_hdr->type) == OFPAT10_OUTPUT) // Output to port action
-				{
-					struct ofp_action_output * action_out = act_hdr;
-					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Action %d:\r\n",q+1);
-					if (ntohs(action_out->port) <= 255) snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"   Output: %d\r\n", ntohs(action_out->port));
-					if (ntohs(action_out->port) == OFPP_IN_PORT) snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"   Output: IN_PORT\r\n");
-					if (ntohs(action_out->port) == OFPP_FLOOD) snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"   Output: FLOOD\r\n");
-					if (ntohs(action_out->port) == OFPP_ALL) snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"   Output: ALL\r\n");
-					if (ntohs(action_out->port) == OFPP_CONTROLLER) snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"   Output: CONTROLLER\r\n");
-				}
-				if(act_hdr->len != 0 && ntohs(act_hdr->type) == OFPAT10_SET_VLAN_VID) //
-				{
-					struct ofp_action_vlan_vid *action_vlanid = act_hdr;
-					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Action %d:\r\n",q+1);
-					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"   Set VLAN ID: %d\r\n", ntohs(action_vlanid->vlan_vid));
-				}
-
-				if(act_hdr->len != 0 && ntohs(act_hdr->type) == OFPAT10_SET_DL_DST) //
-				{
-					struct ofp_action_dl_addr *action_setdl = act_hdr;
-					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Action %d:\r\n",q+1);
-					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"   Set Destination MAC: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X\r\n", action_setdl->dl_addr[0],action_setdl->dl_addr[1],action_setdl->dl_addr[2],action_setdl->dl_addr[3],action_setdl->dl_addr[4],action_setdl->dl_addr[5]);
-				}
-				if(act_hdr->len != 0 && ntohs(act_hdr->type) == OFPAT10_SET_DL_SRC) //
-				{
-					struct ofp_action_dl_addr *action_setdl = act_hdr;
-					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Action %d:\r\n",q+1);
-					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"   Set Source MAC: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X\r\n", action_setdl->dl_addr[0],action_setdl->dl_addr[1],action_setdl->dl_addr[2],action_setdl->dl_addr[3],action_setdl->dl_addr[4],action_setdl->dl_addr[5]);
-				}
-				if(act_hdr->len != 0 && ntohs(act_hdr->type) == OFPAT10_STRIP_VLAN) //
-				{
-					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Action %d:\r\n",q+1);
-					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"   Strip VLAN tag\r\n");
-				}
-			}
-		}
-		snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"\r\n-------\r\n\n");
-	}
-	// OpenFlow v1.3 (0x04) Flow Table
-	if( OF_Version == 4)
+	// OpenFlow v1.0 (0x01) and v1.3 (0x04) flows are kept in the same table
+	if( OF_Version == 1 || OF_Version == 4)
 	{
 		int match_size;
 		int inst_size;
@@ -2462,34 +2404,35 @@ if (iLastFlow > 0)
 		snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"\r\n-------\r\n");
 		for (i=0;i<flowLimit;i++)
 		{
+			if (flow_counters[i].active == false) continue;
 			snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"\r\nFlow %d\r\n",i+1);
 			snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer)," Match:\r\n");
 			match_size = 0;
 
 			while (match_size < (ntohs(flow_match13[i]->match.length)-4))
 			{
-				memcpy(&oxm_header, ofp13_oxm_match[i] + match_size,4);
+				memcpy(&oxm_header, flow_match13[i]->match.oxm_fields + match_size,4);
 				bool has_mask = oxm_header.oxm_field & 1;
 				oxm_header.oxm_field = oxm_header.oxm_field >> 1;
 				switch(oxm_header.oxm_field)
 				{
 					case OFPXMT_OFB_IN_PORT:
-					memcpy(&oxm_value32, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 4);
+					memcpy(&oxm_value32, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 4);
 					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  In Port: %d\r\n",ntohl(oxm_value32));
 					break;
 
 					case OFPXMT_OFB_ETH_DST:
-					memcpy(&oxm_eth, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 6);
+					memcpy(&oxm_eth, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 6);
 					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Destination MAC: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X\r\n", oxm_eth[0], oxm_eth[1], oxm_eth[2], oxm_eth[3], oxm_eth[4], oxm_eth[5]);
 					break;
 
 					case OFPXMT_OFB_ETH_SRC:
-					memcpy(&oxm_eth, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 6);
+					memcpy(&oxm_eth, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 6);
 					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Source MAC: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X\r\n", oxm_eth[0], oxm_eth[1], oxm_eth[2], oxm_eth[3], oxm_eth[4], oxm_eth[5]);
 					break;
 
 					case OFPXMT_OFB_ETH_TYPE:
-					memcpy(&oxm_value16, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 2);
+					memcpy(&oxm_value16, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 2);
 					if (ntohs(oxm_value16) == 0x0806)snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  ETH Type: ARP\r\n");
 					if (ntohs(oxm_value16) == 0x0800)snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  ETH Type: IPv4\r\n");
 					if (ntohs(oxm_value16) == 0x86dd)snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  ETH Type: IPv6\r\n");
@@ -2497,7 +2440,7 @@ if (iLastFlow > 0)
 					break;
 
 					case OFPXMT_OFB_IP_PROTO:
-					memcpy(&oxm_value8, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 1);
+					memcpy(&oxm_value8, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 1);
 					if (oxm_value8 == 1)snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  IP Protocol: ICMP\r\n");
 					if (oxm_value8 == 6)snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  IP Protocol: TCP\r\n");
 					if (oxm_value8 == 17)snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  IP Protocol: UDP\r\n");
@@ -2506,10 +2449,10 @@ if (iLastFlow > 0)
 					case OFPXMT_OFB_IPV4_SRC:
 					if (has_mask)
 					{
-						memcpy(&oxm_ipv4, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 8);
+						memcpy(&oxm_ipv4, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 8);
 						snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Source IP:  %d.%d.%d.%d / %d.%d.%d.%d\r\n", oxm_ipv4[0], oxm_ipv4[1], oxm_ipv4[2], oxm_ipv4[3], oxm_ipv4[4], oxm_ipv4[5], oxm_ipv4[6], oxm_ipv4[7]);
 						} else {
-						memcpy(&oxm_ipv4, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 4);
+						memcpy(&oxm_ipv4, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 4);
 						snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Source IP:  %d.%d.%d.%d\r\n", oxm_ipv4[0], oxm_ipv4[1], oxm_ipv4[2], oxm_ipv4[3]);
 					}
 					break;
@@ -2517,46 +2460,46 @@ if (iLastFlow > 0)
 					case OFPXMT_OFB_IPV4_DST:
 					if (has_mask)
 					{
-						memcpy(&oxm_ipv4, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 8);
+						memcpy(&oxm_ipv4, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 8);
 						snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Destination IP:  %d.%d.%d.%d / %d.%d.%d.%d\r\n", oxm_ipv4[0], oxm_ipv4[1], oxm_ipv4[2], oxm_ipv4[3], oxm_ipv4[4], oxm_ipv4[5], oxm_ipv4[6], oxm_ipv4[7]);
 						} else {
-						memcpy(&oxm_ipv4, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 4);
+						memcpy(&oxm_ipv4, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 4);
 						snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Destination IP:  %d.%d.%d.%d\r\n", oxm_ipv4[0], oxm_ipv4[1], oxm_ipv4[2], oxm_ipv4[3]);
 					}
 					break;
 
 					case OFPXMT_OFB_IPV6_SRC:
-					memcpy(&oxm_ipv6, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 16);
+					memcpy(&oxm_ipv6, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 16);
 					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Source IP: %.4X:%.4X:%.4X:%.4X:%.4X:%.4X:%.4X:%.4X\r\n", oxm_ipv6[0], oxm_ipv6[1], oxm_ipv6[2], oxm_ipv6[3], oxm_ipv6[4], oxm_ipv6[5], oxm_ipv6[6], oxm_ipv6[7]);
 					break;
 
 					case OFPXMT_OFB_IPV6_DST:
-					memcpy(&oxm_ipv6, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 16);
+					memcpy(&oxm_ipv6, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 16);
 					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Destination IP:  %.4X:%.4X:%.4X:%.4X:%.4X:%.4X:%.4X:%.4X\r\n", oxm_ipv6[0], oxm_ipv6[1], oxm_ipv6[2], oxm_ipv6[3], oxm_ipv6[4], oxm_ipv6[5], oxm_ipv6[6], oxm_ipv6[7]);
 					break;
 
 					case OFPXMT_OFB_TCP_SRC:
-					memcpy(&oxm_value16, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 2);
+					memcpy(&oxm_value16, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 2);
 					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Source TCP Port: %d\r\n",ntohs(oxm_value16));
 					break;
 
 					case OFPXMT_OFB_TCP_DST:
-					memcpy(&oxm_value16, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 2);
+					memcpy(&oxm_value16, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 2);
 					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Destination TCP Port: %d\r\n",ntohs(oxm_value16));
 					break;
 
 					case OFPXMT_OFB_UDP_SRC:
-					memcpy(&oxm_value16, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 2);
+					memcpy(&oxm_value16, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 2);
 					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Source UDP Port: %d\r\n",ntohs(oxm_value16));
 					break;
 
 					case OFPXMT_OFB_UDP_DST:
-					memcpy(&oxm_value16, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 2);
+					memcpy(&oxm_value16, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 2);
 					snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Destination UDP Port: %d\r\n",ntohs(oxm_value16));
 					break;
 
 					case OFPXMT_OFB_VLAN_VID:
-					memcpy(&oxm_value16, ofp13_oxm_match[i] + sizeof(struct oxm_header13) + match_size, 2);
+					memcpy(&oxm_value16, flow_match13[i]->match.oxm_fields + sizeof(struct oxm_header13) + match_size, 2);
 					if (oxm_value16 != 0) snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  VLAN ID: %d\r\n",(ntohs(oxm_value16) - OFPVID_PRESENT));
 					break;
 
@@ -2575,10 +2518,10 @@ if (iLastFlow > 0)
 			int sec = t%60;
 			snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"  Last Match: %02d:%02d:%02d\r\n", hr, min, sec);
 			// Print instruction list
-			if (ofp13_oxm_inst[i] != NULL)
+			if (flow_match13[i]->inst->len > 0)
 			{
 				snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"\r Instructions:\r\n");
-				inst_ptr = (struct ofp13_instruction *) ofp13_oxm_inst[i];
+				inst_ptr = (struct ofp13_instruction *) flow_match13[i]->inst->data;
 				inst_size = ntohs(inst_ptr->len);
 				if(ntohs(inst_ptr->type) == OFPIT13_APPLY_ACTIONS)
 				{
@@ -2588,7 +2531,7 @@ if (iLastFlow > 0)
 					if (inst_size == sizeof(struct ofp13_instruction_actions)) snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),"   DROP \r\n");	// No actions
 					while (act_size < (inst_size - sizeof(struct ofp13_instruction_actions)))
 					{
-						inst_actions  = ofp13_oxm_inst[i] + act_size;
+						inst_actions  = flow_match13[i]->inst->data + act_size;
 						act_hdr = &inst_actions->actions;
 						if (htons(act_hdr->type) == OFPAT13_OUTPUT)
 						{
@@ -2612,7 +2555,7 @@ if (iLastFlow > 0)
 							act_output = NULL;
 						}
 
-						if (htons(act_hdr->type) == OFPAT13_SET_FIELD)
+						if (htons(act_hdr->type) == OFPAT13_SET_FIELD || htons(act_hdr->type) == OFPAT13_SET_VLAN10)
 						{
 							struct ofp13_action_set_field *act_set_field = act_hdr;
 							memcpy(&oxm_header, act_set_field->field,4);
@@ -2740,10 +2683,10 @@ if (iLastFlow > 0)
 					continue;
 				}
 				// Is there more then one instruction?
-				if (ofp13_oxm_inst_size[i] > inst_size)
+				if (flow_match13[i]->inst->len > inst_size)
 				{
 					uint8_t *nxt_inst;
-					nxt_inst = ofp13_oxm_inst[i] + inst_size;
+					nxt_inst = flow_match13[i]->inst->data + inst_size;
 					inst_ptr = (struct ofp13_instruction *) nxt_inst;
 					inst_size = ntohs(inst_ptr->len);
 					if(ntohs(inst_ptr->type) == OFPIT13_GOTO_TABLE)
@@ -3081,26 +3024,19 @@ static uint8_t interfaceCreate_Config_OpenFlow(void)
 				, Zodiac_Config.OFPort
 			);
 		
-		if(Zodiac_Config.failstate == 0)
-		{
-			snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),\
-						"Failstate:<br>"\
-						"<select name=\"wi_failstate\">"\
-							"<option value=\"0\">Secure</option>"\
-							"<option value=\"1\">Safe</option>"\
-						"</select><br><br>"\
-			);
-		}
-		else
-		{
-			snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),\
-						"Failstate:<br>"\
-						"<select name=\"wi_failstate\">"\
-							"<option value=\"0\">Secure</option>"\
-							"<option selected value=\"1\">Safe</option>"\
-						"</select><br><br>"\
-					);
-		}
+		snprintf(shared_buffer+strlen(shared_buffer), SHARED_BUFFER_LEN-strlen(shared_buffer),\
+					"Failstate:<br>"\
+					"<select name=\"wi_failstate\">"\
+						"<option %svalue=\"0\">Secure</option>"\
+						"<option %svalue=\"1\">Safe</option>"\
+						"<option %svalue=\"2\">Standalone</option>"\
+						"<option %svalue=\"3\">Standalone (KSZ8795)</option>"\
+					"</select><br><br>"\
+				, (Zodiac_Config.failstate == 0) ? "selected " : ""
+				, (Zodiac_Config.failstate == 1) ? "selected " : ""
+				, (Zodiac_Config.failstate == FAILSTATE_STANDALONE) ? "selected " : ""
+				, (Zodiac_Config.failstate == FAILSTATE_STANDALONE_HW) ? "selected " : ""
+				);
 
 		if(Zodiac_Config.of_version == 1)
 		{
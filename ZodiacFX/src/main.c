@@ -44,7 +44,9 @@
 #include "switch.h"
 #include "http.h"
 #include "flash.h"
+#include "slab.h"
 #include "openflow/openflow.h"
+#include "openflow/snapshot.h"
 #include "ksz8795clx/ethernet_phy.h"
 
 // Global variables
@@ -57,6 +59,10 @@ int portmap[4];
 int32_t ul_temp;
 uint8_t NativePortMatrix;
 uint32_t uid_buf[4];
+extern uint8_t packet_slab_mem[PACKET_SLAB_SIZE];
+extern struct slab packet_slab;
+extern uint8_t ctrl_slab_mem[CTRL_SLAB_SIZE];
+extern struct slab ctrl_slab;
 
 /** Reference voltage for AFEC,in mv. */
 #define VOLT_REF        (3300)
@@ -152,7 +158,9 @@ int main (void)
 	spi_init();
 	eeprom_init();
 	temp_init();
-	membag_init();
+	flow_table_init();
+	slab_init(&packet_slab, packet_slab_mem, sizeof(packet_slab_mem));
+	slab_init(&ctrl_slab, ctrl_slab_mem, sizeof(ctrl_slab_mem));
 
 	loadConfig(); // Load Config
 
@@ -204,6 +212,9 @@ int main (void)
 			}
 		}
 	}
+	update_port_status();
+	update_port_masks();
+	snapshot_restore();	// Put back the flow table saved before the restart
 
 	while(1)
 	{
@@ -42,9 +42,37 @@
 #include "lwip/tcp_impl.h"
 #include "lwip/udp.h"
 #include "switch.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "timers.h"
+#include <sys/types.h>
 
 #define ALIGN8(x) (x+7)/8*8
 
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SLOTS	(1 << TIMER_WHEEL_BITS)	// Buckets on each level of the timer wheel
+#define TIMER_WHEEL_BUCKETS	(3 * TIMER_WHEEL_SLOTS)
+#define LIST_NONE	0xffff	// End of a flow list
+#define LIST_HEAD	0x8000	// Set in prev when the flow is first in a bucket
+#define FLOWREM_MAX_LEN	256	// Largest flow removed message
+#define COOKIE_BUCKETS	64	// Buckets in the cookie index
+#define MATCH_BUCKETS	256	// Buckets in the match index
+#define PRIORITY_BUCKETS	64	// Buckets in the table and priority index
+#define INST_BUCKETS	64	// Buckets in the shared instruction index
+#define FLOW_OUT_OTHER	0x80	// Set in out_ports when a flow outputs to a port other than 1-4
+
+/*
+*	Link for each flow slot in one of the flow lists. The lists are
+*	doubly linked through slot numbers, with the heads kept in an array of
+*	buckets. LIST_HEAD is set in prev with the bucket number for the first
+*	flow in a bucket.
+*/
+struct flow_link
+{
+	uint16_t next;
+	uint16_t prev;
+};
+
 // Global variables
 extern struct zodiac_config Zodiac_Config;
 extern int iLastFlow;
@@ -52,18 +80,42 @@ extern int OF_Version;
 extern int totaltime;
 extern uint8_t last_port_status[4];
 extern uint8_t port_status[4];
-extern struct flows_counter flow_counters[MAX_FLOWS_13];
+extern uint8_t port_config[4];
+extern struct flows_counter *flow_counters;
 extern struct table_counter table_counters[MAX_TABLES];
-extern struct ofp_flow_mod *flow_match10[MAX_FLOWS_10];
-extern struct flow_tbl_actions *flow_actions10[MAX_FLOWS_10];
-extern struct ofp13_flow_mod *flow_match13[MAX_FLOWS_13];
-extern uint8_t *ofp13_oxm_match[MAX_FLOWS_13];
-extern uint8_t *ofp13_oxm_inst[MAX_FLOWS_13];
-extern uint16_t ofp13_oxm_inst_size[MAX_FLOWS_13];
+extern struct flow_entry13 **flow_match13;
+extern int max_flows;
+extern int flow_count;
+extern uint16_t *flow_free;
+extern int flow_free_count;
+extern struct meter_entry13 meter_table13[MAX_METER_13];
+extern struct packet_buffer packet_buffers[MAX_BUFFERS];
+extern struct slab flow_slab;
+extern struct slab packet_slab;
+extern uint8_t shared_buffer[SHARED_BUFFER_LEN];
+extern int __ram_end__;
+extern caddr_t _sbrk(int incr);
 
 // Local Variables
 uint8_t timer_alt;
-static uint16_t VLAN_VID_MASK = 0x0fff;
+uint32_t buffer_seq;
+static struct flow_link *timer_links;
+static uint32_t *timer_expires;
+static uint16_t timer_wheel[TIMER_WHEEL_BUCKETS];
+static uint32_t wheel_time;
+static struct flow_link *cookie_links;
+static uint16_t cookie_index[COOKIE_BUCKETS];
+static struct flow_link *match_links;
+static uint16_t match_index[MATCH_BUCKETS];
+static struct flow_link *priority_links;
+static uint16_t priority_index[PRIORITY_BUCKETS];
+static struct flow_inst13 *inst_index[INST_BUCKETS];
+static struct packet_in_bucket packet_in_buckets[4][2];
+struct packet_in_stats packet_in_stats;
+COMPILER_ALIGNED(8) static uint8_t packet_in_queue[PACKET_IN_QUEUE_SIZE];
+static uint16_t packet_in_len;		// Bytes of packet-in messages waiting in packet_in_queue
+
+static void flow_list_unlink(struct flow_link *links, uint16_t *heads, int flow_id);
 
 static inline uint64_t (htonll)(uint64_t n)
 {
@@ -133,7 +185,7 @@ void nnOF_timer(void)
 	if (timer_alt == 0){
 		update_port_stats();
 		timer_alt = 1;
-	} else if (timer_alt == 1){
+	} else {
 		update_port_status();
 		// If port status has changed send a port status message
 		for (int x=0;x<4;x++)
@@ -141,119 +193,14 @@ void nnOF_timer(void)
 			if (last_port_status[x] != port_status[x] && OF_Version == 1 && Zodiac_Config.of_port[x] == 1) port_status_message10(x);
 			if (last_port_status[x] != port_status[x] && OF_Version == 4 && Zodiac_Config.of_port[x] == 1) port_status_message13(x);
 		}
-		timer_alt = 2;
-	} else if (timer_alt == 2){
-		flow_timeouts();
 		timer_alt = 0;
 	}
+	// The timer wheel only looks at flows that are due so it can run every time
+	flow_timeouts();
+	snapshot_task();
 	return;
 }
 
-/*
-*	Matches packet headers against the installed flows for OpenFlow v1.0 (0x01).
-*	Returns the flow number if it matches.
-*
-*	@param *pBuffer - pointer to the buffer that contains the packet to be macthed.
-*	@param port - The port that the packet was received on.
-*
-*/
-int flowmatch10(uint8_t *pBuffer, int port, struct packet_fields *fields)
-{
-	int matched_flow = -1;
-	int i;
-	uint8_t *eth_dst = pBuffer;
-	uint8_t *eth_src = pBuffer + 6;
-	uint8_t icmp_type;
-	uint8_t icmp_code;
-	bool port_match, eth_src_match, eth_dst_match, eth_prot_match;
-	bool ip_src_match, ip_dst_match, ip_prot_match;
-	bool tcp_src_match = false;
-	bool tcp_dst_match = false;
-	bool vlan_match;
-	uint64_t zero_field = 0;
-
-	if (!fields->parsed) {
-		packet_fields_parser(pBuffer, fields);
-	}
-
-	TRACE("of_helper.c: Looking for match from port %d : "
-	"%.2X:%.2X:%.2X:%.2X:%.2X:%.2X -> %.2X:%.2X:%.2X:%.2X:%.2X:%.2X eth type %4.4X", port,
-	eth_src[0], eth_src[1], eth_src[2], eth_src[3], eth_src[4], eth_src[5],
-	eth_dst[0], eth_dst[1], eth_dst[2], eth_dst[3], eth_dst[4], eth_dst[5],
-	ntohs(fields->eth_prot))
-
-	// IP packets
-	if (ntohs(fields->eth_prot) == 0x0800 && fields->ip_prot == 1)		// ICMP
-	{
-		if (fields->isVlanTag == true)	// Add 4 bytes to the offset
-		{
-			memcpy(&icmp_type, pBuffer + 38, 1);
-			memcpy(&icmp_code, pBuffer + 49, 1);
-		} else {
-			memcpy(&icmp_type, pBuffer + 34, 1);
-			memcpy(&icmp_code, pBuffer + 35, 1);
-		}
-	}
-
-	for (i=0;i<iLastFlow;i++)
-	{
-		// Make sure its an active flow
-		if (flow_counters[i].active == false)
-		{
-			continue;
-		}
-
-		// If this flow is of a lower priority then one that is already match then there is no point going through a check.
-		if(ntohs(flow_match10[i]->priority) <= ntohs(flow_match10[matched_flow]->priority)) continue;
-
-		port_match = (ntohl(flow_match10[i]->match.wildcards) & OFPFW_IN_PORT) || ntohs(flow_match10[i]->match.in_port) == port || flow_match10[i]->match.in_port == 0;
-		eth_src_match = (ntohl(flow_match10[i]->match.wildcards) & OFPFW_DL_SRC) || memcmp(eth_src, flow_match10[i]->match.dl_src, 6) == 0 || memcmp(flow_match10[i]->match.dl_src, zero_field, 6) == 0;
-		eth_dst_match = (ntohl(flow_match10[i]->match.wildcards) & OFPFW_DL_DST) || memcmp(eth_dst, flow_match10[i]->match.dl_dst, 6) == 0 || memcmp(flow_match10[i]->match.dl_dst, zero_field, 6) == 0;
-		eth_prot_match = (ntohl(flow_match10[i]->match.wildcards) & OFPFW_DL_TYPE) || fields->eth_prot == flow_match10[i]->match.dl_type || flow_match10[i]->match.dl_type == 0;
-		vlan_match = (ntohl(flow_match10[i]->match.wildcards) & OFPFW_DL_VLAN) || (fields->isVlanTag == true && (ntohl(fields->vlanid) & VLAN_VID_MASK) == (ntohl(flow_match10[i]->match.dl_vlan) & VLAN_VID_MASK)) || (ntohs(flow_match10[i]->match.dl_vlan) == OFP_VLAN_NONE);
-
-		uint8_t ip_src_wild = ntohl(flow_match10[i]->match.wildcards) >> 8; // OFPFW_NW_SRC_SHIFT
-		ip_src_wild &= 63; // OFPFW_NW_SRC_BITS
-		ip_src_match = (ip_src_wild >= 32) || (ntohs(fields->eth_prot) == 0x0800 && (ntohl(fields->ip_src) >> ip_src_wild) == (ntohl(flow_match10[i]->match.nw_src) >> ip_src_wild)) || flow_match10[i]->match.nw_src == 0;
-
-		uint8_t ip_dst_wild = ntohl(flow_match10[i]->match.wildcards) >> 14;
-		ip_dst_wild &= 63;
-		ip_dst_match = (ip_dst_wild >= 32) || (ntohs(fields->eth_prot) == 0x0800 && (ntohl(fields->ip_dst) >> ip_dst_wild) == (ntohl(flow_match10[i]->match.nw_dst) >> ip_dst_wild)) || flow_match10[i]->match.nw_dst == 0;
-		ip_prot_match = (ntohl(flow_match10[i]->match.wildcards) & OFPFW_NW_PROTO) || (ntohs(fields->eth_prot) == 0x0800 && fields->ip_prot == flow_match10[i]->match.nw_proto) || flow_match10[i]->match.nw_proto == 0  || ntohs(fields->eth_prot) != 0x0800;
-		// If it is TCP or UDP we match on source and destination ports
-		if (ntohs(fields->eth_prot) == 0x0800 && (fields->ip_prot == 6 || fields->ip_prot == 17))
-		{
-			tcp_src_match = (ntohl(flow_match10[i]->match.wildcards) & OFPFW_TP_SRC) || fields->tp_src == flow_match10[i]->match.tp_src || flow_match10[i]->match.tp_src == 0;
-			tcp_dst_match = (ntohl(flow_match10[i]->match.wildcards) & OFPFW_TP_DST) || fields->tp_dst == flow_match10[i]->match.tp_dst || flow_match10[i]->match.tp_dst == 0;
-		}
-		// If it is ICMP the TCP source and destination ports become type and code values
-		if (ntohs(fields->eth_prot) == 0x0800 && fields->ip_prot == 1)
-		{
-			tcp_src_match = (ntohl(flow_match10[i]->match.wildcards) & OFPFW_TP_SRC) || icmp_type == ntohs(flow_match10[i]->match.tp_src) || flow_match10[i]->match.tp_src == 0;
-			tcp_dst_match = (ntohl(flow_match10[i]->match.wildcards) & OFPFW_TP_DST) || icmp_code == ntohs(flow_match10[i]->match.tp_dst) || flow_match10[i]->match.tp_dst == 0;
-		}
-		// If it is ARP then we skip IP and TCP/UDP values
-		if (ntohs(fields->eth_prot) == 0x0806)
-		{
-			ip_src_match = true;
-			ip_dst_match = true;
-			tcp_src_match = true;
-			tcp_dst_match = true;
-		}
-		if (port_match && eth_src_match && eth_dst_match && eth_prot_match && ip_src_match && ip_dst_match && ip_prot_match && tcp_src_match && tcp_dst_match && vlan_match)
-		{
-			if (matched_flow > -1)
-			{
-				if(ntohs(flow_match10[i]->priority) > ntohs(flow_match10[matched_flow]->priority)) matched_flow = i;
-			} else {
-				matched_flow = i;
-			}
-		}
-	}
-
-	return matched_flow;
-}
-
 /*
 *	Populate the packet header fields.
 *
@@ -305,6 +252,296 @@ void packet_fields_parser(uint8_t *pBuffer, struct packet_fields *fields) {
 	fields->parsed = true;
 }
 
+/*
+*	Open a gap in a packet
+*
+*	The bytes in front of the gap are moved into the headroom so only the
+*	headers are copied, whatever the size of the frame. If the headroom is
+*	used up the rest of the frame is moved into the tailroom instead.
+*
+*	@param *pkt - pointer to the packet descriptor.
+*	@param offset - offset of the gap from the start of the frame.
+*	@param len - size of the gap.
+*
+*	Returns a pointer to the gap, or NULL if there is no room left.
+*/
+uint8_t *packet_push(struct packet_desc *pkt, uint16_t offset, uint16_t len)
+{
+	if (offset > pkt->len) return NULL;
+	if (pkt->headroom >= len)
+	{
+		memmove(pkt->data - len, pkt->data, offset);
+		pkt->data -= len;
+		pkt->headroom -= len;
+	} else if (pkt->tailroom >= len)
+	{
+		memmove(pkt->data + offset + len, pkt->data + offset, pkt->len - offset);
+		pkt->tailroom -= len;
+	} else
+	{
+		return NULL;
+	}
+	pkt->len += len;
+	return pkt->data + offset;
+}
+
+/*
+*	Remove bytes from a packet
+*
+*	The bytes in front of the removed section are moved forward into the
+*	space it leaves, giving the headroom back.
+*
+*	@param *pkt - pointer to the packet descriptor.
+*	@param offset - offset of the section from the start of the frame.
+*	@param len - number of bytes to remove.
+*
+*/
+void packet_pull(struct packet_desc *pkt, uint16_t offset, uint16_t len)
+{
+	if (offset + len > pkt->len) return;
+	memmove(pkt->data + len, pkt->data, offset);
+	pkt->data += len;
+	pkt->headroom += len;
+	pkt->len -= len;
+	return;
+}
+
+/*
+*	Store a packet in the buffer pool
+*
+*	Uses a free buffer or one that has been waiting for longer than
+*	BUFFER_TIMEOUT. The buffer id carries the slot number in the low
+*	bits and a sequence number above it so stale ids are not matched.
+*
+*	@param *buffer - pointer to the packet.
+*	@param ul_size - size of the packet.
+*	@param port - port that the packet was received on.
+*
+*	The packet is copied into packet_slab so a buffer only takes up as much
+*	memory as the packet it holds.
+*
+*	Returns the buffer id, or OFP_NO_BUFFER if all of the buffers are in use
+*	or there is not enough memory left for the packet.
+*/
+uint32_t packet_buffer_store(uint8_t *buffer, uint16_t ul_size, uint8_t port)
+{
+	if (ul_size > GMAC_FRAME_LENTGH_MAX) return OFP_NO_BUFFER;
+
+	for (int i=0;i<MAX_BUFFERS;i++)
+	{
+		struct packet_buffer *buf = &packet_buffers[i];
+		if (buf->buffer_id != 0 && (totaltime - buf->time_added) < (BUFFER_TIMEOUT * 2)) continue;
+
+		slab_free(&packet_slab, buf->data);	// Expired packet
+		buf->buffer_id = 0;
+		buf->data = slab_alloc(&packet_slab, PACKET_HEADROOM + ul_size);
+		if (buf->data == NULL) return OFP_NO_BUFFER;
+		buffer_seq = (buffer_seq + 1) & 0x00ffffff;
+		if (buffer_seq == 0) buffer_seq = 1;
+		buf->buffer_id = (buffer_seq * MAX_BUFFERS) + i;
+		buf->in_port = port;
+		buf->size = ul_size;
+		buf->time_added = totaltime;
+		memcpy(buf->data + PACKET_HEADROOM, buffer, ul_size);
+		return buf->buffer_id;
+	}
+	return OFP_NO_BUFFER;
+}
+
+/*
+*	Find a buffered packet
+*
+*	The buffer is kept from being reused until it is released.
+*
+*	@param buffer_id - buffer id sent to the controller.
+*
+*	Returns a pointer to the buffer, or NULL if it does not exist.
+*/
+struct packet_buffer *packet_buffer_get(uint32_t buffer_id)
+{
+	if (buffer_id == 0 || buffer_id == OFP_NO_BUFFER) return NULL;
+	struct packet_buffer *buf = &packet_buffers[buffer_id % MAX_BUFFERS];
+	if (buf->buffer_id != buffer_id) return NULL;
+	buf->time_added = totaltime;
+	return buf;
+}
+
+/*
+*	Return a buffer to the pool
+*
+*	@param *buf - pointer to the buffer, NULL if the buffer has already been reused.
+*
+*/
+void packet_buffer_release(struct packet_buffer *buf)
+{
+	if (buf == NULL) return;
+	slab_free(&packet_slab, buf->data);
+	buf->data = NULL;
+	buf->buffer_id = 0;
+	return;
+}
+
+/*
+*	Run a buffered packet through the flow table and release the buffer
+*
+*	@param buffer_id - buffer id sent to the controller.
+*
+*	Returns false if there is no packet buffered with the id.
+*/
+bool packet_buffer_lookup(uint32_t buffer_id)
+{
+	if (buffer_id == OFP_NO_BUFFER) return true;
+	struct packet_buffer *buf = packet_buffer_get(buffer_id);
+	if (buf == NULL) return false;
+
+	struct packet_desc pkt = {buf->data + PACKET_HEADROOM, buf->size, PACKET_HEADROOM, 0};
+	nnOF_tablelookup(&pkt, buf->in_port);
+	packet_buffer_release(buf);
+	return true;
+}
+
+/*
+*	Release all of the buffered packets
+*
+*/
+void packet_buffer_clear(void)
+{
+	for (int i=0;i<MAX_BUFFERS;i++)
+	{
+		packet_buffers[i].buffer_id = 0;
+		packet_buffers[i].data = NULL;
+	}
+	slab_reset(&packet_slab);
+	return;
+}
+
+/*
+*	Get the packet-in rate limit for a reason
+*
+*	@param reason - OFPR_NO_MATCH or OFPR_ACTION, invalid TTL counts as an action.
+*
+*	Returns packet-ins per second per port, 0 for no limit.
+*/
+uint32_t packet_in_rate(uint8_t reason)
+{
+	int r = (reason == OFPR_NO_MATCH) ? 0 : 1;
+	if (Zodiac_Config.packet_in_rate[r] == 0xFFFF) return (r == 0) ? PACKET_IN_RATE_MISS : PACKET_IN_RATE_ACTION;	// Not set, e.g. a config saved before it was added
+	return Zodiac_Config.packet_in_rate[r];
+}
+
+/*
+*	Check a packet-in against the rate limit for its port and reason
+*
+*	Each port has a token bucket for table misses and one for output
+*	actions, refilled at the rate set in the config and holding up to a
+*	second's worth. Packet-ins are also held back while the controller
+*	queue is backed up so echo, barrier and error replies never wait
+*	behind a flood of them.
+*
+*	@param port - port the packet was received on.
+*	@param reason - OFPR_NO_MATCH or OFPR_ACTION, invalid TTL counts as an action.
+*
+*	Returns true if the packet-in can be sent.
+*/
+bool packet_in_allowed(uint8_t port, uint8_t reason)
+{
+	if (controller_backlog() > TX_QUEUE_SIZE/4)
+	{
+		packet_in_stats.backlog++;
+		return false;
+	}
+	if (port < 1 || port > 4) return true;	// Sent by a packet out
+	if (port_config[port-1] & OFPPC_NO_PACKET_IN) return false;	// Turned off for the port by a port mod
+
+	int r = (reason == OFPR_NO_MATCH) ? 0 : 1;
+	uint32_t rate = packet_in_rate(reason);
+	if (rate == 0) return true;
+
+	struct packet_in_bucket *bucket = &packet_in_buckets[port-1][r];
+	uint32_t now = sys_get_ms();
+	uint32_t elapsed = now - bucket->last;
+	bucket->last = now;
+	if (elapsed >= 1000)
+	{
+		bucket->tokens = rate * 1000;
+	} else {
+		bucket->tokens += elapsed * rate;
+		if (bucket->tokens > rate * 1000) bucket->tokens = rate * 1000;
+	}
+	if (bucket->tokens < 1000)
+	{
+		packet_in_stats.rate_limited[port-1][r]++;
+		return false;
+	}
+	bucket->tokens -= 1000;
+	return true;
+}
+
+/*
+*	Make room for a packet-in message in the packet-in queue
+*
+*	The datapath builds its packet-ins here rather than sending them, so
+*	none of the TCP work is done while a packet is being switched.
+*	Messages start on a 4 byte boundary.
+*
+*	@param len - length of the message.
+*
+*	Returns a pointer to build the message at, or NULL if the queue is full.
+*/
+uint8_t *packet_in_reserve(uint16_t len)
+{
+	uint8_t *msg;
+
+	if (PACKET_IN_QUEUE_SIZE - packet_in_len < len)
+	{
+		packet_in_stats.queue_full++;
+		return NULL;
+	}
+	msg = packet_in_queue + packet_in_len;
+	packet_in_len = (packet_in_len + len + 3) & ~3;
+	if (packet_in_len > PACKET_IN_QUEUE_SIZE) packet_in_len = PACKET_IN_QUEUE_SIZE;
+	return msg;
+}
+
+/*
+*	Send the queued packet-ins to the controllers
+*
+*	Called once per pass of the main loop, the batch goes out with the
+*	next tcp_output(). A packet-in that no controller took has its buffer
+*	released as it will never be asked for.
+*
+*/
+void packet_in_flush(void)
+{
+	uint16_t pos = 0;
+
+	while (pos < packet_in_len)
+	{
+		struct ofp_header *ofph = (struct ofp_header *)(packet_in_queue + pos);
+		uint16_t len = ntohs(ofph->length);
+		uint8_t reason = ((struct ofp13_packet_in *)ofph)->reason;	// Only looked at for 1.3
+		if (send_async(ofph, len, OFPT13_PACKET_IN, reason) == 0)
+		{
+			// buffer_id follows the header in both 1.0 and 1.3 packet-ins
+			uint32_t buffer_id = ntohl(*(uint32_t *)(packet_in_queue + pos + sizeof(struct ofp_header)));
+			if (buffer_id != OFP_NO_BUFFER) packet_buffer_release(packet_buffer_get(buffer_id));
+		}
+		pos = (pos + len + 3) & ~3;
+	}
+	packet_in_len = 0;
+	return;
+}
+
+/*
+*	Drop the queued packet-ins
+*
+*/
+void packet_in_clear(void)
+{
+	packet_in_len = 0;
+	return;
+}
+
 /*
 *	Matches packet headers against the installed flows for OpenFlow v1.3 (0x04).
 *	Returns the flow number if it matches.
@@ -338,11 +575,14 @@ int flowmatch13(uint8_t *pBuffer, int port, uint8_t table_id, struct packet_fiel
 		// Make sure its an active flow
 		if (flow_counters[i].active == false) continue;
 
+		// Fail secure only forwards with flows a controller has added, not ones restored from flash
+		if (flow_match13[i]->restored != 0 && Zodiac_Config.failstate == 0) continue;
+
 		// If the flow is not in the requested table then fail
 		if (table_id != flow_match13[i]->table_id) continue;
 
 		// If the flow has no match fields (full wild) it is an automatic match
-		if (ofp13_oxm_match[i] ==  NULL)
+		if (ntohs(flow_match13[i]->match.length) <= 4)
 		{
 			if (matched_flow == -1 || (ntohs(flow_match13[i]->priority) > ntohs(flow_match13[matched_flow]->priority))) matched_flow = i;
 			continue;
@@ -352,7 +592,7 @@ int flowmatch13(uint8_t *pBuffer, int port, uint8_t table_id, struct packet_fiel
 
 		// Main flow match loop
 		priority_match = 0;
-		uint8_t *hdr = ofp13_oxm_match[i];
+		uint8_t *hdr = flow_match13[i]->match.oxm_fields;
 		uint8_t *tail = hdr + ntohs(flow_match13[i]->match.length) - 4;
 		while (hdr < tail)
 		{
@@ -501,6 +741,18 @@ int flowmatch13(uint8_t *pBuffer, int port, uint8_t table_id, struct packet_fiel
 				}
 				break;
 
+				case OXM_OF_ICMPV4_TYPE:
+				case OXM_OF_ICMPV4_CODE:
+				priority_match = -1;
+				if (fields->eth_prot == htons(0x0800) && fields->ip_prot == 1)
+				{
+					struct ip_hdr *iph = (struct ip_hdr*)fields->payload;
+					uint8_t *icmp = fields->payload + IPH_HL(iph) * 4;
+					// The type is the first byte of the ICMP header and the code the second
+					if (icmp[(field == OXM_OF_ICMPV4_CODE) ? 1 : 0] == oxm_value[0]) priority_match = 0;
+				}
+				break;
+
 				case OXM_OF_VLAN_VID:
 				if (fields->isVlanTag)
 				{
@@ -549,41 +801,6 @@ int flowmatch13(uint8_t *pBuffer, int port, uint8_t table_id, struct packet_fiel
 	return matched_flow;
 }
 
-/*
-*	Compares 2 match fields
-*	Return 1 if they are a match
-*
-*	@param *match_a - pointer to the first match field
-*	@param *match_b - pointer to the second match field
-*
-*/
-int field_match10(struct ofp_match *match_a, struct ofp_match *match_b)
-{
-	int match = 0;
-
-	if (match_a->wildcards == 0xff203800) return 1;	//First check if all wildcards are set, if so return a match
-
-	uint8_t ip_src_wild = ntohl(match_a->wildcards) >> 8;
-	ip_src_wild &= 63;
-	uint8_t ip_dst_wild = ntohl(match_a->wildcards) >> 14;
-	ip_dst_wild &= 63;
-
-	// Check all the match fields. There is definitely a more elegant way of doing this and it's on my TODO list!
-	match += (((ntohl(match_a->nw_dst) >> ip_dst_wild) == (ntohl(match_b->nw_dst) >> ip_dst_wild)) || ip_dst_wild == 32);
-	match += (((ntohl(match_a->nw_src) >> ip_src_wild) == (ntohl(match_b->nw_src) >> ip_src_wild)) || ip_src_wild == 32);
-	match += (match_a->dl_vlan == match_b->dl_vlan || (ntohl(match_a->wildcards) & OFPFW_DL_VLAN));
-	match += (match_a->in_port == match_b->in_port || (ntohl(match_a->wildcards) & OFPFW_IN_PORT));
-	match += (memcmp(match_a->dl_src, match_b->dl_src, 6) == 0 || (ntohl(match_a->wildcards) & OFPFW_DL_SRC));
-	match += (memcmp(match_a->dl_dst, match_b->dl_dst, 6) == 0 || (ntohl(match_a->wildcards) & OFPFW_DL_DST));
-	match += (match_a->dl_type == match_b->dl_type || (ntohl(match_a->wildcards) & OFPFW_DL_TYPE));
-	match += (match_a->nw_proto == match_b->nw_proto || (ntohl(match_a->wildcards) & OFPFW_NW_PROTO));
-	match += (match_a->tp_src == match_b->tp_src || (ntohl(match_a->wildcards) & OFPFW_TP_SRC));
-	match += (match_a->tp_dst == match_b->tp_dst || (ntohl(match_a->wildcards) & OFPFW_TP_DST));
-
-	if (match == 10 ) return 1; // If all 10 values match or are wild then return 1
-	return 0;
-}
-
 #define PREREQ_INVALID 1<<0
 #define PREREQ_VLAN 1<<1
 #define PREREQ_IPV4 1<<2
@@ -968,6 +1185,61 @@ int field_match13(uint8_t *oxm_a, int len_a, uint8_t *oxm_b, int len_b)
 	return 1;
 }
 
+/*
+*	Get a shared copy of an OpenFlow 1.3 instruction list
+*
+*	If another flow already has the same instructions its copy is used,
+*	otherwise a new one is stored in the flow slab.
+*
+*	@param *inst - pointer to the instructions.
+*	@param len - length of the instructions.
+*
+*	Returns a pointer to the shared list, or NULL if there is no memory left.
+*/
+struct flow_inst13 *flow_inst_get13(uint8_t *inst, uint16_t len)
+{
+	struct flow_inst13 *shared;
+	uint32_t hash = 2166136261;	// FNV-1a
+	for (int i=0;i<len;i++) hash = (hash ^ inst[i]) * 16777619;
+
+	for (shared = inst_index[hash % INST_BUCKETS];shared != NULL;shared = shared->next)
+	{
+		if (shared->hash == hash && shared->len == len && memcmp(shared->data, inst, len) == 0)
+		{
+			shared->refs++;
+			return shared;
+		}
+	}
+
+	shared = slab_alloc(&flow_slab, sizeof(struct flow_inst13) + len);
+	if (shared == NULL) return NULL;
+	shared->refs = 1;
+	shared->len = len;
+	shared->hash = hash;
+	memcpy(shared->data, inst, len);
+	shared->next = inst_index[hash % INST_BUCKETS];
+	inst_index[hash % INST_BUCKETS] = shared;
+	return shared;
+}
+
+/*
+*	Release a flow's hold on a shared instruction list
+*
+*	@param *inst - pointer to the shared list.
+*
+*/
+void flow_inst_put13(struct flow_inst13 *inst)
+{
+	if (inst == NULL) return;
+	if (--inst->refs > 0) return;
+
+	struct flow_inst13 **prev = &inst_index[inst->hash % INST_BUCKETS];
+	while (*prev != inst) prev = &(*prev)->next;
+	*prev = inst->next;
+	slab_free(&flow_slab, inst);
+	return;
+}
+
 /*
 *	Remove a flow entry from the flow table (OF 1.3)
 *
@@ -976,148 +1248,703 @@ int field_match13(uint8_t *oxm_a, int len_a, uint8_t *oxm_b, int len_b)
 */
 void remove_flow13(int flow_id)
 {
-	// Free the memory allocated for the match and instructions
-	if(ofp13_oxm_match[flow_id] != NULL)
+	meter_flow_ref13(flow_id, -1);
+	// Free the record holding the flow and match, and drop its hold on the instructions
+	flow_inst_put13(flow_match13[flow_id]->inst);
+	slab_free(&flow_slab, flow_match13[flow_id]);
+	flow_match13[flow_id] = NULL;
+	flow_slot_free(flow_id);
+	return;
+}
+
+/*
+*	Get a slot in the flow table for a new flow
+*
+*	Slots freed by removed flows are reused before the table is extended.
+*	Flows never move once they are added so the index, and the handle made
+*	from it, stay valid until the flow is removed.
+*
+*	Returns the index of the slot, or -1 if the table is full.
+*/
+int flow_slot_alloc(void)
+{
+	int flow_id;
+	if (flow_free_count > 0)
 	{
-		membag_free(ofp13_oxm_match[flow_id]);
-		ofp13_oxm_match[flow_id] = NULL;
+		flow_id = flow_free[--flow_free_count];
+	} else if (iLastFlow < max_flows) {
+		flow_id = iLastFlow++;
+	} else {
+		return -1;
 	}
-	if(ofp13_oxm_inst[flow_id] != NULL)
+	flow_count++;
+	snapshot_touch();
+	return flow_id;
+}
+
+/*
+*	Return a flow's slot to the free list
+*
+*	@param flow_id - the index number of the flow.
+*
+*/
+void flow_slot_free(int flow_id)
+{
+	memset(&flow_counters[flow_id], 0, sizeof(struct flows_counter));
+	flow_list_unlink(timer_links, timer_wheel, flow_id);
+	flow_list_unlink(cookie_links, cookie_index, flow_id);
+	flow_list_unlink(match_links, match_index, flow_id);
+	flow_list_unlink(priority_links, priority_index, flow_id);
+	flow_free[flow_free_count++] = flow_id;
+	flow_count--;
+	snapshot_touch();
+	return;
+}
+
+/*
+*	Add a flow to the front of a bucket in one of the flow lists
+*
+*	@param *links - pointer to the list's links.
+*	@param *heads - pointer to the list's buckets.
+*	@param bucket - the bucket to add the flow to.
+*	@param flow_id - the index number of the flow.
+*
+*/
+static void flow_list_add(struct flow_link *links, uint16_t *heads, int bucket, int flow_id)
+{
+	struct flow_link *l = &links[flow_id];
+	l->prev = LIST_HEAD | bucket;
+	l->next = heads[bucket];
+	if (l->next != LIST_NONE) links[l->next].prev = flow_id;
+	heads[bucket] = flow_id;
+	return;
+}
+
+/*
+*	Take a flow out of one of the flow lists
+*
+*	Does nothing if the flow isn't in the list.
+*
+*	@param *links - pointer to the list's links.
+*	@param *heads - pointer to the list's buckets.
+*	@param flow_id - the index number of the flow.
+*
+*/
+static void flow_list_unlink(struct flow_link *links, uint16_t *heads, int flow_id)
+{
+	struct flow_link *l = &links[flow_id];
+	if (l->prev == LIST_NONE) return;
+
+	if (l->prev & LIST_HEAD)
 	{
-		membag_free(ofp13_oxm_inst[flow_id]);
-		ofp13_oxm_inst[flow_id] = NULL;
+		heads[l->prev & ~LIST_HEAD] = l->next;
+	} else {
+		links[l->prev].next = l->next;
 	}
-	if(flow_match13[flow_id] != NULL)
+	if (l->next != LIST_NONE) links[l->next].prev = l->prev;
+	l->prev = LIST_NONE;
+	l->next = LIST_NONE;
+	return;
+}
+
+/*
+*	Put a flow on the timer wheel
+*
+*	The first level has a bucket for each second, the second a bucket for
+*	each TIMER_WHEEL_SLOTS seconds and so on. Buckets on the upper levels
+*	are moved down a level as the wheel turns.
+*
+*	@param flow_id - the index number of the flow.
+*	@param expires - time in seconds that the timer fires.
+*
+*/
+static void flow_timer_add(int flow_id, uint32_t expires)
+{
+	int bucket;
+
+	if ((int32_t)(expires - wheel_time) <= 0) expires = wheel_time + 1;	// Already due, fire on the next turn
+	uint32_t delta = expires - wheel_time;
+
+	if (delta < TIMER_WHEEL_SLOTS)
 	{
-		membag_free(flow_match13[flow_id]);
-		flow_match13[flow_id] = NULL;
+		bucket = expires & (TIMER_WHEEL_SLOTS-1);
+	} else if (delta < (TIMER_WHEEL_SLOTS * TIMER_WHEEL_SLOTS)) {
+		bucket = TIMER_WHEEL_SLOTS + ((expires >> TIMER_WHEEL_BITS) & (TIMER_WHEEL_SLOTS-1));
+	} else {
+		bucket = (2 * TIMER_WHEEL_SLOTS) + ((expires >> (2 * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS-1));
 	}
-	// Copy the last flow to here to fill the gap
-	flow_match13[flow_id] = flow_match13[iLastFlow-1];
-	ofp13_oxm_match[flow_id] = ofp13_oxm_match[iLastFlow-1];
-	ofp13_oxm_inst[flow_id] = ofp13_oxm_inst[iLastFlow-1];
-	ofp13_oxm_inst_size[flow_id] = ofp13_oxm_inst_size[iLastFlow - 1];
-	// Clear the values from the counters that moved
-	flow_match13[iLastFlow-1] = NULL;
-	ofp13_oxm_match[iLastFlow-1] = NULL;
-	ofp13_oxm_inst[iLastFlow-1] = NULL;
-	ofp13_oxm_inst_size[iLastFlow - 1] = 0;
-	// Move counters
-	memcpy(&flow_counters[flow_id], &flow_counters[iLastFlow-1], sizeof(struct flows_counter));
-	// Clear the counters from the last flow that was moved
-	memset(&flow_counters[iLastFlow-1], 0, sizeof(struct flows_counter));
-	iLastFlow --;
+
+	timer_expires[flow_id] = expires;
+	flow_list_add(timer_links, timer_wheel, bucket, flow_id);
 	return;
 }
 
 /*
-*	Remove a flow entry from the flow table (OF 1.3)
+*	Schedule the next timeout check for a flow
+*
+*	Only the earliest time the flow could expire is scheduled. The idle
+*	timeout is checked against lastmatch when the timer fires rather than
+*	moving the timer every time a packet matches.
 *
-*	@param flow_id - the index number of the flow to remove
+*	@param flow_id - the index number of the flow.
 *
 */
-void remove_flow10(int flow_id)
+void flow_timer_schedule(int flow_id)
 {
-	// Clear flow counters and actions
-	memset(&flow_counters[flow_id], 0, sizeof(struct flows_counter));
-	membag_free(flow_match10[flow_id]);
-	membag_free(flow_actions10[flow_id]);
-	// Copy the last flow to here to fill the gap
-	flow_match10[flow_id] = flow_match10[iLastFlow-1];
-	flow_actions10[flow_id] = flow_actions10[iLastFlow-1];
-	// Clear the pointers to the flows that moved
-	flow_match10[iLastFlow-1] = NULL;
-	flow_actions10[iLastFlow-1] = NULL;
-	// Move the counters
-	memcpy(&flow_counters[flow_id], &flow_counters[iLastFlow-1], sizeof(struct flows_counter));
-	// Clear the counters and action from the last flow that was moved
-	memset(&flow_counters[iLastFlow-1], 0, sizeof(struct flows_counter));
-	iLastFlow --;
+	uint16_t idle_timeout, hard_timeout;
+	uint32_t expires = 0;
+
+	flow_list_unlink(timer_links, timer_wheel, flow_id);
+	idle_timeout = ntohs(flow_match13[flow_id]->idle_timeout);
+	hard_timeout = ntohs(flow_match13[flow_id]->hard_timeout);
+	if (idle_timeout != OFP_FLOW_PERMANENT) expires = flow_counters[flow_id].lastmatch + idle_timeout;
+	if (hard_timeout != OFP_FLOW_PERMANENT && (expires == 0 || flow_counters[flow_id].duration + hard_timeout < expires)) expires = flow_counters[flow_id].duration + hard_timeout;
+	if (expires != 0) flow_timer_add(flow_id, expires);
 	return;
+}
+
+/*
+*	Check a flow whose timer has fired
+*
+*	Expired flows are removed and their flow removed message is sent,
+*	otherwise the flow is scheduled again.
+*
+*	@param flow_id - the index number of the flow.
+*
+*	Returns 1 if the flow was removed.
+*/
+static int flow_timer_expire(int flow_id)
+{
+	uint32_t now = totaltime/2;
+	uint16_t idle_timeout = ntohs(flow_match13[flow_id]->idle_timeout);
+	uint16_t hard_timeout = ntohs(flow_match13[flow_id]->hard_timeout);
+	uint8_t reason;
 
+	// The reason codes are the same in OpenFlow 1.0 and 1.3
+	if (idle_timeout != OFP_FLOW_PERMANENT && (now - flow_counters[flow_id].lastmatch) >= idle_timeout)
+	{
+		reason = OFPRR13_IDLE_TIMEOUT;
+	} else if (hard_timeout != OFP_FLOW_PERMANENT && (now - flow_counters[flow_id].duration) >= hard_timeout) {
+		reason = OFPRR13_HARD_TIMEOUT;
+	} else {
+		flow_timer_schedule(flow_id);
+		return 0;
+	}
+
+	TRACE("of_helper.c: Flow %d timed out", flow_id+1);
+	if (ntohs(flow_match13[flow_id]->flags) & OFPFF13_SEND_FLOW_REM) flowrem_notif(flow_id, reason);
+	remove_flow13(flow_id);
+	return 1;
 }
 
 /*
 *	Processes flow timeouts
 *
+*	Turns the timer wheel up to the current time. Only the flows whose
+*	timers fire are looked at, and every flow that has expired is removed.
+*	The flow removed messages go out together with the next tcp_output().
+*
 */
-void flow_timeouts()
+void flow_timeouts(void)
 {
-	for (int i=0;i<iLastFlow;i++)
+	uint32_t now = totaltime/2;
+	int removed = 0;
+
+	if (OF_Version != 1 && OF_Version != 4) return;
+
+	while ((int32_t)(now - wheel_time) > 0)
 	{
-		if (flow_counters[i].active == true) // Make sure its an active flow
+		wheel_time++;
+		// Move the timers on the upper levels down when their turn comes round
+		if ((wheel_time & (TIMER_WHEEL_SLOTS-1)) == 0)
 		{
-			if (OF_Version == 1)
+			for (int level=2;level>0;level--)
 			{
-				if (&flow_match10[i]->idle_timeout != OFP_FLOW_PERMANENT && flow_counters[i].lastmatch > 0 && ((totaltime/2) - flow_counters[i].lastmatch) >= ntohs(&flow_match10[i]->idle_timeout))
+				if ((wheel_time & ((1 << (level * TIMER_WHEEL_BITS)) - 1)) != 0) continue;
+				int bucket = (level * TIMER_WHEEL_SLOTS) + ((wheel_time >> (level * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS-1));
+				uint16_t flow_id;
+				while ((flow_id = timer_wheel[bucket]) != LIST_NONE)
 				{
-					if (ntohs(flow_match10[i]->flags) &  OFPFF10_SEND_FLOW_REM) flowrem_notif10(i,OFPRR10_IDLE_TIMEOUT);
-					// Clear flow counters and actions
-					remove_flow10(i);
-					iLastFlow --;
-					return;
+					flow_list_unlink(timer_links, timer_wheel, flow_id);
+					flow_timer_add(flow_id, timer_expires[flow_id]);
 				}
+			}
+		}
 
-				if (&flow_match10[i]->hard_timeout != OFP_FLOW_PERMANENT && flow_counters[i].lastmatch > 0 && ((totaltime/2) - flow_counters[i].duration) >= ntohs(&flow_match10[i]->hard_timeout))
-				{
-					if (ntohs(&flow_match10[i]->flags) &  OFPFF10_SEND_FLOW_REM) flowrem_notif10(i,OFPRR10_HARD_TIMEOUT);
-					// Clear flow counters and actions
-					remove_flow10(i);
-					iLastFlow --;
-					return;
-				}
-			} else if (OF_Version == 4)
+		int bucket = wheel_time & (TIMER_WHEEL_SLOTS-1);
+		uint16_t flow_id;
+		while ((flow_id = timer_wheel[bucket]) != LIST_NONE)
+		{
+			flow_list_unlink(timer_links, timer_wheel, flow_id);
+			removed += flow_timer_expire(flow_id);
+		}
+	}
+
+	if (removed > 0) meter_resync13();
+	return;
+}
+
+/*
+*	Send a flow removed message for a flow to the controllers that want it
+*
+*	@param flowid - flow number.
+*	@param reason - the reason the flow was removed.
+*
+*/
+void flowrem_notif(int flowid, uint8_t reason)
+{
+	uint8_t flow_rem[FLOWREM_MAX_LEN];
+	int len;
+	if (async_wanted(OFPT13_FLOW_REMOVED, reason) == false) return;	// No controller wants it, e.g. turned off with SET_ASYNC
+	if (OF_Version == 1)
+	{
+		len = flowrem_msg10(flow_rem, flowid, reason);
+	} else {
+		len = flowrem_msg13(flow_rem, flowid, reason);
+	}
+	send_async(&flow_rem, len, OFPT13_FLOW_REMOVED, reason);
+	TRACE("of_helper.c: Flow removed notification sent");
+	return;
+}
+
+/*
+*	Empty the timer wheel and flow indexes, and set the wheel to the current time
+*
+*/
+void flow_index_clear(void)
+{
+	for (int b=0;b<TIMER_WHEEL_BUCKETS;b++) timer_wheel[b] = LIST_NONE;
+	for (int b=0;b<COOKIE_BUCKETS;b++) cookie_index[b] = LIST_NONE;
+	for (int b=0;b<MATCH_BUCKETS;b++) match_index[b] = LIST_NONE;
+	for (int b=0;b<PRIORITY_BUCKETS;b++) priority_index[b] = LIST_NONE;
+	for (int b=0;b<INST_BUCKETS;b++) inst_index[b] = NULL;
+	for (int q=0;q<max_flows;q++)
+	{
+		timer_links[q].prev = LIST_NONE;
+		timer_links[q].next = LIST_NONE;
+		cookie_links[q].prev = LIST_NONE;
+		cookie_links[q].next = LIST_NONE;
+		match_links[q].prev = LIST_NONE;
+		match_links[q].next = LIST_NONE;
+		priority_links[q].prev = LIST_NONE;
+		priority_links[q].next = LIST_NONE;
+	}
+	wheel_time = totaltime/2;
+	return;
+}
+
+/*
+*	Find the cookie index bucket for a cookie
+*
+*	Flows are indexed on the top 16 bits of the cookie, which is where
+*	controllers such as ONOS keep the id of the application that owns the
+*	flow.
+*
+*	@param cookie - the cookie in network byte order.
+*
+*/
+static int flow_cookie_bucket13(uint64_t cookie)
+{
+	uint8_t *c = (uint8_t *)&cookie;
+	return ((c[0] << 8) | c[1]) % COOKIE_BUCKETS;
+}
+
+/*
+*	Find the match index bucket for a table, priority and match
+*
+*	Each oxm is hashed on its own and the hashes are added together, so
+*	the same fields in a different order land in the same bucket.
+*
+*	@param table_id - the flow table.
+*	@param priority - the priority in network byte order.
+*	@param *match - pointer to the match.
+*
+*/
+static int flow_match_bucket13(uint8_t table_id, uint16_t priority, struct ofp13_match *match)
+{
+	uint32_t hash = 2166136261;	// FNV-1a
+	uint32_t fields = 0;
+	uint8_t *oxm = match->oxm_fields;
+	uint8_t *end = oxm + ntohs(match->length) - 4;
+	hash = (hash ^ table_id) * 16777619;
+	hash = (hash ^ (priority & 0xff)) * 16777619;
+	hash = (hash ^ (priority >> 8)) * 16777619;
+	while (oxm + 4 <= end)
+	{
+		int oxm_len = 4 + OXM_LENGTH(ntohl(*(uint32_t*)(oxm)));
+		uint32_t field_hash = 2166136261;
+		if (oxm + oxm_len > end) break;
+		for (int i=0;i<oxm_len;i++) field_hash = (field_hash ^ oxm[i]) * 16777619;
+		fields += field_hash;
+		oxm += oxm_len;
+	}
+	hash = (hash ^ fields) * 16777619;
+	return hash % MATCH_BUCKETS;
+}
+
+/*
+*	Find the table and priority index bucket for a flow
+*
+*	@param table_id - the flow table.
+*	@param priority - the priority in network byte order.
+*
+*/
+static int flow_priority_bucket13(uint8_t table_id, uint16_t priority)
+{
+	return ((table_id * 31) + ntohs(priority)) % PRIORITY_BUCKETS;
+}
+
+/*
+*	Add a flow to the cookie and match indexes
+*
+*	@param flow_id - the index number of the flow.
+*
+*/
+void flow_index_add13(int flow_id)
+{
+	struct flow_entry13 *entry = flow_match13[flow_id];
+	flow_list_add(cookie_links, cookie_index, flow_cookie_bucket13(entry->cookie), flow_id);
+	flow_list_add(match_links, match_index, flow_match_bucket13(entry->table_id, entry->priority, &entry->match), flow_id);
+	flow_list_add(priority_links, priority_index, flow_priority_bucket13(entry->table_id, entry->priority), flow_id);
+	return;
+}
+
+/*
+*	Check if 2 sets of match oxms hold the same fields, in any order
+*
+*	A field can only appear once in a match, so the sets are the same if
+*	they are the same length and every oxm in the first is in the second.
+*
+*	@param *oxm_a - pointer to the first match fields.
+*	@param len_a - length of the first match fields.
+*	@param *oxm_b - pointer to the second match fields.
+*	@param len_b - length of the second match fields.
+*
+*/
+static bool oxm_same13(uint8_t *oxm_a, int len_a, uint8_t *oxm_b, int len_b)
+{
+	if (len_a != len_b) return false;
+	uint8_t *ahdr = oxm_a;
+	while (ahdr + 4 <= oxm_a + len_a)
+	{
+		int alen = 4 + OXM_LENGTH(ntohl(*(uint32_t*)(ahdr)));
+		uint8_t *bhdr = oxm_b;
+		while (bhdr + 4 <= oxm_b + len_b)
+		{
+			if (memcmp(ahdr, bhdr, 4) == 0) break;
+			bhdr += 4 + OXM_LENGTH(ntohl(*(uint32_t*)(bhdr)));
+		}
+		if (bhdr + alen > oxm_b + len_b || memcmp(ahdr, bhdr, alen) != 0) return false;
+		ahdr += alen;
+	}
+	return true;
+}
+
+/*
+*	Find a flow with exactly the same table, priority and match
+*
+*	@param table_id - the flow table.
+*	@param priority - the priority in network byte order.
+*	@param *match - pointer to the match.
+*
+*	Returns the flow number, or -1 if there isn't one.
+*/
+int flow_find13(uint8_t table_id, uint16_t priority, struct ofp13_match *match)
+{
+	uint16_t flow_id = match_index[flow_match_bucket13(table_id, priority, match)];
+	while (flow_id != LIST_NONE)
+	{
+		struct flow_entry13 *entry = flow_match13[flow_id];
+		if (entry->table_id == table_id && entry->priority == priority \
+			&& oxm_same13(entry->match.oxm_fields, ntohs(entry->match.length) - 4, match->oxm_fields, ntohs(match->length) - 4))
+		{
+			return flow_id;
+		}
+		flow_id = match_links[flow_id].next;
+	}
+	return -1;
+}
+
+/*
+*	Check if any packet could match both of 2 sets of match oxms
+*
+*	Fields that are only in one of the matches don't narrow the other, so
+*	the matches only miss each other if a field in both has values that
+*	differ in the bits both masks care about.
+*
+*	@param *oxm_a - pointer to the first match fields.
+*	@param len_a - length of the first match fields.
+*	@param *oxm_b - pointer to the second match fields.
+*	@param len_b - length of the second match fields.
+*
+*/
+static bool oxm_overlap13(uint8_t *oxm_a, int len_a, uint8_t *oxm_b, int len_b)
+{
+	uint8_t *ahdr = oxm_a;
+	while (ahdr + 4 <= oxm_a + len_a)
+	{
+		uint32_t afield = ntohl(*(uint32_t*)(ahdr));
+		uint8_t *bhdr = oxm_b;
+		while (bhdr + 4 <= oxm_b + len_b)
+		{
+			uint32_t bfield = ntohl(*(uint32_t*)(bhdr));
+			if (OXM_TYPE(afield) == OXM_TYPE(bfield))
 			{
-				if (flow_match13[i]->idle_timeout != OFP_FLOW_PERMANENT && flow_counters[i].lastmatch > 0 && ((totaltime/2) - flow_counters[i].lastmatch) >= ntohs(flow_match13[i]->idle_timeout))
+				// Value length is the same for both, the mask follows the value when there is one
+				int vlen = OXM_HASMASK(afield) ? OXM_LENGTH(afield)/2 : OXM_LENGTH(afield);
+				if (vlen != (OXM_HASMASK(bfield) ? OXM_LENGTH(bfield)/2 : OXM_LENGTH(bfield))) break;
+				for (int i=0;i<vlen;i++)
 				{
-					if (ntohs(flow_match13[i]->flags) &  OFPFF13_SEND_FLOW_REM) flowrem_notif13(i,OFPRR13_IDLE_TIMEOUT);
-					remove_flow13(i);
-					return;
+					uint8_t mask = 0xff;
+					if (OXM_HASMASK(afield)) mask &= ahdr[4 + vlen + i];
+					if (OXM_HASMASK(bfield)) mask &= bhdr[4 + vlen + i];
+					if ((ahdr[4 + i] & mask) != (bhdr[4 + i] & mask)) return false;
 				}
+				break;
+			}
+			bhdr += 4 + OXM_LENGTH(bfield);
+		}
+		ahdr += 4 + OXM_LENGTH(afield);
+	}
+	return true;
+}
 
-				if (flow_match13[i]->hard_timeout != OFP_FLOW_PERMANENT && flow_counters[i].lastmatch > 0 && ((totaltime/2) - flow_counters[i].duration) >= ntohs(flow_match13[i]->hard_timeout))
+/*
+*	Check if a flow mod overlaps a flow already in the table
+*
+*	Only flows in the same table with the same priority can overlap, so
+*	only the flows in their index bucket are checked.
+*
+*	@param *ptr_fm - pointer to the flow mod.
+*
+*/
+bool flow_overlap13(struct ofp13_flow_mod *ptr_fm)
+{
+	uint16_t q = priority_index[flow_priority_bucket13(ptr_fm->table_id, ptr_fm->priority)];
+	while (q != LIST_NONE)
+	{
+		if (flow_match13[q]->table_id == ptr_fm->table_id && flow_match13[q]->priority == ptr_fm->priority \
+			&& oxm_overlap13(ptr_fm->match.oxm_fields, ntohs(ptr_fm->match.length)-4, flow_match13[q]->match.oxm_fields, ntohs(flow_match13[q]->match.length)-4))
+		{
+			return true;
+		}
+		q = priority_links[q].next;
+	}
+	return false;
+}
+
+/*
+*	Start a walk over the flows that could match a flow mod's cookie
+*
+*	If the cookie mask covers the indexed part of the cookie only the
+*	flows in its index bucket are visited, otherwise every active flow is.
+*	The caller still has to check the cookie. The next flow is looked up
+*	before the current one is returned so it can be removed during the walk.
+*
+*	@param *it - pointer to the walk state.
+*	@param cookie - the cookie from the flow mod.
+*	@param cookie_mask - the cookie mask from the flow mod.
+*
+*	Returns the first flow, or -1 if there are none.
+*/
+int flow_iter_first13(struct flow_iter *it, uint64_t cookie, uint64_t cookie_mask)
+{
+	uint8_t *mask = (uint8_t *)&cookie_mask;
+	it->indexed = (mask[0] == 0xff && mask[1] == 0xff);
+	if (it->indexed)
+	{
+		it->next = cookie_index[flow_cookie_bucket13(cookie)];
+	} else {
+		it->next = 0;
+	}
+	return flow_iter_next13(it);
+}
+
+/*
+*	Step to the next flow in a walk
+*
+*	@param *it - pointer to the walk state.
+*
+*	Returns the next flow, or -1 at the end.
+*/
+int flow_iter_next13(struct flow_iter *it)
+{
+	int flow_id;
+	if (it->indexed)
+	{
+		if (it->next == LIST_NONE) return -1;
+		flow_id = it->next;
+		it->next = cookie_links[flow_id].next;
+		return flow_id;
+	}
+
+	while (it->next < iLastFlow && flow_counters[it->next].active == false) it->next++;
+	if (it->next >= iLastFlow) return -1;
+	return it->next++;
+}
+
+/*
+*	Work out which ports a list of instructions outputs to
+*
+*	@param *inst - pointer to the shared instruction list.
+*
+*	Returns a bit for each of ports 1-4, with FLOW_OUT_OTHER set for any
+*	other port.
+*/
+uint8_t flow_out_ports13(struct flow_inst13 *inst)
+{
+	uint8_t out_ports = 0;
+	int inst_offset = 0;
+	while (inst_offset + sizeof(struct ofp13_instruction) <= inst->len)
+	{
+		struct ofp13_instruction *inst_ptr = (struct ofp13_instruction *)(inst->data + inst_offset);
+		int inst_len = ntohs(inst_ptr->len);
+		if (inst_len == 0) break;
+		if (ntohs(inst_ptr->type) == OFPIT13_APPLY_ACTIONS || ntohs(inst_ptr->type) == OFPIT13_WRITE_ACTIONS)
+		{
+			int act_offset = sizeof(struct ofp13_instruction_actions);
+			while (act_offset < inst_len)
+			{
+				struct ofp13_action_header *act = (struct ofp13_action_header *)((uint8_t *)inst_ptr + act_offset);
+				if (ntohs(act->len) == 0) break;
+				if (ntohs(act->type) == OFPAT13_OUTPUT)
 				{
-					if (ntohs(flow_match13[i]->flags) &  OFPFF13_SEND_FLOW_REM) flowrem_notif13(i,OFPRR13_HARD_TIMEOUT);
-					remove_flow13(i);
-					return;
+					uint32_t port = ntohl(((struct ofp13_action_output *)act)->port);
+					if (port >= 1 && port <= 4)
+					{
+						out_ports |= 1 << (port - 1);
+					} else {
+						out_ports |= FLOW_OUT_OTHER;
+					}
 				}
+				act_offset += ntohs(act->len);
 			}
 		}
+		inst_offset += inst_len;
 	}
-	return;
+	return out_ports;
 }
 
 /*
-*	Clears the flow table
+*	Check if a flow outputs to a port
+*
+*	Ports 1-4 are checked against the flow's out_ports bits. The
+*	instructions are only walked for other ports, and only if the flow
+*	outputs to one.
+*
+*	@param *entry - pointer to the flow.
+*	@param port - the port in network byte order.
 *
 */
-void clear_flows(void)
+bool flow_has_output13(struct flow_entry13 *entry, uint32_t port)
 {
-	iLastFlow = 0;
-	membag_init();
+	port = ntohl(port);
+	if (port >= 1 && port <= 4) return (entry->out_ports & (1 << (port - 1))) != 0;
+	if ((entry->out_ports & FLOW_OUT_OTHER) == 0) return false;
 
-	/*	Clear OpenFlow 1.0 flow table	*/
-	if (OF_Version == 0x01)
+	int inst_offset = 0;
+	while (inst_offset + sizeof(struct ofp13_instruction) <= entry->inst->len)
 	{
-		for(int q=0;q<MAX_FLOWS_10;q++)
+		struct ofp13_instruction *inst_ptr = (struct ofp13_instruction *)(entry->inst->data + inst_offset);
+		int inst_len = ntohs(inst_ptr->len);
+		if (inst_len == 0) break;
+		if (ntohs(inst_ptr->type) == OFPIT13_APPLY_ACTIONS || ntohs(inst_ptr->type) == OFPIT13_WRITE_ACTIONS)
 		{
-			memset(&flow_counters[q], 0, sizeof(struct flows_counter));
-			if (flow_match10[q] != NULL) flow_match10[q] = NULL;
-			if (flow_actions10[q] != NULL) flow_actions10[q] = NULL;
+			int act_offset = sizeof(struct ofp13_instruction_actions);
+			while (act_offset < inst_len)
+			{
+				struct ofp13_action_header *act = (struct ofp13_action_header *)((uint8_t *)inst_ptr + act_offset);
+				if (ntohs(act->len) == 0) break;
+				if (ntohs(act->type) == OFPAT13_OUTPUT && ntohl(((struct ofp13_action_output *)act)->port) == port) return true;
+				act_offset += ntohs(act->len);
+			}
 		}
+		inst_offset += inst_len;
 	}
-	
-	/*	Clear OpenFlow 1.3 flow table	*/
-	if (OF_Version == 0x04)
+	return false;
+}
+
+/*
+*	Size the flow table from the SRAM that is free at boot
+*
+*	Everything from the top of the heap to the end of RAM, less
+*	FLOW_RAM_RESERVE for the C library, is given to the flow table. Each
+*	flow needs a slot in flow_match13, flow_counters, the timer wheel, the
+*	cookie, match and priority indexes and the free list plus a record in
+*	the flow slab, FLOW_RECORD_ESTIMATE is used for the record when
+*	working out how many slots there should be. The memory after the
+*	slots becomes the flow slab.
+*
+*/
+void flow_table_init(void)
+{
+	int slot_size = sizeof(struct flow_entry13 *) + sizeof(struct flows_counter) + sizeof(uint32_t) + (4 * sizeof(struct flow_link)) + sizeof(uint16_t);
+	caddr_t heap = _sbrk(0);
+	uintptr_t ram_end = (uintptr_t)&__ram_end__;
+	uintptr_t heap_top = (uintptr_t)heap;
+	int avail = 0;
+	if (ram_end > heap_top && ram_end - heap_top > FLOW_RAM_RESERVE) avail = ram_end - heap_top - FLOW_RAM_RESERVE;
+
+	max_flows = avail / (slot_size + FLOW_RECORD_ESTIMATE);
+	if (max_flows > MAX_FLOWS_13) max_flows = MAX_FLOWS_13;
+
+	uint8_t *mem = (uint8_t *)_sbrk(avail);
+	int slots_len = max_flows * slot_size;
+	memset(mem, 0, slots_len);
+	uint8_t *slot = mem;
+	flow_match13 = (struct flow_entry13 **)slot;
+	slot += max_flows * sizeof(struct flow_entry13 *);
+	flow_counters = (struct flows_counter *)slot;
+	slot += max_flows * sizeof(struct flows_counter);
+	timer_expires = (uint32_t *)slot;
+	slot += max_flows * sizeof(uint32_t);
+	timer_links = (struct flow_link *)slot;
+	slot += max_flows * sizeof(struct flow_link);
+	cookie_links = (struct flow_link *)slot;
+	slot += max_flows * sizeof(struct flow_link);
+	match_links = (struct flow_link *)slot;
+	slot += max_flows * sizeof(struct flow_link);
+	priority_links = (struct flow_link *)slot;
+	slot += max_flows * sizeof(struct flow_link);
+	flow_free = (uint16_t *)slot;
+	slab_init(&flow_slab, mem + slots_len, avail - slots_len);
+	flow_index_clear();
+	return;
+}
+
+/*
+*	Work out how many more flows will fit in the flow table
+*
+*	Limited by both the free slots and the free memory in the flow slab.
+*
+*/
+int flow_table_free(void)
+{
+	struct slab_stats stats;
+	slab_get_stats(&flow_slab, &stats);
+	int free_slots = max_flows - flow_count;
+	int free_records = stats.free / FLOW_RECORD_ESTIMATE;
+	return (free_records < free_slots) ? free_records : free_slots;
+}
+
+/*
+*	Clears the flow table
+*
+*/
+void clear_flows(void)
+{
+	memset(flow_counters, 0, iLastFlow * sizeof(struct flows_counter));
+	iLastFlow = 0;
+	flow_count = 0;
+	flow_free_count = 0;
+	slab_reset(&flow_slab);
+	flow_index_clear();
+	snapshot_touch();
+
+	/*	Clear the flow table, used by both OpenFlow 1.0 and 1.3	*/
+	for(int q=0;q<max_flows;q++)
 	{
-		for(int q=0;q<MAX_FLOWS_13;q++)
-		{
-			memset(&flow_counters[q], 0, sizeof(struct flows_counter));
-			if (ofp13_oxm_match[q] != NULL) ofp13_oxm_match[q] = NULL;
-			if (ofp13_oxm_inst[q] != NULL) ofp13_oxm_inst[q] = NULL;
-			if (flow_match13[q] != NULL) flow_match13[q] = NULL;
-			ofp13_oxm_inst_size[q] = 0;
-		}
+		if (flow_match13[q] != NULL) flow_match13[q] = NULL;
 	}
 	
 	/*	Clear Table Counters	*/
@@ -1126,104 +1953,91 @@ void clear_flows(void)
 		table_counters[x].lookup_count = 0;
 		table_counters[x].matched_count = 0;
 	}
+
+	/*	Clear meters and release any offloaded port rate limits	*/
+	memset(&meter_table13, 0, sizeof(meter_table13));
+	meter_sync13();
 }
 
 /*
-*	Builds the body of a flow stats request for OF 1.0
+*	Builds the body of a flow stats reply for OF 1.0
 *
-*	@param *buffer- pointer to the buffer to store the response
-*	@param *first - first flow to include
-*	@param *last - last flow to include
+*	Starts at flow *next and stops before the flow that doesn't fit, so a
+*	full table can be sent as several replies.
 *
+*	@param *buffer - pointer to the buffer to store the response
+*	@param buf_len - room in the buffer.
+*	@param *next - first flow to include, set to the first flow left out.
+*
+*	Returns the length of the body.
 */
-int flow_stats_msg10(char *buffer, int first, int last)
+int flow_stats_msg10(uint8_t *buffer, int buf_len, int *next)
 {
-	struct ofp_flow_stats flow_stats;
-	struct ofp_action_header *action_hdr1;
-	struct ofp_action_header *action_hdr2;
-	struct ofp_action_header *action_hdr3;
-	struct ofp_action_header *action_hdr4;
-	int len = sizeof(struct ofp10_stats_reply);
-	int stats_size = 0;
+	struct ofp_flow_stats *flow_stats;
+	int len = 0;
 	int actionsize = 0;
-	if ((last - first) > 20) last = first + 20;	// Only show first 20 flows to conserve memory
+	int k;
 
-	for(int k=first; k<last;k++)
+	for(k=*next; k<iLastFlow;k++)
 	{
-		action_hdr1 = flow_actions10[k]->action1;
-		action_hdr2 = flow_actions10[k]->action2;
-		action_hdr3 = flow_actions10[k]->action3;
-		action_hdr4 = flow_actions10[k]->action4;
-		stats_size = sizeof(flow_stats);
-		flow_stats.table_id = 0;
-		memcpy(&flow_stats.match, &flow_match10[k]->match, sizeof(struct ofp_match));
-		memcpy(&flow_stats.cookie, &flow_match10[k]->cookie, sizeof(uint64_t));
-		memcpy(&flow_stats.priority, flow_match10[k]->priority, sizeof(uint16_t));
-		memcpy(&flow_stats.idle_timeout, flow_match10[k]->idle_timeout, sizeof(uint16_t));
-		memcpy(&flow_stats.hard_timeout, flow_match10[k]->hard_timeout, sizeof(uint16_t));
-		flow_stats.duration_sec = HTONL((totaltime/2) - flow_counters[k].duration);
-		flow_stats.duration_nsec = 0;
-		flow_stats.packet_count = htonll(flow_counters[k].hitCount);
-		flow_stats.byte_count = htonll(flow_counters[k].bytes);
-		actionsize = ntohs(action_hdr1->len) + ntohs(action_hdr2->len) + ntohs(action_hdr3->len) + ntohs(action_hdr4->len);
-		flow_stats.length = htons(stats_size + actionsize);
-
-		memcpy(buffer + len, &flow_stats, stats_size);
-		len += stats_size;
-
-		if(ntohs(action_hdr1->len) > 0)
+		if (flow_counters[k].active == false) continue;
+		// 1.0 actions are never longer than the 1.3 actions they were made from
+		if (len + sizeof(struct ofp_flow_stats) + flow_match13[k]->inst->len > buf_len)
 		{
-			memcpy(buffer + len, flow_actions10[k]->action1, ntohs(action_hdr1->len));
-			stats_size += ntohs(action_hdr1->len);
-			len += ntohs(action_hdr1->len);
-		}
-
-		if(ntohs(action_hdr2->len) > 0)
-		{
-			memcpy(buffer + len, flow_actions10[k]->action2, ntohs(action_hdr2->len));
-			stats_size += ntohs(action_hdr2->len);
-			len += ntohs(action_hdr2->len);
-		}
-
-		if(ntohs(action_hdr3->len) > 0)
-		{
-			memcpy(buffer + len, flow_actions10[k]->action3, ntohs(action_hdr3->len));
-			stats_size += ntohs(action_hdr3->len);
-			len += ntohs(action_hdr3->len);
-		}
-
-		if(ntohs(action_hdr4->len) > 0)
-		{
-			memcpy(buffer + len, flow_actions10[k]->action4, ntohs(action_hdr4->len));
-			stats_size += ntohs(action_hdr4->len);
-			len += ntohs(action_hdr4->len);
+			if (len > 0) break;
+			TRACE("of_helper.c: Flow %d is too big for a stats reply", k+1);
+			continue;
 		}
+		flow_stats = (struct ofp_flow_stats *)(buffer + len);
+		memset(flow_stats, 0, sizeof(struct ofp_flow_stats));
+		flow_stats->table_id = 0;
+		oxm_to_match10(&flow_match13[k]->match, &flow_stats->match);
+		flow_stats->cookie = flow_match13[k]->cookie;
+		flow_stats->priority = flow_match13[k]->priority;
+		flow_stats->idle_timeout = flow_match13[k]->idle_timeout;
+		flow_stats->hard_timeout = flow_match13[k]->hard_timeout;
+		flow_stats->duration_sec = HTONL((totaltime/2) - flow_counters[k].duration);
+		flow_stats->duration_nsec = 0;
+		flow_stats->packet_count = htonll(flow_counters[k].hitCount);
+		flow_stats->byte_count = htonll(flow_counters[k].bytes);
+		actionsize = inst_to_actions10(buffer + len + sizeof(struct ofp_flow_stats), flow_match13[k]->inst);
+		flow_stats->length = htons(sizeof(struct ofp_flow_stats) + actionsize);
+		len += sizeof(struct ofp_flow_stats) + actionsize;
 	}
+	*next = k;
 	return len;
 }
 
 /*
-*	Builds the body of a flow stats request for OF 1.3
+*	Builds the body of a flow stats reply for OF 1.3
+*
+*	Starts at flow *next and stops before the flow that doesn't fit, so a
+*	full table can be sent as several replies.
 *
-*	@param *buffer- pointer to the buffer to store the response
-*	@param *first - first flow to include
-*	@param *last - last flow to include
+*	@param *buffer - pointer to the buffer to store the response
+*	@param buf_len - room in the buffer.
+*	@param *next - first flow to include, set to the first flow left out.
 *
+*	Returns the length of the body.
 */
-int flow_stats_msg13(char *buffer, int first, int last)
+int flow_stats_msg13(uint8_t *buffer, int buf_len, int *next)
 {
 	struct ofp13_flow_stats flow_stats;
-	int stats_size = 0;
-	char *buffer_ptr = buffer;
-	int inst_size;
-	int stats_len;
+	uint8_t *buffer_ptr = buffer;
 	int len;
-	int pad = 0;
+	int k;
 
-	for(int k = first; k<last;k++)
+	for(k=*next; k<iLastFlow;k++)
 	{
+		if (flow_counters[k].active == false) continue;
 		// ofp_flow_stats fixed fields are the same length with ofp_flow_mod
-		flow_stats.length = flow_match13[k]->header.length;
+		flow_stats.length = htons(offsetof(struct ofp13_flow_stats, match) + ALIGN8(ntohs(flow_match13[k]->match.length)) + flow_match13[k]->inst->len);
+		if(buffer_ptr + ntohs(flow_stats.length) > buffer + buf_len)
+		{
+			if (buffer_ptr > buffer) break;		// Carry on from here in the next reply
+			TRACE("of_helper.c: Flow %d is too big for a stats reply", k+1);
+			continue;
+		}
 		flow_stats.table_id = flow_match13[k]->table_id;
 		flow_stats.duration_sec = htonl((totaltime/2) - flow_counters[k].duration);
 		flow_stats.duration_nsec = htonl(0);
@@ -1235,20 +2049,16 @@ int flow_stats_msg13(char *buffer, int first, int last)
 		flow_stats.packet_count = htonll(flow_counters[k].hitCount);
 		flow_stats.byte_count = htonll(flow_counters[k].bytes);
 		flow_stats.match = flow_match13[k]->match;
-		// buffer must be shorter than 2048
-		if(buffer_ptr + ntohs(flow_stats.length) > buffer + 2048){
-			break; // XXX: should provide multipart OFPMPF_REPLY_MORE flow
-		}
 		// struct ofp13_flow_stats(including ofp13_match)
 		memcpy(buffer_ptr, &flow_stats, sizeof(struct ofp13_flow_stats));
 		// oxm_fields
 		len = offsetof(struct ofp13_flow_stats, match) + offsetof(struct ofp13_match, oxm_fields);
-		memcpy(buffer_ptr + len, ofp13_oxm_match[k], ntohs(flow_stats.match.length) - 4);
+		memcpy(buffer_ptr + len, flow_match13[k]->match.oxm_fields, ntohs(flow_stats.match.length) - 4);
 		// instructions
 		len = offsetof(struct ofp13_flow_stats, match) + ALIGN8(ntohs(flow_stats.match.length));
-		memcpy(buffer_ptr + len, ofp13_oxm_inst[k], ntohs(flow_stats.length) - len);
+		memcpy(buffer_ptr + len, flow_match13[k]->inst->data, ntohs(flow_stats.length) - len);
 		buffer_ptr += ntohs(flow_stats.length);
 	}
+	*next = k;
 	return (buffer_ptr - buffer);
-
 }
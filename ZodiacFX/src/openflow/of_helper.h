@@ -31,6 +31,7 @@
 #ifndef OF_HELPER_H_
 #define OF_HELPER_H_
 
+#include "config_zodiac.h"
 #include "openflow.h"
 
 struct packet_fields
@@ -48,18 +49,87 @@ struct packet_fields
 	uint16_t tp_dst;
 };
 
+/* Packet descriptor, the start of the frame moves into the headroom when tags are pushed */
+struct packet_desc
+{
+	uint8_t *data;		// Start of the Ethernet frame
+	uint16_t len;		// Length of the frame
+	uint16_t headroom;	// Free bytes in front of the frame
+	uint16_t tailroom;	// Free bytes after the end of the frame
+};
+
+/* Packet held on the switch while the controller decides what to do with it */
+struct packet_buffer
+{
+	uint32_t buffer_id;	// 0 if the buffer is free
+	uint8_t in_port;
+	uint16_t size;
+	int time_added;		// totaltime when the packet was stored
+	uint8_t *data;		// PACKET_HEADROOM bytes followed by the packet, allocated from packet_slab
+};
+
+/* Packet-in token bucket for one port and reason, the tokens are in 1/1000ths of a packet */
+struct packet_in_bucket
+{
+	uint32_t tokens;
+	uint32_t last;		// sys_get_ms() when the bucket was last filled
+};
+
+/* Counters for the packet-ins that were not sent */
+struct packet_in_stats
+{
+	uint32_t rate_limited[4][2];	// Per port, for table misses and output actions
+	uint32_t backlog;				// Dropped because the controller queue was backed up
+	uint32_t queue_full;			// Dropped because the packet-in queue was full
+};
+
+struct flow_entry13;
+struct flow_inst13;
+
+/* Position in a walk over the flows that may match a flow mod */
+struct flow_iter
+{
+	int next;
+	bool indexed;	// Walking a cookie index bucket rather than the whole table
+};
+
 void packet_fields_parser(uint8_t *pBuffer, struct packet_fields *fields);
-int flowmatch10(uint8_t *pBuffer, int port, struct packet_fields *fields);
+uint8_t *packet_push(struct packet_desc *pkt, uint16_t offset, uint16_t len);
+void packet_pull(struct packet_desc *pkt, uint16_t offset, uint16_t len);
+uint32_t packet_buffer_store(uint8_t *buffer, uint16_t ul_size, uint8_t port);
+struct packet_buffer *packet_buffer_get(uint32_t buffer_id);
+void packet_buffer_release(struct packet_buffer *buf);
+bool packet_buffer_lookup(uint32_t buffer_id);
+void packet_buffer_clear(void);
+uint32_t packet_in_rate(uint8_t reason);
+bool packet_in_allowed(uint8_t port, uint8_t reason);
+uint8_t *packet_in_reserve(uint16_t len);
+void packet_in_flush(void);
+void packet_in_clear(void);
 int flowmatch13(uint8_t *pBuffer, int port, uint8_t table_id, struct packet_fields *fields);
-int field_match10(struct ofp_match *match_a, struct ofp_match *match_b);
 int field_match13(uint8_t *oxm_a, int len_a, uint8_t *oxm_b, int len_b);
 void nnOF_timer(void);
 void flow_timeouts(void);
+void flow_timer_schedule(int flow_id);
+void flowrem_notif(int flowid, uint8_t reason);
+void flow_index_clear(void);
+void flow_table_init(void);
+int flow_table_free(void);
 void clear_flows(void);
-int flow_stats_msg10(char *buffer, int first, int last);
-int flow_stats_msg13(char *buffer, int first, int last);
+int flow_stats_msg10(uint8_t *buffer, int buf_len, int *next);
+int flow_stats_msg13(uint8_t *buffer, int buf_len, int *next);
 void set_ip_checksum(uint8_t *p_uc_data, int packet_size, int iphdr_offset);
+struct flow_inst13 *flow_inst_get13(uint8_t *inst, uint16_t len);
+void flow_inst_put13(struct flow_inst13 *inst);
 void remove_flow13(int flow_id);
-void remove_flow10(int flow_id);
+int flow_slot_alloc(void);
+void flow_slot_free(int flow_id);
+void flow_index_add13(int flow_id);
+int flow_find13(uint8_t table_id, uint16_t priority, struct ofp13_match *match);
+bool flow_overlap13(struct ofp13_flow_mod *ptr_fm);
+int flow_iter_first13(struct flow_iter *it, uint64_t cookie, uint64_t cookie_mask);
+int flow_iter_next13(struct flow_iter *it);
+uint8_t flow_out_ports13(struct flow_inst13 *inst);
+bool flow_has_output13(struct flow_entry13 *entry, uint32_t port);
 
 #endif /* OF_HELPER_H_ */
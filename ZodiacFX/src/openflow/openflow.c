@@ -34,11 +34,14 @@
 #include "config_zodiac.h"
 #include "command.h"
 #include "openflow.h"
+#include "snapshot.h"
+#include "standalone.h"
 #include "switch.h"
 #include "lwip/ip_addr.h"
 #include "lwip/tcp.h"
 #include "lwip/err.h"
 #include "timers.h"
+#include "slab.h"
 
 // Global variables
 extern struct zodiac_config Zodiac_Config;
@@ -47,37 +50,55 @@ extern struct ofp10_port_stats phys10_port_stats[4];
 extern struct ofp13_port_stats phys13_port_stats[4];
 
 // Local Variables
-struct ofp_switch_config Switch_config;
-struct ofp_flow_mod *flow_match10[MAX_FLOWS_10];
-struct ofp13_flow_mod *flow_match13[MAX_FLOWS_13];
-uint8_t *ofp13_oxm_match[MAX_FLOWS_13];
-uint8_t *ofp13_oxm_inst[MAX_FLOWS_13];
-uint16_t ofp13_oxm_inst_size[MAX_FLOWS_13];
-struct flows_counter flow_counters[MAX_FLOWS_13];
-struct flow_tbl_actions *flow_actions10[MAX_FLOWS_10];
+struct ofp_switch_config Switch_config = {.miss_send_len = HTONS(OFP_DEFAULT_MISS_SEND_LEN)};
+struct flow_entry13 **flow_match13;	// The flow table is sized at boot by flow_table_init()
+struct flows_counter *flow_counters;
+int max_flows;
+int flow_count = 0;		// Number of flows in the table, iLastFlow is the end of the slots in use
+uint16_t *flow_free;	// Free list of slots below iLastFlow
+int flow_free_count = 0;
 struct table_counter table_counters[MAX_TABLES];
+struct meter_entry13 meter_table13[MAX_METER_13];
+struct packet_buffer packet_buffers[MAX_BUFFERS];
+struct slab flow_slab;
+uint8_t packet_slab_mem[PACKET_SLAB_SIZE];
+struct slab packet_slab;
+uint8_t ctrl_slab_mem[CTRL_SLAB_SIZE];
+struct slab ctrl_slab;
 int iLastFlow = 0;
 uint8_t shared_buffer[SHARED_BUFFER_LEN];
 char sysbuf[64];
-struct ip_addr serverIP;
 int OF_Version = 0x00;
-struct tcp_pcb *tcp_pcb;
-struct tcp_pcb *tcp_pcb_check;
 int fast_of_timer = 0;
-int tcp_con_state = -1;
-int tcp_wait = 0;
 int totaltime = 0;
-int heartbeat = 0;
 int multi_pos;
-bool rcv_freq;
+struct of_controller controllers[MAX_CONTROLLERS];
+struct of_controller *of_ctrl;		// Controller that sendtcp() writes to, the one whose message is being handled
+
+/* Flow stats reply that is sent in parts as the TCP send buffer drains */
+struct stats_stream
+{
+	bool active;
+	struct of_controller *ctrl;	// Controller that asked for it
+	uint32_t xid;		// Transaction ID of the request
+	int next;			// Next flow to report
+};
+static struct stats_stream flow_stats_stream;
+static uint32_t barrier_wait[4];	// Barrier replies held back until the flow stats reply is complete
+static int barrier_waiting;
 
 // Internal Functions
 void OF_hello(void);
 void echo_request(void);
 void echo_reply(uint32_t xid);
+static void echo_rtt(uint32_t xid);
 err_t TCPready(void *arg, struct tcp_pcb *tpcb, err_t err);
 void tcp_error(void * arg, err_t err);
 static err_t of_receive(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err);
+static err_t of_sent(void *arg, struct tcp_pcb *tpcb, u16_t len);
+static err_t of_poll(void *arg, struct tcp_pcb *tpcb);
+static void tx_flush(struct of_controller *ctrl);
+static void controller_close(struct of_controller *ctrl);
 
 /*
 *	Converts a 64bit value from host to network format
@@ -98,26 +119,151 @@ static inline uint64_t (htonll)(uint64_t n)
 *	@param port	- In Port.
 *
 */
-void nnOF_tablelookup(uint8_t *p_uc_data, uint32_t *ul_size, int port)
+void nnOF_tablelookup(struct packet_desc *pkt, int port)
 {
-	if( tcp_pcb != tcp_pcb_check)	// Check if the connect pointer is still valid
+	if (controllers_connected() == 0)
 	{
-		tcp_con_state = -1;
-		tcp_pcb = NULL;
+		if (Zodiac_Config.failstate == 0) return;	// If no controller is connected and fail secure is enabled drop the packet
+		if (standalone_forward(pkt, port) == true) return;	// Fail standalone, the learning bridge has the ports
+	}
+
+	if (OF_Version == 0x01) nnOF10_tablelookup(pkt, port);
+	if (OF_Version == 0x04) nnOF13_tablelookup(pkt, port);
+	return;
+}
+
+/*
+*	Main OpenFlow message function
+*
+*	@param *ofph - pointer to the whole OpenFlow message.
+*
+*/
+static void of_message(struct ofp_header *ofph)
+{
+	int version = 0x00;
+
+	TRACE("openflow.c: Processing %d byte OpenFlow message %u", ntohs(ofph->length), ntohl(ofph->xid));
+
+	if (ofph->version > 6 || ofph->type > 30) //	Invalid OpenFlow message
+	{
+		TRACE("openflow.c: Invalid OpenFlow command, ignoring!");
 		return;
 	}
 
-	if (Zodiac_Config.failstate == 0 && tcp_pcb->state != ESTABLISHED) return;	// If the controller is not connected and fail secure is enabled drop the packet
+	switch(ofph->type)
+	{
+		case OFPT10_HELLO:
+		if (ofph->version == Zodiac_Config.of_version)
+		{
+			version = Zodiac_Config.of_version;
+		} else if (ofph->version > MAX_OFP_VERSION && Zodiac_Config.of_version == 0) {
+			version = MAX_OFP_VERSION;
+		} else if (ofph->version == 1 && Zodiac_Config.of_version == 0) {
+			version = 0x01;
+		} else if (ofph->version == 4 && Zodiac_Config.of_version == 0) {
+			version = 0x04;
+		} else if (Zodiac_Config.of_version != 0) {
+			version = Zodiac_Config.of_version;
+		}
+		// Every controller has to use the same version as they share the flow table
+		if (controllers_connected() > 1 && OF_Version != 0x00 && version != OF_Version)
+		{
+			TRACE("openflow.c: Controller wants OpenFlow version %d but %d is in use, closing!", version, OF_Version);
+			of_ctrl->close = true;
+			break;
+		}
+		OF_Version = version;
+		snapshot_connected();	// Keep or drop the flows restored from flash
+		break;
+
+		case OFPT10_ECHO_REQUEST:
+		echo_reply(ofph->xid);
+		break;
 
-	if (OF_Version == 0x01) nnOF10_tablelookup(p_uc_data, ul_size, port);
-	if (OF_Version == 0x04) nnOF13_tablelookup(p_uc_data, ul_size, port);
+		case OFPT10_ECHO_REPLY:
+		echo_rtt(ofph->xid);
+		break;
+
+		default:
+		if (OF_Version == 0x01) of10_message(ofph);
+		if (OF_Version == 0x04) of13_message(ofph);
+	};
 	return;
 }
 
 /*
-*	Main OpenFlow message function
+*	Take the next part of the message being reassembled from a pbuf
 *
-*	@param *arg - pointer the additional TCP args
+*	The header is gathered first so the length is known, then a buffer
+*	for the whole message is taken from ctrl_slab. A message that doesn't
+*	fit in ctrl_slab is read past and dropped so the stream stays in step.
+*
+*	@param *rx - pointer to the reassembly state of the connection.
+*	@param *data - pointer to the received bytes.
+*	@param avail - number of bytes available.
+*
+*	Returns the number of bytes used, or 0 if the header is corrupt and
+*	the stream can't be framed any more.
+*/
+static uint16_t of_rx_partial(struct of_rx_state *rx, uint8_t *data, uint16_t avail)
+{
+	uint16_t n;
+
+	if (rx->got < sizeof(struct ofp_header))
+	{
+		n = sizeof(struct ofp_header) - rx->got;
+		if (n > avail) n = avail;
+		memcpy((uint8_t *)&rx->hdr + rx->got, data, n);
+		rx->got += n;
+		if (rx->got < sizeof(struct ofp_header)) return n;
+
+		rx->need = ntohs(rx->hdr.length);
+		if (rx->hdr.version == 0 || rx->need < sizeof(struct ofp_header))
+		{
+			TRACE("openflow.c: Corrupt OpenFlow Message!!!");
+			rx->got = 0;
+			return 0;	// Nothing after this can be trusted
+		}
+		rx->msg = slab_alloc(&ctrl_slab, rx->need);
+		if (rx->msg == NULL)
+		{
+			TRACE("openflow.c: No memory for %d byte OpenFlow message, dropping!", rx->need);
+		} else {
+			memcpy(rx->msg, &rx->hdr, sizeof(struct ofp_header));
+		}
+		if (rx->got == rx->need) goto done;
+		return n;
+	}
+
+	n = rx->need - rx->got;
+	if (n > avail) n = avail;
+	if (rx->msg != NULL) memcpy(rx->msg + rx->got, data, n);
+	rx->got += n;
+	if (rx->got < rx->need) return n;
+
+done:
+	if (rx->msg != NULL)
+	{
+		of_message((struct ofp_header *)rx->msg);
+		slab_free(&ctrl_slab, rx->msg);
+		rx->msg = NULL;
+	}
+	rx->got = 0;
+	return n;
+}
+
+/*
+*	TCP receive callback function
+*
+*	OpenFlow messages are framed straight out of the pbuf chain. A message
+*	that is whole and aligned inside one pbuf is handled where it is,
+*	only messages split across pbufs or segments are copied.
+*
+*	Replies to the messages in a segment are collected in the controller
+*	queue and handed to TCP together once the segment has been handled,
+*	so a segment of small requests doesn't use a pbuf for every reply.
+*
+*	@param *arg - pointer to the controller the connection belongs to.
 *	@param *tcp_pcb - pointer the TCP session structure.
 *	@param *p - pointer to the buffer containing the TCP packet.
 *	@param err - error code.
@@ -125,79 +271,64 @@ void nnOF_tablelookup(uint8_t *p_uc_data, uint32_t *ul_size, int port)
 */
 static err_t of_receive(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err)
 {
-	char *pc;
-	char packetbuffer[1536];
-	heartbeat = 0;	// Reset heartbeat counter
+	struct of_controller *ctrl = arg;
 
-	if (err == ERR_OK && p != NULL)
+	if (ctrl == NULL)
 	{
-		tcp_recved(tpcb, p->tot_len);
-        pc=(char *)p->payload;	//pointer to the payload
-        int len = p->tot_len;	//size of the payload
-        for (int i=0; i<len; i++)packetbuffer[i] = pc[i];	//copy to our own buffer
-        pbuf_free(p);	//Free the packet buffer
-		TRACE("openflow.c: OpenFlow data received (%d bytes)", len);
-		struct ofp_header *ofph;
-		int size = 0;
-		int plen = 0;
-
-		while (size < len)
+		if (p != NULL) pbuf_free(p);
+		return ERR_OK;
+	}
+	of_ctrl = ctrl;		// Replies go back to the controller that sent the request
+	ctrl->last_rx = sys_get_ms();	// Anything from the controller shows it is alive
+
+	if (err == ERR_OK && p != NULL && ctrl->close == true)
+	{
+		tcp_recved(tpcb, p->tot_len);	// Closing, the data is dropped
+		pbuf_free(p);
+	} else if (err == ERR_OK && p != NULL) {
+		TRACE("openflow.c: OpenFlow data received (%d bytes)", p->tot_len);
+		multi_pos = 0;
+		uint32_t batched = ctrl->tx_stats.batched;
+		ctrl->tx_batch = true;
+		for (struct pbuf *q = p; q != NULL && ctrl->close == false; q = q->next)
 		{
-			ofph = &packetbuffer[size];
-			if (size == 0) multi_pos = 0;
-			if (ofph->length == 0 || ofph->version == 0){
-				return ERR_OK;	//Not an OpenFlow packet
-			}
-			plen = htons(ofph->length);
-			
-			if (ofph->version > 6 || ofph->type > 30) //	Invalid OpenFlow message
-			{
-				TRACE("openflow.c: Invalid OpenFlow command, ignoring!");
-				return ERR_OK;
-			}
-			size = size + plen;
-			if (size > len) // corrupt OpenFlow command
-			{
-				break;
-				TRACE("openflow.c: Corrupt OpenFlow Message!!!");	
-			}
-			TRACE("openflow.c: Processing %d byte OpenFlow message %u (%d)", plen, htonl(ofph->xid), size);
+			uint8_t *data = q->payload;
+			uint16_t avail = q->len;
 
-			switch(ofph->type)
+			while (avail > 0 && ctrl->close == false)
 			{
-				case OFPT10_HELLO:
-				if (ofph->version == Zodiac_Config.of_version)
+				struct ofp_header *ofph = (struct ofp_header *)data;
+				uint16_t n;
+
+				// Handle the message in the pbuf if it is all there and aligned
+				if (ctrl->rx.got == 0 && avail >= sizeof(struct ofp_header) && ((uintptr_t)data & 3) == 0 && ofph->version != 0 && ntohs(ofph->length) >= sizeof(struct ofp_header) && ntohs(ofph->length) <= avail)
 				{
-					OF_Version = Zodiac_Config.of_version;
-				} else if (ofph->version > MAX_OFP_VERSION && Zodiac_Config.of_version == 0) {
-					OF_Version = MAX_OFP_VERSION;
-				} else if (ofph->version == 1 && Zodiac_Config.of_version == 0) {
-					OF_Version = 0x01;
-				} else if (ofph->version == 4 && Zodiac_Config.of_version == 0) {
-					OF_Version = 0x04;
-				} else if (Zodiac_Config.of_version != 0) {
-					OF_Version = Zodiac_Config.of_version;
+					n = ntohs(ofph->length);
+					of_message(ofph);
+				} else {
+					n = of_rx_partial(&ctrl->rx, data, avail);
+					if (n == 0) ctrl->close = true;	// Lost track of the message boundaries, start the connection again
 				}
-
-				break;
-
-				case OFPT10_ECHO_REQUEST:
-					echo_reply(ofph->xid);
-				break;
-
-				default:
-					if (OF_Version == 0x01) of10_message(ofph, size, len);
-					if (OF_Version == 0x04) of13_message(ofph, size, len);
-			};
-
+				data += n;
+				avail -= n;
+			}
 		}
-	} else {
+		if (multi_pos != 0) sendtcp(&shared_buffer, multi_pos);	// Multipart replies are sent together
+		multi_pos = 0;
+		ctrl->tx_batch = false;
+		if (ctrl->tx_stats.batched != batched) ctrl->tx_stats.batches++;
+		tx_flush(ctrl);
+		flow_stats_send();
+		tcp_recved(tpcb, p->tot_len);
+		pbuf_free(p);	//Free the packet buffer
+	} else if (p != NULL) {
 		pbuf_free(p);
 	}
 
-	if ((err = ERR_OK) && (p == NULL))
+	if (p == NULL)
 	{
-		tcp_close(tpcb);
+		TRACE("openflow.c: Connection closed by controller %d", (int)(ctrl - controllers) + 1);
+		controller_close(ctrl);
 	}
 	return ERR_OK;
 }
@@ -205,12 +336,37 @@ static err_t of_receive(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t e
 /*
 *	OpenFlow HELLO message function
 *
+*	Starts a new connection to the controller in of_ctrl. Buffer ids and
+*	switch settings are only reset when it is the only controller.
+*
 */
 void OF_hello(void)
 {
 	struct ofp_header ofph;
-	OF_Version = 0x00;
-	rcv_freq = false;
+	struct of_controller *ctrl = of_ctrl;
+
+	ctrl->rcv_freq = false;
+	ctrl->close = false;
+	ctrl->last_rx = sys_get_ms();
+	ctrl->echo_pending = false;
+	memset(&ctrl->rtt, 0, sizeof(ctrl->rtt));
+	async_reset13();	// Async config and role only last for the connection
+	if (ctrl->rx.msg != NULL) slab_free(&ctrl_slab, ctrl->rx.msg);
+	memset(&ctrl->rx, 0, sizeof(ctrl->rx));	// Drop any message left over from the last connection
+	ctrl->tx_head = 0;		// Anything queued for the last connection is dropped
+	ctrl->tx_stats.depth = 0;
+	if (controllers_connected() == 1)
+	{
+		OF_Version = 0x00;
+		Switch_config.miss_send_len = HTONS(OFP_DEFAULT_MISS_SEND_LEN);
+		packet_buffer_clear();	// Buffer ids handed to a previous controller are no longer valid
+		packet_in_clear();
+		role_clear13();
+		port_config_clear();	// Port mods from the last controller don't carry over
+		slab_reset(&ctrl_slab);
+		flow_stats_stream.active = false;
+		barrier_waiting = 0;
+	}
 	// Make sure this is a valid version otherwise it won't connect
 	if (Zodiac_Config.of_version == 1){
 		ofph.version = 1;
@@ -248,156 +404,643 @@ void echo_reply(uint32_t xid)
 /*
 *	OpenFlow ECHO Request message function
 *
+*	The time it is sent is kept so the reply gives the round trip time.
+*
 */
 void echo_request(void)
 {
 	struct ofp_header echo;
+	of_ctrl->echo_xid++;
 	echo.version= OF_Version;
 	echo.length = HTONS(sizeof(echo));
 	echo.type   = OFPT10_ECHO_REQUEST;
-	echo.xid = 1234;
+	echo.xid = htonl(of_ctrl->echo_xid);
 	TRACE("openflow.c: Sent ECHO request");
-	sendtcp(&echo, sizeof(echo));
+	if (sendtcp(&echo, sizeof(echo)) == false) return;
+	of_ctrl->echo_sent = sys_get_ms();
+	of_ctrl->echo_pending = true;
+	return;
+}
+
+/*
+*	Record the round trip time of an ECHO reply
+*
+*	@param xid - transaction ID of the reply.
+*
+*/
+static void echo_rtt(uint32_t xid)
+{
+	struct echo_rtt *rtt = &of_ctrl->rtt;
+	uint32_t ms;
+
+	if (of_ctrl->echo_pending == false || ntohl(xid) != of_ctrl->echo_xid) return;	// Not ours, or too late
+	of_ctrl->echo_pending = false;
+	ms = sys_get_ms() - of_ctrl->echo_sent;
+	if (ms > UINT16_MAX) ms = UINT16_MAX;
+	rtt->last = ms;
+	if (rtt->count == 0 || ms < rtt->min) rtt->min = ms;
+	if (ms > rtt->max) rtt->max = ms;
+	rtt->count++;
+	rtt->total += ms;
+	TRACE("openflow.c: ECHO round trip %d ms", ms);
+	return;
+}
+
+/*
+*	Milliseconds without hearing from a controller before an echo request is sent
+*
+*/
+uint32_t heartbeat_interval(void)
+{
+	if (Zodiac_Config.hb_interval < HB_MIN || Zodiac_Config.hb_interval == 0xFFFF) return HB_INTERVAL;	// Not set, e.g. a config saved before it was added
+	return Zodiac_Config.hb_interval;
+}
+
+/*
+*	Milliseconds without hearing from a controller before the connection is reset
+*
+*/
+uint32_t heartbeat_timeout(void)
+{
+	if (Zodiac_Config.hb_timeout < HB_MIN || Zodiac_Config.hb_timeout == 0xFFFF) return HB_TIMEOUT;
+	if (Zodiac_Config.hb_timeout <= heartbeat_interval()) return heartbeat_interval() * 2;	// Leave time for the echo reply
+	return Zodiac_Config.hb_timeout;
+}
+
+/*
+*	Pick when to try connecting to a controller again
+*
+*	The backoff doubles on each failure up to RECONNECT_MAX and is only
+*	reset once a handshake completes. The wait is a random time between
+*	half and all of the backoff, so switches that lost the same controller
+*	don't all come back at once.
+*
+*	@param *ctrl - pointer to the controller.
+*
+*/
+static void controller_backoff(struct of_controller *ctrl)
+{
+	static bool seeded = false;
+	uint32_t wait;
+
+	if (seeded == false)
+	{
+		// Every switch has its own MAC address so they each get their own jitter
+		uint32_t seed = sys_get_ms();
+		for (int i=0;i<6;i++) seed = (seed * 31) + Zodiac_Config.MAC_address[i];
+		srand(seed);
+		seeded = true;
+	}
+	if (ctrl->backoff == 0)
+	{
+		ctrl->backoff = RECONNECT_MIN;
+	} else if (ctrl->backoff < RECONNECT_MAX) {
+		ctrl->backoff *= 2;
+		if (ctrl->backoff > RECONNECT_MAX) ctrl->backoff = RECONNECT_MAX;
+	}
+	wait = (ctrl->backoff / 2) + (rand() % ((ctrl->backoff / 2) + 1));
+	ctrl->retry_at = sys_get_ms() + wait;
+	TRACE("openflow.c: Trying controller %d again in %d ms", (int)(ctrl - controllers) + 1, wait);
 	return;
 }
 
 /*
 *	TCP send packet function
 *
+*	Sends to the controller in of_ctrl. The message goes straight to TCP
+*	if there is room and nothing is waiting in front of it, otherwise it
+*	is queued whole and sent by tx_flush() so the order is kept. While a
+*	received segment is being handled replies are always queued, the
+*	queue is only flushed early if it fills up. tcp_output() is left to
+*	the main loop.
+*
 *	@param *buffer - pointer to the buffer containing the data to send.
 *	@param len - size of the packet to send
 *
+*	Returns false if the message was dropped.
 */
-void sendtcp(const void *buffer, u16_t len)
+bool sendtcp(const void *buffer, u16_t len)
 {
-	err_t err;
-	uint16_t buf_size;
-	
-	if( tcp_pcb != tcp_pcb_check)
+	struct of_controller *ctrl = of_ctrl;
+	uint16_t tail;
+	uint16_t n;
+
+	// Not connected, e.g. while restoring flows at boot
+	if (ctrl == NULL || ctrl->con_state != 2 || ctrl->pcb == NULL || ctrl->pcb != ctrl->pcb_check) return false;
+
+	if (ctrl->tx_stats.depth == 0 && ctrl->tx_batch == false && tcp_write(ctrl->pcb, buffer, len, TCP_WRITE_FLAG_COPY + TCP_WRITE_FLAG_MORE) == ERR_OK)
 	{
-		tcp_con_state = -1;
-		tcp_pcb = NULL;
-		return;
+		TRACE("openflow.c: Sending %d bytes to TCP stack, %d available in buffer", len, tcp_sndbuf(ctrl->pcb));
+		ctrl->tx_output = true;
+		return true;
 	}
-	
-	buf_size = tcp_sndbuf(tcp_pcb);
-	err = tcp_write(tcp_pcb, buffer, len, TCP_WRITE_FLAG_COPY + TCP_WRITE_FLAG_MORE);
-	TRACE("openflow.c: Sending %d bytes to TCP stack, %d available in buffer", len, buf_size);
+
+	if (TX_QUEUE_SIZE - ctrl->tx_stats.depth < len && ctrl->tx_batch == true) tx_flush(ctrl);	// Make room with what is batched so far
+	if (TX_QUEUE_SIZE - ctrl->tx_stats.depth < len)
+	{
+		TRACE("openflow.c: Controller queue is full, dropping %d byte message!", len);
+		ctrl->tx_stats.dropped++;
+		return false;
+	}
+	tail = (ctrl->tx_head + ctrl->tx_stats.depth) % TX_QUEUE_SIZE;
+	n = TX_QUEUE_SIZE - tail;
+	if (n > len) n = len;
+	memcpy(ctrl->tx_queue_mem + tail, buffer, n);
+	memcpy(ctrl->tx_queue_mem, (const uint8_t *)buffer + n, len - n);
+	ctrl->tx_stats.depth += len;
+	if (ctrl->tx_batch == true)
+	{
+		ctrl->tx_stats.batched++;
+	} else {
+		ctrl->tx_stats.queued++;
+	}
+	if (ctrl->tx_stats.depth > ctrl->tx_stats.high_water) ctrl->tx_stats.high_water = ctrl->tx_stats.depth;
+	TRACE("openflow.c: Queued %d bytes, %d waiting for the TCP stack", len, ctrl->tx_stats.depth);
+	return true;
+}
+
+/*
+*	Hand as much of a controller's queue to TCP as there is room for
+*
+*	@param *ctrl - pointer to the controller.
+*
+*/
+static void tx_flush(struct of_controller *ctrl)
+{
+	uint16_t n;
+
+	if (ctrl->pcb == NULL || ctrl->pcb != ctrl->pcb_check) return;
+	while (ctrl->tx_stats.depth > 0)
+	{
+		n = TX_QUEUE_SIZE - ctrl->tx_head;
+		if (n > ctrl->tx_stats.depth) n = ctrl->tx_stats.depth;
+		if (n > tcp_sndbuf(ctrl->pcb)) n = tcp_sndbuf(ctrl->pcb);
+		if (n == 0 || tcp_write(ctrl->pcb, ctrl->tx_queue_mem + ctrl->tx_head, n, TCP_WRITE_FLAG_COPY + TCP_WRITE_FLAG_MORE) != ERR_OK) break;
+		ctrl->tx_head = (ctrl->tx_head + n) % TX_QUEUE_SIZE;
+		ctrl->tx_stats.depth -= n;
+		ctrl->tx_output = true;
+	}
+	if (ctrl->tx_stats.depth == 0) ctrl->tx_head = 0;
 	return;
 }
 
 /*
-*	Main OpenFlow processing loop
+*	Check if a controller has finished the handshake and can be sent async messages
+*
+*	@param *ctrl - pointer to the controller.
 *
 */
-void task_openflow(void)
+static bool controller_ready(struct of_controller *ctrl)
 {
+	if (ctrl->con_state != 2 || ctrl->pcb == NULL || ctrl->pcb != ctrl->pcb_check) return false;
+	return ctrl->pcb->state == ESTABLISHED && ctrl->rcv_freq == true && ctrl->close == false;
+}
 
-	if (tcp_con_state == 0 && Zodiac_Config.OFEnabled == OF_ENABLED)
+/*
+*	Count the controllers that are connected
+*
+*/
+int controllers_connected(void)
+{
+	int n = 0;
+	for (int i=0;i<MAX_CONTROLLERS;i++)
 	{
-		tcp_con_state = 1;
-		IP4_ADDR(&serverIP, Zodiac_Config.OFIP_address[0], Zodiac_Config.OFIP_address[1], Zodiac_Config.OFIP_address[2], Zodiac_Config.OFIP_address[3]);
-		tcp_pcb = tcp_new();
-		tcp_pcb_check = tcp_pcb;
-		tcp_arg(tcp_pcb, NULL);
-		tcp_err(tcp_pcb, tcp_error);
-		tcp_nagle_disable(tcp_pcb);
-		tcp_connect(tcp_pcb, &serverIP, Zodiac_Config.OFPort, TCPready);
-		return;
+		struct of_controller *ctrl = &controllers[i];
+		if (ctrl->con_state == 2 && ctrl->pcb != NULL && ctrl->pcb == ctrl->pcb_check && ctrl->pcb->state == ESTABLISHED) n++;
 	}
+	return n;
+}
 
-	if(tcp_pcb == tcp_pcb_check)
+/*
+*	Check if any controller wants an asynchronous message
+*
+*	Called before the message is built so unwanted ones cost nothing.
+*	OpenFlow 1.0 controllers get every message.
+*
+*	@param type - OFPT13_PACKET_IN, OFPT13_FLOW_REMOVED or OFPT13_PORT_STATUS.
+*	@param reason - reason code of the message.
+*
+*/
+bool async_wanted(uint8_t type, uint8_t reason)
+{
+	for (int i=0;i<MAX_CONTROLLERS;i++)
 	{
-		if (tcp_con_state == 1 && tcp_pcb->state != ESTABLISHED && Zodiac_Config.OFEnabled == OF_ENABLED)
+		if (controller_ready(&controllers[i]) == false) continue;
+		if (OF_Version != 4 || async_wanted13(&controllers[i], type, reason) == true) return true;
+	}
+	return false;
+}
+
+/*
+*	Send an asynchronous message to every controller whose role wants it
+*
+*	@param *buffer - pointer to the message.
+*	@param len - length of the message.
+*	@param type - OFPT13_PACKET_IN, OFPT13_FLOW_REMOVED or OFPT13_PORT_STATUS.
+*	@param reason - reason code of the message, only looked at for OpenFlow 1.3.
+*
+*	Returns the number of controllers the message was sent to.
+*/
+int send_async(const void *buffer, u16_t len, uint8_t type, uint8_t reason)
+{
+	struct of_controller *cur = of_ctrl;
+	int sent = 0;
+
+	for (int i=0;i<MAX_CONTROLLERS;i++)
+	{
+		if (controller_ready(&controllers[i]) == false) continue;
+		if (OF_Version == 4 && async_wanted13(&controllers[i], type, reason) == false) continue;
+		of_ctrl = &controllers[i];
+		if (sendtcp(buffer, len) == true) sent++;
+	}
+	of_ctrl = cur;
+	return sent;
+}
+
+/*
+*	Bytes waiting in the shortest controller queue
+*
+*	Packet-ins are held back when this gets too big, a controller that
+*	is keeping up still gets them while a slow one drops its copies.
+*
+*/
+uint16_t controller_backlog(void)
+{
+	uint16_t depth = 0;
+	bool found = false;
+
+	for (int i=0;i<MAX_CONTROLLERS;i++)
+	{
+		if (controller_ready(&controllers[i]) == false) continue;
+		if (found == false || controllers[i].tx_stats.depth < depth) depth = controllers[i].tx_stats.depth;
+		found = true;
+	}
+	return depth;
+}
+
+/*
+*	Forget a controller connection that has closed or failed
+*
+*	In fail secure mode the flows are only cleared once no other
+*	controller is connected, so a backup controller takes over with the
+*	flow table as it was.
+*
+*	@param *ctrl - pointer to the controller.
+*
+*/
+static void controller_down(struct of_controller *ctrl)
+{
+	ctrl->pcb = NULL;
+	ctrl->pcb_check = NULL;
+	ctrl->con_state = -1;
+	controller_backoff(ctrl);
+	ctrl->rcv_freq = false;
+	ctrl->close = false;
+	ctrl->tx_head = 0;
+	ctrl->tx_stats.depth = 0;
+	ctrl->tx_output = false;
+	ctrl->tx_batch = false;
+	if (ctrl->rx.msg != NULL) slab_free(&ctrl_slab, ctrl->rx.msg);
+	memset(&ctrl->rx, 0, sizeof(ctrl->rx));
+	if (flow_stats_stream.ctrl == ctrl)
+	{
+		flow_stats_stream.active = false;
+		barrier_waiting = 0;
+	}
+	if (Zodiac_Config.failstate == 0 && controllers_connected() == 0 && snapshot_pending() == false) clear_flows();		// Clear the flow if in secure mode
+	return;
+}
+
+/*
+*	Close the connection to a controller
+*
+*	The callbacks are taken off first so lwIP doesn't call back about
+*	a pcb the controller no longer owns.
+*
+*	@param *ctrl - pointer to the controller.
+*
+*/
+static void controller_close(struct of_controller *ctrl)
+{
+	struct tcp_pcb *pcb = ctrl->pcb;
+
+	if (pcb != NULL && pcb == ctrl->pcb_check)
+	{
+		tcp_arg(pcb, NULL);
+		tcp_recv(pcb, NULL);
+		tcp_sent(pcb, NULL);
+		tcp_poll(pcb, NULL, 0);
+		tcp_err(pcb, NULL);
+		tcp_close(pcb);
+	}
+	controller_down(ctrl);
+	return;
+}
+
+/*
+*	Get the address of a controller from the config
+*
+*	@param index - controller number, from 0.
+*	@param *server - filled in with the IP address.
+*	@param *port - filled in with the TCP port.
+*
+*	Returns false if no controller is set up for the number.
+*/
+static bool controller_address(int index, struct ip_addr *server, int *port)
+{
+	uint8_t *ip;
+
+	if (index == 0)
+	{
+		ip = Zodiac_Config.OFIP_address;
+		*port = Zodiac_Config.OFPort;
+	} else if (index == 1) {
+		ip = Zodiac_Config.OFIP_address2;
+		*port = Zodiac_Config.OFPort2;
+	} else {
+		return false;
+	}
+	if (ip[0] == 0 || ip[0] == 255) return false;	// Not set, or a config saved before it was added
+	IP4_ADDR(server, ip[0], ip[1], ip[2], ip[3]);
+	return true;
+}
+
+/*
+*	Hold back a barrier reply while a flow stats reply is being sent
+*
+*	@param xid - transaction ID of the barrier request.
+*
+*	Returns true if the reply will be sent once the flow stats are complete.
+*/
+bool barrier_hold(uint32_t xid)
+{
+	if (flow_stats_stream.active == false || flow_stats_stream.ctrl != of_ctrl) return false;
+	if (barrier_waiting == sizeof(barrier_wait)/sizeof(barrier_wait[0]))
+	{
+		TRACE("openflow.c: Too many barriers waiting for flow stats");
+		return false;
+	}
+	barrier_wait[barrier_waiting++] = xid;
+	return true;
+}
+
+/*
+*	Start sending a flow stats reply
+*
+*	Only one flow stats reply is sent at a time, to the controller in of_ctrl.
+*
+*	@param xid - transaction ID of the request.
+*
+*	Returns false if another flow stats reply is still being sent.
+*/
+bool flow_stats_start(uint32_t xid)
+{
+	if (flow_stats_stream.active == true) return false;
+	flow_stats_stream.active = true;
+	flow_stats_stream.ctrl = of_ctrl;
+	flow_stats_stream.xid = xid;
+	flow_stats_stream.next = 0;
+	return true;
+}
+
+/*
+*	Send as much of the flow stats reply as the TCP send buffer has room for
+*
+*	Each part is built in shared_buffer, which must not be holding any
+*	other reply. Parts are only made when the controller queue is empty so
+*	a big table can't crowd out other messages, the rest is sent from
+*	of_sent() as the controller acknowledges what has gone. Barrier
+*	replies held back by barrier_hold() follow the last part.
+*
+*/
+void flow_stats_send(void)
+{
+	struct of_controller *cur = of_ctrl;
+	struct of_controller *ctrl = flow_stats_stream.ctrl;
+	int next;
+	int len;
+
+	if (flow_stats_stream.active == false) return;
+	of_ctrl = ctrl;
+	while (flow_stats_stream.active == true)
+	{
+		if (ctrl->con_state != 2 || ctrl->pcb == NULL || ctrl->pcb != ctrl->pcb_check || (OF_Version != 1 && OF_Version != 4))
+		{
+			flow_stats_stream.active = false;
+			barrier_waiting = 0;
+			break;
+		}
+		next = flow_stats_stream.next;
+		if (OF_Version == 1)
 		{
-			tcp_con_state = -1;
-			if(Zodiac_Config.failstate == 0) clear_flows();		// Clear the flow if in secure mode
+			len = stats_flow_part10(shared_buffer, flow_stats_stream.xid, &next);
+		} else {
+			len = multi_flow_part13(shared_buffer, flow_stats_stream.xid, &next);
 		}
+		if (ctrl->tx_stats.depth > 0 || tcp_sndbuf(ctrl->pcb) < len || tcp_sndqueuelen(ctrl->pcb) >= TCP_SND_QUEUELEN) break;	// Wait for room
+		TRACE("openflow.c: Sending flow stats from flow %d to %d", flow_stats_stream.next+1, next);
+		sendtcp(shared_buffer, len);
+		flow_stats_stream.next = next;
+		if (next >= iLastFlow) flow_stats_stream.active = false;
+	}
 
-		if (tcp_con_state == 1 && tcp_pcb->state == ESTABLISHED && Zodiac_Config.OFEnabled == OF_DISABLED)
+	if (flow_stats_stream.active == false)
+	{
+		for (int i=0;i<barrier_waiting;i++)
 		{
-			tcp_con_state = -1;
-			if(Zodiac_Config.failstate == 0) clear_flows();		// Clear the flow if in secure mode
-			tcp_close(tcp_pcb);
+			if (OF_Version == 1) barrier10_reply(barrier_wait[i]);
+			if (OF_Version == 4) barrier13_reply(barrier_wait[i]);
 		}
-	} else {
-		tcp_con_state = -1;
-		tcp_pcb = NULL;
+		barrier_waiting = 0;
 	}
+	of_ctrl = cur;
+	return;
+}
 
+/*
+*	Connect, keep alive and send the queued messages for one controller
+*
+*	@param *ctrl - pointer to the controller.
+*	@param index - controller number, from 0.
+*
+*/
+static void controller_task(struct of_controller *ctrl, int index)
+{
+	struct ip_addr server;
+	uint32_t now = sys_get_ms();
+	uint32_t quiet;
+	int port;
 
-	if((sys_get_ms() - fast_of_timer) > 500)	// every 500 ms (0.5 secs)
+	if (ctrl->con_state == 0 && Zodiac_Config.OFEnabled == OF_ENABLED && controller_address(index, &server, &port) == true)
 	{
-		fast_of_timer = sys_get_ms();
-		nnOF_timer();
+		ctrl->pcb = tcp_new();
+		if (ctrl->pcb == NULL)
+		{
+			ctrl->con_state = -1;
+			controller_backoff(ctrl);
+			return;
+		}
+		ctrl->con_state = 1;
+		ctrl->last_rx = now;
+		ctrl->pcb_check = ctrl->pcb;
+		tcp_arg(ctrl->pcb, ctrl);
+		tcp_err(ctrl->pcb, tcp_error);
+		tcp_nagle_disable(ctrl->pcb);
+		tcp_connect(ctrl->pcb, &server, port, TCPready);
+		return;
+	}
 
-		if (heartbeat > (HB_INTERVAL * 2) && tcp_con_state == 1)	//If we haven't heard anything from the controller for more then the heartbeat interval send an echo request
+	if (ctrl->con_state == 2)
+	{
+		if (ctrl->close == true || ctrl->pcb->state != ESTABLISHED || Zodiac_Config.OFEnabled == OF_DISABLED)
 		{
-			if (rcv_freq == false)	// If we never got a feature request then the handshake failed, disconnect and try again.
+			TRACE("openflow.c: Closing connection to controller %d", index+1);
+			controller_close(ctrl);
+			return;
+		}
+		// One tcp_output() per pass of the main loop sends everything written since the last one
+		tx_flush(ctrl);
+		if (ctrl->tx_output == true) tcp_output(ctrl->pcb);
+		ctrl->tx_output = false;
+	}
+
+	quiet = now - ctrl->last_rx;
+	if (ctrl->con_state == 2)
+	{
+		if (ctrl->rcv_freq == false)
+		{
+			if (quiet >= HANDSHAKE_TIMEOUT)	// If we never got a feature request then the handshake failed, disconnect and try again.
 			{
-				tcp_con_state = -1;
-				if(Zodiac_Config.failstate == 0) clear_flows();		// Clear the flow if in secure mode
 				TRACE("openflow.c: Closing connection due to failed handshake!");
-				tcp_close(tcp_pcb);
-			} else {
-				echo_request();
+				controller_close(ctrl);
 			}
+			return;
 		}
-		heartbeat++;	// Increment number of seconds since last response
-		if (heartbeat > (HB_TIMEOUT * 2) && tcp_con_state == 1)	// If there is no response from the controller for HB_TIMEOUT seconds reset the connection
+		ctrl->backoff = 0;	// A good connection, the next failure starts from RECONNECT_MIN
+		if (quiet >= heartbeat_timeout())	// If there is no response from the controller for the heartbeat timeout reset the connection
 		{
-			tcp_con_state = -1;
-			if(Zodiac_Config.failstate == 0) clear_flows();		// Clear the flow if in secure mode
 			TRACE("openflow.c: Closing connection due to no heartbeat!");
-			tcp_close(tcp_pcb);
+			controller_close(ctrl);
+			return;
 		}
-
-		if (tcp_con_state < 1) tcp_wait++;	//Increment tcp wait counter
-
-		if (tcp_con_state == -1 && tcp_wait > 3)	// Wait 3 seconds then try to connect again
+		if (quiet >= heartbeat_interval())	//If we haven't heard anything from the controller for more then the heartbeat interval send an echo request
 		{
-			tcp_con_state = 0;
-			tcp_wait = 0;
+			// One echo request per interval while the controller is quiet
+			if (ctrl->echo_pending == false || now - ctrl->echo_sent >= heartbeat_interval()) echo_request();
 		}
+		return;
+	}
+
+	if (ctrl->con_state == 1 && quiet >= CONNECT_TIMEOUT)	// Give up on a connection that never completes
+	{
+		TRACE("openflow.c: Connection to controller %d timed out", index+1);
+		controller_close(ctrl);
+		return;
+	}
+	if (ctrl->con_state == -1 && (int32_t)(now - ctrl->retry_at) >= 0) ctrl->con_state = 0;	// Backoff is over, connect again
+	return;
+}
+
+/*
+*	Main OpenFlow processing loop
+*
+*	Every controller is kept connected all the time, so when one fails
+*	the others already have the switch and nothing has to be rediscovered.
+*
+*/
+void task_openflow(void)
+{
+	packet_in_flush();	// Packet-ins queued by the datapath since the last pass, dropped if not connected
+
+	if((sys_get_ms() - fast_of_timer) > 500)	// every 500 ms (0.5 secs)
+	{
+		fast_of_timer = sys_get_ms();
+		nnOF_timer();
 	}
 
+	for (int i=0;i<MAX_CONTROLLERS;i++)
+	{
+		of_ctrl = &controllers[i];
+		controller_task(&controllers[i], i);
+	}
+	standalone_task();
+	return;
 }
 
 /*
 *	TCP callback function
 *
-*	@param *arg - additional arguments
+*	@param *arg - pointer to the controller the connection belongs to.
 *	@param tcp_pcb - TCP struct.
 *	@param err - TCP error code.
 *
 */
 err_t TCPready(void *arg, struct tcp_pcb *tpcb, err_t err)
 {
-	tcp_con_state = true;
+	struct of_controller *ctrl = arg;
+
+	if(Zodiac_Config.failstate == 0 && controllers_connected() == 0 && snapshot_pending() == false) clear_flows();		// Clear the flow if in secure mode, unless flows restored from flash are waiting for the controller
+	ctrl->con_state = 2;
 	tcp_recv(tpcb, of_receive);
-	tcp_poll(tpcb, NULL, 4);
-	tcp_err(tpcb, NULL);
-	if(Zodiac_Config.failstate == 0) clear_flows();		// Clear the flow if in secure mode
-	TRACE("openflow.c: Connected to controller");
+	tcp_sent(tpcb, of_sent);
+	tcp_poll(tpcb, of_poll, 4);
+	TRACE("openflow.c: Connected to controller %d", (int)(ctrl - controllers) + 1);
+	of_ctrl = ctrl;
 	OF_hello();
 	return ERR_OK;
 }
 
+/*
+*	TCP sent callback function
+*
+*	@param *arg - pointer to the controller the connection belongs to.
+*	@param tcp_pcb - TCP struct.
+*	@param len - number of bytes acknowledged.
+*
+*/
+static err_t of_sent(void *arg, struct tcp_pcb *tpcb, u16_t len)
+{
+	if (arg == NULL) return ERR_OK;
+	tx_flush(arg);
+	flow_stats_send();
+	return ERR_OK;
+}
+
+/*
+*	TCP poll callback function
+*
+*	Picks up anything still queued if no acknowledgements have come in.
+*
+*	@param *arg - pointer to the controller the connection belongs to.
+*	@param tcp_pcb - TCP struct.
+*
+*/
+static err_t of_poll(void *arg, struct tcp_pcb *tpcb)
+{
+	if (arg == NULL) return ERR_OK;
+	tx_flush(arg);
+	flow_stats_send();
+	return ERR_OK;
+}
+
 /*
 *	TCP connection error callback function
 *
-*	@param *arg - additional arguments
+*	lwIP has already freed the pcb. The error callback stays set once the
+*	connection is up, so a controller that resets the connection is
+*	noticed straight away rather than at the heartbeat timeout.
+*
+*	@param *arg - pointer to the controller the connection belongs to.
 *	@param err - TCP error code.
 *
 */
 void tcp_error(void * arg, err_t err)
 {
-	if (err == ERR_TIMEOUT){
-		tcp_pcb = NULL;
-	}
-	tcp_con_state = -1;
+	struct of_controller *ctrl = arg;
+
+	if (ctrl == NULL) return;
+	TRACE("openflow.c: Connection to controller %d failed (%d)", (int)(ctrl - controllers) + 1, err);
+	ctrl->pcb = NULL;
+	controller_down(ctrl);
 	return;
 }
-
-
-
@@ -37,11 +37,50 @@
 
 struct flows_counter
 {
-	uint16_t hitCount;
 	int bytes;
 	int duration;
-	uint8_t active;
 	int lastmatch;
+	uint16_t hitCount;
+	uint8_t active;
+};
+
+/*
+*	Instruction list shared by every OpenFlow 1.3 flow with the same
+*	instructions. Flows installed by a controller tend to repeat the same
+*	few output actions so each list is only stored once.
+*/
+struct flow_inst13
+{
+	uint16_t refs;		// Number of flows using this list
+	uint16_t len;		// Length of the instructions
+	uint32_t hash;
+	struct flow_inst13 *next;	// Next list in the same index bucket
+	uint8_t data[];		// The instructions as sent in the flow mod
+};
+
+/*
+*	Compact form of an OpenFlow 1.3 flow mod. Only the fields that are needed
+*	after the flow is added are kept, in network byte order. The record is
+*	sized to hold all of the OXM fields after match.
+*
+*	OpenFlow 1.0 flows are stored the same way. Their match is translated
+*	to OXM fields and their actions to a single apply actions instruction
+*	when they are added, so both versions share the flow table, lookup and
+*	actions.
+*/
+struct flow_entry13
+{
+	uint64_t cookie;
+	struct flow_inst13 *inst;
+	uint16_t priority;
+	uint16_t idle_timeout;
+	uint16_t hard_timeout;
+	uint16_t flags;
+	uint8_t table_id;
+	uint8_t out_ports;	// Bit for each of ports 1-4 the instructions output to, FLOW_OUT_OTHER for any other port
+	uint8_t restored;	// 1 if loaded from the flash snapshot and not yet added again by the controller
+	uint8_t pad;
+	struct ofp13_match match;
 };
 
 struct table_counter
@@ -51,14 +90,30 @@ struct table_counter
 	int byte_count;
 };
 
-struct flow_tbl_actions
+struct meter_entry13
 {
-	uint8_t action1[16];
-	uint8_t action2[16];
-	uint8_t action3[16];
-	uint8_t action4[16];
+	uint32_t meter_id;		// 0 if the entry is free
+	uint16_t flags;
+	uint32_t rate;			// Band rate in kbps or packets per second
+	uint32_t burst_size;	// Band burst size in kilobits or packets
+	uint8_t hw_port;		// Port the meter is offloaded to, 0 if policed in software
+	uint16_t flow_refs;		// Number of flows with a meter instruction for the meter
+	uint32_t tokens;		// Software token bucket in bits or 1/1000 packets
+	uint32_t last_refill;	// Time of the last bucket refill (ms)
+	int time_added;
+	uint64_t packet_in_count;
+	uint64_t byte_in_count;
+	uint64_t packet_band_count;
+	uint64_t byte_band_count;
 };
 
+/*
+*	Internal action for the OpenFlow 1.0 SET_VLAN_VID and SET_VLAN_PCP
+*	actions. It is laid out like a set field action, but a VLAN tag is
+*	pushed first if the packet doesn't have one.
+*/
+#define OFPAT13_SET_VLAN10	0xfff0
+
 struct oxm_header13
 {
 	uint16_t oxm_class;
@@ -66,19 +121,105 @@ struct oxm_header13
 	uint8_t oxm_len;
 };
 
+/* Counters for the messages queued to the controller */
+struct tx_queue_stats
+{
+	uint32_t queued;		// Messages that had to wait for room in the TCP send buffer
+	uint32_t batched;		// Replies held back to go out with the rest of the replies to a segment
+	uint32_t batches;		// Segments from the controller that had replies batched
+	uint32_t dropped;		// Messages dropped because the queue was full
+	uint16_t depth;			// Bytes waiting now
+	uint16_t high_water;
+};
+
+/* OpenFlow message that is being put back together from several pbufs */
+struct of_rx_state
+{
+	struct ofp_header hdr;	// Header of the message, gathered first
+	uint8_t *msg;		// Whole message, from ctrl_slab
+	uint16_t got;		// Bytes of the message received so far
+	uint16_t need;		// Length of the message once the header is complete
+};
+
+/* Round trip times of the echo requests sent to a controller (ms) */
+struct echo_rtt
+{
+	uint32_t count;
+	uint32_t total;		// Sum of every sample, for the mean
+	uint16_t last;
+	uint16_t min;
+	uint16_t max;
+};
+
+/*
+*	Connection to one of the controllers. Every controller has its own
+*	TCP session, framer and send queue, the flow table is shared.
+*/
+struct of_controller
+{
+	struct tcp_pcb *pcb;
+	struct tcp_pcb *pcb_check;
+	int con_state;		// -1 waiting to retry, 0 ready to connect, 1 connecting, 2 connected
+	uint32_t last_rx;	// sys_get_ms() when anything was last received, or the connection was started
+	uint32_t retry_at;	// sys_get_ms() of the next connection attempt
+	uint32_t backoff;	// Reconnect backoff (ms), 0 once a handshake has completed
+	uint32_t echo_xid;	// Transaction ID of the last echo request
+	uint32_t echo_sent;	// sys_get_ms() when it was sent
+	bool echo_pending;	// No reply to it yet
+	struct echo_rtt rtt;
+	bool rcv_freq;		// Features request received, the handshake is complete
+	bool close;			// Close from the main loop, e.g. the OpenFlow version doesn't match
+	uint32_t role;		// OFPCR_ROLE_EQUAL, MASTER or SLAVE
+	struct ofp13_async_config async;	// Async masks from SET_ASYNC, in network byte order
+	struct of_rx_state rx;
+	uint8_t tx_queue_mem[TX_QUEUE_SIZE];	// Messages waiting for room in the TCP send buffer
+	uint16_t tx_head;	// Next byte to hand to TCP, tx_stats.depth bytes follow it
+	bool tx_output;		// tcp_output() is due
+	bool tx_batch;		// Replies are going to the queue until the received segment is handled
+	struct tx_queue_stats tx_stats;
+};
+
 void task_openflow(void);
-void nnOF_tablelookup(uint8_t *p_uc_data, uint32_t *ul_size, int port);
-void nnOF10_tablelookup(uint8_t *p_uc_data, uint32_t *ul_size, int port);
-void nnOF13_tablelookup(uint8_t *p_uc_data, uint32_t *ul_size, int port);
-void of10_message(struct ofp_header *ofph, int size, int len);
-void of13_message(struct ofp_header *ofph, int size, int len);
+void nnOF_tablelookup(struct packet_desc *pkt, int port);
+void nnOF10_tablelookup(struct packet_desc *pkt, int port);
+void nnOF13_tablelookup(struct packet_desc *pkt, int port);
+void of10_message(struct ofp_header *ofph);
+void of13_message(struct ofp_header *ofph);
 void barrier10_reply(uint32_t xid);
 void barrier13_reply(uint32_t xid);
-void sendtcp(const void *buffer, u16_t len);
-void flowrem_notif10(int flowid, uint8_t reason);
-void flowrem_notif13(int flowid, uint8_t reason);
+bool sendtcp(const void *buffer, u16_t len);
+int send_async(const void *buffer, u16_t len, uint8_t type, uint8_t reason);
+bool async_wanted(uint8_t type, uint8_t reason);
+int controllers_connected(void);
+uint16_t controller_backlog(void);
+bool barrier_hold(uint32_t xid);
+bool flow_stats_start(uint32_t xid);
+void flow_stats_send(void);
+int stats_flow_part10(uint8_t *buffer, uint32_t xid, int *next);
+int multi_flow_part13(uint8_t *buffer, uint32_t xid, int *next);
+int flowrem_msg10(uint8_t *buffer, int flowid, uint8_t reason);
+int flowrem_msg13(uint8_t *buffer, int flowid, uint8_t reason);
 void port_status_message10(uint8_t port);
 void port_status_message13(uint8_t port);
+void async_reset13(void);
+uint32_t heartbeat_interval(void);
+uint32_t heartbeat_timeout(void);
+void role_clear13(void);
+bool async_wanted13(struct of_controller *ctrl, uint8_t type, uint8_t reason);
+void meter_sync13(void);
+void meter_flow_ref13(int flow_id, int delta);
+void meter_resync13(void);
+void flow_mod13(struct ofp_header *msg);
+void flow_add13(struct ofp_header *msg);
+int flow_modify13(struct ofp_header *msg, bool strict);
+void flow_mod10_error(uint16_t type, uint16_t code);
+void oxm_to_match10(struct ofp13_match *oxm_match, struct ofp_match *match);
+int inst_to_actions10(uint8_t *buffer, struct flow_inst13 *inst);
+void packet_in10(uint8_t *buffer, uint16_t ul_size, uint8_t port, uint8_t reason, uint16_t max_len);
+void apply_actions13(struct packet_desc *pkt, struct packet_fields *fields, uint8_t *actions, int actions_len, int port, int flow);
+void meter_mod13(struct ofp_header *msg);
+int flow_mod_msg13(uint8_t *buffer, int flowid, int buf_len);
+int meter_mod_msg13(uint8_t *buffer, struct meter_entry13 *meter);
 
 #define HTONS(x) ((((x) & 0xff) << 8) | (((x) & 0xff00) >> 8))
 #define NTOHS(x) HTONS(x)
@@ -34,6 +34,7 @@
 #include "openflow.h"
 #include "switch.h"
 #include "of_helper.h"
+#include "slab.h"
 #include "trace.h"
 #include "lwip/tcp.h"
 #include "ipv4/lwip/ip.h"
@@ -43,23 +44,25 @@
 // Global variables
 extern struct zodiac_config Zodiac_Config;
 extern int totaltime;
-extern struct tcp_pcb *tcp_pcb;
 extern int iLastFlow;
-extern struct ofp_flow_mod *flow_match10[MAX_FLOWS_10];
-extern struct flows_counter flow_counters[MAX_FLOWS_13];
-extern struct flow_tbl_actions *flow_actions10[MAX_FLOWS_10];
+extern struct flow_entry13 **flow_match13;
+extern struct flows_counter *flow_counters;
+extern int max_flows;
+extern int flow_count;
 extern struct table_counter table_counters[MAX_TABLES];
 extern int OF_Version;
-extern bool rcv_freq;
-extern uint8_t NativePortMatrix;
+extern struct of_controller *of_ctrl;
 extern struct ofp10_port_stats phys10_port_stats[4];
 extern uint8_t port_status[4];
+extern uint8_t port_config[4];
+extern uint8_t flood_mask[5];
+extern uint8_t all_mask[5];
 extern uint8_t shared_buffer[SHARED_BUFFER_LEN];
 extern struct zodiac_config Zodiac_Config;
 extern struct ofp_switch_config Switch_config;
+extern struct slab flow_slab;
 
 //Internal Functions
-void packet_in(uint8_t *buffer, uint16_t ul_size, uint8_t port, uint8_t reason);
 void features_reply10(uint32_t xid);
 void set_config10(struct ofp_header * msg);
 void config_reply(uint32_t xid);
@@ -68,15 +71,18 @@ void stats_flow_reply(struct ofp_stats_request * req);
 void stats_table_reply(struct ofp_stats_request * req);
 void stats_port_reply(struct ofp_stats_request * req);
 void packet_out(struct ofp_header * msg);
+void port_mod10(struct ofp_header *msg);
 void flow_mod(struct ofp_header * msg);
 void vendor_reply(uint32_t xid);
-void flow_add(struct ofp_header * msg);
-void flow_modify(struct ofp_header * msg);
-void flow_modify_strict(struct ofp_header * msg);
-void flow_delete(struct ofp_header * msg);
-void flow_delete_strict(struct ofp_header * msg);
 void of10_error(struct ofp_header *msg, uint16_t type, uint16_t code);
 
+#define ALIGN8(x) (x+7)/8*8
+#define VLAN_VID_MASK	0x0fff
+#define FLOW_MOD10_LEN	512	// Room for a 1.0 flow mod, or the actions of a packet out, once translated to 1.3
+
+// 1.0 flow mod being handled by the 1.3 flow code
+static struct ofp_header *flow_mod_req = NULL;
+
 /*
 *	Converts a 64bit value from host to network format
 *
@@ -89,263 +95,702 @@ static inline uint64_t (htonll)(uint64_t n)
 }
 
 /*
-*	Main OpenFlow flow processing function
+*	Map a 1.0 port number to 1.3, the reserved ports keep their low 16 bits
 *
-*	@param *p_uc_data - pointer to the buffer containing the packet.
-*	@param ul_size - size of the packet.
-*	@param port - the port that the packet was received on.
+*	@param port - 1.0 port number.
 *
 */
-void nnOF10_tablelookup(uint8_t *p_uc_data, uint32_t *ul_size, int port)
+static inline uint32_t port10_to13(uint16_t port)
 {
-	uint16_t packet_size;
-	struct packet_fields fields = {0};
-	packet_fields_parser(p_uc_data, &fields);
-		
-	memcpy(&packet_size, ul_size, 2);
-	uint16_t eth_prot;
-	memcpy(&eth_prot, p_uc_data + 12, 2);
-
-	struct ofp_action_output *action_out;	// Need to move these
-	struct ofp_action_dl_addr *action_setdl;
-	struct ofp_action_nw_addr *action_setnw;
-	struct ofp_action_nw_tos *action_settos;
-	struct ofp_action_vlan_vid *action_vlanid;
-	struct ofp_action_vlan_pcp *action_vlanpcp;
-	struct ofp_action_tp_port *action_port;
-	struct ofp_action_header *act_hdr;
-
-	uint16_t vlanid;
-	uint16_t pcp;
-	uint16_t vlanid_mask = htons(0x0fff);
-	uint16_t tcpport;
-	uint32_t ipadr;
-	uint16_t vlantag = htons(0x8100);
-	int outport = 0;
+	return (port >= OFPP_MAX) ? (0xffff0000 | port) : port;
+}
 
-	table_counters[0].lookup_count++;
+/*
+*	Map a 1.3 port number back to 1.0
+*
+*	@param port - 1.3 port number.
+*
+*/
+static inline uint16_t port13_to10(uint32_t port)
+{
+	return (port >= OFPP13_MAX) ? (port & 0xffff) : port;
+}
 
-	if (Zodiac_Config.OFEnabled == OF_ENABLED && iLastFlow == 0) // Check to if the flow table is empty
+/*
+*	Add an OXM field to a match or set field action
+*
+*	@param *buffer - where to write the field.
+*	@param header - OXM header of the field.
+*	@param *value - value of the field, followed by the mask for a masked field.
+*
+*	Returns the length of the field.
+*/
+static int oxm_put(uint8_t *buffer, uint32_t header, const void *value)
+{
+	uint32_t oxm_header = htonl(header);
+	memcpy(buffer, &oxm_header, 4);
+	memcpy(buffer + 4, value, OXM_LENGTH(header));
+	return 4 + OXM_LENGTH(header);
+}
+
+/*
+*	Add a 1.0 network address to the OXM fields of a match
+*
+*	@param *buffer - where to write the field.
+*	@param header - OXM header for an exact match.
+*	@param header_w - OXM header for a masked match.
+*	@param addr - the address.
+*	@param wild_bits - number of low bits of the address that are wildcarded.
+*
+*	Returns the length of the field, 0 if the address is wildcarded.
+*/
+static int nw_addr_to_oxm(uint8_t *buffer, uint32_t header, uint32_t header_w, uint32_t addr, int wild_bits)
+{
+	uint32_t value[2];
+	if (wild_bits >= 32 || addr == 0) return 0;
+	if (wild_bits == 0) return oxm_put(buffer, header, &addr);
+	value[1] = htonl(0xffffffff << wild_bits);
+	value[0] = addr & value[1];
+	return oxm_put(buffer, header_w, value);
+}
+
+/*
+*	Translate an OpenFlow 1.0 match into OXM fields
+*
+*	A field is only added if it is not wildcarded and its prerequisites
+*	are in the match, so every 1.0 match has a single OXM form. Network
+*	fields need an IPv4 or ARP ethertype and transport fields need the TCP,
+*	UDP or ICMP protocol. A zero value is taken as a wildcard, other than
+*	for the VLAN fields, as some controllers leave unused fields zeroed
+*	without setting the wildcard bit.
+*
+*	@param *match - pointer to the 1.0 match.
+*	@param *oxm - pointer to the buffer for the OXM fields, room for 128 bytes.
+*
+*	Returns the length of the OXM fields.
+*/
+static int match10_to_oxm(struct ofp_match *match, uint8_t *oxm)
+{
+	uint32_t wildcards = ntohl(match->wildcards);
+	uint8_t zero_mac[6] = {0};
+	uint8_t *ptr = oxm;
+	uint16_t dl_type = 0;
+	uint8_t nw_proto = 0;
+
+	if (!(wildcards & OFPFW_IN_PORT) && match->in_port != 0)
 	{
-		packet_in (p_uc_data, packet_size, port, OFPR_NO_MATCH); // Packet In if there are no flows in the table
-		return;
+		uint32_t in_port = htonl(port10_to13(ntohs(match->in_port)));
+		ptr += oxm_put(ptr, OXM_OF_IN_PORT, &in_port);
+	}
+	if (!(wildcards & OFPFW_DL_DST) && memcmp(match->dl_dst, zero_mac, 6) != 0) ptr += oxm_put(ptr, OXM_OF_ETH_DST, match->dl_dst);
+	if (!(wildcards & OFPFW_DL_SRC) && memcmp(match->dl_src, zero_mac, 6) != 0) ptr += oxm_put(ptr, OXM_OF_ETH_SRC, match->dl_src);
+	if (!(wildcards & OFPFW_DL_TYPE) && match->dl_type != 0)
+	{
+		dl_type = ntohs(match->dl_type);
+		ptr += oxm_put(ptr, OXM_OF_ETH_TYPE, &match->dl_type);
+	}
+	if (!(wildcards & OFPFW_DL_VLAN))
+	{
+		uint16_t vid;
+		if (ntohs(match->dl_vlan) == OFP_VLAN_NONE)
+		{
+			vid = htons(OFPVID_NONE);
+		} else {
+			vid = htons(OFPVID_PRESENT | (ntohs(match->dl_vlan) & VLAN_VID_MASK));
+		}
+		ptr += oxm_put(ptr, OXM_OF_VLAN_VID, &vid);
+		// The priority can only be matched on tagged packets
+		if (!(wildcards & OFPFW_DL_VLAN_PCP) && ntohs(match->dl_vlan) != OFP_VLAN_NONE)
+		{
+			uint8_t pcp = match->dl_vlan_pcp & 0x07;
+			ptr += oxm_put(ptr, OXM_OF_VLAN_PCP, &pcp);
+		}
 	}
 
-	if (Zodiac_Config.OFEnabled == OF_ENABLED && iLastFlow > 0) // Main lookup
+	if (dl_type == 0x0800)
 	{
-		int i = -1;
-		// Check if packet matches an existing flow
-		i = flowmatch10(p_uc_data, port, &fields);
-		if (i == -2) return;	// Error packet
-		if (i == -1)	// No match
+		if (!(wildcards & OFPFW_NW_TOS) && match->nw_tos != 0)
 		{
-			packet_in (p_uc_data, packet_size, port, OFPR_NO_MATCH);
-			return;
+			uint8_t dscp = match->nw_tos >> 2;
+			ptr += oxm_put(ptr, OXM_OF_IP_DSCP, &dscp);
+		}
+		if (!(wildcards & OFPFW_NW_PROTO) && match->nw_proto != 0)
+		{
+			nw_proto = match->nw_proto;
+			ptr += oxm_put(ptr, OXM_OF_IP_PROTO, &nw_proto);
+		}
+		ptr += nw_addr_to_oxm(ptr, OXM_OF_IPV4_SRC, OXM_OF_IPV4_SRC_W, match->nw_src, (wildcards & OFPFW_NW_SRC_MASK) >> OFPFW_NW_SRC_SHIFT);
+		ptr += nw_addr_to_oxm(ptr, OXM_OF_IPV4_DST, OXM_OF_IPV4_DST_W, match->nw_dst, (wildcards & OFPFW_NW_DST_MASK) >> OFPFW_NW_DST_SHIFT);
+	} else if (dl_type == 0x0806)
+	{
+		// For ARP the protocol is the opcode and the addresses are the protocol addresses
+		if (!(wildcards & OFPFW_NW_PROTO) && match->nw_proto != 0)
+		{
+			uint16_t arp_op = htons(match->nw_proto);
+			ptr += oxm_put(ptr, OXM_OF_ARP_OP, &arp_op);
+		}
+		ptr += nw_addr_to_oxm(ptr, OXM_OF_ARP_SPA, OXM_OF_ARP_SPA_W, match->nw_src, (wildcards & OFPFW_NW_SRC_MASK) >> OFPFW_NW_SRC_SHIFT);
+		ptr += nw_addr_to_oxm(ptr, OXM_OF_ARP_TPA, OXM_OF_ARP_TPA_W, match->nw_dst, (wildcards & OFPFW_NW_DST_MASK) >> OFPFW_NW_DST_SHIFT);
+	}
+
+	if (nw_proto == 6 || nw_proto == 17)
+	{
+		if (!(wildcards & OFPFW_TP_SRC) && match->tp_src != 0) ptr += oxm_put(ptr, (nw_proto == 6) ? OXM_OF_TCP_SRC : OXM_OF_UDP_SRC, &match->tp_src);
+		if (!(wildcards & OFPFW_TP_DST) && match->tp_dst != 0) ptr += oxm_put(ptr, (nw_proto == 6) ? OXM_OF_TCP_DST : OXM_OF_UDP_DST, &match->tp_dst);
+	} else if (nw_proto == 1)
+	{
+		// For ICMP the transport ports hold the type and code
+		if (!(wildcards & OFPFW_ICMP_TYPE) && match->tp_src != 0)
+		{
+			uint8_t icmp_type = ntohs(match->tp_src);
+			ptr += oxm_put(ptr, OXM_OF_ICMPV4_TYPE, &icmp_type);
+		}
+		if (!(wildcards & OFPFW_ICMP_CODE) && match->tp_dst != 0)
+		{
+			uint8_t icmp_code = ntohs(match->tp_dst);
+			ptr += oxm_put(ptr, OXM_OF_ICMPV4_CODE, &icmp_code);
 		}
+	}
+	return ptr - oxm;
+}
+
+/*
+*	Number of low bits wildcarded by the mask of an OXM address field
+*
+*	@param field - OXM header of the field.
+*	@param *oxm_value - pointer to the value of the field.
+*
+*/
+static int oxm_wild_bits(uint32_t field, uint8_t *oxm_value)
+{
+	uint32_t mask;
+	int bits = 0;
+	if (!OXM_HASMASK(field)) return 0;
+	memcpy(&mask, oxm_value + 4, 4);
+	mask = ntohl(mask);
+	while (bits < 32 && !(mask & (1 << bits))) bits++;
+	return bits;
+}
 
-		if ( i > -1)
+/*
+*	Translate the OXM fields of a flow back into an OpenFlow 1.0 match
+*
+*	@param *oxm_match - pointer to the OXM match of the flow.
+*	@param *match - pointer to the 1.0 match to fill in.
+*
+*/
+void oxm_to_match10(struct ofp13_match *oxm_match, struct ofp_match *match)
+{
+	uint32_t wildcards = OFPFW_ALL;
+	uint8_t *hdr = oxm_match->oxm_fields;
+	uint8_t *tail = hdr + ntohs(oxm_match->length) - 4;
+	uint32_t in_port;
+	uint16_t vid;
+
+	memset(match, 0, sizeof(struct ofp_match));
+	while (hdr < tail)
+	{
+		uint32_t field;
+		memcpy(&field, hdr, 4);
+		field = ntohl(field);
+		uint8_t *oxm_value = hdr + 4;
+		hdr += 4 + OXM_LENGTH(field);
+
+		switch(field)
 		{
-			flow_counters[i].hitCount++; // Increment flow hit count
-			flow_counters[i].bytes += packet_size;
-			flow_counters[i].lastmatch = (totaltime/2); // Increment flow hit count
-			table_counters[0].matched_count++;
-			table_counters[0].byte_count += packet_size;
-
-			// If there are no actions DROP the packet
-			act_hdr = flow_actions10[i]->action1;
-			if(act_hdr->len == 0 )
+			case OXM_OF_IN_PORT:
+			memcpy(&in_port, oxm_value, 4);
+			match->in_port = htons(port13_to10(ntohl(in_port)));
+			wildcards &= ~OFPFW_IN_PORT;
+			break;
+
+			case OXM_OF_ETH_DST:
+			memcpy(match->dl_dst, oxm_value, 6);
+			wildcards &= ~OFPFW_DL_DST;
+			break;
+
+			case OXM_OF_ETH_SRC:
+			memcpy(match->dl_src, oxm_value, 6);
+			wildcards &= ~OFPFW_DL_SRC;
+			break;
+
+			case OXM_OF_ETH_TYPE:
+			memcpy(&match->dl_type, oxm_value, 2);
+			wildcards &= ~OFPFW_DL_TYPE;
+			break;
+
+			case OXM_OF_VLAN_VID:
+			memcpy(&vid, oxm_value, 2);
+			vid = ntohs(vid);
+			match->dl_vlan = htons((vid & OFPVID_PRESENT) ? (vid & VLAN_VID_MASK) : OFP_VLAN_NONE);
+			wildcards &= ~OFPFW_DL_VLAN;
+			break;
+
+			case OXM_OF_VLAN_PCP:
+			match->dl_vlan_pcp = oxm_value[0];
+			wildcards &= ~OFPFW_DL_VLAN_PCP;
+			break;
+
+			case OXM_OF_IP_DSCP:
+			match->nw_tos = oxm_value[0] << 2;
+			wildcards &= ~OFPFW_NW_TOS;
+			break;
+
+			case OXM_OF_IP_PROTO:
+			match->nw_proto = oxm_value[0];
+			wildcards &= ~OFPFW_NW_PROTO;
+			break;
+
+			case OXM_OF_ARP_OP:
+			match->nw_proto = oxm_value[1];
+			wildcards &= ~OFPFW_NW_PROTO;
+			break;
+
+			case OXM_OF_IPV4_SRC:
+			case OXM_OF_IPV4_SRC_W:
+			case OXM_OF_ARP_SPA:
+			case OXM_OF_ARP_SPA_W:
+			memcpy(&match->nw_src, oxm_value, 4);
+			wildcards = (wildcards & ~OFPFW_NW_SRC_MASK) | (oxm_wild_bits(field, oxm_value) << OFPFW_NW_SRC_SHIFT);
+			break;
+
+			case OXM_OF_IPV4_DST:
+			case OXM_OF_IPV4_DST_W:
+			case OXM_OF_ARP_TPA:
+			case OXM_OF_ARP_TPA_W:
+			memcpy(&match->nw_dst, oxm_value, 4);
+			wildcards = (wildcards & ~OFPFW_NW_DST_MASK) | (oxm_wild_bits(field, oxm_value) << OFPFW_NW_DST_SHIFT);
+			break;
+
+			case OXM_OF_TCP_SRC:
+			case OXM_OF_UDP_SRC:
+			memcpy(&match->tp_src, oxm_value, 2);
+			wildcards &= ~OFPFW_TP_SRC;
+			break;
+
+			case OXM_OF_TCP_DST:
+			case OXM_OF_UDP_DST:
+			memcpy(&match->tp_dst, oxm_value, 2);
+			wildcards &= ~OFPFW_TP_DST;
+			break;
+
+			case OXM_OF_ICMPV4_TYPE:
+			match->tp_src = htons(oxm_value[0]);
+			wildcards &= ~OFPFW_ICMP_TYPE;
+			break;
+
+			case OXM_OF_ICMPV4_CODE:
+			match->tp_dst = htons(oxm_value[0]);
+			wildcards &= ~OFPFW_ICMP_CODE;
+			break;
+		}
+	}
+	match->wildcards = htonl(wildcards);
+	return;
+}
+
+/*
+*	Add a 1.3 output action
+*
+*	@param *buffer - where to write the action.
+*	@param port - 1.0 port number in network byte order.
+*	@param max_len - bytes to send to the controller in network byte order.
+*
+*	Returns the length of the action.
+*/
+static int output13_put(uint8_t *buffer, uint16_t port, uint16_t max_len)
+{
+	struct ofp13_action_output *act_output = (struct ofp13_action_output *)buffer;
+	memset(act_output, 0, sizeof(struct ofp13_action_output));
+	act_output->type = htons(OFPAT13_OUTPUT);
+	act_output->len = htons(sizeof(struct ofp13_action_output));
+	act_output->port = htonl(port10_to13(ntohs(port)));
+	act_output->max_len = max_len;
+	return sizeof(struct ofp13_action_output);
+}
+
+/*
+*	Add a 1.3 set field action holding a single OXM field
+*
+*	@param *buffer - where to write the action.
+*	@param type - OFPAT13_SET_FIELD or OFPAT13_SET_VLAN10.
+*	@param header - OXM header of the field.
+*	@param *value - value of the field.
+*
+*	Returns the length of the action.
+*/
+static int set_field13_put(uint8_t *buffer, uint16_t type, uint32_t header, const void *value)
+{
+	struct ofp13_action_set_field *act_set_field = (struct ofp13_action_set_field *)buffer;
+	int len = ALIGN8(8 + OXM_LENGTH(header));
+	memset(buffer, 0, len);
+	act_set_field->type = htons(type);
+	act_set_field->len = htons(len);
+	oxm_put(act_set_field->field, header, value);
+	return len;
+}
+
+/*
+*	Add a 1.3 pop VLAN action
+*
+*	@param *buffer - where to write the action.
+*
+*	Returns the length of the action.
+*/
+static int pop_vlan13_put(uint8_t *buffer)
+{
+	struct ofp13_action_header *act_hdr = (struct ofp13_action_header *)buffer;
+	memset(act_hdr, 0, sizeof(struct ofp13_action_header));
+	act_hdr->type = htons(OFPAT13_POP_VLAN);
+	act_hdr->len = htons(sizeof(struct ofp13_action_header));
+	return sizeof(struct ofp13_action_header);
+}
+
+/*
+*	Translate a list of OpenFlow 1.0 actions into OpenFlow 1.3 actions
+*
+*	Each 1.0 action becomes the 1.3 action that does the same thing so the
+*	actions can be run by apply_actions13(). SET_VLAN_VID and SET_VLAN_PCP
+*	become OFPAT13_SET_VLAN10, which also tags an untagged packet. SET_TP
+*	is set on both TCP and UDP unless the match says which one it is.
+*
+*	@param *buffer - pointer to the buffer for the 1.3 actions.
+*	@param buf_len - size of the buffer.
+*	@param *actions - pointer to the first 1.0 action.
+*	@param actions_len - length of the 1.0 actions.
+*	@param nw_proto - IP protocol in the match, 0 if it is wildcarded.
+*	@param *error - set to the OFPBAC10 error code if the actions are rejected.
+*
+*	Returns the length of the 1.3 actions, or -1 if they are rejected.
+*/
+static int actions10_to_13(uint8_t *buffer, int buf_len, uint8_t *actions, int actions_len, uint8_t nw_proto, uint16_t *error)
+{
+	int len = 0;
+	int act_size = 0;
+
+	while (act_size < actions_len)
+	{
+		struct ofp_action_header *act_hdr = (struct ofp_action_header *)(actions + act_size);
+		int act_len = ntohs(act_hdr->len);
+		if (act_len < sizeof(struct ofp_action_header) || (act_len % 8) != 0 || (act_size + act_len) > actions_len)
+		{
+			*error = OFPBAC10_BAD_LEN;
+			return -1;
+		}
+		// No 1.0 action takes more than 32 bytes once translated
+		if (len + 32 > buf_len)
+		{
+			*error = OFPBAC10_TOO_MANY;
+			return -1;
+		}
+
+		switch(ntohs(act_hdr->type))
+		{
+			case OFPAT10_OUTPUT:
+			{
+				struct ofp_action_output *act_output = (struct ofp_action_output *)act_hdr;
+				if (ntohs(act_output->port) == OFPP_NORMAL)	// We do not support port NORMAL
+				{
+					*error = OFPBAC10_BAD_OUT_PORT;
+					return -1;
+				}
+				len += output13_put(buffer + len, act_output->port, act_output->max_len);
+			}
+			break;
+
+			// Queues are not supported so the packet is just sent out of the port
+			case OFPAT10_ENQUEUE:
+			len += output13_put(buffer + len, ((struct ofp_action_enqueue *)act_hdr)->port, 0);
+			break;
+
+			case OFPAT10_SET_VLAN_VID:
+			{
+				uint16_t vid = htons(OFPVID_PRESENT | (ntohs(((struct ofp_action_vlan_vid *)act_hdr)->vlan_vid) & VLAN_VID_MASK));
+				len += set_field13_put(buffer + len, OFPAT13_SET_VLAN10, OXM_OF_VLAN_VID, &vid);
+			}
+			break;
+
+			case OFPAT10_SET_VLAN_PCP:
+			{
+				uint8_t pcp = ((struct ofp_action_vlan_pcp *)act_hdr)->vlan_pcp & 0x07;
+				len += set_field13_put(buffer + len, OFPAT13_SET_VLAN10, OXM_OF_VLAN_PCP, &pcp);
+			}
+			break;
+
+			case OFPAT10_STRIP_VLAN:
+			len += pop_vlan13_put(buffer + len);
+			break;
+
+			case OFPAT10_SET_DL_SRC:
+			len += set_field13_put(buffer + len, OFPAT13_SET_FIELD, OXM_OF_ETH_SRC, ((struct ofp_action_dl_addr *)act_hdr)->dl_addr);
+			break;
+
+			case OFPAT10_SET_DL_DST:
+			len += set_field13_put(buffer + len, OFPAT13_SET_FIELD, OXM_OF_ETH_DST, ((struct ofp_action_dl_addr *)act_hdr)->dl_addr);
+			break;
+
+			case OFPAT10_SET_NW_SRC:
+			len += set_field13_put(buffer + len, OFPAT13_SET_FIELD, OXM_OF_IPV4_SRC, &((struct ofp_action_nw_addr *)act_hdr)->nw_addr);
+			break;
+
+			case OFPAT10_SET_NW_DST:
+			len += set_field13_put(buffer + len, OFPAT13_SET_FIELD, OXM_OF_IPV4_DST, &((struct ofp_action_nw_addr *)act_hdr)->nw_addr);
+			break;
+
+			case OFPAT10_SET_NW_TOS:
+			{
+				uint8_t dscp = ((struct ofp_action_nw_tos *)act_hdr)->nw_tos >> 2;
+				len += set_field13_put(buffer + len, OFPAT13_SET_FIELD, OXM_OF_IP_DSCP, &dscp);
+			}
+			break;
+
+			case OFPAT10_SET_TP_SRC:
+			case OFPAT10_SET_TP_DST:
 			{
-				return;
+				struct ofp_action_tp_port *act_port = (struct ofp_action_tp_port *)act_hdr;
+				bool tp_src = (ntohs(act_hdr->type) == OFPAT10_SET_TP_SRC);
+				if (nw_proto != 17) len += set_field13_put(buffer + len, OFPAT13_SET_FIELD, tp_src ? OXM_OF_TCP_SRC : OXM_OF_TCP_DST, &act_port->tp_port);
+				if (nw_proto != 6) len += set_field13_put(buffer + len, OFPAT13_SET_FIELD, tp_src ? OXM_OF_UDP_SRC : OXM_OF_UDP_DST, &act_port->tp_port);
 			}
+			break;
 
-			// Apply each action included action
-			for(int q=0;q<4;q++)
+			default:
+			*error = OFPBAC10_BAD_TYPE;
+			return -1;
+		}
+		act_size += act_len;
+	}
+	return len;
+}
+
+/*
+*	Translate the instructions of a flow back into OpenFlow 1.0 actions
+*
+*	Undoes actions10_to_13() for flow stats. A SET_TP action stored as both
+*	a TCP and a UDP set field is only reported once.
+*
+*	@param *buffer - pointer to the buffer for the 1.0 actions.
+*	@param *inst - pointer to the instructions of the flow.
+*
+*	Returns the length of the 1.0 actions.
+*/
+int inst_to_actions10(uint8_t *buffer, struct flow_inst13 *inst)
+{
+	struct ofp13_instruction_actions *inst_actions = (struct ofp13_instruction_actions *)inst->data;
+	struct ofp_action_header *last = NULL;
+	int len = 0;
+	int act_size = 0;
+
+	if (inst->len < sizeof(struct ofp13_instruction_actions) || ntohs(inst_actions->type) != OFPIT13_APPLY_ACTIONS) return 0;
+	uint8_t *actions = (uint8_t *)inst_actions->actions;
+	int actions_len = ntohs(inst_actions->len) - sizeof(struct ofp13_instruction_actions);
+
+	while (act_size < actions_len)
+	{
+		struct ofp13_action_header *act_hdr = (struct ofp13_action_header *)(actions + act_size);
+		struct ofp_action_header *act10 = (struct ofp_action_header *)(buffer + len);
+		if (ntohs(act_hdr->len) == 0) break;	// Corrupt action list
+		act_size += ntohs(act_hdr->len);
+		memset(act10, 0, sizeof(struct ofp_action_header));
+
+		switch(ntohs(act_hdr->type))
+		{
+			case OFPAT13_OUTPUT:
 			{
-				if(q == 0) act_hdr = flow_actions10[i]->action1;
-				if(q == 1) act_hdr = flow_actions10[i]->action2;
-				if(q == 2) act_hdr = flow_actions10[i]->action3;
-				if(q == 3) act_hdr = flow_actions10[i]->action4;
+				struct ofp13_action_output *act_output = (struct ofp13_action_output *)act_hdr;
+				struct ofp_action_output *out10 = (struct ofp_action_output *)act10;
+				out10->type = htons(OFPAT10_OUTPUT);
+				out10->len = htons(sizeof(struct ofp_action_output));
+				out10->port = htons(port13_to10(ntohl(act_output->port)));
+				out10->max_len = act_output->max_len;
+			}
+			break;
+
+			case OFPAT13_POP_VLAN:
+			act10->type = htons(OFPAT10_STRIP_VLAN);
+			act10->len = htons(sizeof(struct ofp_action_header));
+			break;
 
-				if (act_hdr->len != 0)
+			case OFPAT13_SET_FIELD:
+			case OFPAT13_SET_VLAN10:
+			{
+				struct ofp13_action_set_field *act_set_field = (struct ofp13_action_set_field *)act_hdr;
+				uint8_t *oxm_value = act_set_field->field + sizeof(struct oxm_header13);
+				uint32_t field;
+				memcpy(&field, act_set_field->field, 4);
+				switch(ntohl(field))
 				{
-					switch(ntohs(act_hdr->type))
-					{
-						case OFPAT10_OUTPUT:
-						action_out = act_hdr;
-						if (ntohs(action_out->port) <= 255 && ntohs(action_out->port) != port) // physical port
-						{
-							outport = (1<< (ntohs(action_out->port)-1));
-							gmac_write(p_uc_data, packet_size, outport);
-						}
-
-						if (ntohs(action_out->port) == OFPP_IN_PORT)
-						{
-							outport = (1<< (port-1));
-							gmac_write(p_uc_data, packet_size, outport);
-						}
-
-						if (ntohs(action_out->port) == OFPP_ALL || ntohs(action_out->port) == OFPP_FLOOD)
-						{
-							outport = (15 - NativePortMatrix) - (1<<(port-1));
-							gmac_write(p_uc_data, packet_size, outport);
-						}
-
-						if (ntohs(action_out->port) == OFPP_CONTROLLER)
-						{
-							int pisize = ntohs(action_out->max_len);
-							if (pisize > packet_size) pisize = packet_size;
-							packet_in(p_uc_data, pisize, port, OFPR_ACTION);
-						}
-						break;
-
-						case OFPAT10_SET_DL_SRC:
-						action_setdl  = act_hdr;
-						memcpy(p_uc_data + 6, action_setdl->dl_addr, 6);
-						break;
-
-						case OFPAT10_SET_DL_DST:
-						action_setdl  = act_hdr;
-						memcpy(p_uc_data, action_setdl->dl_addr, 6);
-						break;
-
-						case OFPAT10_SET_NW_SRC:
-						action_setnw  = act_hdr;
-						ipadr = action_setnw->nw_addr;
-						if (eth_prot == vlantag)	// Add 4 bytes to the offset
-						{
-							memcpy(p_uc_data + 30, &ipadr, 4);
-							set_ip_checksum(p_uc_data, packet_size, 18);
-						} else {
-							memcpy(p_uc_data + 26, &ipadr, 4);
-							set_ip_checksum(p_uc_data, packet_size, 14);
-						}
-						break;
-
-						case OFPAT10_SET_NW_DST:
-						action_setnw  = act_hdr;
-						ipadr = action_setnw->nw_addr;
-						if (eth_prot == vlantag)	// Add 4 bytes to the offset
-						{
-							memcpy(p_uc_data + 34, &ipadr, 4);
-							set_ip_checksum(p_uc_data, packet_size, 18);
-						} else {
-							memcpy(p_uc_data + 30, &ipadr, 4);
-							set_ip_checksum(p_uc_data, packet_size, 14);
-						}
-						break;
-
-						case OFPAT10_SET_NW_TOS:
-						action_settos = act_hdr;
-						if (eth_prot == vlantag)
-						{
-							p_uc_data[19] = action_settos->nw_tos;
-							set_ip_checksum(p_uc_data, packet_size, 18);
-							} else {
-							p_uc_data[15] = action_settos->nw_tos;
-							set_ip_checksum(p_uc_data, packet_size, 14);
-						}
-						break;
-
-						case OFPAT10_SET_VLAN_VID:
-						action_vlanid  = act_hdr;
-						if (eth_prot == vlantag)
-						{
-							memcpy(pcp, p_uc_data + 14, 2);
-						} else {
-							pcp = 0;
-						}
-						if (action_vlanid->vlan_vid == 0xffff)
-						{
-							vlanid = pcp & ~vlanid_mask;
-						} else {
-							vlanid = (action_vlanid->vlan_vid & vlanid_mask) | (pcp & ~vlanid_mask);
-						}
-						// Does the packet have a VLAN header?
-						if (eth_prot == vlantag)
-						{
-							memcpy(p_uc_data + 14, &vlanid, 2);
-						} else {
-							memmove(p_uc_data + 16, p_uc_data + 12, packet_size - 12);
-							memcpy(p_uc_data + 12, &vlantag,2);
-							memcpy(p_uc_data + 14, &vlanid, 2);
-							packet_size += 4;
-							memcpy(ul_size, &packet_size, 2);
-						}
-						break;
-
-						case OFPAT10_SET_VLAN_PCP:
-						action_vlanpcp = act_hdr;
-						if (eth_prot == vlantag)
-						{
-							memcpy(vlanid, p_uc_data + 14, 2);
-						} else {
-							vlanid = 0;
-						}
-						pcp = ((uint16_t)action_vlanpcp->vlan_pcp)<<13;
-						vlanid = (vlanid & vlanid_mask) | (htons(pcp) & ~vlanid_mask);
-						// Does the packet have a VLAN header?
-						if (eth_prot == vlantag)
-						{
-							memcpy(p_uc_data + 14, &vlanid, 2);
-						} else {
-							memmove(p_uc_data + 16, p_uc_data + 12, packet_size - 12);
-							memcpy(p_uc_data + 12, &vlantag,2);
-							memcpy(p_uc_data + 14, &vlanid, 2);
-							packet_size += 4;
-							memcpy(ul_size, &packet_size, 2);
-						}
-						break;
-
-						case OFPAT10_STRIP_VLAN:
-						if (eth_prot == vlantag)
-						{
-							memmove(p_uc_data + 12, p_uc_data + 16, packet_size - 16);
-							packet_size -= 4;
-							memcpy(ul_size, &packet_size, 2);
-						}
-						break;
-
-						case OFPAT10_SET_TP_DST:
-						action_port = act_hdr;
-						tcpport = action_port->tp_port;
-
-						if (eth_prot == vlantag)	// Add 4 bytes to the offset
-						{
-							memcpy(p_uc_data + 40, &tcpport, 2);
-							} else {
-							memcpy(p_uc_data + 36, &tcpport, 2);
-						}
-						break;
-
-						case OFPAT10_SET_TP_SRC:
-						action_port = act_hdr;
-						tcpport = action_port->tp_port;
-						if (eth_prot == vlantag)	// Add 4 bytes to the offset
-						{
-							memcpy(p_uc_data + 38, &tcpport, 2);
-							set_ip_checksum(p_uc_data, packet_size, 18);
-							} else {
-							memcpy(p_uc_data + 34, &tcpport, 2);
-							set_ip_checksum(p_uc_data, packet_size, 14);
-						}
-						break;
-					};
+					case OXM_OF_VLAN_VID:
+					act10->type = htons(OFPAT10_SET_VLAN_VID);
+					act10->len = htons(sizeof(struct ofp_action_vlan_vid));
+					((struct ofp_action_vlan_vid *)act10)->vlan_vid = htons(((oxm_value[0] << 8) | oxm_value[1]) & VLAN_VID_MASK);
+					break;
+
+					case OXM_OF_VLAN_PCP:
+					act10->type = htons(OFPAT10_SET_VLAN_PCP);
+					act10->len = htons(sizeof(struct ofp_action_vlan_pcp));
+					((struct ofp_action_vlan_pcp *)act10)->vlan_pcp = oxm_value[0];
+					break;
+
+					case OXM_OF_ETH_SRC:
+					case OXM_OF_ETH_DST:
+					act10->type = htons((ntohl(field) == OXM_OF_ETH_SRC) ? OFPAT10_SET_DL_SRC : OFPAT10_SET_DL_DST);
+					act10->len = htons(sizeof(struct ofp_action_dl_addr));
+					memcpy(((struct ofp_action_dl_addr *)act10)->dl_addr, oxm_value, 6);
+					memset(((struct ofp_action_dl_addr *)act10)->pad, 0, 6);
+					break;
+
+					case OXM_OF_IPV4_SRC:
+					case OXM_OF_IPV4_DST:
+					act10->type = htons((ntohl(field) == OXM_OF_IPV4_SRC) ? OFPAT10_SET_NW_SRC : OFPAT10_SET_NW_DST);
+					act10->len = htons(sizeof(struct ofp_action_nw_addr));
+					memcpy(&((struct ofp_action_nw_addr *)act10)->nw_addr, oxm_value, 4);
+					break;
+
+					case OXM_OF_IP_DSCP:
+					act10->type = htons(OFPAT10_SET_NW_TOS);
+					act10->len = htons(sizeof(struct ofp_action_nw_tos));
+					((struct ofp_action_nw_tos *)act10)->nw_tos = oxm_value[0] << 2;
+					break;
+
+					case OXM_OF_TCP_SRC:
+					case OXM_OF_UDP_SRC:
+					case OXM_OF_TCP_DST:
+					case OXM_OF_UDP_DST:
+					act10->type = htons((ntohl(field) == OXM_OF_TCP_SRC || ntohl(field) == OXM_OF_UDP_SRC) ? OFPAT10_SET_TP_SRC : OFPAT10_SET_TP_DST);
+					act10->len = htons(sizeof(struct ofp_action_tp_port));
+					memcpy(&((struct ofp_action_tp_port *)act10)->tp_port, oxm_value, 2);
+					// The UDP half of a SET_TP action that was also set on TCP
+					if (last != NULL && memcmp(last, act10, sizeof(struct ofp_action_tp_port)) == 0) act10->len = 0;
+					break;
 				}
 			}
+			break;
+		}
+		if (act10->len == 0) continue;	// Nothing 1.0 can show
+		last = act10;
+		len += ntohs(act10->len);
+	}
+	return len;
+}
+
+/*
+*	Translate an OpenFlow 1.0 flow mod into an OpenFlow 1.3 flow mod
+*
+*	The flow goes in table 0 with its actions in a single apply actions
+*	instruction. A flow without actions has no instructions and drops.
+*	An error is sent to the controller if the actions are rejected.
+*
+*	@param *fm10 - pointer to the 1.0 flow mod.
+*	@param *buffer - pointer to the buffer for the 1.3 flow mod.
+*	@param buf_len - size of the buffer.
+*
+*	Returns the length of the 1.3 flow mod, or 0 if it was rejected.
+*/
+static int flow_mod10_to13(struct ofp_flow_mod *fm10, uint8_t *buffer, int buf_len)
+{
+	struct ofp13_flow_mod *fm = (struct ofp13_flow_mod *)buffer;
+	uint16_t command = ntohs(fm10->command);
+	uint32_t wildcards = ntohl(fm10->match.wildcards);
+	uint8_t nw_proto = 0;
+	uint16_t error;
+
+	memset(buffer, 0, sizeof(struct ofp13_flow_mod));
+	fm->header.version = OF_Version;
+	fm->header.type = OFPT13_FLOW_MOD;
+	fm->header.xid = fm10->header.xid;
+	fm->cookie = fm10->cookie;
+	fm->cookie_mask = 0;
+	fm->table_id = (command == OFPFC_DELETE || command == OFPFC_DELETE_STRICT) ? OFPTT_ALL : 0;
+	fm->command = command;
+	fm->idle_timeout = fm10->idle_timeout;
+	fm->hard_timeout = fm10->hard_timeout;
+	fm->priority = fm10->priority;
+	fm->buffer_id = fm10->buffer_id;
+	fm->out_port = htonl(port10_to13(ntohs(fm10->out_port)));
+	fm->out_group = htonl(OFPG13_ANY);
+	// EMERG has no 1.3 equivalent, and a 1.0 ADD that replaces a flow clears its counters
+	uint16_t flags = ntohs(fm10->flags) & (OFPFF10_SEND_FLOW_REM | OFPFF10_CHECK_OVERLAP);
+	if (command == OFPFC_ADD) flags |= OFPFF13_RESET_COUNTS;
+	fm->flags = htons(flags);
+
+	int match_len = 4 + match10_to_oxm(&fm10->match, fm->match.oxm_fields);
+	int mod_size = ALIGN8(offsetof(struct ofp13_flow_mod, match) + match_len);
+	fm->match.type = htons(OFPMT_OXM);
+	fm->match.length = htons(match_len);
+	memset(buffer + offsetof(struct ofp13_flow_mod, match) + match_len, 0, mod_size - (offsetof(struct ofp13_flow_mod, match) + match_len));
+	int len = mod_size;
+
+	// The actions of a delete are ignored
+	int actions_len = ntohs(fm10->header.length) - sizeof(struct ofp_flow_mod);
+	if (command != OFPFC_DELETE && command != OFPFC_DELETE_STRICT && actions_len > 0)
+	{
+		if (!(wildcards & OFPFW_DL_TYPE) && ntohs(fm10->match.dl_type) == 0x0800 && !(wildcards & OFPFW_NW_PROTO)) nw_proto = fm10->match.nw_proto;
+		struct ofp13_instruction_actions *inst = (struct ofp13_instruction_actions *)(buffer + mod_size);
+		int inst_len = actions10_to_13((uint8_t *)inst->actions, buf_len - mod_size - sizeof(struct ofp13_instruction_actions), (uint8_t *)fm10->actions, actions_len, nw_proto, &error);
+		if (inst_len < 0)
+		{
+			of10_error(&fm10->header, OFPET10_BAD_ACTION, error);
+			return 0;
+		}
+		if (inst_len > 0)
+		{
+			inst->type = htons(OFPIT13_APPLY_ACTIONS);
+			inst->len = htons(sizeof(struct ofp13_instruction_actions) + inst_len);
+			memset(inst->pad, 0, sizeof(inst->pad));
+			len += sizeof(struct ofp13_instruction_actions) + inst_len;
 		}
+	}
+	fm->header.length = htons(len);
+	return len;
+}
 
+/*
+*	Main OpenFlow flow processing function
+*
+*	1.0 flows are kept in the same table as 1.3 flows, in table 0, so the
+*	lookup and the actions are shared with OpenFlow 1.3.
+*
+*	@param *pkt - pointer to the packet descriptor.
+*	@param port - the port that the packet was received on.
+*
+*/
+void nnOF10_tablelookup(struct packet_desc *pkt, int port)
+{
+	struct packet_fields fields = {0};
+	packet_fields_parser(pkt->data, &fields);
+
+	if (Zodiac_Config.OFEnabled != OF_ENABLED) return;
+	table_counters[0].lookup_count++;
+
+	int i = flowmatch13(pkt->data, port, 0, &fields);
+	if (i < 0)	// No match
+	{
+		packet_in10(pkt->data, pkt->len, port, OFPR_NO_MATCH, ntohs(Switch_config.miss_send_len));
 		return;
 	}
-	return;	// Should only get to here if the action is unknown
+
+	flow_counters[i].hitCount++; // Increment flow hit count
+	flow_counters[i].bytes += pkt->len;
+	flow_counters[i].lastmatch = (totaltime/2); // Increment flow hit count
+	table_counters[0].matched_count++;
+	table_counters[0].byte_count += pkt->len;
+
+	// If there are no actions DROP the packet
+	struct flow_inst13 *inst = flow_match13[i]->inst;
+	if (inst->len < sizeof(struct ofp13_instruction_actions)) return;
+	struct ofp13_instruction_actions *inst_actions = (struct ofp13_instruction_actions *)inst->data;
+	apply_actions13(pkt, &fields, (uint8_t *)inst_actions->actions, ntohs(inst_actions->len) - sizeof(struct ofp13_instruction_actions), port, i);
+	return;
 }
 
-void of10_message(struct ofp_header *ofph, int size, int len)
+void of10_message(struct ofp_header *ofph)
 {
 	struct ofp_stats_request *stats_req;
 	switch(ofph->type)
 	{
 		case OFPT10_FEATURES_REQUEST:
-		rcv_freq = true;
+		of_ctrl->rcv_freq = true;
 		features_reply10(ofph->xid);
 		break;
 
@@ -391,6 +836,10 @@ void of10_message(struct ofp_header *ofph, int size, int len)
 		packet_out(ofph);
 		break;
 
+		case OFPT10_PORT_MOD:
+		port_mod10(ofph);
+		break;
+
 		case OFPT10_FLOW_MOD:
 		flow_mod(ofph);
 		break;
@@ -429,7 +878,7 @@ void features_reply10(uint32_t xid)
 	struct ofp10_switch_features features;
 	struct ofp10_phy_port phys_port[numofports];
 	uint8_t buf[256];
-	int l, k;
+	int l;
 	int j = 0;
 	char portname[8];
 
@@ -440,10 +889,10 @@ void features_reply10(uint32_t xid)
 	features.header.xid = xid;
 	memcpy(&datapathid, &Zodiac_Config.MAC_address, 6);
 	features.datapath_id = datapathid << 16;
-	features.n_buffers = htonl(0);		// Number of packets that can be buffered
+	features.n_buffers = htonl(MAX_BUFFERS);		// Number of packets that can be buffered
 	features.n_tables = 1;		// Number of flow tables
 	features.capabilities = htonl(OFPC10_FLOW_STATS + OFPC10_TABLE_STATS + OFPC10_PORT_STATS);	// Switch Capabilities
-	features.actions = htonl((1 << OFPAT10_OUTPUT) + (1 << OFPAT10_SET_VLAN_VID) + (1 << OFPAT10_SET_DL_SRC) + (1 << OFPAT10_SET_DL_DST) + (1 << OFPAT10_SET_NW_SRC) + (1 << OFPAT10_SET_NW_DST) + (1 << OFPAT10_SET_TP_SRC) + (1 << OFPAT10_SET_TP_DST));		// Action Capabilities
+	features.actions = htonl((1 << OFPAT10_OUTPUT) + (1 << OFPAT10_SET_VLAN_VID) + (1 << OFPAT10_SET_VLAN_PCP) + (1 << OFPAT10_STRIP_VLAN) + (1 << OFPAT10_SET_NW_TOS) + (1 << OFPAT10_SET_DL_SRC) + (1 << OFPAT10_SET_DL_DST) + (1 << OFPAT10_SET_NW_SRC) + (1 << OFPAT10_SET_NW_DST) + (1 << OFPAT10_SET_TP_SRC) + (1 << OFPAT10_SET_TP_DST));		// Action Capabilities
 
 	uint8_t mac[] = {0x00,0x00,0x00,0x00,0x00,0x00};
 
@@ -455,16 +904,12 @@ void features_reply10(uint32_t xid)
 		if(Zodiac_Config.of_port[l] == 1)
 		{
 			phys_port[j].port_no = HTONS(l+1);
-			for(k = 0; k<6; k++)            // Generate random MAC address
-			{
-				int r = rand() % 255;
-				memset(mac + k,r,1);
-			}
+			port_hw_addr(l, mac);
 			memcpy(&phys_port[j].hw_addr, mac, sizeof(mac));
 			memset(phys_port[j].name, 0, OFP10_MAX_PORT_NAME_LEN);	// Zero out the name string
 			sprintf(portname, "eth%d",l);
 			strcpy(phys_port[j].name, portname);
-			phys_port[j].config = 0;
+			phys_port[j].config = htonl(port_config[l]);
 			phys_port[j].state = htonl(OFPPS10_STP_LISTEN);
 			if (port_status[l] == 1) phys_port[j].state = htonl(OFPPS10_STP_LISTEN);
 			if (port_status[l] == 0) phys_port[j].state = htonl(OFPPS10_LINK_DOWN);
@@ -509,7 +954,7 @@ void config_reply(uint32_t xid)
 	cfg_reply.header.xid = xid;
 	cfg_reply.header.length = HTONS(sizeof(cfg_reply));
 	cfg_reply.flags = OFPC_FRAG_NORMAL;
-	cfg_reply.miss_send_len = 128;		// Send the first 128 bytes of the packet
+	cfg_reply.miss_send_len = Switch_config.miss_send_len;
 	sendtcp(&cfg_reply, sizeof(cfg_reply));
 	return;
 }
@@ -522,6 +967,7 @@ void config_reply(uint32_t xid)
 */
 void barrier10_reply(uint32_t xid)
 {
+	if (barrier_hold(xid)) return;	// Sent once the flow stats reply in progress is complete
 	struct ofp_header of_barrier;
 	of_barrier.version= OF_Version;
 	of_barrier.length = htons(sizeof(of_barrier));
@@ -585,18 +1031,35 @@ void stats10_desc_reply(struct ofp_stats_request *msg)
 */
 void stats_flow_reply(struct ofp_stats_request *msg)
 {
-	char statsbuffer[2048];
-	struct ofp10_stats_reply *reply;
-	reply = statsbuffer;
+	// The reply is sent in parts by flow_stats_send()
+	if (flow_stats_start(msg->header.xid) == false)
+	{
+		of10_error(&msg->header, OFPET10_BAD_REQUEST, OFPBRC10_EPERM);
+	}
+	return;
+}
+
+/*
+*	Build the next part of a FLOW Stats Reply
+*
+*	@param *buffer - pointer to the buffer to build the reply in.
+*	@param xid - transaction ID of the request.
+*	@param *next - first flow to include, moved on past the flows included.
+*
+*	Returns the length of the reply.
+*/
+int stats_flow_part10(uint8_t *buffer, uint32_t xid, int *next)
+{
+	struct ofp10_stats_reply *reply = (struct ofp10_stats_reply *)buffer;
+	int len = sizeof(struct ofp10_stats_reply);
+	len += flow_stats_msg10(reply->body, STATS_PART_LEN - len, next);
 	reply->header.version = OF_Version;
 	reply->header.type = OFPT10_STATS_REPLY;
-	reply->header.xid = msg->header.xid;
-	reply->type = htons(OFPST_FLOW);
-	int len = flow_stats_msg10(&statsbuffer, 0, iLastFlow);
 	reply->header.length = htons(len);
-	reply->flags = 0;
-	sendtcp(&statsbuffer, len);
-	return;
+	reply->header.xid = xid;
+	reply->type = htons(OFPST_FLOW);
+	reply->flags = (*next < iLastFlow) ? htons(OFPSF_REPLY_MORE) : 0;
+	return len;
 }
 
 /*
@@ -620,8 +1083,8 @@ void stats_table_reply(struct ofp_stats_request *msg)
 	reply.flags = 0;
 
 	tbl_stats.table_id = 0;
-	tbl_stats.max_entries = htonl(MAX_FLOWS_13);
-	tbl_stats.active_count = htonl(iLastFlow);
+	tbl_stats.max_entries = htonl(flow_count + flow_table_free());
+	tbl_stats.active_count = htonl(flow_count);
 	tbl_stats.lookup_count = htonll(table_counters[0].lookup_count);
 	tbl_stats.matched_count = htonll(table_counters[0].matched_count);
 	memcpy(buf, &reply, sizeof(struct ofp10_stats_reply));
@@ -719,32 +1182,46 @@ void stats_port_reply(struct ofp_stats_request *msg)
 */
 void packet_out(struct ofp_header *msg)
 {
-	struct ofp_packet_out * po;
-	po = (struct ofp_packet_out *) msg;
-	uint8_t * ptr = (uint8_t *) po;
-	uint16_t *iport;
-	iport = ptr + 12;
-	ptr += sizeof(struct ofp_packet_out) + NTOHS(po->actions_len);
-	int size = NTOHS(po->header.length) - ((sizeof(struct ofp_packet_out) + NTOHS(po->actions_len)));
-	uint16_t *eport;
-	eport = ptr - 4;
-	int outPort = NTOHS(*eport);
-	int inPort = NTOHS(*iport);
-
-	if (outPort == OFPP_TABLE)
+	struct ofp_packet_out *po = (struct ofp_packet_out *) msg;
+	uint8_t actions[FLOW_MOD10_LEN];
+	uint16_t error;
+	int actions_len = ntohs(po->actions_len);
+	uint8_t *ptr = (uint8_t *)po + sizeof(struct ofp_packet_out) + actions_len;
+	int size = ntohs(po->header.length) - (sizeof(struct ofp_packet_out) + actions_len);
+	int inPort = ntohs(po->in_port);
+	if (size < 0) return; // Corrupt packet!
+
+	// Translate the whole action list before any of it is applied
+	int len = actions10_to_13(actions, sizeof(actions), (uint8_t *)po->actions, actions_len, 0, &error);
+	if (len < 0)
 	{
-		nnOF_tablelookup(ptr, &size, inPort);
+		of10_error(msg, OFPET10_BAD_ACTION, error);
 		return;
 	}
 
-	if (outPort == OFPP_FLOOD || outPort == OFPP13_ALL)
-	{
-		outPort = (15 - NativePortMatrix) - (1<<(inPort-1));
-	} else
+	// The packet out header in front of the data is no longer needed so it can be used as headroom
+	struct packet_desc pkt = {ptr, size, ptr - (uint8_t *)po, 0};
+	struct packet_buffer *buf = NULL;
+
+	// Use the packet held on the switch if the controller refers to one
+	if (ntohl(po->buffer_id) != OFP_NO_BUFFER)
 	{
-		outPort = 1 << (outPort-1);
+		buf = packet_buffer_get(ntohl(po->buffer_id));
+		if (buf == NULL)
+		{
+			of10_error(msg, OFPET10_BAD_REQUEST, OFPBRC10_BUFFER_UNKNOWN);
+			return;
+		}
+		pkt.data = buf->data + PACKET_HEADROOM;
+		pkt.len = buf->size;
+		pkt.headroom = PACKET_HEADROOM;
+		pkt.tailroom = 0;
 	}
-	gmac_write(ptr, size, outPort);
+
+	struct packet_fields fields = {0};
+	packet_fields_parser(pkt.data, &fields);
+	apply_actions13(&pkt, &fields, actions, len, inPort, -1);
+	if (buf != NULL) packet_buffer_release(buf);
 	return;
 }
 
@@ -755,358 +1232,146 @@ void packet_out(struct ofp_header *msg)
 *	@param ul_size - size of the packet.
 *	@param *buffer - port that the packet was received on.
 *	@param reason - reason for the packet in.
+*	@param max_len - number of bytes of the packet to send, the rest is buffered on the switch.
 *
 */
-void packet_in(uint8_t *buffer, uint16_t ul_size, uint8_t port, uint8_t reason)
+void packet_in10(uint8_t *buffer, uint16_t ul_size, uint8_t port, uint8_t reason, uint16_t max_len)
 {
 	uint16_t send_size = ul_size;
-	if(tcp_sndbuf(tcp_pcb) < (send_size + 18)) return;
+	uint32_t buffer_id = OFP_NO_BUFFER;
+	if (packet_in_allowed(port, reason) == false) return;	// Rate limited, counted in packet_in_stats
+
+	// Only send the start of the packet if it can be buffered, otherwise send all of it
+	if (max_len < ul_size)
+	{
+		buffer_id = packet_buffer_store(buffer, ul_size, port);
+		if (buffer_id != OFP_NO_BUFFER) send_size = max_len;
+	}
 	uint16_t size = 0;
 	struct ofp_packet_in * pi;
 
+	// The message is built in the packet-in queue and sent from task_openflow()
 	size = send_size + 18;
-	memset(shared_buffer, 0, 128);
-	pi = (struct ofp_packet_in *) shared_buffer;
+	pi = (struct ofp_packet_in *)packet_in_reserve(size);
+	if (pi == NULL)
+	{
+		if (buffer_id != OFP_NO_BUFFER) packet_buffer_release(packet_buffer_get(buffer_id));
+		return;
+	}
+	memset(pi, 0, 18);
 	pi->header.version = OF_Version;
 	pi->header.type = OFPT10_PACKET_IN;
 	pi->header.xid = 0;
-	pi->buffer_id = -1;
+	pi->buffer_id = htonl(buffer_id);
 	pi->in_port = HTONS(port);
 	pi->header.length = HTONS(size);
 	pi->total_len = HTONS(ul_size);
 	pi->reason = reason;
 	memcpy(pi->data, buffer, send_size);
-	sendtcp(&shared_buffer, size);
 	return;
 }
 
 /*
-*	Main OpenFlow FLOW_MOD message function
+*	OpenFlow PORT_MOD function
 *
 *	@param *msg - pointer to the OpenFlow message.
 *
 */
-void flow_mod(struct ofp_header *msg)
+void port_mod10(struct ofp_header *msg)
 {
-	struct ofp_flow_mod * ptr_fm;
-	ptr_fm = (struct ofp_flow_mod *) msg;
+	struct ofp_port_mod *pm = (struct ofp_port_mod *) msg;
+	int port = ntohs(pm->port_no);
+	uint8_t mac[6];
 
-	uint8_t command = HTONS(ptr_fm->command);
-	switch(command)
+	if (port < 1 || port > 4 || Zodiac_Config.of_port[port-1] != 1)
 	{
-
-		case OFPFC_ADD:
-		flow_add(msg);
-		break;
-
-		case OFPFC_MODIFY:
-		flow_modify(msg);
-		break;
-
-		case OFPFC_MODIFY_STRICT:
-		flow_modify_strict(msg);
-		break;
-
-		case OFPFC_DELETE:
-		flow_delete(msg);
-		break;
-
-		case OFPFC_DELETE_STRICT:
-		flow_delete_strict(msg);
-		break;
-
-	}
-	return;
-}
-
-/*
-*	OpenFlow FLOW_ADD function
-*
-*	@param *msg - pointer to the OpenFlow message.
-*
-*/
-void flow_add(struct ofp_header *msg)
-{
-
-	if (iLastFlow > (MAX_FLOWS_10-1))
-	{
-		of10_error(msg, OFPET10_FLOW_MOD_FAILED, OFPFMFC10_ALL_TABLES_FULL);
+		of10_error(msg, OFPET10_PORT_MOD_FAILED, OFPPMFC10_BAD_PORT);
 		return;
 	}
-
-	struct ofp_flow_mod * ptr_fm;
-	ptr_fm = (struct ofp_flow_mod *) msg;
-	struct ofp_action_header * action_hdr = NULL;
-	struct ofp_action_header * action_hdr1 = NULL;
-	int action_size = ntohs(msg->length) - sizeof(struct ofp_flow_mod);
-	int action_cnt_size = 0;
-	int action_count = 0;
-
-	action_hdr = &ptr_fm->actions;
-	
-	flow_match10[iLastFlow] = membag_alloc(sizeof(struct ofp_flow_mod));	// Allocate a space to store match fields
-	flow_actions10[iLastFlow] = membag_alloc(sizeof(struct flow_tbl_actions));	// Allocate a space to store actions fields
-	if (flow_match10[iLastFlow] == NULL || flow_actions10[iLastFlow] == NULL)
+	port_hw_addr(port-1, mac);
+	if (memcmp(pm->hw_addr, mac, sizeof(mac)) != 0)
 	{
-		TRACE("Unable to allocate %d bytes of memory for match fields", sizeof(struct ofp_flow_mod));
-		of10_error(msg, OFPET10_FLOW_MOD_FAILED, OFPFMFC10_ALL_TABLES_FULL);
+		of10_error(msg, OFPET10_PORT_MOD_FAILED, OFPPMFC10_BAD_HW_ADDR);
 		return;
 	}
-	TRACE("Allocating %d bytes at %p for flow %d\r\n", sizeof(struct ofp_flow_mod), iLastFlow+1);
-	
-	memcpy(flow_match10[iLastFlow], ptr_fm, sizeof(struct ofp_flow_mod));
-
-	if(action_size > 0)
-	{
-		for(int q=0;q<4;q++)
-		{
-			if (action_cnt_size < action_size)
-			{
-				action_hdr1 = action_hdr + action_count;
-
-				// Check for unsupported ports
-				if (HTONS(action_hdr1->type) == OFPAT10_OUTPUT)
-				{
-					struct ofp_action_output * action_out;
-					action_out = action_hdr1;
-
-					if (htons(action_out->port) == OFPP_NORMAL) // We do not support port NORMAL
-					{
-						of10_error(msg, OFPET10_BAD_ACTION, OFPBAC10_BAD_OUT_PORT);
-						return;
-					}
-				}
-				// If set VLAD ID field is 0 change to a STRIP_VLAN action
-				if (htons(action_hdr1->type) == OFPAT10_SET_VLAN_VID)
-				{
-					struct ofp_action_vlan_vid * action_vlan;
-					action_vlan = action_hdr1;
-					if(action_vlan->vlan_vid == 0) action_hdr1->type = htons(OFPAT10_STRIP_VLAN);
-				}
-
-				// Copy action
-				if(q == 0) memcpy(flow_actions10[iLastFlow]->action1, action_hdr1, ntohs(action_hdr1->len));
-				if(q == 1) memcpy(flow_actions10[iLastFlow]->action2, action_hdr1, ntohs(action_hdr1->len));
-				if(q == 2) memcpy(flow_actions10[iLastFlow]->action3, action_hdr1, ntohs(action_hdr1->len));
-				if(q == 3) memcpy(flow_actions10[iLastFlow]->action4, action_hdr1, ntohs(action_hdr1->len));
-			}
-			if(ntohs(action_hdr1->len) == 8) action_count += 1;
-			if(ntohs(action_hdr1->len) == 16) action_count += 2;
-			action_cnt_size += ntohs(action_hdr1->len);
-		}
-	}
 
-	flow_counters[iLastFlow].duration = (totaltime/2);
-	flow_counters[iLastFlow].lastmatch = (totaltime/2);
-	flow_counters[iLastFlow].active = true;
-	iLastFlow++;
+	// Every 1.0 config bit is supported, there is no spanning tree for NO_STP to turn off
+	uint32_t mask = ntohl(pm->mask) & (OFPPC_PORT_DOWN | OFPPC_NO_STP | OFPPC_NO_RECV | OFPPC_NO_RECV_STP | OFPPC_NO_FLOOD | OFPPC_NO_FWD | OFPPC_NO_PACKET_IN);
+	uint8_t config = (port_config[port-1] & ~mask) | (ntohl(pm->config) & mask);
+	if (config == port_config[port-1]) return;
+	port_config[port-1] = config;
+	TRACE("openflow_10.c: Port %d config set to 0x%x", port, port_config[port-1]);
+	update_port_masks();
+	port_status_message10(port-1);
 	return;
-
 }
 
 /*
-*	OpenFlow FLOW Modify function
-*
-*	@param *msg - pointer to the OpenFlow message.
+*	Main OpenFlow FLOW_MOD message function
 *
-*/
-void flow_modify(struct ofp_header *msg)
-{
-	struct ofp_flow_mod * ptr_fm;
-	ptr_fm = (struct ofp_flow_mod *) msg;
-	struct ofp_action_header * action_hdr = NULL;
-	struct ofp_action_header * action_hdr1 = NULL;
-	int action_size = ntohs(msg->length) - sizeof(struct ofp_flow_mod);
-	int action_cnt_size = 0;
-	int action_count = 0;
-
-	for(int q=0;q<iLastFlow;q++)
-	{
-		if(flow_counters[q].active == true)
-		{
-			if (field_match10(&ptr_fm->match, &flow_match10[q]->match) == 1)
-			{
-				// Update actions
-				action_hdr = &ptr_fm->actions;
-				if(action_size > 0)
-				{
-					for(int j=0;j<4;j++)
-					{
-						if (action_cnt_size < action_size)
-						{
-							action_hdr1 = action_hdr + action_count;
-
-							// Check for unsupported ports
-							if (HTONS(action_hdr1->type) == OFPAT10_OUTPUT)
-							{
-								struct ofp_action_output * action_out;
-								action_out = action_hdr1;
-
-								if (htons(action_out->port) == OFPP_NORMAL) // We do not support port NORMAL
-								{
-									of10_error(msg, OFPET10_BAD_ACTION, OFPBAC10_BAD_OUT_PORT);
-									return;
-								}
-							}
-							// If set VLAD ID field is 0 change to a STRIP_VLAN action
-							if (htons(action_hdr1->type) == OFPAT10_SET_VLAN_VID)
-							{
-								struct ofp_action_vlan_vid * action_vlan;
-								action_vlan = action_hdr1;
-								if(action_vlan->vlan_vid == 0) action_hdr1->type = htons(OFPAT10_STRIP_VLAN);
-							}
-
-							// Copy actions
-							if(j == 0) memcpy(flow_actions10[q]->action1, action_hdr1, ntohs(action_hdr1->len));
-							if(j == 1) memcpy(flow_actions10[q]->action2, action_hdr1, ntohs(action_hdr1->len));
-							if(j == 2) memcpy(flow_actions10[q]->action3, action_hdr1, ntohs(action_hdr1->len));
-							if(j == 3) memcpy(flow_actions10[q]->action4, action_hdr1, ntohs(action_hdr1->len));
-						}
-						if(ntohs(action_hdr1->len) == 8) action_count += 1;
-						if(ntohs(action_hdr1->len) == 16) action_count += 2;
-						action_cnt_size += ntohs(action_hdr1->len);
-					}
-				}
-				} else {
-				flow_add(msg);	// If there is no existing flow that matches then it's just an ADD
-			}
-		}
-	}
-	return;
-}
-
-/*
-*	OpenFlow FLOW Modify Strict function
+*	The flow mod is translated to OpenFlow 1.3 and handled by the same
+*	code as a 1.3 flow mod, so 1.0 flows use the same table.
 *
 *	@param *msg - pointer to the OpenFlow message.
 *
 */
-void flow_modify_strict(struct ofp_header *msg)
+void flow_mod(struct ofp_header *msg)
 {
-	struct ofp_flow_mod * ptr_fm;
-	ptr_fm = (struct ofp_flow_mod *) msg;
-	struct ofp_action_header * action_hdr = NULL;
-	struct ofp_action_header * action_hdr1 = NULL;
-	int action_size = ntohs(msg->length) - sizeof(struct ofp_flow_mod);
-	int action_cnt_size = 0;
-	int action_count = 0;
-
-	for(int q=0;q<iLastFlow;q++)
+	struct ofp_flow_mod *ptr_fm = (struct ofp_flow_mod *) msg;
+	uint8_t fm13_buf[FLOW_MOD10_LEN];
+	struct ofp13_flow_mod *ptr_fm13 = (struct ofp13_flow_mod *) fm13_buf;
+	uint16_t command = ntohs(ptr_fm->command);
+
+	if (command > OFPFC_DELETE_STRICT)
 	{
-		if(flow_counters[q].active == true)
-		{
-			if((memcmp(&flow_match10[q]->match, &ptr_fm->match, sizeof(struct ofp_match)) == 0) && (flow_match10[q]->priority == ptr_fm->priority))
-			{
-				// Update actions
-				action_hdr = &ptr_fm->actions;
-				if(action_size > 0)
-				{
-					for(int j=0;j<4;j++)
-					{
-						if (action_cnt_size < action_size)
-						{
-							action_hdr1 = action_hdr + action_count;
-
-							// Check for unsupported ports
-							if (HTONS(action_hdr1->type) == OFPAT10_OUTPUT)
-							{
-								struct ofp_action_output * action_out;
-								action_out = action_hdr1;
-
-								if (htons(action_out->port) == OFPP_NORMAL) // We do not support port NORMAL
-								{
-									of10_error(msg, OFPET10_BAD_ACTION, OFPBAC10_BAD_OUT_PORT);
-									return;
-								}
-							}
-							// If set VLAD ID field is 0 change to a STRIP_VLAN action
-							if (htons(action_hdr1->type) == OFPAT10_SET_VLAN_VID)
-							{
-								struct ofp_action_vlan_vid * action_vlan;
-								action_vlan = action_hdr1;
-								if(action_vlan->vlan_vid == 0) action_hdr1->type = htons(OFPAT10_STRIP_VLAN);
-							}
-
-							// Copy actions
-							if(j == 0) memcpy(flow_actions10[q]->action1, action_hdr1, ntohs(action_hdr1->len));
-							if(j == 1) memcpy(flow_actions10[q]->action2, action_hdr1, ntohs(action_hdr1->len));
-							if(j == 2) memcpy(flow_actions10[q]->action3, action_hdr1, ntohs(action_hdr1->len));
-							if(j == 3) memcpy(flow_actions10[q]->action4, action_hdr1, ntohs(action_hdr1->len));
-						}
-						if(ntohs(action_hdr1->len) == 8) action_count += 1;
-						if(ntohs(action_hdr1->len) == 16) action_count += 2;
-						action_cnt_size += ntohs(action_hdr1->len);
-					}
-				}
-				} else {
-				flow_add(msg);	// If there is no existing flow that matches then it's just an ADD
-			}
-		}
+		of10_error(msg, OFPET10_FLOW_MOD_FAILED, OFPFMFC10_BAD_COMMAND);
+		return;
 	}
-	return;
-}
-
-/*
-*	OpenFlow FLOW Delete function
-*
-*	@param *msg - pointer to the OpenFlow message.
-*
-*/
-void flow_delete(struct ofp_header *msg)
-{
-	struct ofp_flow_mod * ptr_fm;
-	ptr_fm = (struct ofp_flow_mod *) msg;
-	int q = 0;
+	if (flow_mod10_to13(ptr_fm, fm13_buf, sizeof(fm13_buf)) == 0) return;
 
-	while(q<iLastFlow)
+	flow_mod_req = msg;	// Errors from the 1.3 code are sent against the 1.0 request
+	if (command == OFPFC_MODIFY || command == OFPFC_MODIFY_STRICT)
 	{
-		if(flow_counters[q].active == true)
+		// A 1.0 modify that doesn't change any flows is an ADD, the buffered packet is only applied once
+		uint32_t buffer_id = ptr_fm13->buffer_id;
+		ptr_fm13->buffer_id = htonl(OFP_NO_BUFFER);
+		int modified = flow_modify13(&ptr_fm13->header, command == OFPFC_MODIFY_STRICT);
+		ptr_fm13->buffer_id = buffer_id;
+		if (modified == 0)
 		{
-			if (field_match10(&ptr_fm->match, &flow_match10[q]->match) == 1)
-			{
-				if (ptr_fm->flags &  OFPFF10_SEND_FLOW_REM) flowrem_notif10(q,OFPRR10_DELETE);
-				// Clear flow counters and actions
-				memset(&flow_counters[q], 0, sizeof(struct flows_counter));
-				memset(flow_actions10[q], 0, sizeof(struct flow_tbl_actions));
-				// Copy the last flow to here to fill the gap
-				memcpy(flow_match10[q], flow_match10[iLastFlow-1], sizeof(struct ofp_flow_mod));
-				memcpy(flow_actions10[q], &flow_actions10[iLastFlow-1], sizeof(struct flow_tbl_actions));
-				memcpy(&flow_counters[q], &flow_counters[iLastFlow-1], sizeof(struct flows_counter));
-				// Clear the counters and action from the last flow that was moved
-				memset(&flow_counters[iLastFlow-1], 0, sizeof(struct flows_counter));
-				memset(flow_actions10[iLastFlow-1], 0, sizeof(struct flow_tbl_actions));
-				iLastFlow --;
-				} else {
-				q++;
-			}
+			flow_add13(&ptr_fm13->header);
+		} else if (modified > 0 && packet_buffer_lookup(ntohl(buffer_id)) == false) {
+			of10_error(msg, OFPET10_BAD_REQUEST, OFPBRC10_BUFFER_UNKNOWN);
 		}
+	} else {
+		flow_mod13(&ptr_fm13->header);
 	}
+	flow_mod_req = NULL;
 	return;
 }
 
 /*
-*	OpenFlow FLOW Delete Strict function
+*	Send the error for a 1.0 flow mod that the 1.3 flow code rejected
 *
-*	@param *msg - pointer to the OpenFlow message.
+*	The 1.3 error is changed to the nearest 1.0 error and sent with the
+*	start of the original 1.0 request.
+*
+*	@param type - 1.3 error type.
+*	@param code - 1.3 error code.
 *
 */
-void flow_delete_strict(struct ofp_header *msg)
+void flow_mod10_error(uint16_t type, uint16_t code)
 {
-	struct ofp_flow_mod * ptr_fm;
-	ptr_fm = (struct ofp_flow_mod *) msg;
-	int q;
-
-	for(q=0;q<iLastFlow;q++)
+	uint16_t code10 = OFPFMFC10_UNSUPPORTED;
+	if (flow_mod_req == NULL) return;	// Not from the controller, e.g. flows restored from flash
+	if (type == OFPET13_BAD_REQUEST && code == OFPBRC13_BUFFER_UNKNOWN)
 	{
-		if(flow_counters[q].active == true)
-		{
-			if((memcmp(&flow_match10[q]->match, &ptr_fm->match, sizeof(struct ofp_match)) == 0) && (memcmp(&flow_match10[q]->cookie, &ptr_fm->cookie,8) == 0))
-			{
-				if (ptr_fm->flags &  OFPFF10_SEND_FLOW_REM) flowrem_notif10(q,OFPRR10_DELETE);
-				remove_flow10(q);
-			}
-		}
+		of10_error(flow_mod_req, OFPET10_BAD_REQUEST, OFPBRC10_BUFFER_UNKNOWN);
+		return;
 	}
+	if (type == OFPET13_FLOW_MOD_FAILED && code == OFPFMFC13_TABLE_FULL) code10 = OFPFMFC10_ALL_TABLES_FULL;
+	if (type == OFPET13_FLOW_MOD_FAILED && code == OFPFMFC13_OVERLAP) code10 = OFPFMFC10_OVERLAP;
+	of10_error(flow_mod_req, OFPET10_FLOW_MOD_FAILED, code10);
 	return;
 }
 
@@ -1138,32 +1403,35 @@ void of10_error(struct ofp_header *msg, uint16_t type, uint16_t code)
 }
 
 /*
-*	OpenFlow FLOW Removed message function
+*	Build an OpenFlow FLOW Removed message
 *
+*	@param *buffer - pointer to the buffer to build the message in.
 *	@param flowid - flow number.
 *	@param reason - the reason the flow was removed.
 *
+*	Returns the length of the message.
 */
-void flowrem_notif10(int flowid, uint8_t reason)
+int flowrem_msg10(uint8_t *buffer, int flowid, uint8_t reason)
 {
 	struct ofp_flow_removed ofr;
 	double diff;
 
+	memset(&ofr, 0, sizeof(struct ofp_flow_removed));
 	ofr.header.type = OFPT10_FLOW_REMOVED;
 	ofr.header.version = OF_Version;
 	ofr.header.length = htons(sizeof(struct ofp_flow_removed));
 	ofr.header.xid = 0;
-	ofr.cookie = flow_match10[flowid]->cookie;
+	ofr.cookie = flow_match13[flowid]->cookie;
 	ofr.reason = reason;
-	ofr.priority = flow_match10[flowid]->priority;
+	ofr.priority = flow_match13[flowid]->priority;
 	diff = (totaltime/2) - flow_counters[flowid].duration;
 	ofr.duration_sec = htonl(diff);
-	ofr.packet_count = flow_counters[flowid].hitCount;
-	ofr.byte_count = flow_counters[flowid].bytes;
-	ofr.idle_timeout = flow_match10[flowid]->idle_timeout;
-	ofr.match = flow_match10[flowid]->match;
-	sendtcp(&ofr, sizeof(struct ofp_flow_removed));
-	return;
+	ofr.packet_count = htonll(flow_counters[flowid].hitCount);
+	ofr.byte_count = htonll(flow_counters[flowid].bytes);
+	ofr.idle_timeout = flow_match13[flowid]->idle_timeout;
+	oxm_to_match10(&flow_match13[flowid]->match, &ofr.match);
+	memcpy(buffer, &ofr, sizeof(struct ofp_flow_removed));
+	return sizeof(struct ofp_flow_removed);
 }
 
 /*
@@ -1184,23 +1452,19 @@ void port_status_message10(uint8_t port)
 	ofps.header.xid = 0;
 	ofps.reason = OFPPR10_MODIFY;
 	ofps.desc.port_no = htons(port+1);
-	for(int k = 0; k<6; k++)            // Generate random MAC address
-	{
-		int r = rand() % 255;
-		memset(mac + k,r,1);
-	}
+	port_hw_addr(port, mac);
 	memcpy(&ofps.desc.hw_addr, mac, sizeof(mac));
 	memset(ofps.desc.name, 0, OFP10_MAX_PORT_NAME_LEN);	// Zero out the name string
 	sprintf(portname, "eth%d",port);
 	strcpy(ofps.desc.name, portname);
-	ofps.desc.config = 0;
+	ofps.desc.config = htonl(port_config[port]);
 	if (port_status[port] == 1) ofps.desc.state = htonl(OFPPS10_STP_LISTEN);
 	if (port_status[port] == 0) ofps.desc.state = htonl(OFPPS10_LINK_DOWN);
 	ofps.desc.curr = htonl(OFPPF10_100MB_FD + OFPPF10_COPPER);
 	ofps.desc.advertised = 0;
 	ofps.desc.supported = 0;
 	ofps.desc.peer = 0;
-	sendtcp(&ofps, htons(ofps.header.length));
+	send_async(&ofps, htons(ofps.header.length), OFPT10_PORT_STATUS, OFPPR10_MODIFY);
 	TRACE("openflow_10.c: Port Status change notification sent");
 	return;
 }
@@ -35,6 +35,9 @@
 #include "command.h"
 #include "openflow.h"
 #include "switch.h"
+#include "timers.h"
+#include "slab.h"
+#include "snapshot.h"
 #include "lwip/tcp.h"
 #include "ipv4/lwip/ip.h"
 #include "lwip/inet_chksum.h"
@@ -44,32 +47,41 @@
 
 // Global variables
 extern struct zodiac_config Zodiac_Config;
-extern struct tcp_pcb *tcp_pcb;
 extern int OF_Version;
-extern bool rcv_freq;
+extern struct of_controller controllers[MAX_CONTROLLERS];
+extern struct of_controller *of_ctrl;
 extern int iLastFlow;
 extern int totaltime;
-extern struct ofp13_flow_mod *flow_match13[MAX_FLOWS_13];
-extern uint8_t *ofp13_oxm_match[MAX_FLOWS_13];
-extern uint8_t *ofp13_oxm_inst[MAX_FLOWS_13];
-extern uint16_t ofp13_oxm_inst_size[MAX_FLOWS_13];
-extern struct flows_counter flow_counters[MAX_FLOWS_13];
+extern struct flow_entry13 **flow_match13;
+extern int max_flows;
+extern int flow_count;
+extern struct flows_counter *flow_counters;
 extern struct ofp13_port_stats phys13_port_stats[4];
 extern struct table_counter table_counters[MAX_TABLES];
 extern uint8_t port_status[4];
+extern uint8_t port_config[4];
+extern uint8_t flood_mask[5];
+extern uint8_t all_mask[5];
 extern struct ofp_switch_config Switch_config;
 extern uint8_t shared_buffer[SHARED_BUFFER_LEN];
 extern int multi_pos;
-extern uint8_t NativePortMatrix;
+extern struct meter_entry13 meter_table13[MAX_METER_13];
+extern uint8_t meter_ingress_limit[4];
+extern struct slab flow_slab;
+
+// Local Variables
+static uint64_t role_generation;	// Highest generation_id a controller has asked to be master or slave with
+static bool role_generation_set;
+static bool meter_resync;	// Set when a flow change may have moved a meter between hardware and software
 
 // Internal functions
+void set_async13(struct ofp_header *msg);
+void get_async_reply13(struct ofp_header *msg);
 void features_reply13(uint32_t xid);
 void of_error13(struct ofp_header *msg, uint16_t type, uint16_t code);
 void set_config13(struct ofp_header * msg);
 void config_reply13(uint32_t xid);
 void role_reply13(struct ofp_header *msg);
-void flow_mod13(struct ofp_header *msg);
-void flow_add13(struct ofp_header *msg);
 void flow_delete13(struct ofp_header *msg);
 void flow_delete_strict13(struct ofp_header *msg);
 int multi_desc_reply13(uint8_t *buffer, struct ofp13_multipart_request * req);
@@ -79,8 +91,15 @@ int multi_portdesc_reply13(uint8_t *buffer, struct ofp13_multipart_request * req
 int multi_table_reply13(uint8_t *buffer, struct ofp13_multipart_request *req);
 int multi_tablefeat_reply13(uint8_t *buffer, struct ofp13_multipart_request *msg);
 int multi_flow_reply13(uint8_t *buffer, struct ofp13_multipart_request *msg);
-void packet_in13(uint8_t *buffer, uint16_t ul_size, uint8_t port, uint8_t reason, int flow);
+void packet_in13(uint8_t *buffer, uint16_t ul_size, uint8_t port, uint8_t reason, int flow, uint16_t max_len);
 void packet_out13(struct ofp_header *msg);
+void port_mod13(struct ofp_header *msg);
+struct meter_entry13 *meter_lookup13(uint32_t meter_id);
+bool meter_police13(struct meter_entry13 *meter, uint16_t packet_size);
+uint32_t flow_meter13(int flow_id);
+int multi_meter_stats_reply13(uint8_t *buffer, struct ofp13_multipart_request *msg);
+int multi_meter_config_reply13(uint8_t *buffer, struct ofp13_multipart_request *msg);
+int multi_meter_features_reply13(uint8_t *buffer, struct ofp13_multipart_request *msg);
 
 /*
 *	Converts a 64bit value from host to network format
@@ -93,10 +112,18 @@ static inline uint64_t (htonll)(uint64_t n)
 	return HTONL(1) == 1 ? n : ((uint64_t) HTONL(n) << 32) | HTONL(n >> 32);
 }
 
-void nnOF13_tablelookup(uint8_t *p_uc_data, uint32_t *ul_size, int port)
+/*
+*	Main OpenFlow flow processing function
+*
+*	@param *pkt - pointer to the packet descriptor.
+*	@param port - the port that the packet was received on.
+*
+*/
+void nnOF13_tablelookup(struct packet_desc *pkt, int port)
 {
+	uint8_t *p_uc_data = pkt->data;
 	uint8_t table_id = 0;
-	uint16_t packet_size = (uint16_t)*ul_size;
+	uint16_t packet_size = pkt->len;
 	struct packet_fields fields = {0};
 	packet_fields_parser(p_uc_data, &fields);
 
@@ -116,373 +143,457 @@ void nnOF13_tablelookup(uint8_t *p_uc_data, uint32_t *ul_size, int port)
 		table_counters[table_id].byte_count += packet_size;
 
 		// If there are no instructions then it's a DROP so just return
-		if(ofp13_oxm_inst[i] == NULL) return;
+		if(flow_match13[i]->inst->len == 0) return;
 
 		// Process Instructions
 		// The order is Meter -> Apply -> Clear -> Write -> Metadata -> Goto
 		void *insts[8] = {0};
 		int inst_size = 0;
-		while(inst_size < ofp13_oxm_inst_size[i]){
-			struct ofp13_instruction *inst_ptr = (struct ofp13_instruction *)(ofp13_oxm_inst[i] + inst_size);
+		while(inst_size < flow_match13[i]->inst->len){
+			struct ofp13_instruction *inst_ptr = (struct ofp13_instruction *)(flow_match13[i]->inst->data + inst_size);
 			insts[ntohs(inst_ptr->type)] = inst_ptr;
 			inst_size += ntohs(inst_ptr->len);
 		}
+
+		// Drop the packet if it exceeds the meter rate
+		if(insts[OFPIT13_METER] != NULL)
+		{
+			struct ofp13_instruction_meter *inst_meter = insts[OFPIT13_METER];
+			struct meter_entry13 *meter = meter_lookup13(ntohl(inst_meter->meter_id));
+			if (meter != NULL && meter_police13(meter, packet_size))
+			{
+				TRACE("openflow_13.c: Packet dropped by meter %d", ntohl(inst_meter->meter_id));
+				return;
+			}
+		}
 			
 		if(insts[OFPIT13_APPLY_ACTIONS] != NULL)
 		{
-			bool recalculate_ip_checksum = false;
 			struct ofp13_instruction_actions *inst_actions = insts[OFPIT13_APPLY_ACTIONS];
-			int act_size = 0;
-			while (act_size < (inst_size - sizeof(struct ofp13_instruction_actions)))
+			apply_actions13(pkt, &fields, (uint8_t *)inst_actions->actions, ntohs(inst_actions->len) - sizeof(struct ofp13_instruction_actions), port, i);
+			p_uc_data = pkt->data;
+			packet_size = pkt->len;
+		}
+			
+		if(insts[OFPIT13_GOTO_TABLE] != NULL)
+		{
+			struct ofp13_instruction_goto_table *inst_goto_ptr = insts[OFPIT13_GOTO_TABLE];
+			if (table_id >= inst_goto_ptr->table_id) {
+				TRACE("openflow_13.c: Goto loop detected, aborting (cannot goto to earlier/same table)");
+				return;
+			}
+			table_id = inst_goto_ptr->table_id;
+			TRACE("openflow_13.c: Goto table %d", table_id);
+		}
+		else
+		{
+			return;
+		}
+	}
+	return;
+}
+
+/*
+*	Apply an OpenFlow 1.3 action list to a packet
+*
+*	Used for the apply-actions instruction of a matched flow and for the
+*	actions of a packet out.
+*
+*	@param *pkt - pointer to the packet descriptor.
+*	@param *fields - parsed fields of the packet, kept up to date as the packet changes.
+*	@param *actions - pointer to the first action.
+*	@param actions_len - length of the action list.
+*	@param port - the port that the packet was received on.
+*	@param flow - the flow the actions belong to, -1 for a packet out.
+*
+*/
+void apply_actions13(struct packet_desc *pkt, struct packet_fields *fields, uint8_t *actions, int actions_len, int port, int flow)
+{
+	uint8_t *p_uc_data = pkt->data;
+	uint16_t packet_size = pkt->len;
+	bool recalculate_ip_checksum = false;
+	int act_size = 0;
+	while (act_size < actions_len)
+	{
+		struct ofp13_action_header *act_hdr = (struct ofp13_action_header*)(actions + act_size);
+		if (ntohs(act_hdr->len) == 0) break;	// Corrupt action list
+		switch (htons(act_hdr->type))
+		{
+		// Output Action
+		case OFPAT13_OUTPUT:
+		{
+			if(recalculate_ip_checksum){
+				set_ip_checksum(p_uc_data, packet_size, fields->payload - p_uc_data);
+				recalculate_ip_checksum = false;
+			}
+
+			struct ofp13_action_output *act_output = act_hdr;
+			uint32_t outport = ntohl(act_output->port);
+			int in_port = (port > 0 && port <= 4) ? port : 0;	// A packet out may come from the controller rather than a port
+			if (outport < OFPP13_MAX && outport != port)
 			{
-				struct ofp13_action_header *act_hdr = (struct ofp13_action_header*)((uintptr_t)inst_actions->actions + act_size);
-				switch (htons(act_hdr->type))
-				{
-				// Output Action
-				case OFPAT13_OUTPUT:
+				TRACE("openflow_13.c: Output to port %d (%d bytes)", outport, packet_size);
+				gmac_write(p_uc_data, packet_size, 1<<(outport-1));
+			} else if (outport == OFPP13_IN_PORT && in_port != 0)
+			{
+				TRACE("openflow_13.c: Output to in_port %d (%d bytes)", port, packet_size);
+				gmac_write(p_uc_data, packet_size, 1<<(in_port-1));
+			} else if (outport == OFPP13_CONTROLLER)
+			{
+				TRACE("openflow_13.c: Output to controller (%d bytes)", packet_size);
+				if (OF_Version == 1)
 				{
-					if(recalculate_ip_checksum){
-						set_ip_checksum(p_uc_data, packet_size, fields.payload - p_uc_data);
-						recalculate_ip_checksum = false;
-					}
-
-					struct ofp13_action_output *act_output = act_hdr;
-					if (htonl(act_output->port) < OFPP13_MAX && htonl(act_output->port) != port)
-					{
-						int outport = (1<< (ntohl(act_output->port)-1));
-						TRACE("openflow_13.c: Output to port %d (%d bytes)", ntohl(act_output->port), packet_size);
-						gmac_write(p_uc_data, packet_size, outport);
-					} else if (htonl(act_output->port) == OFPP13_IN_PORT)
-					{
-						int outport = (1<< (port-1));
-						TRACE("openflow_13.c: Output to in_port %d (%d bytes)", port, packet_size);
-						gmac_write(p_uc_data, packet_size, outport);
-					} else if (htonl(act_output->port) == OFPP13_CONTROLLER)
-					{
-						int pisize = ntohs(act_output->max_len);
-						if (pisize > packet_size) pisize = packet_size;
-						TRACE("openflow_13.c: Output to controller (%d bytes)", packet_size);
-						packet_in13(p_uc_data, pisize, port, OFPR_ACTION, i);
-					} else if (htonl(act_output->port) == OFPP13_FLOOD || htonl(act_output->port) == OFPP13_ALL)
-					{
-						int outport = (15 - NativePortMatrix) - (1<<(port-1));
-						if (htonl(act_output->port) == OFPP13_FLOOD) TRACE("openflow_13.c: Output to FLOOD (%d bytes)", packet_size);
-						if (htonl(act_output->port) == OFPP13_ALL) TRACE("openflow_13.c: Output to ALL (%d bytes)", packet_size);
-						gmac_write(p_uc_data, packet_size, outport);
-					}
+					packet_in10(p_uc_data, packet_size, port, OFPR_ACTION, ntohs(act_output->max_len));
+				} else {
+					packet_in13(p_uc_data, packet_size, port, OFPR_ACTION, flow, ntohs(act_output->max_len));
 				}
-				break;
+			} else if (outport == OFPP13_FLOOD)
+			{
+				TRACE("openflow_13.c: Output to FLOOD (%d bytes)", packet_size);
+				gmac_write(p_uc_data, packet_size, flood_mask[in_port]);
+			} else if (outport == OFPP13_ALL)
+			{
+				TRACE("openflow_13.c: Output to ALL (%d bytes)", packet_size);
+				gmac_write(p_uc_data, packet_size, all_mask[in_port]);
+			} else if (outport == OFPP13_TABLE && flow < 0)
+			{
+				// Only valid in a packet out, run the packet through the flow table
+				TRACE("openflow_13.c: Output to TABLE (%d bytes)", packet_size);
+				nnOF_tablelookup(pkt, port);
+				p_uc_data = pkt->data;
+				packet_size = pkt->len;
+				packet_fields_parser(p_uc_data, fields);
+			}
+		}
+		break;
 
-				// Push a VLAN tag
-				case OFPAT13_PUSH_VLAN:
-				{
-					struct ofp13_action_push *push = (struct ofp13_action_push*)act_hdr;
-					memmove(p_uc_data+16, p_uc_data+12, packet_size-12);
-					memcpy(p_uc_data+12, &push->ethertype, 2);
-					if(fields.isVlanTag){
-						memcpy(p_uc_data+14, p_uc_data+18, 2);
-					}else{
-						bzero(p_uc_data+14, 2);
-					}
-					packet_size += 4;
-					*ul_size += 4;
-					fields.payload += 4;
-					fields.isVlanTag = true;
+		// Push a VLAN tag
+		case OFPAT13_PUSH_VLAN:
+		{
+			struct ofp13_action_push *push = (struct ofp13_action_push*)act_hdr;
+			uint16_t payload_offset = fields->payload - p_uc_data;
+			if (packet_push(pkt, 12, 4) == NULL) break;
+			p_uc_data = pkt->data;
+			packet_size = pkt->len;
+			memcpy(p_uc_data+12, &push->ethertype, 2);
+			if(fields->isVlanTag){
+				memcpy(p_uc_data+14, p_uc_data+18, 2);
+			}else{
+				bzero(p_uc_data+14, 2);
+			}
+			fields->payload = p_uc_data + payload_offset + 4;
+			fields->isVlanTag = true;
+		}
+		break;
+
+		// Pop a VLAN tag
+		case OFPAT13_POP_VLAN:
+		if(fields->isVlanTag){
+			uint16_t payload_offset = fields->payload - p_uc_data;
+			packet_pull(pkt, 12, 4);
+			p_uc_data = pkt->data;
+			packet_size = pkt->len;
+			fields->payload = p_uc_data + payload_offset - 4;
+			if(fields->payload == p_uc_data+14){
+				fields->isVlanTag = false;
+			}
+		}
+		break;
+
+		// Push an MPLS tag
+		case OFPAT13_PUSH_MPLS:
+		{
+			uint8_t mpls[4] = {0, 0, 1, 0}; // zeros with bottom stack bit ON
+			if (fields->eth_prot == htons(0x0800)){
+				struct ip_hdr *hdr = fields->payload;
+				mpls[3] = IPH_TTL(hdr);
+			} else if (fields->eth_prot == htons(0x8847) || fields->eth_prot == htons(0x8848)){
+				memcpy(mpls, fields->payload, 4);
+				mpls[2] &= 0xFE; // clear bottom stack bit
+			}
+			struct ofp13_action_push *push = (struct ofp13_action_push*)act_hdr;
+			uint16_t payload_offset = fields->payload - p_uc_data;
+			if (packet_push(pkt, payload_offset, 4) == NULL) break;
+			p_uc_data = pkt->data;
+			packet_size = pkt->len;
+			fields->payload = p_uc_data + payload_offset;
+			memcpy(fields->payload - 2, &push->ethertype, 2);
+			memcpy(fields->payload, mpls, 4);
+			fields->eth_prot = push->ethertype;
+		}
+		break;
+
+		// Pop an MPLS tag
+		case OFPAT13_POP_MPLS:
+		if(fields->eth_prot == htons(0x8847) || fields->eth_prot == htons(0x8848)){
+			struct ofp13_action_pop_mpls *pop = (struct ofp13_action_pop_mpls*)act_hdr;
+			uint16_t payload_offset = fields->payload - p_uc_data;
+			packet_pull(pkt, payload_offset, 4);
+			p_uc_data = pkt->data;
+			packet_size = pkt->len;
+			memcpy(p_uc_data + payload_offset - 2, &pop->ethertype, 2);
+			packet_fields_parser(p_uc_data, fields);
+		}
+		break;
+
+		// OpenFlow 1.0 set VLAN ID or priority, the packet is tagged first if it isn't already
+		case OFPAT13_SET_VLAN10:
+		if(!fields->isVlanTag){
+			uint16_t payload_offset = fields->payload - p_uc_data;
+			if (packet_push(pkt, 12, 4) == NULL) break;
+			p_uc_data = pkt->data;
+			packet_size = pkt->len;
+			p_uc_data[12] = 0x81;
+			p_uc_data[13] = 0x00;
+			bzero(p_uc_data+14, 2);
+			fields->payload = p_uc_data + payload_offset + 4;
+			fields->isVlanTag = true;
+		}
+		// Fall through to set the field
+
+		// Set Field Action
+		case OFPAT13_SET_FIELD:
+		{
+			struct ofp13_action_set_field *act_set_field = act_hdr;
+			struct oxm_header13 oxm_header;
+			uint8_t oxm_value[8];
+			memcpy(&oxm_header, act_set_field->field,4);
+			oxm_header.oxm_field = oxm_header.oxm_field >> 1;
+			switch(oxm_header.oxm_field)
+			{
+				// Set VLAN ID
+				case OFPXMT_OFB_VLAN_VID:
+				// SPEC: The use of a set-field action assumes that the corresponding header field exists in the packet
+				if(fields->isVlanTag){
+					memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 2);
+					p_uc_data[14] = (p_uc_data[14] & 0xf0) | (oxm_value[0] & 0x0f);
+					p_uc_data[15] = oxm_value[1];
+					memcpy(&fields->vlanid, oxm_value, 2);
+					TRACE("Set VID %u", (ntohs(fields->vlanid) - OFPVID_PRESENT));
 				}
 				break;
 
-				// Pop a VLAN tag
-				case OFPAT13_POP_VLAN:
-				if(fields.isVlanTag){
-					memmove(p_uc_data+12, p_uc_data+16, packet_size-16);
-					packet_size -= 4;
-					*ul_size -= 4;
-					fields.payload -= 4;
-					if(fields.payload == p_uc_data+14){
-						fields.isVlanTag = false;
-					}
+				case OFPXMT_OFB_VLAN_PCP:
+				if(fields->isVlanTag){
+					memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 1);
+					p_uc_data[14] = (oxm_value[0]<<5) | (p_uc_data[14] & 0x0f);
+					TRACE("Set VLAN_PCP %u", oxm_value[0]);
 				}
 				break;
 
-				// Push an MPLS tag
-				case OFPAT13_PUSH_MPLS:
-				{
-					uint8_t mpls[4] = {0, 0, 1, 0}; // zeros with bottom stack bit ON
-					if (fields.eth_prot == htons(0x0800)){
-						struct ip_hdr *hdr = fields.payload;
-						mpls[3] = IPH_TTL(hdr);
-					} else if (fields.eth_prot == htons(0x8847) || fields.eth_prot == htons(0x8848)){
-						memcpy(mpls, fields.payload, 4);
-						mpls[2] &= 0xFE; // clear bottom stack bit
-					}
-					struct ofp13_action_push *push = (struct ofp13_action_push*)act_hdr;
-					uint16_t payload_offset = fields.payload - p_uc_data;
-					memmove(fields.payload + 4, fields.payload, packet_size - payload_offset);
-					memcpy(fields.payload - 2, &push->ethertype, 2);
-					memcpy(fields.payload, mpls, 4);
-					packet_size += 4;
-					*ul_size += 4;
-					fields.eth_prot = push->ethertype;
-				}
+				// Set Source Ethernet Address
+				case OFPXMT_OFB_ETH_SRC:
+				memcpy(p_uc_data + 6, act_set_field->field + sizeof(struct oxm_header13), 6);
+				break;
+				// Set Destination Ethernet Address
+				case OFPXMT_OFB_ETH_DST:
+				memcpy(p_uc_data, act_set_field->field + sizeof(struct oxm_header13), 6);
 				break;
 
-				// Pop an MPLS tag
-				case OFPAT13_POP_MPLS:
-				if(fields.eth_prot == htons(0x8847) || fields.eth_prot == htons(0x8848)){
-					struct ofp13_action_pop_mpls *pop = (struct ofp13_action_pop_mpls*)act_hdr;
-					uint16_t payload_offset = fields.payload - p_uc_data;
-					memmove(fields.payload, fields.payload + 4, packet_size - payload_offset - 4);
-					memcpy(fields.payload - 2, &pop->ethertype, 2);
-					packet_size -= 4;
-					*ul_size -= 4;
-					packet_fields_parser(p_uc_data, &fields);
-				}
+				// Set Ether Type
+				case OFPXMT_OFB_ETH_TYPE:
+				memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 2);
+				memcpy(fields->payload-2, oxm_value, 2);
+				memcpy(&fields->eth_prot, oxm_value, 2);
 				break;
 
-				// Set Field Action
-				case OFPAT13_SET_FIELD:
+				case OFPXMT_OFB_IP_DSCP:
+				if (fields->eth_prot == htons(0x0800))
 				{
-					struct ofp13_action_set_field *act_set_field = act_hdr;
-					struct oxm_header13 oxm_header;
-					uint8_t oxm_value[8];
-					memcpy(&oxm_header, act_set_field->field,4);
-					oxm_header.oxm_field = oxm_header.oxm_field >> 1;
-					switch(oxm_header.oxm_field)
-					{
-						// Set VLAN ID
-						case OFPXMT_OFB_VLAN_VID:
-						// SPEC: The use of a set-field action assumes that the corresponding header field exists in the packet
-						if(fields.isVlanTag){
-							memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 2);
-							p_uc_data[14] = (p_uc_data[14] & 0xf0) | (oxm_value[0] & 0x0f);
-							p_uc_data[15] = oxm_value[1];
-							memcpy(&fields.vlanid, oxm_value, 2);
-							TRACE("Set VID %u", (ntohs(fields.vlanid) - OFPVID_PRESENT));
-						}
-						break;
-
-						case OFPXMT_OFB_VLAN_PCP:
-						if(fields.isVlanTag){
-							memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 1);
-							p_uc_data[14] = (oxm_value[0]<<5) | (p_uc_data[14] & 0x0f);
-							TRACE("Set VLAN_PCP %u", oxm_value[0]);
-						}
-						break;
-
-						// Set Source Ethernet Address
-						case OFPXMT_OFB_ETH_SRC:
-						memcpy(p_uc_data + 6, act_set_field->field + sizeof(struct oxm_header13), 6);
-						break;
-						// Set Destination Ethernet Address
-						case OFPXMT_OFB_ETH_DST:
-						memcpy(p_uc_data, act_set_field->field + sizeof(struct oxm_header13), 6);
-						break;
-
-						// Set Ether Type
-						case OFPXMT_OFB_ETH_TYPE:
-						memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 2);
-						memcpy(fields.payload-2, oxm_value, 2);
-						memcpy(&fields.eth_prot, oxm_value, 2);
-						break;
-
-						case OFPXMT_OFB_IP_DSCP:
-						if (fields.eth_prot == htons(0x0800))
-						{
-							memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 1);
-							struct ip_hdr *hdr = fields.payload;
-							IPH_TOS_SET(hdr, (oxm_value[0]<<2)|(IPH_TOS(hdr)&0x3));
-							recalculate_ip_checksum = true;
-							TRACE("openflow_13.c: Set IP_DSCP %u", oxm_value[0]);
-						}// TODO: IPv6
-						break;
-
-						case OFPXMT_OFB_IP_ECN:
-						if (fields.eth_prot == htons(0x0800))
-						{
-							memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 1);
-							struct ip_hdr *hdr = fields.payload;
-							IPH_TOS_SET(hdr, (oxm_value[0]&0x3)|(IPH_TOS(hdr)&0xFC));
-							recalculate_ip_checksum = true;
-							TRACE("openflow_13.c: Set IP_ECN %u", oxm_value[0]);
-						}// TODO: IPv6
-						break;
-
-						// Set IP protocol
-						case OFPXMT_OFB_IP_PROTO:
-						if (fields.eth_prot == htons(0x0800))	// IPv4 packet
-						{
-							memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 2);
-							memcpy(fields.payload + 9, oxm_value, 2);
-							memcpy(&fields.ip_prot, oxm_value, 2);
-							recalculate_ip_checksum = true;
-						}
-						// TODO: or IPv6
-						break;
+					memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 1);
+					struct ip_hdr *hdr = fields->payload;
+					IPH_TOS_SET(hdr, (oxm_value[0]<<2)|(IPH_TOS(hdr)&0x3));
+					recalculate_ip_checksum = true;
+					TRACE("openflow_13.c: Set IP_DSCP %u", oxm_value[0]);
+				}// TODO: IPv6
+				break;
 
-						// Set Source IP Address
-						case OFPXMT_OFB_IPV4_SRC:
-						if (fields.eth_prot == htons(0x0800))	// Only set the field if it is an IPv4 packet
-						{
-							memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 4);
-							memcpy(fields.payload + 12, oxm_value, 4);
-							memcpy(&fields.ip_src, oxm_value, 4);
-							recalculate_ip_checksum = true;
-						}
-						break;
+				case OFPXMT_OFB_IP_ECN:
+				if (fields->eth_prot == htons(0x0800))
+				{
+					memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 1);
+					struct ip_hdr *hdr = fields->payload;
+					IPH_TOS_SET(hdr, (oxm_value[0]&0x3)|(IPH_TOS(hdr)&0xFC));
+					recalculate_ip_checksum = true;
+					TRACE("openflow_13.c: Set IP_ECN %u", oxm_value[0]);
+				}// TODO: IPv6
+				break;
 
-						// Set Destination IP Address
-						case OFPXMT_OFB_IPV4_DST:
-						if (fields.eth_prot == htons(0x0800))	// Only set the field if it is an IPv4 packet
-						{
-							memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 4);
-							memcpy(fields.payload + 16, act_set_field->field + sizeof(struct oxm_header13), 4);
-							memcpy(&fields.ip_dst, act_set_field->field + sizeof(struct oxm_header13), 4);
-							recalculate_ip_checksum = true;
-						}
-						break;
+				// Set IP protocol
+				case OFPXMT_OFB_IP_PROTO:
+				if (fields->eth_prot == htons(0x0800))	// IPv4 packet
+				{
+					memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 1);
+					memcpy(fields->payload + 9, oxm_value, 1);
+					fields->ip_prot = oxm_value[0];
+					recalculate_ip_checksum = true;
+				}
+				// TODO: or IPv6
+				break;
 
-						// Set Source TCP port
-						case OFPXMT_OFB_TCP_SRC:
-						if (fields.eth_prot == htons(0x0800) && fields.ip_prot == IP_PROTO_TCP)	// Only set the field if it is an IPv4 TCP packet
-						{
-							memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 2);
-							memcpy(fields.payload + 20, oxm_value, 2);
-							memcpy(&fields.tp_src, oxm_value, 2);
-							recalculate_ip_checksum = true;
-						}
-						break;
+				// Set Source IP Address
+				case OFPXMT_OFB_IPV4_SRC:
+				if (fields->eth_prot == htons(0x0800))	// Only set the field if it is an IPv4 packet
+				{
+					memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 4);
+					memcpy(fields->payload + 12, oxm_value, 4);
+					memcpy(&fields->ip_src, oxm_value, 4);
+					recalculate_ip_checksum = true;
+				}
+				break;
 
-						// Set Destination TCP port
-						case OFPXMT_OFB_TCP_DST:
-						if (fields.eth_prot == htons(0x0800) && fields.ip_prot == IP_PROTO_TCP)	// Only set the field if it is an IPv4 TCP packet
-						{
-							memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 2);
-							memcpy(fields.payload + 22, oxm_value, 2);
-							memcpy(&fields.tp_dst, oxm_value, 2);
-							recalculate_ip_checksum = true;
-						}
-						break;
+				// Set Destination IP Address
+				case OFPXMT_OFB_IPV4_DST:
+				if (fields->eth_prot == htons(0x0800))	// Only set the field if it is an IPv4 packet
+				{
+					memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 4);
+					memcpy(fields->payload + 16, act_set_field->field + sizeof(struct oxm_header13), 4);
+					memcpy(&fields->ip_dst, act_set_field->field + sizeof(struct oxm_header13), 4);
+					recalculate_ip_checksum = true;
+				}
+				break;
 
-						// Set Source UDP port
-						case OFPXMT_OFB_UDP_SRC:
-						if (fields.eth_prot == htons(0x0800) && fields.ip_prot == IP_PROTO_UDP)	// Only set the field if it is an IPv4 UDP packet
-						{
-							memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 2);
-							memcpy(fields.payload + 20, oxm_value, 2);
-							memcpy(&fields.tp_src, oxm_value, 2);
-							recalculate_ip_checksum = true;
-						}
-						break;
+				// Set Source TCP port
+				case OFPXMT_OFB_TCP_SRC:
+				if (fields->eth_prot == htons(0x0800) && fields->ip_prot == IP_PROTO_TCP)	// Only set the field if it is an IPv4 TCP packet
+				{
+					memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 2);
+					memcpy(fields->payload + 20, oxm_value, 2);
+					memcpy(&fields->tp_src, oxm_value, 2);
+					recalculate_ip_checksum = true;
+				}
+				break;
 
-						// Set Destination UDP port
-						case OFPXMT_OFB_UDP_DST:
-						if (fields.eth_prot == htons(0x0800) && fields.ip_prot == IP_PROTO_UDP)	// Only set the field if it is an IPv4 UDP packet
-						{
-							memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 2);
-							memcpy(fields.payload + 22, oxm_value, 2);
-							memcpy(&fields.tp_dst, oxm_value, 2);
-							recalculate_ip_checksum = true;
-						}
-						break;
+				// Set Destination TCP port
+				case OFPXMT_OFB_TCP_DST:
+				if (fields->eth_prot == htons(0x0800) && fields->ip_prot == IP_PROTO_TCP)	// Only set the field if it is an IPv4 TCP packet
+				{
+					memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 2);
+					memcpy(fields->payload + 22, oxm_value, 2);
+					memcpy(&fields->tp_dst, oxm_value, 2);
+					recalculate_ip_checksum = true;
+				}
+				break;
 
-						// Set ICMP type
-						case OFPXMT_OFB_ICMPV4_TYPE:
-						if (fields.eth_prot == htons(0x0800) && fields.ip_prot == IP_PROTO_ICMP)	// Only set the field if it is an ICMP packet
-						{
-							struct ip_hdr *iphdr = fields.payload;
-							uint8_t *icmp = fields.payload + IPH_HL(iphdr) * 4;
-							memcpy(icmp, act_set_field->field + sizeof(struct oxm_header13), 1);
-							recalculate_ip_checksum = true;
-						}
-						break;
+				// Set Source UDP port
+				case OFPXMT_OFB_UDP_SRC:
+				if (fields->eth_prot == htons(0x0800) && fields->ip_prot == IP_PROTO_UDP)	// Only set the field if it is an IPv4 UDP packet
+				{
+					memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 2);
+					memcpy(fields->payload + 20, oxm_value, 2);
+					memcpy(&fields->tp_src, oxm_value, 2);
+					recalculate_ip_checksum = true;
+				}
+				break;
 
-						// Set ICMP code
-						case OFPXMT_OFB_ICMPV4_CODE:
-						if (fields.eth_prot == htons(0x0800) && fields.ip_prot == IP_PROTO_ICMP)	// Only set the field if it is an ICMP packet
-						{
-							struct ip_hdr *iphdr = fields.payload;
-							uint8_t *icmp = fields.payload + IPH_HL(iphdr) * 4;
-							memcpy(icmp+1, act_set_field->field + sizeof(struct oxm_header13), 1);
-							recalculate_ip_checksum = true;
-						}
-						break;
+				// Set Destination UDP port
+				case OFPXMT_OFB_UDP_DST:
+				if (fields->eth_prot == htons(0x0800) && fields->ip_prot == IP_PROTO_UDP)	// Only set the field if it is an IPv4 UDP packet
+				{
+					memcpy(oxm_value, act_set_field->field + sizeof(struct oxm_header13), 2);
+					memcpy(fields->payload + 22, oxm_value, 2);
+					memcpy(&fields->tp_dst, oxm_value, 2);
+					recalculate_ip_checksum = true;
+				}
+				break;
 
-						// Set ARP opcode
-						case OFPXMT_OFB_ARP_OP:
-						if (fields.eth_prot == htons(0x0806))	// Only set the field if it is a ARP packet
-						{
-							memcpy(fields.payload + 6, act_set_field->field + sizeof(struct oxm_header13), 2);
-						}
-						break;
+				// Set ICMP type
+				case OFPXMT_OFB_ICMPV4_TYPE:
+				if (fields->eth_prot == htons(0x0800) && fields->ip_prot == IP_PROTO_ICMP)	// Only set the field if it is an ICMP packet
+				{
+					struct ip_hdr *iphdr = fields->payload;
+					uint8_t *icmp = fields->payload + IPH_HL(iphdr) * 4;
+					memcpy(icmp, act_set_field->field + sizeof(struct oxm_header13), 1);
+					recalculate_ip_checksum = true;
+				}
+				break;
 
-						// Set ARP source IP address
-						case OFPXMT_OFB_ARP_SPA:
-						if (fields.eth_prot == htons(0x0806))	// Only set the field if it is an ARP packet
-						{
-							memcpy(fields.payload + 14, act_set_field->field + sizeof(struct oxm_header13), 4);
-						}
-						break;
+				// Set ICMP code
+				case OFPXMT_OFB_ICMPV4_CODE:
+				if (fields->eth_prot == htons(0x0800) && fields->ip_prot == IP_PROTO_ICMP)	// Only set the field if it is an ICMP packet
+				{
+					struct ip_hdr *iphdr = fields->payload;
+					uint8_t *icmp = fields->payload + IPH_HL(iphdr) * 4;
+					memcpy(icmp+1, act_set_field->field + sizeof(struct oxm_header13), 1);
+					recalculate_ip_checksum = true;
+				}
+				break;
 
-						// Set ARP target IP address
-						case OFPXMT_OFB_ARP_TPA:
-						if (fields.eth_prot == htons(0x0806))	// Only set the field if it is an ARP packet
-						{
-							memcpy(fields.payload + 24, act_set_field->field + sizeof(struct oxm_header13), 4);
-						}
-						break;
+				// Set ARP opcode
+				case OFPXMT_OFB_ARP_OP:
+				if (fields->eth_prot == htons(0x0806))	// Only set the field if it is a ARP packet
+				{
+					memcpy(fields->payload + 6, act_set_field->field + sizeof(struct oxm_header13), 2);
+				}
+				break;
 
-						// Set ARP source hardware address
-						case OFPXMT_OFB_ARP_SHA:
-						if (fields.eth_prot == htons(0x0806))	// Only set the field if it is an ARP packet
-						{
-							memcpy(fields.payload + 8, act_set_field->field + sizeof(struct oxm_header13), 6);
-						}
-						break;
+				// Set ARP source IP address
+				case OFPXMT_OFB_ARP_SPA:
+				if (fields->eth_prot == htons(0x0806))	// Only set the field if it is an ARP packet
+				{
+					memcpy(fields->payload + 14, act_set_field->field + sizeof(struct oxm_header13), 4);
+				}
+				break;
 
-						// Set ARP target hardware address
-						case OFPXMT_OFB_ARP_THA:
-						if (fields.eth_prot == htons(0x0806))	// Only set the field if it is an ARP packet
-						{
-							memcpy(fields.payload + 18, act_set_field->field + sizeof(struct oxm_header13), 6);
-						}
-						break;
-					}
+				// Set ARP target IP address
+				case OFPXMT_OFB_ARP_TPA:
+				if (fields->eth_prot == htons(0x0806))	// Only set the field if it is an ARP packet
+				{
+					memcpy(fields->payload + 24, act_set_field->field + sizeof(struct oxm_header13), 4);
 				}
+				break;
+
+				// Set ARP source hardware address
+				case OFPXMT_OFB_ARP_SHA:
+				if (fields->eth_prot == htons(0x0806))	// Only set the field if it is an ARP packet
+				{
+					memcpy(fields->payload + 8, act_set_field->field + sizeof(struct oxm_header13), 6);
 				}
-				act_size += htons(act_hdr->len);
-			}
+				break;
 
-			if (recalculate_ip_checksum) {
-				set_ip_checksum(p_uc_data, packet_size, fields.payload + 14);
-			}
-		}
-			
-		if(insts[OFPIT13_GOTO_TABLE] != NULL)
-		{
-			struct ofp13_instruction_goto_table *inst_goto_ptr = insts[OFPIT13_GOTO_TABLE];
-			if (table_id >= inst_goto_ptr->table_id) {
-				TRACE("openflow_13.c: Goto loop detected, aborting (cannot goto to earlier/same table)");
-				return;
+				// Set ARP target hardware address
+				case OFPXMT_OFB_ARP_THA:
+				if (fields->eth_prot == htons(0x0806))	// Only set the field if it is an ARP packet
+				{
+					memcpy(fields->payload + 18, act_set_field->field + sizeof(struct oxm_header13), 6);
+				}
+				break;
 			}
-			table_id = inst_goto_ptr->table_id;
-			TRACE("openflow_13.c: Goto table %d", table_id);
 		}
-		else
-		{
-			return;
 		}
+		act_size += htons(act_hdr->len);
+	}
+
+	if (recalculate_ip_checksum) {
+		set_ip_checksum(p_uc_data, packet_size, fields->payload - p_uc_data);
 	}
 	return;
 }
 
-void of13_message(struct ofp_header *ofph, int size, int len)
+void of13_message(struct ofp_header *ofph)
 {
 	struct ofp13_multipart_request *multi_req;
 	TRACE("openflow_13.c: %u: OpenFlow message received type = %d", htonl(ofph->xid), ofph->type);
+	// A slave controller can only read the state of the switch
+	if (of_ctrl->role == OFPCR_ROLE_SLAVE)
+	{
+		switch(ofph->type)
+		{
+			case OFPT13_FLOW_MOD:
+			case OFPT13_GROUP_MOD:
+			case OFPT13_METER_MOD:
+			case OFPT13_PORT_MOD:
+			case OFPT13_TABLE_MOD:
+			case OFPT13_PACKET_OUT:
+			of_error13(ofph, OFPET13_BAD_REQUEST, OFPBRC13_IS_SLAVE);
+			return;
+		}
+	}
+
 	switch(ofph->type)
 	{
 		case OFPT13_FEATURES_REQUEST:
-		rcv_freq = true;
+		of_ctrl->rcv_freq = true;
 		features_reply13(ofph->xid);
 		break;
 
@@ -498,6 +609,14 @@ void of13_message(struct ofp_header *ofph, int size, int len)
 		role_reply13(ofph);
 		break;
 
+		case OFPT13_SET_ASYNC:
+		set_async13(ofph);
+		break;
+
+		case OFPT13_GET_ASYNC_REQUEST:
+		get_async_reply13(ofph);
+		break;
+
 		case OFPT13_FLOW_MOD:
 		flow_mod13(ofph);
 		break;
@@ -506,6 +625,14 @@ void of13_message(struct ofp_header *ofph, int size, int len)
 		of_error13(ofph, OFPET13_BAD_REQUEST, OFPBRC13_BAD_TYPE);
 		break;
 
+		case OFPT13_METER_MOD:
+		meter_mod13(ofph);
+		break;
+
+		case OFPT13_PORT_MOD:
+		port_mod13(ofph);
+		break;
+
 
 		case OFPT13_MULTIPART_REQUEST:
 		multi_req  = (struct ofp13_multipart_request *) ofph;
@@ -547,6 +674,21 @@ void of13_message(struct ofp_header *ofph, int size, int len)
 			multi_pos += multi_table_reply13(&shared_buffer[multi_pos], multi_req);
 		}
 
+		if ( ntohs(multi_req->type) == OFPMP13_METER )
+		{
+			multi_pos += multi_meter_stats_reply13(&shared_buffer[multi_pos], multi_req);
+		}
+
+		if ( ntohs(multi_req->type) == OFPMP13_METER_CONFIG )
+		{
+			multi_pos += multi_meter_config_reply13(&shared_buffer[multi_pos], multi_req);
+		}
+
+		if ( ntohs(multi_req->type) == OFPMP13_METER_FEATURES )
+		{
+			multi_pos += multi_meter_features_reply13(&shared_buffer[multi_pos], multi_req);
+		}
+
 		break;
 
 		case OFPT10_PACKET_OUT:
@@ -554,14 +696,12 @@ void of13_message(struct ofp_header *ofph, int size, int len)
 		break;
 
 		case OFPT13_BARRIER_REQUEST:
+		// Multipart replies to the requests before the barrier go first
+		if (multi_pos != 0) sendtcp(&shared_buffer, multi_pos);
+		multi_pos = 0;
 		barrier13_reply(ofph->xid);
 		break;
 	};
-
-	if (size == len && multi_pos !=0)
-	{
-		sendtcp(&shared_buffer, multi_pos);
-	}
 	return;
 }
 
@@ -588,7 +728,7 @@ void features_reply13(uint32_t xid)
 	features.header.xid = xid;
 	memcpy(&datapathid, &Zodiac_Config.MAC_address, 6);
 	features.datapath_id = datapathid << 16;
-	features.n_buffers = htonl(0);		// Number of packets that can be buffered
+	features.n_buffers = htonl(MAX_BUFFERS);		// Number of packets that can be buffered
 	features.n_tables = MAX_TABLES;		// Number of flow tables
 	features.capabilities = htonl(OFPC13_FLOW_STATS + OFPC13_TABLE_STATS + OFPC13_PORT_STATS);	// Switch Capabilities
 	features.auxiliary_id = 0;	// Primary connection
@@ -626,13 +766,17 @@ void config_reply13(uint32_t xid)
 	cfg_reply.header.xid = xid;
 	cfg_reply.header.length = HTONS(sizeof(cfg_reply));
 	cfg_reply.flags = OFPC13_FRAG_NORMAL;
-	cfg_reply.miss_send_len = htons(256);	// Only sending the first 256 bytes
+	cfg_reply.miss_send_len = Switch_config.miss_send_len;
 	sendtcp(&cfg_reply, sizeof(cfg_reply));
 	return;
 }
 
 /*
-*	OpenFlow SET CONFIG message function
+*	OpenFlow ROLE Reply message function
+*
+*	Requests to become master or slave carry a generation_id, one older
+*	than the last seen is stale and refused. When a controller becomes
+*	master any other master is made a slave.
 *
 *	@param *msg - pointer to the OpenFlow message.
 *
@@ -640,62 +784,208 @@ void config_reply13(uint32_t xid)
 void role_reply13(struct ofp_header *msg)
 {
 	struct ofp13_role_request role_request;
+	uint32_t role;
+	uint64_t generation_id;
+
+	if (ntohs(msg->length) != sizeof(struct ofp13_role_request))
+	{
+		of_error13(msg, OFPET13_BAD_REQUEST, OFPBRC13_BAD_LEN);
+		return;
+	}
 	memcpy(&role_request, msg, sizeof(struct ofp13_role_request));
+	role = ntohl(role_request.role);
+	generation_id = htonll(role_request.generation_id);
+	if (role > OFPCR_ROLE_SLAVE)
+	{
+		of_error13(msg, OFPET13_ROLE_REQUEST_FAILED, OFPRRFC13_BAD_ROLE);
+		return;
+	}
+
+	if (role == OFPCR_ROLE_MASTER || role == OFPCR_ROLE_SLAVE)
+	{
+		// Compared as a signed difference so the generation can wrap
+		if (role_generation_set == true && (int64_t)(generation_id - role_generation) < 0)
+		{
+			TRACE("openflow_13.c: Stale role request, generation %" PRIu64, generation_id);
+			of_error13(msg, OFPET13_ROLE_REQUEST_FAILED, OFPRRFC13_STALE);
+			return;
+		}
+		role_generation = generation_id;
+		role_generation_set = true;
+	}
+
+	if (role == OFPCR_ROLE_MASTER)
+	{
+		for (int i=0;i<MAX_CONTROLLERS;i++)
+		{
+			if (&controllers[i] != of_ctrl && controllers[i].role == OFPCR_ROLE_MASTER) controllers[i].role = OFPCR_ROLE_SLAVE;
+		}
+	}
+	if (role != OFPCR_ROLE_NOCHANGE) of_ctrl->role = role;
+	TRACE("openflow_13.c: Controller %d role is now %d", (int)(of_ctrl - controllers) + 1, of_ctrl->role);
+
 	role_request.header.type = OFPT13_ROLE_REPLY;
-	role_request.generation_id = 0;
-	role_request.role = htonl(OFPCR_ROLE_MASTER);
+	role_request.role = htonl(of_ctrl->role);
+	role_request.generation_id = htonll(role_generation);
 	sendtcp(&role_request, sizeof(struct ofp13_role_request));
 	return;
 }
 
 /*
-*	OpenFlow Multi-part DESCRIPTION reply message function
-*
-*	@param *msg - pointer to the OpenFlow message.
+*	Forget the last generation_id once no controller is connected
 *
 */
-int multi_desc_reply13(uint8_t *buffer, struct ofp13_multipart_request *msg)
+void role_clear13(void)
 {
-	const struct ofp13_desc zodiac_desc = {
-		.mfr_desc = "Northbound Networks",
-		.hw_desc  = "Zodiac-FX Rev.A",
-		.sw_desc  = VERSION,
-		.serial_num= "none",
-		.dp_desc  = "World's smallest OpenFlow switch!"
-	};
-	struct ofp13_multipart_reply *reply;
-	uint16_t len = sizeof(struct ofp13_multipart_reply) + sizeof(struct ofp13_desc);
-	reply = (struct ofp13_multipart_reply *) buffer;
-	reply->header.version = OF_Version;
-	reply->header.type = OFPT13_MULTIPART_REPLY;
-	reply->header.length = htons(len);
-	reply->header.xid = msg->header.xid;
-	reply->flags = 0;
-	reply->type = htons(OFPMP13_DESC);
-	memcpy(reply->body, &zodiac_desc, sizeof(zodiac_desc));
-	return len;
+	role_generation = 0;
+	role_generation_set = false;
+	return;
 }
 
 /*
-*	OpenFlow Multi-part FLOW reply message function
+*	Set the asynchronous messages to their defaults for a new connection
 *
-*	@param *msg - pointer to the OpenFlow message.
+*	A master or equal controller gets table miss and action packet-ins,
+*	every flow removed and every port status. A slave only gets port status.
 *
 */
-int multi_flow_reply13(uint8_t *buffer, struct ofp13_multipart_request *msg)
+void async_reset13(void)
+{
+	struct ofp13_async_config *async = &of_ctrl->async;
+	of_ctrl->role = OFPCR_ROLE_EQUAL;
+	async->packet_in_mask[0] = htonl((1 << OFPR13_NO_MATCH) | (1 << OFPR13_ACTION));
+	async->packet_in_mask[1] = 0;
+	async->port_status_mask[0] = htonl((1 << OFPPR13_ADD) | (1 << OFPPR13_DELETE) | (1 << OFPPR13_MODIFY));
+	async->port_status_mask[1] = async->port_status_mask[0];
+	async->flow_removed_mask[0] = htonl((1 << OFPRR13_IDLE_TIMEOUT) | (1 << OFPRR13_HARD_TIMEOUT) | (1 << OFPRR13_DELETE) | (1 << OFPRR13_GROUP_DELETE));
+	async->flow_removed_mask[1] = 0;
+	return;
+}
+
+/*
+*	Check whether a controller wants an asynchronous message
+*
+*	@param *ctrl - pointer to the controller.
+*	@param type - OFPT13_PACKET_IN, OFPT13_FLOW_REMOVED or OFPT13_PORT_STATUS.
+*	@param reason - reason code of the message.
+*
+*	Returns true if the message should be sent.
+*/
+bool async_wanted13(struct of_controller *ctrl, uint8_t type, uint8_t reason)
+{
+	int r = (ctrl->role == OFPCR_ROLE_SLAVE) ? 1 : 0;
+	uint32_t mask = 0;
+
+	if (reason > 31) return false;
+	if (type == OFPT13_PACKET_IN) mask = ntohl(ctrl->async.packet_in_mask[r]);
+	if (type == OFPT13_FLOW_REMOVED) mask = ntohl(ctrl->async.flow_removed_mask[r]);
+	if (type == OFPT13_PORT_STATUS) mask = ntohl(ctrl->async.port_status_mask[r]);
+	return (mask & (1 << reason)) != 0;
+}
+
+/*
+*	OpenFlow SET_ASYNC message function
+*
+*	@param *msg - pointer to the OpenFlow message.
+*
+*/
+void set_async13(struct ofp_header *msg)
+{
+	if (ntohs(msg->length) != sizeof(struct ofp13_async_config))
+	{
+		of_error13(msg, OFPET13_BAD_REQUEST, OFPBRC13_BAD_LEN);
+		return;
+	}
+	struct ofp13_async_config *async = (struct ofp13_async_config *)msg;
+	memcpy(of_ctrl->async.packet_in_mask, async->packet_in_mask, sizeof(struct ofp13_async_config) - sizeof(struct ofp_header));
+	TRACE("openflow_13.c: Async config set, packet in 0x%x, flow removed 0x%x", ntohl(of_ctrl->async.packet_in_mask[0]), ntohl(of_ctrl->async.flow_removed_mask[0]));
+	return;
+}
+
+/*
+*	OpenFlow GET_ASYNC Reply message function
+*
+*	@param *msg - pointer to the OpenFlow message.
+*
+*/
+void get_async_reply13(struct ofp_header *msg)
 {
-	char statsbuffer[2048];
+	struct ofp13_async_config async_reply;
+	memcpy(&async_reply, &of_ctrl->async, sizeof(struct ofp13_async_config));
+	async_reply.header.version = OF_Version;
+	async_reply.header.type = OFPT13_GET_ASYNC_REPLY;
+	async_reply.header.length = htons(sizeof(struct ofp13_async_config));
+	async_reply.header.xid = msg->xid;
+	sendtcp(&async_reply, sizeof(struct ofp13_async_config));
+	return;
+}
+
+/*
+*	OpenFlow Multi-part DESCRIPTION reply message function
+*
+*	@param *msg - pointer to the OpenFlow message.
+*
+*/
+int multi_desc_reply13(uint8_t *buffer, struct ofp13_multipart_request *msg)
+{
+	const struct ofp13_desc zodiac_desc = {
+		.mfr_desc = "Northbound Networks",
+		.hw_desc  = "Zodiac-FX Rev.A",
+		.sw_desc  = VERSION,
+		.serial_num= "none",
+		.dp_desc  = "World's smallest OpenFlow switch!"
+	};
 	struct ofp13_multipart_reply *reply;
+	uint16_t len = sizeof(struct ofp13_multipart_reply) + sizeof(struct ofp13_desc);
 	reply = (struct ofp13_multipart_reply *) buffer;
 	reply->header.version = OF_Version;
 	reply->header.type = OFPT13_MULTIPART_REPLY;
+	reply->header.length = htons(len);
 	reply->header.xid = msg->header.xid;
 	reply->flags = 0;
-	reply->type = htons(OFPMP13_FLOW);
-	int len = flow_stats_msg13(&statsbuffer, 0, iLastFlow);
-	memcpy(reply->body, &statsbuffer, len);
-	len += 	sizeof(struct ofp13_multipart_reply);
+	reply->type = htons(OFPMP13_DESC);
+	memcpy(reply->body, &zodiac_desc, sizeof(zodiac_desc));
+	return len;
+}
+
+/*
+*	OpenFlow Multi-part FLOW reply message function
+*
+*	The flows are sent in parts by flow_stats_send() once the other
+*	replies to this receive have gone, so nothing is added to the buffer.
+*
+*	@param *msg - pointer to the OpenFlow message.
+*
+*/
+int multi_flow_reply13(uint8_t *buffer, struct ofp13_multipart_request *msg)
+{
+	if (flow_stats_start(msg->header.xid) == false)
+	{
+		of_error13(&msg->header, OFPET13_BAD_REQUEST, OFPBRC13_MULTIPART_BUFFER_OVERFLOW);
+	}
+	return 0;
+}
+
+/*
+*	Build the next part of a Multi-part FLOW reply
+*
+*	@param *buffer - pointer to the buffer to build the reply in.
+*	@param xid - transaction ID of the request.
+*	@param *next - first flow to include, moved on past the flows included.
+*
+*	Returns the length of the reply.
+*/
+int multi_flow_part13(uint8_t *buffer, uint32_t xid, int *next)
+{
+	struct ofp13_multipart_reply *reply = (struct ofp13_multipart_reply *)buffer;
+	int len = sizeof(struct ofp13_multipart_reply);
+	len += flow_stats_msg13(reply->body, STATS_PART_LEN - len, next);
+	reply->header.version = OF_Version;
+	reply->header.type = OFPT13_MULTIPART_REPLY;
 	reply->header.length = htons(len);
+	reply->header.xid = xid;
+	reply->type = htons(OFPMP13_FLOW);
+	reply->flags = (*next < iLastFlow) ? htons(OFPMPF13_REPLY_MORE) : 0;
 	return len;
 }
 
@@ -729,7 +1019,7 @@ int multi_aggregate_reply13(uint8_t *buffer, struct ofp13_multipart_request *msg
 	reply->type = htons(OFPMP13_AGGREGATE);
 	aggregate_reply.packet_count = htonll(total_packets);
 	aggregate_reply.byte_count = htonll(total_bytes);
-	aggregate_reply.flow_count = htonl(iLastFlow);
+	aggregate_reply.flow_count = htonl(flow_count);
 	memcpy(reply->body, &aggregate_reply, sizeof(aggregate_reply));
 	reply->header.length = htons(len);
 	return len;
@@ -769,18 +1059,14 @@ int multi_portdesc_reply13(uint8_t *buffer, struct ofp13_multipart_request *msg)
 		if(Zodiac_Config.of_port[l] == 1)
 		{
 			phys_port[j].port_no = htonl(l+1);
-			for(int k = 0; k<6; k++)            // Generate random MAC address
-			{
-				int r = rand() % 255;
-				memset(mac + k,r,1);
-			}
+			port_hw_addr(l, mac);
 			memcpy(&phys_port[j].hw_addr, mac, sizeof(mac));
 			memset(phys_port[j].name, 0, OFP13_MAX_PORT_NAME_LEN);	// Zero out the name string
 			sprintf(portname, "eth%d",l);
 			strcpy(phys_port[j].name, portname);
-			phys_port[j].config = 0;
-			if (port_status[j] == 1) phys_port[j].state = htonl(OFPPS13_LIVE);
-			if (port_status[j] == 0) phys_port[j].state = htonl(OFPPS13_LINK_DOWN);
+			phys_port[j].config = htonl(port_config[l]);
+			if (port_status[l] == 1) phys_port[j].state = htonl(OFPPS13_LIVE);
+			if (port_status[l] == 0) phys_port[j].state = htonl(OFPPS13_LINK_DOWN);
 			phys_port[j].curr = htonl(OFPPF13_100MB_FD + OFPPF13_COPPER);
 			phys_port[j].advertised = 0;
 			phys_port[j].supported = 0;
@@ -862,7 +1148,7 @@ int multi_tablefeat_reply13(uint8_t *buffer, struct ofp13_multipart_request *msg
 	tbl_feats.metadata_match = 0;
 	tbl_feats.metadata_write = 0;
 	tbl_feats.config = 0;
-	tbl_feats.max_entries = htonl(MAX_FLOWS_13);
+	tbl_feats.max_entries = htonl(flow_count + flow_table_free());
 	int len = sizeof(struct ofp13_multipart_reply) + sizeof(struct ofp13_table_features) + prop_size;
 	reply->header.length = htons(len);
 	tbl_feats.length = htons(sizeof(struct ofp13_table_features) + prop_size);
@@ -1039,11 +1325,11 @@ void flow_mod13(struct ofp_header *msg)
 		break;
 
 		case OFPFC_MODIFY:
-		//flow_modify13(msg);
+		flow_modify13(msg, false);
 		break;
 
 		case OFPFC_MODIFY_STRICT:
-		//flow_modify_strict13(msg);
+		flow_modify13(msg, true);
 		break;
 
 		case OFPFC13_DELETE:
@@ -1057,6 +1343,70 @@ void flow_mod13(struct ofp_header *msg)
 	return;
 }
 
+/*
+*	Build an OpenFlow FLOW_MOD ADD message that recreates a flow
+*
+*	@param *buffer - pointer to the buffer to build the message in.
+*	@param flowid - flow number.
+*	@param buf_len - size of the buffer.
+*
+*	Returns the length of the message, or 0 if it doesn't fit.
+*/
+int flow_mod_msg13(uint8_t *buffer, int flowid, int buf_len)
+{
+	struct flow_entry13 *entry = flow_match13[flowid];
+	struct ofp13_flow_mod *fm = (struct ofp13_flow_mod *)buffer;
+	int match_len = ntohs(entry->match.length);
+	int mod_size = ALIGN8(offsetof(struct ofp13_flow_mod, match) + match_len);
+	int len = mod_size + entry->inst->len;
+
+	if (len > buf_len) return 0;
+	memset(buffer, 0, mod_size);
+	fm->header.version = 0x04;
+	fm->header.type = OFPT13_FLOW_MOD;
+	fm->header.length = htons(len);
+	fm->header.xid = 0;
+	fm->cookie = entry->cookie;
+	fm->table_id = entry->table_id;
+	fm->command = OFPFC13_ADD;
+	fm->idle_timeout = entry->idle_timeout;
+	fm->hard_timeout = entry->hard_timeout;
+	fm->priority = entry->priority;
+	fm->buffer_id = htonl(OFP_NO_BUFFER);
+	fm->out_port = htonl(OFPP13_ANY);
+	fm->out_group = htonl(OFPG13_ANY);
+	fm->flags = entry->flags;
+	memcpy(&fm->match, &entry->match, match_len);
+	memcpy(buffer + mod_size, entry->inst->data, entry->inst->len);
+	return len;
+}
+
+/*
+*	Make sure the meter referenced by a meter instruction exists
+*
+*	An UNKNOWN_METER error is sent if it doesn't.
+*
+*	@param *msg - pointer to the OpenFlow message.
+*
+*/
+static bool flow_meters_exist13(struct ofp_header *msg)
+{
+	struct ofp13_flow_mod *ptr_fm = (struct ofp13_flow_mod *) msg;
+	int inst_offset = ALIGN8(offsetof(struct ofp13_flow_mod, match) + ntohs(ptr_fm->match.length));
+	while (inst_offset < ntohs(ptr_fm->header.length))
+	{
+		struct ofp13_instruction *inst_ptr = (struct ofp13_instruction *)((uint8_t *)ptr_fm + inst_offset);
+		if (ntohs(inst_ptr->len) == 0) break;
+		if (ntohs(inst_ptr->type) == OFPIT13_METER && meter_lookup13(ntohl(((struct ofp13_instruction_meter *)inst_ptr)->meter_id)) == NULL)
+		{
+			of_error13(msg, OFPET13_METER_MOD_FAILED, OFPMMFC13_UNKNOWN_METER);
+			return false;
+		}
+		inst_offset += ntohs(inst_ptr->len);
+	}
+	return true;
+}
+
 /*
 *	OpenFlow FLOW_ADD function
 *
@@ -1066,8 +1416,9 @@ void flow_mod13(struct ofp_header *msg)
 void flow_add13(struct ofp_header *msg)
 {
 	// Return an error if tables are full
-	if (iLastFlow > (MAX_FLOWS_13-1))
+	if (flow_count >= max_flows)
 	{
+		TRACE("openflow_13.c: Flow table full (%d flows)", flow_count);
 		of_error13(msg, OFPET13_FLOW_MOD_FAILED, OFPFMFC13_TABLE_FULL);
 		return;
 	}
@@ -1080,172 +1431,189 @@ void flow_add13(struct ofp_header *msg)
 		return;
 	}
 
-	// Check for an existing flow the same
+	if (flow_meters_exist13(msg) == false) return;
+
+	// Check for an overlapping flow in the same table with the same priority
+	if ((ntohs(ptr_fm->flags) & OFPFF13_CHECK_OVERLAP) && flow_overlap13(ptr_fm))
+	{
+		of_error13(msg, OFPET13_FLOW_MOD_FAILED, OFPFMFC13_OVERLAP);
+		return;
+	}
+
+	// Replace an existing flow that is the same
 	struct flows_counter flow_count_old;
-	for(int q=0;q<iLastFlow;q++)
+	bool keep_counters = false;
+	int q = flow_find13(ptr_fm->table_id, ptr_fm->priority, &ptr_fm->match);
+	if (q >= 0)
 	{
-		if(ofp13_oxm_match[q] == NULL)
+		// Check if we need to reset the counters
+		if (!(ntohs(ptr_fm->flags) & OFPFF13_RESET_COUNTS))
 		{
-			if((memcmp(flow_match13[q]->match.oxm_fields, ptr_fm->match.oxm_fields, 4) == 0) && (flow_match13[q]->priority == ptr_fm->priority) && (flow_match13[q]->table_id == ptr_fm->table_id))
-			{
-				// Check for overlap flag
-				if (ptr_fm->flags &  OFPFF13_CHECK_OVERLAP)
-				{
-					of_error13(msg, OFPET13_FLOW_MOD_FAILED, OFPFMFC13_OVERLAP);
-					return;
-				}
-				// Check if we need to reset the counters
-				if (ptr_fm->flags &  OFPFF13_RESET_COUNTS)
-				{
-					remove_flow13(q);	// remove the matching flow
-				} else
-				{
-					TRACE("openflow_13.c: Replacing flow %d", q);
-					memcpy(&flow_count_old, &flow_counters[q], sizeof(struct flows_counter));	// Copy counters from the old flow to temp location
-					remove_flow13(q);	// remove the matching flow
-					memcpy(&flow_counters[iLastFlow], &flow_count_old, sizeof(struct flows_counter));	// Copy counters from the temp location to the new flow
-					flow_counters[iLastFlow].duration = 0;
-				}
-			}
-		} else
-		{
-			if((memcmp(ofp13_oxm_match[q], ptr_fm->match.oxm_fields, ntohs(flow_match13[q]->match.length)-4) == 0) && (flow_match13[q]->priority == ptr_fm->priority) && (flow_match13[q]->table_id == ptr_fm->table_id))
-			{
-				if (ptr_fm->flags &  OFPFF13_CHECK_OVERLAP)
-				{
-					of_error13(msg, OFPET13_FLOW_MOD_FAILED, OFPFMFC13_OVERLAP);
-					return;
-				}
-				// Check if we need to reset the counters
-				if (ptr_fm->flags &  OFPFF13_RESET_COUNTS)
-				{
-					remove_flow13(q);	// remove the matching flow
-				} else
-				{
-					TRACE("openflow_13.c: Replacing flow %d", q);
-					memcpy(&flow_count_old, &flow_counters[q], sizeof(struct flows_counter));	// Copy counters from the old flow to temp location
-					remove_flow13(q);	// remove the matching flow
-					memcpy(&flow_counters[iLastFlow], &flow_count_old, sizeof(struct flows_counter));	// Copy counters from the temp location to the new flow
-					flow_counters[iLastFlow].duration = 0;
-				}
-			}
+			TRACE("openflow_13.c: Replacing flow %d", q);
+			memcpy(&flow_count_old, &flow_counters[q], sizeof(struct flows_counter));	// Copy counters from the old flow to temp location
+			keep_counters = true;
 		}
+		remove_flow13(q);	// remove the matching flow
 	}
 	
-	// Allocate a space to store flow mod
-	flow_match13[iLastFlow] = membag_alloc(sizeof(struct ofp13_flow_mod));	
-	if (flow_match13[iLastFlow] == NULL)
+	// Store the flow in its compact form with the match fields, the instructions are shared with other flows
+	int match_len = ntohs(ptr_fm->match.length);
+	int mod_size = ALIGN8(offsetof(struct ofp13_flow_mod, match) + match_len);
+	int instruction_size = ntohs(ptr_fm->header.length) - mod_size;
+	if (match_len < sizeof(struct ofp13_match)) match_len = sizeof(struct ofp13_match);
+	if (instruction_size < 0) instruction_size = 0;
+	int record_size = offsetof(struct flow_entry13, match) + match_len;
+	struct flow_inst13 *inst = flow_inst_get13((uint8_t *)ptr_fm + mod_size, instruction_size);
+	struct flow_entry13 *entry = NULL;
+	if (inst != NULL) entry = slab_alloc(&flow_slab, record_size);
+	if (entry == NULL)
 	{
-		TRACE("openflow_13.c: Unable to allocate %d bytes of memory for flow mod", sizeof(struct ofp13_flow_mod));
+		flow_inst_put13(inst);
+		TRACE("openflow_13.c: Unable to allocate %d bytes of memory for a new flow (%d flows)", record_size, flow_count);
 		of_error13(msg, OFPET13_FLOW_MOD_FAILED, OFPFMFC13_TABLE_FULL);
 		return;
 	}
-	TRACE("openflow_13.c: Allocating %d bytes at %p for flow mode in flow %d", sizeof(struct ofp13_flow_mod), flow_match13[iLastFlow], iLastFlow+1);
-	//printf("openflow_13.c: Allocating %d bytes at %p for flow mode in flow %d\r\n", sizeof(struct ofp13_flow_mod), flow_match13[iLastFlow], iLastFlow+1);
-	memcpy(flow_match13[iLastFlow], ptr_fm, sizeof(struct ofp13_flow_mod));
-	
-	// Allocate a space to store match fields
-	if (ntohs(ptr_fm->match.length) > 4)
+	TRACE("openflow_13.c: Allocating %d bytes at %p for a new flow", record_size, entry);
+	entry->cookie = ptr_fm->cookie;
+	entry->inst = inst;
+	entry->priority = ptr_fm->priority;
+	entry->idle_timeout = ptr_fm->idle_timeout;
+	entry->hard_timeout = ptr_fm->hard_timeout;
+	entry->flags = ptr_fm->flags;
+	entry->table_id = ptr_fm->table_id;
+	entry->out_ports = flow_out_ports13(inst);
+	entry->restored = 0;
+	memcpy(&entry->match, &ptr_fm->match, match_len);
+	int flow_id = flow_slot_alloc();
+	flow_match13[flow_id] = entry;
+	flow_index_add13(flow_id);
+	if (keep_counters)
 	{
-		ofp13_oxm_match[iLastFlow] = membag_alloc(ntohs(flow_match13[iLastFlow]->match.length)-4);	
-		if (ofp13_oxm_match[iLastFlow] == NULL)
-		{
-			TRACE("openflow_13.c: Unable to allocate %d bytes of memory for match fields", ntohs(flow_match13[iLastFlow]->match.length)-4);
-			of_error13(msg, OFPET13_FLOW_MOD_FAILED, OFPFMFC13_TABLE_FULL);
-			return;
-		}
-		TRACE("openflow_13.c: Allocating %d bytes at %p for match field in flow %d", ntohs(flow_match13[iLastFlow]->match.length)-4, ofp13_oxm_match[iLastFlow], iLastFlow+1);
-		//printf("openflow_13.c: Allocating %d bytes at %p for match field in flow %d\r\n", ntohs(flow_match13[iLastFlow]->match.length)-4, ofp13_oxm_match[iLastFlow], iLastFlow+1);
-		memcpy(ofp13_oxm_match[iLastFlow], ptr_fm->match.oxm_fields, ntohs(flow_match13[iLastFlow]->match.length)-4);
-	} else {
-		ofp13_oxm_match[iLastFlow] = NULL;
+		flow_counters[flow_id].hitCount = flow_count_old.hitCount;
+		flow_counters[flow_id].bytes = flow_count_old.bytes;
 	}
+	flow_counters[flow_id].duration = (totaltime/2);
+	flow_counters[flow_id].lastmatch = (totaltime/2);
+	flow_counters[flow_id].active = true;
+	flow_timer_schedule(flow_id);
+	meter_flow_ref13(flow_id, 1);
+	TRACE("openflow_13.c: New flow added at %d into table %d : priority %d : cookie 0x%" PRIx64, flow_id+1, ptr_fm->table_id, ntohs(ptr_fm->priority), htonll(ptr_fm->cookie));
+	meter_resync13();
+	// Apply the new flow to the buffered packet, the flow stays if the buffer has gone
+	if (packet_buffer_lookup(ntohl(ptr_fm->buffer_id)) == false) of_error13(msg, OFPET13_BAD_REQUEST, OFPBRC13_BUFFER_UNKNOWN);
+	return;
+}
+
+/*
+*	OpenFlow FLOW Modify and Modify Strict function
+*
+*	The instructions of the matching flows are replaced where they sit in
+*	the table, so their slot, counters and timeouts are kept. The stored
+*	instruction lists are shared and never written to, so each flow just
+*	has its pointer moved to the new list and drops its hold on the old
+*	one. Packets see either the old or the new instructions, never a mix.
+*
+*	@param *msg - pointer to the OpenFlow message.
+*	@param strict - true if the priority and match must be the same.
+*
+*	Returns the number of flows changed, or -1 if the flow mod was rejected.
+*/
+int flow_modify13(struct ofp_header *msg, bool strict)
+{
+	struct ofp13_flow_mod *ptr_fm = (struct ofp13_flow_mod *) msg;
+	TRACE("openflow_13.c: Flow mod MODIFY%s received", strict ? " STRICT" : "");
 
-	// Allocate a space to store instructions and actions
-	int mod_size = ALIGN8(offsetof(struct ofp13_flow_mod, match) + ntohs(ptr_fm->match.length));
+	if (ptr_fm->table_id > (MAX_TABLES-1))
+	{
+		of_error13(msg, OFPET13_FLOW_MOD_FAILED, OFPFMFC13_BAD_TABLE_ID);
+		return -1;
+	}
+	if (flow_meters_exist13(msg) == false) return -1;
+
+	int match_len = ntohs(ptr_fm->match.length);
+	int mod_size = ALIGN8(offsetof(struct ofp13_flow_mod, match) + match_len);
 	int instruction_size = ntohs(ptr_fm->header.length) - mod_size;
-	if (instruction_size > 0)
+	if (instruction_size < 0) instruction_size = 0;
+
+	// One copy of the new instructions is shared by every flow that is changed
+	struct flow_inst13 *inst = flow_inst_get13((uint8_t *)ptr_fm + mod_size, instruction_size);
+	if (inst == NULL)
+	{
+		TRACE("openflow_13.c: Unable to allocate %d bytes of memory for new instructions", instruction_size);
+		of_error13(msg, OFPET13_FLOW_MOD_FAILED, OFPFMFC13_TABLE_FULL);
+		return -1;
+	}
+
+	int modified = 0;
+	uint8_t out_ports = flow_out_ports13(inst);
+	struct flow_iter it;
+	for(int q=flow_iter_first13(&it, ptr_fm->cookie, ptr_fm->cookie_mask);q>=0;q=flow_iter_next13(&it))
 	{
-		ofp13_oxm_inst[iLastFlow] = membag_alloc(instruction_size);	
-		if (ofp13_oxm_inst[iLastFlow] == NULL)
+		if (ptr_fm->table_id != flow_match13[q]->table_id) continue;
+		if (ptr_fm->cookie_mask != 0 && (ptr_fm->cookie & ptr_fm->cookie_mask) != (flow_match13[q]->cookie & ptr_fm->cookie_mask)) continue;
+		if (strict)
 		{
-			TRACE("openflow_13.c: Unable to allocate %d bytes of memory for instructions", instruction_size);
-			of_error13(msg, OFPET13_FLOW_MOD_FAILED, OFPFMFC13_TABLE_FULL);
-			return;
+			if (ptr_fm->priority != flow_match13[q]->priority) continue;
+			if (ptr_fm->match.length != flow_match13[q]->match.length) continue;
+			if (match_len > 4 && memcmp(flow_match13[q]->match.oxm_fields, ptr_fm->match.oxm_fields, match_len-4) != 0) continue;
+		} else {
+			if (field_match13(ptr_fm->match.oxm_fields, match_len-4, flow_match13[q]->match.oxm_fields, ntohs(flow_match13[q]->match.length)-4) == 0) continue;
 		}
-		TRACE("openflow_13.c: Allocating %d bytes at %p for instruction field in flow %d", instruction_size, ofp13_oxm_inst[iLastFlow], iLastFlow+1);
-		//printf("openflow_13.c: Allocating %d bytes at %p for instruction field in flow %d\r\n", instruction_size, ofp13_oxm_inst[iLastFlow], iLastFlow+1);
-		uint8_t *inst_ptr = (uint8_t *)ptr_fm + mod_size;
-		memcpy(ofp13_oxm_inst[iLastFlow], inst_ptr, instruction_size);
-	} else {
-		ofp13_oxm_inst[iLastFlow] = NULL;
+
+		struct flow_inst13 *old_inst = flow_match13[q]->inst;
+		meter_flow_ref13(q, -1);
+		inst->refs++;
+		flow_match13[q]->inst = inst;
+		flow_match13[q]->out_ports = out_ports;
+		flow_match13[q]->restored = 0;	// The controller still wants this flow
+		flow_inst_put13(old_inst);
+		meter_flow_ref13(q, 1);
+		if (ntohs(ptr_fm->flags) & OFPFF13_RESET_COUNTS)
+		{
+			flow_counters[q].hitCount = 0;
+			flow_counters[q].bytes = 0;
+		}
+		TRACE("openflow_13.c: Flow %d modified", q+1);
+		modified++;
 	}
-	ofp13_oxm_inst_size[iLastFlow] = instruction_size;
-	flow_counters[iLastFlow].duration = (totaltime/2);
-	flow_counters[iLastFlow].lastmatch = (totaltime/2);
-	flow_counters[iLastFlow].active = true;
-	iLastFlow++;
-	TRACE("openflow_13.c: New flow added at %d into table %d : priority %d : cookie 0x%" PRIx64, iLastFlow+1, ptr_fm->table_id, ntohs(ptr_fm->priority), htonll(ptr_fm->cookie));
-	return;
+	flow_inst_put13(inst);	// Drop the hold taken by flow_inst_get13
+
+	if (modified > 0)
+	{
+		snapshot_touch();
+		meter_resync13();
+	}
+	// Apply the changed flows to the buffered packet
+	if (packet_buffer_lookup(ntohl(ptr_fm->buffer_id)) == false) of_error13(msg, OFPET13_BAD_REQUEST, OFPBRC13_BUFFER_UNKNOWN);
+	return modified;
 }
 
 void flow_delete13(struct ofp_header *msg)
 {
 	struct ofp13_flow_mod *ptr_fm = msg;
 	TRACE("openflow_13.c: Flow mod DELETE received");
-	for(int q=0;q<iLastFlow;q++)
+	struct flow_iter it;
+	for(int q=flow_iter_first13(&it, ptr_fm->cookie, ptr_fm->cookie_mask);q>=0;q=flow_iter_next13(&it))
 	{
-		if(flow_counters[q].active == false)
-		{
-			continue;
-		}
 		if (ptr_fm->table_id != OFPTT_ALL && ptr_fm->table_id != flow_match13[q]->table_id)
 		{
 			continue;
 		}
 
-		if (ptr_fm->cookie_mask != 0 && ptr_fm->cookie != flow_match13[q]->cookie & ptr_fm->cookie_mask)
+		if (ptr_fm->cookie_mask != 0 && (ptr_fm->cookie & ptr_fm->cookie_mask) != (flow_match13[q]->cookie & ptr_fm->cookie_mask))
 		{
 			continue;
 		}
-		if (ptr_fm->out_port != OFPP13_ANY)
+		if (ptr_fm->out_port != OFPP13_ANY && flow_has_output13(flow_match13[q], ptr_fm->out_port) == false)
 		{
-			bool out_port_match = false;
-			int mod_size = ALIGN8(offsetof(struct ofp13_flow_mod, match) + ntohs(ptr_fm->match.length));
-			int instruction_size = ntohs(flow_match13[q]->header.length) - mod_size;
-			struct ofp13_instruction *inst;
-			for(inst=ofp13_oxm_inst[q]; inst<ofp13_oxm_inst[q]+instruction_size; inst+=inst->len)
-			{
-				if(inst->type == OFPIT13_APPLY_ACTIONS || inst->type == OFPIT13_WRITE_ACTIONS)
-				{
-					struct ofp13_instruction_actions *ia = inst;
-					struct ofp13_action_header *action;
-					for(action=ia->actions; action<inst+inst->len; action+=action->len)
-					{
-						if(action->type==OFPAT13_OUTPUT)
-						{
-							struct ofp13_action_output *output = action;
-							if (output->port == ptr_fm->out_port)
-							{
-								out_port_match = true;
-							}
-						}
-					}
-				}
-			}
-
-			if(out_port_match==false)
-			{
-				continue;
-			}
+			continue;
 		}
 		if (ptr_fm->out_group != OFPG13_ANY)
 		{
 			bool out_group_match = false;
-			int mod_size = ALIGN8(offsetof(struct ofp13_flow_mod, match) + ntohs(ptr_fm->match.length));
-			int instruction_size = ntohs(flow_match13[q]->header.length) - mod_size;
+			int instruction_size = flow_match13[q]->inst->len;
 			struct ofp13_instruction *inst;
-			for(inst=ofp13_oxm_inst[q]; inst<ofp13_oxm_inst[q]+instruction_size; inst+=inst->len)
+			for(inst=flow_match13[q]->inst->data; inst<flow_match13[q]->inst->data+instruction_size; inst+=inst->len)
 			{
 				if(inst->type == OFPIT13_APPLY_ACTIONS || inst->type == OFPIT13_WRITE_ACTIONS)
 				{
@@ -1270,17 +1638,17 @@ void flow_delete13(struct ofp_header *msg)
 			}
 		}
 
-		if(field_match13(ptr_fm->match.oxm_fields, ntohs(ptr_fm->match.length)-4, ofp13_oxm_match[q], ntohs(flow_match13[q]->match.length)-4) == 0)
+		if(field_match13(ptr_fm->match.oxm_fields, ntohs(ptr_fm->match.length)-4, flow_match13[q]->match.oxm_fields, ntohs(flow_match13[q]->match.length)-4) == 0)
 		{
 			continue;
 		}
 
-		if (ntohs(ptr_fm->flags) & OFPFF13_SEND_FLOW_REM || ntohs(flow_match13[q]->flags) &  OFPFF13_SEND_FLOW_REM) flowrem_notif13(q,OFPRR13_DELETE);
+		if (ntohs(ptr_fm->flags) & OFPFF13_SEND_FLOW_REM || ntohs(flow_match13[q]->flags) &  OFPFF13_SEND_FLOW_REM) flowrem_notif(q,OFPRR13_DELETE);
 		TRACE("openflow_13.c: Flow %d removed", q+1);
 		// Remove the flow entry
 		remove_flow13(q);
-		q--;
 	}
+	meter_resync13();
 	return;
 }
 
@@ -1294,13 +1662,9 @@ void flow_delete_strict13(struct ofp_header *msg)
 {
 	struct ofp13_flow_mod *ptr_fm = msg;
 	TRACE("openflow_13.c: Flow mod DELETE STRICT received");
-	for(int q=0;q<iLastFlow;q++)
+	struct flow_iter it;
+	for(int q=flow_iter_first13(&it, ptr_fm->cookie, ptr_fm->cookie_mask);q>=0;q=flow_iter_next13(&it))
 	{
-		// Check if the flow is active
-		if(flow_counters[q].active == false)
-		{
-			continue;
-		}
 		// Check if it is the correct flow table
 		if (ptr_fm->table_id != OFPTT_ALL && ptr_fm->table_id != flow_match13[q]->table_id)
 		{
@@ -1312,49 +1676,21 @@ void flow_delete_strict13(struct ofp_header *msg)
 			continue;
 		}
 		// Check if the cookie values are the same
-		if (ptr_fm->cookie_mask != 0 && ptr_fm->cookie != flow_match13[q]->cookie & ptr_fm->cookie_mask)
+		if (ptr_fm->cookie_mask != 0 && (ptr_fm->cookie & ptr_fm->cookie_mask) != (flow_match13[q]->cookie & ptr_fm->cookie_mask))
 		{
 			continue;
 		}
 		
-		if (ptr_fm->out_port != OFPP13_ANY)
+		if (ptr_fm->out_port != OFPP13_ANY && flow_has_output13(flow_match13[q], ptr_fm->out_port) == false)
 		{
-			bool out_port_match = false;
-			int mod_size = ALIGN8(offsetof(struct ofp13_flow_mod, match) + ntohs(ptr_fm->match.length));
-			int instruction_size = ntohs(flow_match13[q]->header.length) - mod_size;
-			struct ofp13_instruction *inst;
-			for(inst=ofp13_oxm_inst[q]; inst<ofp13_oxm_inst[q]+instruction_size; inst+=inst->len)
-			{
-				if(inst->type == OFPIT13_APPLY_ACTIONS || inst->type == OFPIT13_WRITE_ACTIONS)
-				{
-					struct ofp13_instruction_actions *ia = inst;
-					struct ofp13_action_header *action;
-					for(action=ia->actions; action<inst+inst->len; action+=action->len)
-					{
-						if(action->type==OFPAT13_OUTPUT)
-						{
-							struct ofp13_action_output *output = action;
-							if (output->port == ptr_fm->out_port)
-							{
-								out_port_match = true;
-							}
-						}
-					}
-				}
-			}
-
-			if(out_port_match == false)
-			{
-				continue;
-			}
+			continue;
 		}
 		if (ptr_fm->out_group != OFPG13_ANY)
 		{
 			bool out_group_match = false;
-			int mod_size = ALIGN8(offsetof(struct ofp13_flow_mod, match) + ntohs(ptr_fm->match.length));
-			int instruction_size = ntohs(flow_match13[q]->header.length) - mod_size;
+			int instruction_size = flow_match13[q]->inst->len;
 			struct ofp13_instruction *inst;
-			for(inst=ofp13_oxm_inst[q]; inst<ofp13_oxm_inst[q]+instruction_size; inst+=inst->len)
+			for(inst=flow_match13[q]->inst->data; inst<flow_match13[q]->inst->data+instruction_size; inst+=inst->len)
 			{
 				if(inst->type == OFPIT13_APPLY_ACTIONS || inst->type == OFPIT13_WRITE_ACTIONS)
 				{
@@ -1379,7 +1715,7 @@ void flow_delete_strict13(struct ofp_header *msg)
 			}
 		}
 
-		if(ofp13_oxm_match[q] == NULL)
+		if(ntohs(flow_match13[q]->match.length) <= 4)
 		{
 			if(memcmp(flow_match13[q]->match.oxm_fields, ptr_fm->match.oxm_fields, 4) != 0)
 			{
@@ -1387,21 +1723,574 @@ void flow_delete_strict13(struct ofp_header *msg)
 			}
 		} else
 		{
-			if(memcmp(ofp13_oxm_match[q], ptr_fm->match.oxm_fields, ntohs(flow_match13[q]->match.length)-4) != 0)
+			if(memcmp(flow_match13[q]->match.oxm_fields, ptr_fm->match.oxm_fields, ntohs(flow_match13[q]->match.length)-4) != 0)
 			{
 				continue;
 			}
 		}
 
-		if (ntohs(ptr_fm->flags) & OFPFF13_SEND_FLOW_REM || ntohs(flow_match13[q]->flags) &  OFPFF13_SEND_FLOW_REM) flowrem_notif13(q,OFPRR13_DELETE);
+		if (ntohs(ptr_fm->flags) & OFPFF13_SEND_FLOW_REM || ntohs(flow_match13[q]->flags) &  OFPFF13_SEND_FLOW_REM) flowrem_notif(q,OFPRR13_DELETE);
 		TRACE("openflow_13.c: Flow %d removed", q+1);
 		// Remove the flow entry
 		remove_flow13(q);
-		q--;
 	}
+	meter_resync13();
 	return;
 }
 
+/*
+*	OpenFlow METER_MOD function
+*
+*	Only meters with a single DROP band are supported. Meters that can be
+*	expressed by the KSZ8795 ingress rate limiters are offloaded by
+*	meter_sync13(), the rest are policed in software.
+*
+*	@param *msg - pointer to the OpenFlow message.
+*
+*/
+void meter_mod13(struct ofp_header *msg)
+{
+	struct ofp13_meter_mod *ptr_mm = (struct ofp13_meter_mod *) msg;
+	uint32_t meter_id = ntohl(ptr_mm->meter_id);
+	uint16_t flags = ntohs(ptr_mm->flags);
+	int bands_len = ntohs(msg->length) - sizeof(struct ofp13_meter_mod);
+	struct meter_entry13 *meter = meter_lookup13(meter_id);
+	struct ofp13_meter_band_header *band = ptr_mm->bands;
+
+	switch(ntohs(ptr_mm->command))
+	{
+		case OFPMC13_ADD:
+		case OFPMC13_MODIFY:
+		if (meter_id == 0 || meter_id > OFPM13_MAX)
+		{
+			of_error13(msg, OFPET13_METER_MOD_FAILED, OFPMMFC13_INVALID_METER);
+			return;
+		}
+		if (ntohs(ptr_mm->command) == OFPMC13_ADD && meter != NULL)
+		{
+			of_error13(msg, OFPET13_METER_MOD_FAILED, OFPMMFC13_METER_EXISTS);
+			return;
+		}
+		if (ntohs(ptr_mm->command) == OFPMC13_MODIFY && meter == NULL)
+		{
+			of_error13(msg, OFPET13_METER_MOD_FAILED, OFPMMFC13_UNKNOWN_METER);
+			return;
+		}
+		// The rate must be in either kbps or packets per second
+		if (((flags & OFPMF13_KBPS) == 0) == ((flags & OFPMF13_PKTPS) == 0) || (flags & ~(OFPMF13_KBPS | OFPMF13_PKTPS | OFPMF13_BURST | OFPMF13_STATS)))
+		{
+			of_error13(msg, OFPET13_METER_MOD_FAILED, OFPMMFC13_BAD_FLAGS);
+			return;
+		}
+		if (bands_len > (int)sizeof(struct ofp13_meter_band_drop))
+		{
+			of_error13(msg, OFPET13_METER_MOD_FAILED, OFPMMFC13_OUT_OF_BANDS);
+			return;
+		}
+		if (bands_len > 0)
+		{
+			if (bands_len != (int)sizeof(struct ofp13_meter_band_drop) || ntohs(band->len) != sizeof(struct ofp13_meter_band_drop) || ntohs(band->type) != OFPMBT13_DROP)
+			{
+				of_error13(msg, OFPET13_METER_MOD_FAILED, OFPMMFC13_BAD_BAND);
+				return;
+			}
+			if (ntohl(band->rate) == 0 || ntohl(band->rate) > METER_RATE_MAX)
+			{
+				of_error13(msg, OFPET13_METER_MOD_FAILED, OFPMMFC13_BAD_RATE);
+				return;
+			}
+			if ((flags & OFPMF13_BURST) && ntohl(band->burst_size) > METER_RATE_MAX)
+			{
+				of_error13(msg, OFPET13_METER_MOD_FAILED, OFPMMFC13_BAD_BURST);
+				return;
+			}
+		} else if (bands_len < 0) {
+			of_error13(msg, OFPET13_BAD_REQUEST, OFPBRC13_BAD_LEN);
+			return;
+		}
+		if (meter == NULL)
+		{
+			for (int m=0;m<MAX_METER_13;m++)
+			{
+				if (meter_table13[m].meter_id == 0)
+				{
+					meter = &meter_table13[m];
+					break;
+				}
+			}
+			if (meter == NULL)
+			{
+				of_error13(msg, OFPET13_METER_MOD_FAILED, OFPMMFC13_OUT_OF_METERS);
+				return;
+			}
+			memset(meter, 0, sizeof(struct meter_entry13));
+			meter->meter_id = meter_id;
+			meter->time_added = (totaltime/2);
+		}
+		meter->flags = flags;
+		meter->rate = 0;	// A meter with no band only counts packets
+		meter->burst_size = 0;
+		if (bands_len > 0)
+		{
+			meter->rate = ntohl(band->rate);
+			if (flags & OFPMF13_BURST) meter->burst_size = ntohl(band->burst_size);
+		}
+		meter->hw_port = 0;
+		meter->tokens = 0xFFFFFFFF;	// Start with a full bucket
+		meter->last_refill = sys_get_ms();
+		TRACE("openflow_13.c: Meter %d set, rate %d %s", meter_id, meter->rate, (flags & OFPMF13_KBPS) ? "kbps" : "pktps");
+		break;
+
+		case OFPMC13_DELETE:
+		// Flows that use a deleted meter are removed with it
+		for (int q=0;q<iLastFlow;q++)
+		{
+			if (flow_counters[q].active == false) continue;
+			uint32_t flow_meter = flow_meter13(q);
+			if (flow_meter == 0 || (meter_id != OFPM13_ALL && flow_meter != meter_id)) continue;
+			if (ntohs(flow_match13[q]->flags) & OFPFF13_SEND_FLOW_REM) flowrem_notif(q,OFPRR13_DELETE);
+			remove_flow13(q);
+		}
+		for (int m=0;m<MAX_METER_13;m++)
+		{
+			if (meter_table13[m].meter_id != 0 && (meter_id == OFPM13_ALL || meter_table13[m].meter_id == meter_id))
+			{
+				TRACE("openflow_13.c: Meter %d deleted", meter_table13[m].meter_id);
+				memset(&meter_table13[m], 0, sizeof(struct meter_entry13));
+			}
+		}
+		break;
+
+		default:
+		of_error13(msg, OFPET13_METER_MOD_FAILED, OFPMMFC13_BAD_COMMAND);
+		return;
+	}
+	snapshot_touch();
+	meter_sync13();
+	return;
+}
+
+/*
+*	Build an OpenFlow METER_MOD ADD message that recreates a meter
+*
+*	@param *buffer - pointer to the buffer to build the message in.
+*	@param *meter - pointer to the meter.
+*
+*	Returns the length of the message.
+*/
+int meter_mod_msg13(uint8_t *buffer, struct meter_entry13 *meter)
+{
+	struct ofp13_meter_mod *mm = (struct ofp13_meter_mod *)buffer;
+	int len = sizeof(struct ofp13_meter_mod);
+
+	mm->header.version = 0x04;
+	mm->header.type = OFPT13_METER_MOD;
+	mm->header.xid = 0;
+	mm->command = htons(OFPMC13_ADD);
+	mm->flags = htons(meter->flags);
+	mm->meter_id = htonl(meter->meter_id);
+	if (meter->rate > 0)
+	{
+		struct ofp13_meter_band_drop *band = (struct ofp13_meter_band_drop *)mm->bands;
+		memset(band, 0, sizeof(struct ofp13_meter_band_drop));
+		band->type = htons(OFPMBT13_DROP);
+		band->len = htons(sizeof(struct ofp13_meter_band_drop));
+		band->rate = htonl(meter->rate);
+		band->burst_size = htonl(meter->burst_size);
+		len += sizeof(struct ofp13_meter_band_drop);
+	}
+	mm->header.length = htons(len);
+	return len;
+}
+
+/*
+*	Find a meter by its ID
+*
+*	@param meter_id - the meter ID.
+*
+*/
+struct meter_entry13 *meter_lookup13(uint32_t meter_id)
+{
+	if (meter_id == 0) return NULL;
+	for (int m=0;m<MAX_METER_13;m++)
+	{
+		if (meter_table13[m].meter_id == meter_id) return &meter_table13[m];
+	}
+	return NULL;
+}
+
+/*
+*	Software token bucket for meters that are not offloaded
+*
+*	Returns true if the packet is over the band rate and should be dropped.
+*
+*	@param *meter - pointer to the meter.
+*	@param packet_size - size of the packet.
+*
+*/
+bool meter_police13(struct meter_entry13 *meter, uint16_t packet_size)
+{
+	meter->packet_in_count++;
+	meter->byte_in_count += packet_size;
+
+	// Offloaded meters have already been policed by the switch
+	if (meter->hw_port != 0 || meter->rate == 0) return false;
+
+	// Bucket depth in bits (kbps) or 1/1000 packets (pktps), default is 100ms worth of traffic
+	uint32_t bucket = meter->burst_size * 1000;
+	if (bucket == 0) bucket = meter->rate * 100;
+	uint32_t cost = (meter->flags & OFPMF13_PKTPS) ? 1000 : (packet_size * 8);
+	if (bucket < cost) bucket = cost;
+
+	// A rate in kbps is also bits per ms, a rate in pktps is 1/1000 packets per ms
+	uint32_t now = sys_get_ms();
+	uint32_t elapsed = now - meter->last_refill;
+	if (elapsed > 1000) elapsed = 1000;
+	if (elapsed > 0)
+	{
+		meter->last_refill = now;
+		if (meter->tokens < bucket) meter->tokens += elapsed * meter->rate;
+	}
+	if (meter->tokens > bucket) meter->tokens = bucket;
+
+	if (meter->tokens < cost)
+	{
+		meter->packet_band_count++;
+		meter->byte_band_count += packet_size;
+		return true;
+	}
+	meter->tokens -= cost;
+	return false;
+}
+
+/*
+*	Get the meter ID used by a flow
+*
+*	Returns 0 if the flow does not have a meter instruction.
+*
+*	@param flow_id - the flow number.
+*
+*/
+uint32_t flow_meter13(int flow_id)
+{
+	int inst_size = 0;
+	while (inst_size < flow_match13[flow_id]->inst->len)
+	{
+		struct ofp13_instruction *inst_ptr = (struct ofp13_instruction *)(flow_match13[flow_id]->inst->data + inst_size);
+		if (ntohs(inst_ptr->len) == 0) break;
+		if (ntohs(inst_ptr->type) == OFPIT13_METER) return ntohl(((struct ofp13_instruction_meter *)inst_ptr)->meter_id);
+		inst_size += ntohs(inst_ptr->len);
+	}
+	return 0;
+}
+
+/*
+*	Get the in_port a flow matches on
+*
+*	Returns 0 if the flow does not match on in_port.
+*
+*	@param flow_id - the flow number.
+*
+*/
+static uint32_t flow_inport13(int flow_id)
+{
+	if (ntohs(flow_match13[flow_id]->match.length) <= 4) return 0;
+	uint8_t *hdr = flow_match13[flow_id]->match.oxm_fields;
+	uint8_t *tail = hdr + ntohs(flow_match13[flow_id]->match.length) - 4;
+	while (hdr < tail)
+	{
+		uint32_t field = ntohl(*(uint32_t*)(hdr));
+		if (field == (uint32_t)OXM_OF_IN_PORT) return ntohl(*(uint32_t*)(hdr + 4));
+		hdr += 4 + OXM_LENGTH(field);
+	}
+	return 0;
+}
+
+/*
+*	Check if a flow polices every packet received on a port
+*
+*	This is the case for a table 0 flow that matches on in_port only and
+*	has no other table 0 flow of the same or higher priority that could
+*	match packets from the port. A meter used by that flow is then the same
+*	as an ingress rate limit on the port.
+*
+*	Returns the port number, or 0 if the flow is not a per-port flow.
+*
+*	@param flow_id - the flow number.
+*
+*/
+static uint8_t flow_port_meter13(int flow_id)
+{
+	if (flow_match13[flow_id]->table_id != 0) return 0;
+	if (ntohs(flow_match13[flow_id]->match.length) != 4 + sizeof(struct oxm_header13) + 4) return 0;
+	uint32_t port = flow_inport13(flow_id);
+	if (port < 1 || port > 4) return 0;
+
+	for (int i=0;i<iLastFlow;i++)
+	{
+		if (i == flow_id || flow_counters[i].active == false || flow_match13[i]->table_id != 0) continue;
+		if (ntohs(flow_match13[i]->priority) < ntohs(flow_match13[flow_id]->priority)) continue;
+		uint32_t other_port = flow_inport13(i);
+		if (other_port == 0 || other_port == port) return 0;
+	}
+	return port;
+}
+
+/*
+*	Check if a meter's band can be set on a port ingress rate limiter
+*
+*	The meter needs a kbps rate the switch can set exactly and no burst
+*	size.
+*
+*	@param *meter - pointer to the meter.
+*
+*/
+static bool meter_offloadable13(struct meter_entry13 *meter)
+{
+	if (meter->meter_id == 0 || meter->rate == 0 || (meter->flags & OFPMF13_KBPS) == 0 || meter->burst_size != 0) return false;
+	if (meter->rate < 100000 && ratelimit_decode(ratelimit_encode(meter->rate)) != meter->rate) return false;
+	return true;
+}
+
+/*
+*	Count a flow in or out of the meter it uses
+*
+*	Called when a flow is added or removed, and before and after its
+*	instructions are changed. The offload only needs working out again if
+*	the flow uses a meter that could be offloaded, or is a table 0 flow
+*	that could change which flows are per-port flows while such a meter
+*	is in use.
+*
+*	@param flow_id - the flow number.
+*	@param delta - 1 when the flow starts using its meter, -1 when it stops.
+*
+*/
+void meter_flow_ref13(int flow_id, int delta)
+{
+	struct meter_entry13 *meter = meter_lookup13(flow_meter13(flow_id));
+	if (meter != NULL)
+	{
+		meter->flow_refs += delta;
+		if (meter_offloadable13(meter)) meter_resync = true;
+	}
+	if (flow_match13[flow_id]->table_id != 0) return;
+	for (int m=0;m<MAX_METER_13;m++)
+	{
+		if (meter_table13[m].flow_refs > 0 && meter_offloadable13(&meter_table13[m])) meter_resync = true;
+	}
+	return;
+}
+
+/*
+*	Offload meters again if a flow change since the last time may have moved one
+*
+*/
+void meter_resync13(void)
+{
+	if (meter_resync == true) meter_sync13();
+	return;
+}
+
+/*
+*	Offload meters to the KSZ8795 ingress rate limiters
+*
+*	A meter is offloaded when it is only used by per-port flows on a single
+*	OpenFlow port and meter_offloadable13() is true for it. The port must
+*	not have a rate limit configured from the CLI or another meter
+*	offloaded to it. All other meters stay in software. Called when the
+*	meters or port rate limits change, and through meter_resync13() when
+*	the flows change.
+*
+*/
+void meter_sync13(void)
+{
+	uint8_t meter_port[MAX_METER_13] = {0};
+	bool offload[MAX_METER_13];
+	uint8_t port_meter[4] = {0};	// Index + 1 of the meter offloaded to each port
+	bool port_conflict[4] = {false};
+	bool meters = false;
+	bool used = false;
+
+	meter_resync = false;
+	for (int m=0;m<MAX_METER_13;m++)
+	{
+		struct meter_entry13 *meter = &meter_table13[m];
+		offload[m] = meter_offloadable13(meter);
+		if (offload[m] && meter->flow_refs > 0) used = true;
+		if (meter->meter_id != 0 || meter->hw_port != 0) meters = true;
+	}
+
+	if (meters)
+	{
+		// Find the port of every flow that uses a meter, there is nothing to find if no flow uses one that can be offloaded
+		for (int q=0;q<iLastFlow && used;q++)
+		{
+			if (flow_counters[q].active == false) continue;
+			struct meter_entry13 *meter = meter_lookup13(flow_meter13(q));
+			if (meter == NULL) continue;
+			int m = meter - meter_table13;
+			if (offload[m] == false) continue;
+			uint8_t port = flow_port_meter13(q);
+			if (port == 0 || (meter_port[m] != 0 && meter_port[m] != port))
+			{
+				offload[m] = false;
+				continue;
+			}
+			meter_port[m] = port;
+		}
+
+		// Assign the ports
+		for (int m=0;m<MAX_METER_13;m++)
+		{
+			if (offload[m] == false || meter_port[m] == 0) continue;
+			int p = meter_port[m] - 1;
+			if (Zodiac_Config.of_port[p] != 1 || Zodiac_Config.ingress_limit[p] != 0) continue;
+			if (port_meter[p] != 0) port_conflict[p] = true;
+			port_meter[p] = m + 1;
+		}
+
+		for (int m=0;m<MAX_METER_13;m++)
+		{
+			struct meter_entry13 *meter = &meter_table13[m];
+			uint8_t hw_port = 0;
+			if (meter_port[m] != 0 && port_meter[meter_port[m]-1] == m + 1 && port_conflict[meter_port[m]-1] == false) hw_port = meter_port[m];
+			if (hw_port != meter->hw_port)
+			{
+				TRACE("openflow_13.c: Meter %d moved to %s", meter->meter_id, (hw_port != 0) ? "hardware" : "software");
+				meter->hw_port = hw_port;
+				meter->tokens = 0xFFFFFFFF;
+				meter->last_refill = sys_get_ms();
+			}
+		}
+	}
+
+	for (int p=0;p<4;p++)
+	{
+		meter_ingress_limit[p] = 0;
+		if (port_meter[p] != 0 && port_conflict[p] == false) meter_ingress_limit[p] = ratelimit_encode(meter_table13[port_meter[p]-1].rate);
+	}
+	ratelimit_apply();
+	return;
+}
+
+/*
+*	OpenFlow Multi-part METER stats reply message function
+*
+*	@param *msg - pointer to the OpenFlow message.
+*
+*/
+int multi_meter_stats_reply13(uint8_t *buffer, struct ofp13_multipart_request *msg)
+{
+	struct ofp13_meter_multipart_request *req = (struct ofp13_meter_multipart_request *) msg->body;
+	uint32_t meter_id = ntohl(req->meter_id);
+	int len = offsetof(struct ofp13_multipart_reply, body);
+	int stats_len = sizeof(struct ofp13_meter_stats) + sizeof(struct ofp13_meter_band_stats);
+	struct ofp13_multipart_reply *reply = (struct ofp13_multipart_reply *) buffer;
+
+	for (int m=0;m<MAX_METER_13;m++)
+	{
+		struct meter_entry13 *meter = &meter_table13[m];
+		if (meter->meter_id == 0 || (meter_id != OFPM13_ALL && meter->meter_id != meter_id)) continue;
+		if (SHARED_BUFFER_LEN - multi_pos < len + stats_len) break;	// guard for buffer overrun
+		struct ofp13_meter_stats *stats = (struct ofp13_meter_stats *) (buffer + len);
+		bzero(stats, stats_len);
+		stats->meter_id = htonl(meter->meter_id);
+		stats->len = htons(stats_len);
+		stats->flow_count = htonl(meter->flow_refs);
+		stats->packet_in_count = htonll(meter->packet_in_count);
+		stats->byte_in_count = htonll(meter->byte_in_count);
+		stats->duration_sec = htonl((totaltime/2) - meter->time_added);
+		stats->band_stats[0].packet_band_count = htonll(meter->packet_band_count);
+		stats->band_stats[0].byte_band_count = htonll(meter->byte_band_count);
+		len += stats_len;
+	}
+
+	reply->header.version = OF_Version;
+	reply->header.type = OFPT13_MULTIPART_REPLY;
+	reply->header.length = htons(len);
+	reply->header.xid = msg->header.xid;
+	reply->type = htons(OFPMP13_METER);
+	reply->flags = 0;
+	memset(reply->pad, 0, sizeof(reply->pad));
+	return len;
+}
+
+/*
+*	OpenFlow Multi-part METER config reply message function
+*
+*	@param *msg - pointer to the OpenFlow message.
+*
+*/
+int multi_meter_config_reply13(uint8_t *buffer, struct ofp13_multipart_request *msg)
+{
+	struct ofp13_meter_multipart_request *req = (struct ofp13_meter_multipart_request *) msg->body;
+	uint32_t meter_id = ntohl(req->meter_id);
+	int len = offsetof(struct ofp13_multipart_reply, body);
+	struct ofp13_multipart_reply *reply = (struct ofp13_multipart_reply *) buffer;
+
+	for (int m=0;m<MAX_METER_13;m++)
+	{
+		struct meter_entry13 *meter = &meter_table13[m];
+		if (meter->meter_id == 0 || (meter_id != OFPM13_ALL && meter->meter_id != meter_id)) continue;
+		int config_len = sizeof(struct ofp13_meter_config);
+		if (meter->rate != 0) config_len += sizeof(struct ofp13_meter_band_drop);
+		if (SHARED_BUFFER_LEN - multi_pos < len + config_len) break;	// guard for buffer overrun
+		struct ofp13_meter_config *config = (struct ofp13_meter_config *) (buffer + len);
+		bzero(config, config_len);
+		config->length = htons(config_len);
+		config->flags = htons(meter->flags);
+		config->meter_id = htonl(meter->meter_id);
+		if (meter->rate != 0)
+		{
+			struct ofp13_meter_band_drop *band = (struct ofp13_meter_band_drop *) config->bands;
+			band->type = htons(OFPMBT13_DROP);
+			band->len = htons(sizeof(struct ofp13_meter_band_drop));
+			band->rate = htonl(meter->rate);
+			band->burst_size = htonl(meter->burst_size);
+		}
+		len += config_len;
+	}
+
+	reply->header.version = OF_Version;
+	reply->header.type = OFPT13_MULTIPART_REPLY;
+	reply->header.length = htons(len);
+	reply->header.xid = msg->header.xid;
+	reply->type = htons(OFPMP13_METER_CONFIG);
+	reply->flags = 0;
+	memset(reply->pad, 0, sizeof(reply->pad));
+	return len;
+}
+
+/*
+*	OpenFlow Multi-part METER features reply message function
+*
+*	@param *msg - pointer to the OpenFlow message.
+*
+*/
+int multi_meter_features_reply13(uint8_t *buffer, struct ofp13_multipart_request *msg)
+{
+	int len = offsetof(struct ofp13_multipart_reply, body) + sizeof(struct ofp13_meter_features);
+	if (SHARED_BUFFER_LEN - multi_pos < len){
+		return 0; // guard for buffer overrun
+	}
+	bzero(buffer, len);
+	struct ofp13_multipart_reply *reply = (struct ofp13_multipart_reply *) buffer;
+	reply->header.version = OF_Version;
+	reply->header.type = OFPT13_MULTIPART_REPLY;
+	reply->header.length = htons(len);
+	reply->header.xid = msg->header.xid;
+	reply->type = htons(OFPMP13_METER_FEATURES);
+	reply->flags = 0;
+
+	struct ofp13_meter_features *features = (struct ofp13_meter_features *) reply->body;
+	features->max_meter = htonl(MAX_METER_13);
+	features->band_types = htonl(1 << OFPMBT13_DROP);
+	features->capabilities = htonl(OFPMF13_KBPS | OFPMF13_PKTPS | OFPMF13_BURST | OFPMF13_STATS);
+	features->max_bands = 1;
+	features->max_color = 0;
+	return len;
+}
+
 /*
 *	OpenFlow PACKET_IN function
 *
@@ -1409,41 +2298,62 @@ void flow_delete_strict13(struct ofp_header *msg)
 *	@param ul_size - size of the packet.
 *	@param *buffer - port that the packet was received on.
 *	@param reason - reason for the packet in.
+*	@param flow - flow that sent the packet to the controller, -1 for a packet out.
+*	@param max_len - number of bytes of the packet to send, the rest is buffered on the switch.
 *
 */
-void packet_in13(uint8_t *buffer, uint16_t ul_size, uint8_t port, uint8_t reason, int flow)
+void packet_in13(uint8_t *buffer, uint16_t ul_size, uint8_t port, uint8_t reason, int flow, uint16_t max_len)
 {
 	TRACE("openflow_13.c: Packet in from packet received on port %d reason = %d (%d bytes)", port, reason, ul_size);
 	uint16_t size = 0;
 	struct ofp13_packet_in * pi;
 	uint16_t send_size = ul_size;
+	uint32_t buffer_id = OFP_NO_BUFFER;
 	struct oxm_header13 oxm_header;
 	uint32_t in_port = ntohl(port);
 
-	if(tcp_sndbuf(tcp_pcb) < (send_size + 34)) return;
+	if (async_wanted(OFPT13_PACKET_IN, reason) == false) return;	// No controller wants it, e.g. turned off with SET_ASYNC
+	if (packet_in_allowed(port, reason) == false) return;	// Rate limited, counted in packet_in_stats
+
+	// Only send the start of the packet if it can be buffered, otherwise send all of it
+	if (max_len != OFPCML_NO_BUFFER && max_len < ul_size)
+	{
+		buffer_id = packet_buffer_store(buffer, ul_size, port);
+		if (buffer_id != OFP_NO_BUFFER) send_size = max_len;
+	}
 
-	pi = (struct ofp13_packet_in *) shared_buffer;
+	// The message is built in the packet-in queue and sent from task_openflow()
+ 	size = sizeof(struct ofp13_packet_in) + 10 + send_size;
+	pi = (struct ofp13_packet_in *)packet_in_reserve(size);
+	if (pi == NULL)
+	{
+		if (buffer_id != OFP_NO_BUFFER) packet_buffer_release(packet_buffer_get(buffer_id));
+		return;
+	}
 	pi->header.version = OF_Version;
 	pi->header.type = OFPT13_PACKET_IN;
 	pi->header.xid = 0;
-	pi->buffer_id = -1;
+	pi->buffer_id = htonl(buffer_id);
 	pi->reason = reason;
-	pi->table_id = flow_match13[flow]->table_id;
-	pi->cookie = flow_match13[flow]->cookie;
+	if (flow < 0)	// Sent by a packet out rather than a flow
+	{
+		pi->table_id = OFPTT_ALL;
+		pi->cookie = 0xffffffffffffffffULL;
+	} else {
+		pi->table_id = flow_match13[flow]->table_id;
+		pi->cookie = flow_match13[flow]->cookie;
+	}
 
 	pi->match.type = htons(OFPMT_OXM);
 	pi->match.length = htons(12);
 	oxm_header.oxm_class = ntohs(0x8000);
 	oxm_header.oxm_field = OFPXMT_OFB_IN_PORT;
 	oxm_header.oxm_len = 4;
-	memcpy(shared_buffer + sizeof(struct ofp13_packet_in)-4, &oxm_header, 4);
-	memcpy(shared_buffer + sizeof(struct ofp13_packet_in), &in_port, 4);
- 	size = sizeof(struct ofp13_packet_in) + 10 + send_size;
+	memcpy((uint8_t *)pi + sizeof(struct ofp13_packet_in)-4, &oxm_header, 4);
+	memcpy((uint8_t *)pi + sizeof(struct ofp13_packet_in), &in_port, 4);
 	pi->header.length = HTONS(size);
-	pi->total_len = HTONS(send_size);
-	memcpy(shared_buffer + (size-send_size), buffer, send_size);
-	sendtcp(&shared_buffer, size);
-	tcp_output(tcp_pcb);
+	pi->total_len = HTONS(ul_size);
+	memcpy((uint8_t *)pi + (size-send_size), buffer, send_size);
 	return;
 }
 
@@ -1457,24 +2367,98 @@ void packet_out13(struct ofp_header *msg)
 {
 	struct ofp13_packet_out * po;
 	po = (struct ofp13_packet_out *) msg;
-	uint32_t inPort = htonl(po->in_port);
+	uint32_t inPort = ntohl(po->in_port);
 	uint8_t *ptr = (uint8_t *) po;
-	int size = ntohs(po->header.length) - ((sizeof(struct ofp13_packet_out) + ntohs(po->actions_len)));
-	ptr += sizeof(struct ofp13_packet_out) + ntohs(po->actions_len);
+	int actions_len = ntohs(po->actions_len);
+	int size = ntohs(po->header.length) - (sizeof(struct ofp13_packet_out) + actions_len);
+	ptr += sizeof(struct ofp13_packet_out) + actions_len;
 	if (size < 0) return; // Corrupt packet!
-	struct ofp13_action_header *act_hdr = po->actions;
-	if (ntohs(act_hdr->type) != OFPAT13_OUTPUT) return;
-	struct ofp13_action_output *act_out = act_hdr;
-	uint32_t outPort = htonl(act_out->port);
-	if (outPort == OFPP13_FLOOD)
+
+	// Check the action list before any of it is applied
+	int act_size = 0;
+	while (act_size < actions_len)
 	{
-		outPort = 7 - (1 << (inPort-1));	// Need to fix this, may also send out the Non-OpenFlow port
-		} else {
-		outPort = 1 << (outPort-1);
-		TRACE("openflow_13.c: Packet out FLOOD (%d bytes)", size);
+		struct ofp13_action_header *act_hdr = (struct ofp13_action_header*)((uint8_t *)po->actions + act_size);
+		if (ntohs(act_hdr->len) < sizeof(struct ofp13_action_header) || (act_size + ntohs(act_hdr->len)) > actions_len)
+		{
+			of_error13(msg, OFPET13_BAD_ACTION, OFPBAC13_BAD_LEN);
+			return;
+		}
+		if (ntohs(act_hdr->type) == OFPAT13_GROUP)
+		{
+			of_error13(msg, OFPET13_BAD_ACTION, OFPBAC13_BAD_OUT_GROUP);	// Groups are not supported so the group can't exist
+			return;
+		}
+		act_size += ntohs(act_hdr->len);
+	}
+
+	uint32_t buffer_id = ntohl(po->buffer_id);
+	uint8_t *actions = (uint8_t *)po->actions;
+	struct packet_desc pkt = {ptr, size, 0, 0};
+	struct packet_buffer *buf = NULL;
+	if (buffer_id == OFP_NO_BUFFER)
+	{
+		// Move the action list to the front of the message, the packet out header behind it can then be used as headroom
+		memmove(po, actions, actions_len);
+		actions = (uint8_t *)po;
+		pkt.headroom = sizeof(struct ofp13_packet_out);
+	} else {
+		buf = packet_buffer_get(buffer_id);
+		if (buf == NULL)
+		{
+			of_error13(msg, OFPET13_BAD_REQUEST, OFPBRC13_BUFFER_UNKNOWN);
+			return;
+		}
+		pkt.data = buf->data + PACKET_HEADROOM;
+		pkt.len = buf->size;
+		pkt.headroom = PACKET_HEADROOM;
+		pkt.tailroom = 0;
 	}
-	TRACE("openflow_13.c: Packet out port %d (%d bytes)", outPort, size);
-	gmac_write(ptr, size, outPort);
+
+	TRACE("openflow_13.c: Packet out from port %d (%d bytes)", inPort, pkt.len);
+	struct packet_fields fields = {0};
+	packet_fields_parser(pkt.data, &fields);
+	apply_actions13(&pkt, &fields, actions, actions_len, inPort, -1);
+	if (buf != NULL) packet_buffer_release(buf);
+	return;
+}
+
+/*
+*	OpenFlow PORT_MOD function
+*
+*	@param *msg - pointer to the OpenFlow message.
+*
+*/
+void port_mod13(struct ofp_header *msg)
+{
+	struct ofp13_port_mod *pm = (struct ofp13_port_mod *) msg;
+	uint32_t port = ntohl(pm->port_no);
+	uint8_t mac[6];
+
+	if (port < 1 || port > 4 || Zodiac_Config.of_port[port-1] != 1)
+	{
+		of_error13(msg, OFPET13_PORT_MOD_FAILED, OFPPMFC13_BAD_PORT);
+		return;
+	}
+	port_hw_addr(port-1, mac);
+	if (memcmp(pm->hw_addr, mac, sizeof(mac)) != 0)
+	{
+		of_error13(msg, OFPET13_PORT_MOD_FAILED, OFPPMFC13_BAD_HW_ADDR);
+		return;
+	}
+
+	uint32_t mask = ntohl(pm->mask);
+	if (mask & ~(OFPPC13_PORT_DOWN | OFPPC13_NO_RECV | OFPPC13_NO_FWD | OFPPC13_NO_PACKET_IN))
+	{
+		of_error13(msg, OFPET13_PORT_MOD_FAILED, OFPPMFC13_BAD_CONFIG);
+		return;
+	}
+	uint8_t config = (port_config[port-1] & ~mask) | (ntohl(pm->config) & mask);
+	if (config == port_config[port-1]) return;
+	port_config[port-1] = config;
+	TRACE("openflow_13.c: Port %d config set to 0x%x", port, port_config[port-1]);
+	update_port_masks();
+	port_status_message13(port-1);
 	return;
 }
 
@@ -1486,6 +2470,7 @@ void packet_out13(struct ofp_header *msg)
 */
 void barrier13_reply(uint32_t xid)
 {
+	if (barrier_hold(xid)) return;	// Sent once the flow stats reply in progress is complete
 	TRACE("Sent Barrier reply");
 	struct ofp_header of_barrier;
 	of_barrier.version= OF_Version;
@@ -1506,6 +2491,12 @@ void barrier13_reply(uint32_t xid)
 */
 void of_error13(struct ofp_header *msg, uint16_t type, uint16_t code)
 {
+	// The flow code also handles 1.0 flow mods, their errors go back as 1.0 errors
+	if (OF_Version == 1)
+	{
+		flow_mod10_error(type, code);
+		return;
+	}
 	TRACE("openflow_13.c: Sent OF error code %d", code);
 	// get the size of the message, we send up to the first 64 back with the error
 	int msglen = htons(msg->length);
@@ -1525,17 +2516,18 @@ void of_error13(struct ofp_header *msg, uint16_t type, uint16_t code)
 }
 
 /*
-*	OpenFlow FLOW Removed message function
+*	Build an OpenFlow FLOW Removed message
 *
+*	@param *buffer - pointer to the buffer to build the message in.
 *	@param flowid - flow number.
 *	@param reason - the reason the flow was removed.
 *
+*	Returns the length of the message.
 */
-void flowrem_notif13(int flowid, uint8_t reason)
+int flowrem_msg13(uint8_t *buffer, int flowid, uint8_t reason)
 {
 	struct ofp13_flow_removed ofr;
 	double diff;
-	char flow_rem[128];
 
 	ofr.header.type = OFPT13_FLOW_REMOVED;
 	ofr.header.version = OF_Version;
@@ -1553,14 +2545,12 @@ void flowrem_notif13(int flowid, uint8_t reason)
 	ofr.hard_timeout = flow_match13[flowid]->hard_timeout;
 	ofr.table_id = flow_match13[flowid]->table_id;
 	memcpy(&ofr.match, &flow_match13[flowid]->match, sizeof(struct ofp13_match));
-	memcpy(flow_rem, &ofr, sizeof(struct ofp13_flow_removed));
+	memcpy(buffer, &ofr, sizeof(struct ofp13_flow_removed));
 	if (ntohs(flow_match13[flowid]->match.length) > 4) 
 	{
-		memcpy(flow_rem + (sizeof(struct ofp13_flow_removed)-4), ofp13_oxm_match[flowid], ntohs(flow_match13[flowid]->match.length)-4);
+		memcpy(buffer + (sizeof(struct ofp13_flow_removed)-4), flow_match13[flowid]->match.oxm_fields, ntohs(flow_match13[flowid]->match.length)-4);
 	}
-	sendtcp(&flow_rem, htons(ofr.header.length));
-	TRACE("openflow_13.c: Flow removed notification sent");
-	return;
+	return htons(ofr.header.length);
 }
 
 /*
@@ -1574,23 +2564,20 @@ void port_status_message13(uint8_t port)
 	char portname[8];
 	uint8_t mac[] = {0x00,0x00,0x00,0x00,0x00,0x00};
 	struct ofp13_port_status ofps;
-	
+
+	if (async_wanted(OFPT13_PORT_STATUS, OFPPR13_MODIFY) == false) return;
 	ofps.header.type = OFPT13_PORT_STATUS;
 	ofps.header.version = OF_Version;
 	ofps.header.length = htons(sizeof(struct ofp13_port_status));
 	ofps.header.xid = 0;
 	ofps.reason = OFPPR13_MODIFY;
 	ofps.desc.port_no = htonl(port+1);
-	for(int k = 0; k<6; k++)            // Generate random MAC address
-	{
-		int r = rand() % 255;
-		memset(mac + k,r,1);
-	}
+	port_hw_addr(port, mac);
 	memcpy(&ofps.desc.hw_addr, mac, sizeof(mac));
 	memset(ofps.desc.name, 0, OFP13_MAX_PORT_NAME_LEN);	// Zero out the name string
 	sprintf(portname, "eth%d",port);
 	strcpy(ofps.desc.name, portname);
-	ofps.desc.config = 0;
+	ofps.desc.config = htonl(port_config[port]);
 	if (port_status[port] == 1) ofps.desc.state = htonl(OFPPS13_LIVE);
 	if (port_status[port] == 0) ofps.desc.state = htonl(OFPPS13_LINK_DOWN);
 	ofps.desc.curr = htonl(OFPPF13_100MB_FD + OFPPF13_COPPER);
@@ -1599,7 +2586,7 @@ void port_status_message13(uint8_t port)
 	ofps.desc.peer = 0;
 	ofps.desc.curr_speed = 0;
 	ofps.desc.max_speed = 0;
-	sendtcp(&ofps, htons(ofps.header.length));
+	send_async(&ofps, htons(ofps.header.length), OFPT13_PORT_STATUS, OFPPR13_MODIFY);
 	TRACE("openflow_13.c: Port Status change notification sent");
 	return;
 }
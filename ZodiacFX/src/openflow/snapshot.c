@@ -0,0 +1,410 @@
+/**
+ * @file
+ * snapshot.c
+ *
+ * This file contains the functions that save the flow table to flash
+ * and put it back after a restart
+ *
+ */
+
+/*
+ * This file is part of the Zodiac FX firmware.
+ * Copyright (c) 2016 Northbound Networks.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Paul Zanna <paul@northboundnetworks.com>
+ *
+ */
+
+#include <asf.h>
+#include <string.h>
+#include "trace.h"
+#include "config_zodiac.h"
+#include "command.h"
+#include "flash.h"
+#include "openflow.h"
+#include "of_helper.h"
+#include "snapshot.h"
+#include "lwip/def.h"
+
+// Global variables
+extern struct zodiac_config Zodiac_Config;
+extern int iLastFlow;
+extern int OF_Version;
+extern int totaltime;
+extern int flow_count;
+extern struct flows_counter *flow_counters;
+extern struct flow_entry13 **flow_match13;
+extern struct meter_entry13 meter_table13[MAX_METER_13];
+extern uint8_t shared_buffer[SHARED_BUFFER_LEN];
+
+enum snapshot_state
+{
+	SNAPSHOT_IDLE,
+	SNAPSHOT_ERASE,
+	SNAPSHOT_WRITE,
+	SNAPSHOT_HEADER
+};
+
+/* Progress of the snapshot being written, one flash operation is done on each timer tick */
+struct snapshot_progress
+{
+	uint8_t state;
+	uint8_t sector;		// Next sector to erase
+	uint32_t offset;	// Next page of the snapshot area to write
+	uint32_t len;		// Bytes of records written
+	int meter;			// Next meter to save
+	int flow;			// Next flow to save
+	uint16_t rec_off;	// Bytes of the current record already written
+	uint16_t records;
+	uint32_t checksum;
+	uint32_t seq;		// table_seq when the snapshot was started
+};
+
+// Local Variables
+static struct snapshot_progress snap;
+static uint32_t table_seq;		// Changed every time a flow or meter is added, changed or removed
+static uint32_t saved_seq;		// table_seq of the last snapshot in flash
+static int last_change;
+static int last_saved = -FLOW_SNAPSHOT_INTERVAL;
+static bool restore_pending;	// Flows were restored and the controller hasn't connected yet
+static int restored_version;	// OpenFlow version the restored flows were added with
+static int reconcile_time;		// Time the restored flows the controller didn't add again are removed
+
+/*
+*	Note that the flow table or meters have changed
+*
+*/
+void snapshot_touch(void)
+{
+	table_seq++;
+	last_change = totaltime/2;
+	return;
+}
+
+/*
+*	Build the next record of the snapshot
+*
+*	The meters are saved first so the flows that use them can be put
+*	back. The record is rebuilt from the tables each time it is needed
+*	rather than being kept between timer ticks.
+*
+*	@param *buffer - pointer to the buffer to build the record in.
+*	@param buf_len - size of the buffer.
+*
+*	Returns the length of the record, or 0 if there are no more.
+*/
+static int snapshot_record(uint8_t *buffer, int buf_len)
+{
+	while (snap.meter < MAX_METER_13)
+	{
+		if (meter_table13[snap.meter].meter_id != 0) return meter_mod_msg13(buffer, &meter_table13[snap.meter]);
+		snap.meter++;
+	}
+	while (snap.flow < iLastFlow)
+	{
+		if (flow_counters[snap.flow].active == true)
+		{
+			int len = flow_mod_msg13(buffer, snap.flow, buf_len);
+			if (len > 0) return len;
+			TRACE("snapshot.c: Flow %d is too big to save", snap.flow+1);
+		}
+		snap.flow++;
+	}
+	return 0;
+}
+
+/*
+*	Fill a page with the next part of the snapshot
+*
+*	The page is built in the start of shared_buffer and the records in
+*	the rest of it.
+*
+*	Returns the number of bytes put in the page.
+*/
+static int snapshot_fill(void)
+{
+	uint8_t *page = shared_buffer;
+	uint8_t *rec = shared_buffer + IFLASH_PAGE_SIZE;
+	int pos = 0;
+
+	memset(page, 0xFF, IFLASH_PAGE_SIZE);
+	while (pos < IFLASH_PAGE_SIZE)
+	{
+		int len = snapshot_record(rec, SHARED_BUFFER_LEN - IFLASH_PAGE_SIZE);
+		if (len == 0) break;
+		int n = len - snap.rec_off;
+		if (n > IFLASH_PAGE_SIZE - pos) n = IFLASH_PAGE_SIZE - pos;
+		memcpy(page + pos, rec + snap.rec_off, n);
+		for (int i=0;i<n;i++) snap.checksum = (snap.checksum ^ page[pos+i]) * 16777619;
+		pos += n;
+		snap.rec_off += n;
+		if (snap.rec_off == len)
+		{
+			// Move on to the next record
+			if (snap.meter < MAX_METER_13)
+			{
+				snap.meter++;
+			} else {
+				snap.flow++;
+			}
+			snap.rec_off = 0;
+			snap.records++;
+		}
+	}
+	return pos;
+}
+
+/*
+*	Start writing a new snapshot
+*
+*/
+static void snapshot_start(void)
+{
+	memset(&snap, 0, sizeof(snap));
+	snap.state = SNAPSHOT_ERASE;
+	snap.offset = IFLASH_PAGE_SIZE;		// The header page is written last
+	snap.checksum = 2166136261;
+	snap.seq = table_seq;
+	last_saved = totaltime/2;
+	TRACE("snapshot.c: Saving the flow table to flash");
+	return;
+}
+
+/*
+*	Do the next flash operation of the snapshot being written
+*
+*	The snapshot is given up if the flow table changes part way through,
+*	it will be started again once the table has been quiet for a while.
+*
+*	Returns 1 if there is more to do, 0 when the snapshot is complete or
+*	-1 if it failed.
+*/
+static int snapshot_step(void)
+{
+	struct snapshot_header hdr;
+	int pos;
+
+	if (snap.seq != table_seq)
+	{
+		TRACE("snapshot.c: Flow table changed, snapshot abandoned");
+		snap.state = SNAPSHOT_IDLE;
+		return -1;
+	}
+
+	switch(snap.state)
+	{
+		case SNAPSHOT_ERASE:
+		if (snapshot_erase_sector(snap.sector) == 0) break;
+		snap.sector++;
+		if (snap.sector * ERASE_SECTOR_SIZE >= SNAPSHOT_SIZE) snap.state = SNAPSHOT_WRITE;
+		return 1;
+
+		case SNAPSHOT_WRITE:
+		pos = snapshot_fill();
+		if (pos > 0)
+		{
+			if (snapshot_write_page(snap.offset, shared_buffer) == 0) break;
+			snap.offset += IFLASH_PAGE_SIZE;
+			snap.len += pos;
+		}
+		if (pos < IFLASH_PAGE_SIZE)
+		{
+			snap.state = SNAPSHOT_HEADER;
+		} else if (snap.offset >= SNAPSHOT_SIZE) {
+			// Out of room, finish only if that was the last record
+			if (snapshot_record(shared_buffer, SHARED_BUFFER_LEN) != 0)
+			{
+				TRACE("snapshot.c: Flow table is too big for the snapshot area");
+				break;
+			}
+			snap.state = SNAPSHOT_HEADER;
+		}
+		return 1;
+
+		case SNAPSHOT_HEADER:
+		memset(shared_buffer, 0xFF, IFLASH_PAGE_SIZE);
+		hdr.magic = SNAPSHOT_MAGIC;
+		hdr.of_version = OF_Version;
+		hdr.pad = 0;
+		hdr.records = snap.records;
+		hdr.len = snap.len;
+		hdr.checksum = snap.checksum;
+		memcpy(shared_buffer, &hdr, sizeof(hdr));
+		if (snapshot_write_page(0, shared_buffer) == 0) break;
+		saved_seq = snap.seq;
+		snap.state = SNAPSHOT_IDLE;
+		TRACE("snapshot.c: Saved %d records (%d bytes) to flash", snap.records, snap.len);
+		return 0;
+	}
+
+	TRACE("snapshot.c: Unable to save the flow table to flash");
+	snap.state = SNAPSHOT_IDLE;
+	return -1;
+}
+
+/*
+*	Remove the restored flows that the controller hasn't added again
+*
+*/
+static void snapshot_reconcile(void)
+{
+	int removed = 0;
+
+	reconcile_time = 0;
+	for (int q=0;q<iLastFlow;q++)
+	{
+		if (flow_counters[q].active == false || flow_match13[q]->restored == 0) continue;
+		remove_flow13(q);
+		removed++;
+	}
+	if (removed > 0) meter_resync13();
+	TRACE("snapshot.c: Removed %d restored flows the controller didn't add again", removed);
+	return;
+}
+
+/*
+*	Snapshot timer function
+*
+*	Called on every timer tick. A snapshot is started once the flow table
+*	has been quiet for FLOW_SNAPSHOT_QUIET seconds, and no more often than
+*	every FLOW_SNAPSHOT_INTERVAL seconds to spare the flash.
+*
+*/
+void snapshot_task(void)
+{
+	int now = totaltime/2;
+
+	if (reconcile_time != 0 && now >= reconcile_time) snapshot_reconcile();
+
+	if (Zodiac_Config.flow_snapshot != 1 || (OF_Version != 1 && OF_Version != 4))
+	{
+		snap.state = SNAPSHOT_IDLE;
+		return;
+	}
+
+	if (snap.state != SNAPSHOT_IDLE)
+	{
+		snapshot_step();
+		return;
+	}
+
+	if (table_seq != saved_seq && reconcile_time == 0 && (now - last_change) >= FLOW_SNAPSHOT_QUIET && (now - last_saved) >= FLOW_SNAPSHOT_INTERVAL)
+	{
+		snapshot_start();
+	}
+	return;
+}
+
+/*
+*	Save the flow table to flash now
+*
+*	Returns the number of flows and meters saved, or -1 if it failed.
+*/
+int snapshot_save(void)
+{
+	int rc;
+
+	if (OF_Version != 1 && OF_Version != 4) return -1;
+	snapshot_start();
+	while ((rc = snapshot_step()) == 1);
+	if (rc < 0) return -1;
+	return snap.records;
+}
+
+/*
+*	Put back the flow table saved in flash
+*
+*	Called at boot before the controller connects, so the switch forwards
+*	with the saved flows straight away. The flows are marked as restored
+*	until the controller adds them again. In fail secure mode restored
+*	flows are kept but not matched until then.
+*
+*/
+void snapshot_restore(void)
+{
+	struct snapshot_header *hdr = (struct snapshot_header *)SNAPSHOT_BASE;
+	uint8_t *data = (uint8_t *)(SNAPSHOT_BASE + IFLASH_PAGE_SIZE);
+	uint32_t checksum = 2166136261;	// FNV-1a
+	uint32_t pos = 0;
+
+	if (Zodiac_Config.flow_snapshot != 1) return;
+	if (hdr->magic != SNAPSHOT_MAGIC || (hdr->of_version != 1 && hdr->of_version != 4) || hdr->len > SNAPSHOT_SIZE - IFLASH_PAGE_SIZE) return;
+	for (int i=0;i<hdr->len;i++) checksum = (checksum ^ data[i]) * 16777619;
+	if (checksum != hdr->checksum)
+	{
+		TRACE("snapshot.c: Flow snapshot in flash is corrupt");
+		return;
+	}
+
+	// Both versions keep their flows as 1.3 flow mods, the version is kept so 1.0 errors aren't sent as 1.3
+	OF_Version = hdr->of_version;
+	restored_version = hdr->of_version;
+	while (pos + sizeof(struct ofp_header) <= hdr->len)
+	{
+		struct ofp_header *ofph = (struct ofp_header *)shared_buffer;
+		memcpy(ofph, data + pos, sizeof(struct ofp_header));
+		uint16_t len = ntohs(ofph->length);
+		if (len < sizeof(struct ofp_header) || len > SHARED_BUFFER_LEN || pos + len > hdr->len) break;
+		memcpy(shared_buffer, data + pos, len);
+		if (ofph->type == OFPT13_METER_MOD) meter_mod13(ofph);
+		if (ofph->type == OFPT13_FLOW_MOD) flow_mod13(ofph);
+		pos += len;
+	}
+
+	for (int q=0;q<iLastFlow;q++)
+	{
+		if (flow_counters[q].active == true) flow_match13[q]->restored = 1;
+	}
+	restore_pending = true;
+	saved_seq = table_seq;
+	TRACE("snapshot.c: Restored %d flows from flash", flow_count);
+	return;
+}
+
+/*
+*	Reconcile the restored flows when a controller connects
+*
+*	Called once the OpenFlow version has been agreed. Restored flows are
+*	kept while the controller adds its flows again, any it hasn't added
+*	after FLOW_SNAPSHOT_GRACE seconds are removed.
+*
+*/
+void snapshot_connected(void)
+{
+	if (restore_pending == false) return;
+	restore_pending = false;
+
+	if (OF_Version != restored_version)
+	{
+		// The restored flows were added by a controller using the other version
+		clear_flows();
+		return;
+	}
+	reconcile_time = (totaltime/2) + FLOW_SNAPSHOT_GRACE;
+	return;
+}
+
+/*
+*	Check if restored flows are waiting for a controller to connect
+*
+*	Fail secure mode doesn't clear the flow table while they are, so
+*	the controller still gets the chance to add them again.
+*
+*/
+bool snapshot_pending(void)
+{
+	return restore_pending;
+}
@@ -0,0 +1,62 @@
+/**
+ * @file
+ * snapshot.h
+ *
+ * This file contains the function declarations for saving the flow table to flash
+ *
+ */
+
+/*
+ * This file is part of the Zodiac FX firmware.
+ * Copyright (c) 2016 Northbound Networks.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Paul Zanna <paul@northboundnetworks.com>
+ *
+ */
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SNAPSHOT_MAGIC	0x5346465A	// "ZFFS"
+
+/*
+*	Kept in the first page of the snapshot area and written last, so a
+*	snapshot that was cut short is never loaded. The records that follow
+*	are OpenFlow 1.3 METER_MOD and FLOW_MOD ADD messages, exactly as a
+*	controller would send them. 1.0 flows are saved the same way as they
+*	are kept in the table as 1.3 flows.
+*/
+struct snapshot_header
+{
+	uint32_t magic;
+	uint8_t of_version;
+	uint8_t pad;
+	uint16_t records;
+	uint32_t len;		// Bytes of records after the header page
+	uint32_t checksum;	// FNV-1a of the records
+};
+
+void snapshot_touch(void);
+void snapshot_task(void);
+int snapshot_save(void);
+void snapshot_restore(void);
+void snapshot_connected(void);
+bool snapshot_pending(void);
+
+#endif /* SNAPSHOT_H_ */
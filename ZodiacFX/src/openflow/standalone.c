@@ -0,0 +1,252 @@
+/**
+ * @file
+ * standalone.c
+ *
+ * This file contains the fail standalone learning bridge
+ *
+ */
+
+/*
+ * This file is part of the Zodiac FX firmware.
+ * Copyright (c) 2016 Northbound Networks.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Paul Zanna <paul@northboundnetworks.com>
+ *
+ */
+
+#include <asf.h>
+#include <string.h>
+#include "trace.h"
+#include "config_zodiac.h"
+#include "command.h"
+#include "openflow.h"
+#include "standalone.h"
+#include "switch.h"
+
+#define MAC_WAYS	4	// Entries in each hash bucket
+#define MAC_BUCKETS	(STANDALONE_MAC_ENTRIES / MAC_WAYS)
+
+// Global variables
+extern struct zodiac_config Zodiac_Config;
+extern int totaltime;
+extern uint8_t port_status[4];
+extern uint8_t flood_mask[5];
+
+/* Learned MAC address, a port of 0 marks a free entry */
+struct mac_entry
+{
+	uint8_t mac[6];
+	uint8_t port;		// Port the address was last seen on, 1 - 4
+	uint8_t pad;
+	uint32_t seen;		// Time it was last seen (seconds)
+};
+
+// Local Variables
+static struct mac_entry mac_table[MAC_BUCKETS][MAC_WAYS];
+static uint8_t bridge_mode = FAILSTATE_SECURE;	// Failstate the bridge is running in, FAILSTATE_SECURE while it is off
+struct standalone_stats standalone_stats;
+
+/*
+*	Hash a MAC address to a bucket of the MAC table
+*
+*	@param *mac - pointer to the MAC address.
+*
+*/
+static inline uint32_t mac_hash(const uint8_t *mac)
+{
+	uint32_t h = 2166136261u;	// FNV-1a
+	for (int i=0;i<6;i++) h = (h ^ mac[i]) * 16777619u;
+	return h & (MAC_BUCKETS - 1);
+}
+
+/*
+*	Look up the port a MAC address was learned on
+*
+*	@param *mac - pointer to the MAC address.
+*
+*	Returns the entry, or NULL if the address is unknown or has aged out.
+*/
+static struct mac_entry *mac_lookup(const uint8_t *mac)
+{
+	struct mac_entry *bucket = mac_table[mac_hash(mac)];
+	uint32_t now = totaltime/2;
+
+	for (int i=0;i<MAC_WAYS;i++)
+	{
+		if (bucket[i].port == 0 || memcmp(bucket[i].mac, mac, 6) != 0) continue;
+		if (now - bucket[i].seen >= STANDALONE_MAC_AGE) return NULL;
+		return &bucket[i];
+	}
+	return NULL;
+}
+
+/*
+*	Learn the port a MAC address is on
+*
+*	A new address takes a free or aged out entry in its bucket, or the
+*	one seen longest ago if the bucket is full.
+*
+*	@param *mac - pointer to the source MAC address.
+*	@param port - port the frame was received on.
+*
+*/
+static void mac_learn(const uint8_t *mac, uint8_t port)
+{
+	struct mac_entry *bucket = mac_table[mac_hash(mac)];
+	struct mac_entry *slot = NULL;
+	uint32_t now = totaltime/2;
+	uint32_t oldest = 0;
+	uint32_t age;
+
+	for (int i=0;i<MAC_WAYS;i++)
+	{
+		if (bucket[i].port != 0 && memcmp(bucket[i].mac, mac, 6) == 0)
+		{
+			bucket[i].port = port;	// Follow a host that has moved
+			bucket[i].seen = now;
+			return;
+		}
+		age = (bucket[i].port == 0) ? UINT32_MAX : now - bucket[i].seen;
+		if (slot == NULL || age > oldest)
+		{
+			slot = &bucket[i];
+			oldest = age;
+		}
+	}
+	if (oldest < STANDALONE_MAC_AGE) standalone_stats.evicted++;
+	memcpy(slot->mac, mac, 6);
+	slot->port = port;
+	slot->seen = now;
+	standalone_stats.learned++;
+	return;
+}
+
+/*
+*	Give the OpenFlow ports to the KSZ8795 or take them back
+*
+*	With the OpenFlow port settings cleared the ports switch between
+*	themselves in hardware, learning MAC addresses in the KSZ8795's own
+*	table, the same as when OpenFlow is disabled. The flow table is kept.
+*
+*	@param on - true to hand the ports to the KSZ8795.
+*
+*/
+static void standalone_hw(bool on)
+{
+	if (on == false)
+	{
+		if (Zodiac_Config.OFEnabled == OF_ENABLED) enableOF();
+		return;
+	}
+	for (int x=0;x<4;x++)
+	{
+		if (Zodiac_Config.of_port[x] == 1) switch_write(21 + (x*16), 0);
+	}
+	return;
+}
+
+/*
+*	Start or stop the bridge as controllers come and go
+*
+*	Called every pass of the OpenFlow task. The bridge runs while
+*	OpenFlow is enabled, the failstate is standalone and no controller is
+*	connected, it hands back as soon as one connects.
+*
+*/
+void standalone_task(void)
+{
+	uint8_t mode = FAILSTATE_SECURE;
+
+	if (Zodiac_Config.OFEnabled == OF_ENABLED && controllers_connected() == 0 && (Zodiac_Config.failstate == FAILSTATE_STANDALONE || Zodiac_Config.failstate == FAILSTATE_STANDALONE_HW))
+	{
+		mode = Zodiac_Config.failstate;
+	}
+	if (mode == bridge_mode) return;
+
+	if (bridge_mode == FAILSTATE_STANDALONE_HW) standalone_hw(false);
+	if (mode == FAILSTATE_STANDALONE_HW) standalone_hw(true);
+	memset(mac_table, 0, sizeof(mac_table));	// Hosts may have moved while the controller had the ports
+	if (mode != FAILSTATE_SECURE)
+	{
+		port_config_clear();	// Ports the controller disabled are bridged too
+		TRACE("standalone.c: No controller, OpenFlow ports are now a learning bridge");
+	} else {
+		TRACE("standalone.c: Handing the OpenFlow ports back to the controller");
+	}
+	bridge_mode = mode;
+	return;
+}
+
+/*
+*	Switch a frame with the learning bridge
+*
+*	@param *pkt - pointer to the packet.
+*	@param port - port the packet was received on.
+*
+*	Returns false if the bridge isn't running and the flow table should be used.
+*/
+bool standalone_forward(struct packet_desc *pkt, int port)
+{
+	uint8_t *eth = pkt->data;
+	struct mac_entry *entry = NULL;
+	uint8_t out;
+
+	if (bridge_mode == FAILSTATE_SECURE) return false;
+	if (bridge_mode == FAILSTATE_STANDALONE_HW) return true;	// Only frames received before the KSZ8795 took over get here
+
+	if ((eth[6] & 1) == 0) mac_learn(eth + 6, port);
+	if ((eth[0] & 1) == 0) entry = mac_lookup(eth);
+
+	if (entry != NULL && port_status[entry->port-1] == 1)
+	{
+		if (entry->port == port) return true;	// Already on the right segment
+		out = 1 << (entry->port-1);
+		standalone_stats.forwarded++;
+	} else {
+		out = flood_mask[port];
+		standalone_stats.flooded++;
+	}
+	if (out != 0) gmac_write(pkt->data, pkt->len, out);
+	return true;
+}
+
+/*
+*	Failstate the bridge is running in, FAILSTATE_SECURE if it is off
+*
+*/
+uint8_t standalone_mode(void)
+{
+	return bridge_mode;
+}
+
+/*
+*	Count the MAC addresses in the table that haven't aged out
+*
+*/
+int standalone_mac_count(void)
+{
+	uint32_t now = totaltime/2;
+	int count = 0;
+
+	for (int b=0;b<MAC_BUCKETS;b++)
+	{
+		for (int i=0;i<MAC_WAYS;i++)
+		{
+			if (mac_table[b][i].port != 0 && now - mac_table[b][i].seen < STANDALONE_MAC_AGE) count++;
+		}
+	}
+	return count;
+}
@@ -0,0 +1,51 @@
+/**
+ * @file
+ * standalone.h
+ *
+ * This file contains the function declarations for the fail standalone bridge
+ *
+ */
+
+/*
+ * This file is part of the Zodiac FX firmware.
+ * Copyright (c) 2016 Northbound Networks.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Paul Zanna <paul@northboundnetworks.com>
+ *
+ */
+
+#ifndef STANDALONE_H_
+#define STANDALONE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "of_helper.h"
+
+/* Counters for the fail standalone bridge */
+struct standalone_stats
+{
+	uint32_t learned;		// MAC addresses added to the table
+	uint32_t evicted;		// Live MAC addresses pushed out by a full bucket
+	uint32_t forwarded;		// Frames sent to a single learned port
+	uint32_t flooded;		// Frames flooded to an unknown, broadcast or multicast destination
+};
+
+void standalone_task(void);
+bool standalone_forward(struct packet_desc *pkt, int port);
+uint8_t standalone_mode(void);
+int standalone_mac_count(void);
+
+#endif /* STANDALONE_H_ */
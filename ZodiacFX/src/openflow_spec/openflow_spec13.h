@@ -352,6 +352,37 @@ struct ofp13_port_stats {
                                 duration_sec. */
 };
 
+/* Flags to indicate behavior of the physical port.  These flags are
+ * used in ofp_port to describe the current configuration.  They are
+ * used in the ofp_port_mod message to configure the port's behavior.
+ */
+enum ofp13_port_config {
+    OFPPC13_PORT_DOWN    = 1 << 0,  /* Port is administratively down. */
+
+    OFPPC13_NO_RECV      = 1 << 2,  /* Drop all packets received by port. */
+    OFPPC13_NO_FWD       = 1 << 5,  /* Drop packets forwarded to port. */
+    OFPPC13_NO_PACKET_IN = 1 << 6   /* Do not send packet-in msgs for port. */
+};
+
+/* Modify behavior of the physical port */
+struct ofp13_port_mod {
+    struct ofp_header header;
+    uint32_t port_no;
+    uint8_t pad[4];
+    uint8_t hw_addr[OFP13_ETH_ALEN]; /* The hardware address is not
+                                      configurable.  This is used to
+                                      sanity-check the request, so it must
+                                      be the same as returned in an
+                                      ofp_port struct. */
+    uint8_t pad2[2];        /* Pad to 64 bits. */
+    uint32_t config;        /* Bitmap of OFPPC_* flags. */
+    uint32_t mask;          /* Bitmap of OFPPC_* flags to be changed. */
+
+    uint32_t advertise;     /* Bitmap of OFPPF_*.  Zero all bits to prevent
+                               any action taking place. */
+    uint8_t pad3[4];        /* Pad to 64 bits. */
+};
+
 /* Current state of the physical port.  These are not configurable from
  * the controller.
  */
@@ -449,6 +480,50 @@ enum ofp13_flow_mod_failed_code {
     OFPFMFC13_BAD_FLAGS    = 7,   /* Unsupported or unknown flags. */
 };
 
+/* ofp_error_msg 'code' values for OFPET_PORT_MOD_FAILED.  'data' contains
+ * at least the first 64 bytes of the failed request. */
+enum ofp13_port_mod_failed_code {
+    OFPPMFC13_BAD_PORT      = 0,   /* Specified port number does not exist. */
+    OFPPMFC13_BAD_HW_ADDR   = 1,   /* Specified hardware address does not
+                                    * match the port number. */
+    OFPPMFC13_BAD_CONFIG    = 2,   /* Specified config is invalid. */
+    OFPPMFC13_BAD_ADVERTISE = 3,   /* Specified advertise is invalid. */
+    OFPPMFC13_EPERM         = 4,   /* Permissions error. */
+};
+
+/* ofp_error_msg 'code' values for OFPET_ROLE_REQUEST_FAILED. 'data' contains
+ * at least the first 64 bytes of the failed request. */
+enum ofp13_role_request_failed_code {
+    OFPRRFC13_STALE    = 0,        /* Stale Message: old generation_id. */
+    OFPRRFC13_UNSUP    = 1,        /* Controller role change unsupported. */
+    OFPRRFC13_BAD_ROLE = 2,        /* Invalid role. */
+};
+
+/* ofp_error_msg 'code' values for OFPET_BAD_ACTION.  'data' contains at least
+ * the first 64 bytes of the failed request. */
+enum ofp13_bad_action_code {
+    OFPBAC13_BAD_TYPE           = 0,  /* Unknown action type. */
+    OFPBAC13_BAD_LEN            = 1,  /* Length problem in actions. */
+    OFPBAC13_BAD_EXPERIMENTER   = 2,  /* Unknown experimenter id specified. */
+    OFPBAC13_BAD_EXP_TYPE       = 3,  /* Unknown action for experimenter id. */
+    OFPBAC13_BAD_OUT_PORT       = 4,  /* Problem validating output port. */
+    OFPBAC13_BAD_ARGUMENT       = 5,  /* Bad action argument. */
+    OFPBAC13_EPERM              = 6,  /* Permissions error. */
+    OFPBAC13_TOO_MANY           = 7,  /* Can't handle this many actions. */
+    OFPBAC13_BAD_QUEUE          = 8,  /* Problem validating output queue. */
+    OFPBAC13_BAD_OUT_GROUP      = 9,  /* Invalid group id in forward action. */
+    OFPBAC13_MATCH_INCONSISTENT = 10, /* Action can't apply for this match,
+                                         or Set-Field missing prerequisite. */
+    OFPBAC13_UNSUPPORTED_ORDER  = 11, /* Action order is unsupported for the
+                                         action list in an Apply-Actions
+                                         instruction */
+    OFPBAC13_BAD_TAG            = 12, /* Actions uses an unsupported
+                                         tag/encap. */
+    OFPBAC13_BAD_SET_TYPE       = 13, /* Unsupported type in SET_FIELD action. */
+    OFPBAC13_BAD_SET_LEN        = 14, /* Length problem in SET_FIELD action. */
+    OFPBAC13_BAD_SET_ARGUMENT   = 15, /* Bad argument in SET_FIELD action. */
+};
+
 /* ## ----------------- ## */
 /* ## OpenFlow Actions. ## */
 /* ## ----------------- ## */
@@ -1532,4 +1607,146 @@ struct ofp13_role_request {
     uint8_t pad[4];             /* Align to 64 bits. */
     uint64_t generation_id;     /* Master Election Generation Id */
 };
+
+/* Asynchronous message configuration. */
+struct ofp13_async_config {
+    struct ofp_header header;     /* OFPT_GET_ASYNC_REPLY or OFPT_SET_ASYNC. */
+    uint32_t packet_in_mask[2];   /* Bitmasks of OFPR_* values. */
+    uint32_t port_status_mask[2]; /* Bitmasks of OFPPR_* values. */
+    uint32_t flow_removed_mask[2];/* Bitmasks of OFPRR_* values. */
+};
+
+/* ## ------------------------------------ ## */
+/* ## OpenFlow Meters and rate limiters.  ## */
+/* ## ------------------------------------ ## */
+
+/* Meter numbering. Flow meters can use any number up to OFPM_MAX. */
+enum ofp13_meter {
+    /* Last usable meter. */
+    OFPM13_MAX        = 0xffff0000,
+
+    /* Virtual meters. */
+    OFPM13_SLOWPATH   = 0xfffffffd,  /* Meter for slow datapath. */
+    OFPM13_CONTROLLER = 0xfffffffe,  /* Meter for controller connection. */
+    OFPM13_ALL        = 0xffffffff,  /* Represents all meters for stat requests
+                                        commands. */
+};
+
+/* Meter band types */
+enum ofp13_meter_band_type {
+    OFPMBT13_DROP            = 1,      /* Drop packet. */
+    OFPMBT13_DSCP_REMARK     = 2,      /* Remark DSCP in the IP header. */
+    OFPMBT13_EXPERIMENTER    = 0xFFFF  /* Experimenter meter band. */
+};
+
+/* Common header for all meter bands */
+struct ofp13_meter_band_header {
+    uint16_t type;        /* One of OFPMBT_*. */
+    uint16_t len;         /* Length in bytes of this band. */
+    uint32_t rate;        /* Rate for this band. */
+    uint32_t burst_size;  /* Size of bursts. */
+};
+
+/* OFPMBT_DROP band - drop packets */
+struct ofp13_meter_band_drop {
+    uint16_t type;        /* OFPMBT_DROP. */
+    uint16_t len;         /* Length in bytes of this band. */
+    uint32_t rate;        /* Rate for dropping packets. */
+    uint32_t burst_size;  /* Size of bursts. */
+    uint8_t pad[4];
+};
+
+/* Meter commands */
+enum ofp13_meter_mod_command {
+    OFPMC13_ADD,              /* New meter. */
+    OFPMC13_MODIFY,           /* Modify specified meter. */
+    OFPMC13_DELETE,           /* Delete specified meter. */
+};
+
+/* Meter configuration flags */
+enum ofp13_meter_flags {
+    OFPMF13_KBPS    = 1 << 0,     /* Rate value in kb/s (kilo-bit per second). */
+    OFPMF13_PKTPS   = 1 << 1,     /* Rate value in packet/sec. */
+    OFPMF13_BURST   = 1 << 2,     /* Do burst size. */
+    OFPMF13_STATS   = 1 << 3,     /* Collect statistics. */
+};
+
+/* Meter configuration. OFPT_METER_MOD. */
+struct ofp13_meter_mod {
+    struct ofp_header header;
+    uint16_t command;        /* One of OFPMC_*. */
+    uint16_t flags;          /* Bitmap of OFPMF_* flags. */
+    uint32_t meter_id;       /* Meter instance. */
+    struct ofp13_meter_band_header bands[0]; /* The band list length is
+                                           inferred from the length field
+                                           in the header. */
+};
+
+/* ofp_error_msg 'code' values for OFPET_METER_MOD_FAILED.  'data' contains
+ * at least the first 64 bytes of the failed request. */
+enum ofp13_meter_mod_failed_code {
+    OFPMMFC13_UNKNOWN        = 0,  /* Unspecified error. */
+    OFPMMFC13_METER_EXISTS   = 1,  /* Meter not added because a Meter ADD
+                                    * attempted to replace an existing Meter. */
+    OFPMMFC13_INVALID_METER  = 2,  /* Meter not added because Meter specified
+                                    * is invalid. */
+    OFPMMFC13_UNKNOWN_METER  = 3,  /* Meter not modified because a Meter
+                                      MODIFY attempted to modify a non-existent
+                                      Meter. */
+    OFPMMFC13_BAD_COMMAND    = 4,  /* Unsupported or unknown command. */
+    OFPMMFC13_BAD_FLAGS      = 5,  /* Flag configuration unsupported. */
+    OFPMMFC13_BAD_RATE       = 6,  /* Rate unsupported. */
+    OFPMMFC13_BAD_BURST      = 7,  /* Burst size unsupported. */
+    OFPMMFC13_BAD_BAND       = 8,  /* Band unsupported. */
+    OFPMMFC13_BAD_BAND_VALUE = 9,  /* Band value unsupported. */
+    OFPMMFC13_OUT_OF_METERS  = 10, /* No more meters available. */
+    OFPMMFC13_OUT_OF_BANDS   = 11, /* The maximum number of properties
+                                    * for a meter has been exceeded. */
+};
+
+/* Body of OFPMP_METER and OFPMP_METER_CONFIG requests. */
+struct ofp13_meter_multipart_request {
+    uint32_t meter_id;    /* Meter instance, or OFPM_ALL. */
+    uint8_t pad[4];       /* Align to 64 bits. */
+};
+
+/* Statistics for each meter band */
+struct ofp13_meter_band_stats {
+    uint64_t packet_band_count;   /* Number of packets in band. */
+    uint64_t byte_band_count;     /* Number of bytes in band. */
+};
+
+/* Body of reply to OFPMP_METER request. Meter statistics. */
+struct ofp13_meter_stats {
+    uint32_t meter_id;            /* Meter instance. */
+    uint16_t len;                 /* Length in bytes of this stats. */
+    uint8_t pad[6];
+    uint32_t flow_count;          /* Number of flows bound to meter. */
+    uint64_t packet_in_count;     /* Number of packets in input. */
+    uint64_t byte_in_count;       /* Number of bytes in input. */
+    uint32_t duration_sec;        /* Time meter has been alive in seconds. */
+    uint32_t duration_nsec;       /* Time meter has been alive in nanoseconds beyond
+                                     duration_sec. */
+    struct ofp13_meter_band_stats band_stats[0]; /* The band_stats length is
+                                           inferred from the length field. */
+};
+
+/* Body of reply to OFPMP_METER_CONFIG request. Meter configuration. */
+struct ofp13_meter_config {
+    uint16_t length;              /* Length of this entry. */
+    uint16_t flags;               /* All OFPMF_* that apply. */
+    uint32_t meter_id;            /* Meter instance. */
+    struct ofp13_meter_band_header bands[0]; /* The bands length is
+                                           inferred from the length field. */
+};
+
+/* Body of reply to OFPMP_METER_FEATURES request. Meter features. */
+struct ofp13_meter_features {
+    uint32_t max_meter;       /* Maximum number of meters. */
+    uint32_t band_types;      /* Bitmaps of OFPMBT_* values supported. */
+    uint32_t capabilities;    /* Bitmaps of "ofp_meter_flags". */
+    uint8_t max_bands;        /* Maximum bands per meters */
+    uint8_t max_color;        /* Maximum color value */
+    uint8_t pad[2];
+};
 #endif /* OPENFLOW_13_H_ */
\ No newline at end of file
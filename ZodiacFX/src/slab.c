@@ -0,0 +1,210 @@
+/**
+ * @file
+ * slab.c
+ *
+ * This file contains the slab memory allocator functions
+ *
+ */
+
+/*
+ * This file is part of the Zodiac FX firmware.
+ * Copyright (c) 2016 Northbound Networks.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Paul Zanna <paul@northboundnetworks.com>
+ *
+ */
+
+#include <stddef.h>
+#include "slab.h"
+
+/*
+*	Every record is preceded by a block header. Blocks are laid out back
+*	to back so the next block is found by adding the size, free blocks next
+*	to each other are joined as they are walked over. Sizes are kept to a
+*	multiple of 8 so 64 bit fields in the records stay aligned.
+*/
+struct slab_block
+{
+	uint32_t size;		// Size of the block including this header
+	uint32_t used;
+};
+
+#define SLAB_ALIGN(x)		(((x) + 7) & ~7)
+#define SLAB_HDR_SIZE		SLAB_ALIGN(sizeof(struct slab_block))
+#define SLAB_MIN_BLOCK		(SLAB_HDR_SIZE + 8)	// Don't split off blocks smaller than this
+
+/*
+*	Join a free block with any free blocks that follow it
+*
+*	@param *s - pointer to the slab.
+*	@param *blk - pointer to the free block.
+*
+*/
+static void slab_join(struct slab *s, struct slab_block *blk)
+{
+	uint8_t *end = s->mem + s->size;
+	struct slab_block *next = (struct slab_block *)((uint8_t *)blk + blk->size);
+	while ((uint8_t *)next < end && next->used == 0)
+	{
+		blk->size += next->size;
+		next = (struct slab_block *)((uint8_t *)blk + blk->size);
+	}
+	return;
+}
+
+/*
+*	Set up a slab in a block of memory
+*
+*	@param *s - pointer to the slab.
+*	@param *mem - pointer to the memory to allocate from.
+*	@param size - size of the memory.
+*
+*/
+void slab_init(struct slab *s, void *mem, uint32_t size)
+{
+	// Start on an 8 byte boundary
+	uint8_t *start = (uint8_t *)SLAB_ALIGN((uintptr_t)mem);
+	size -= start - (uint8_t *)mem;
+	s->mem = start;
+	s->size = size & ~7;
+	s->high_water = 0;
+	s->failures = 0;
+	slab_reset(s);
+	return;
+}
+
+/*
+*	Release everything in a slab at once
+*
+*	The whole slab becomes a single free block so this takes the same time
+*	however many records were allocated. The high water mark is kept.
+*
+*	@param *s - pointer to the slab.
+*
+*/
+void slab_reset(struct slab *s)
+{
+	struct slab_block *blk = (struct slab_block *)s->mem;
+	blk->size = s->size;
+	blk->used = 0;
+	s->used = 0;
+	s->blocks = 0;
+	return;
+}
+
+/*
+*	Allocate a record from a slab
+*
+*	Uses the first free block that is big enough.
+*
+*	@param *s - pointer to the slab.
+*	@param size - size of the record.
+*
+*	Returns a pointer to the record, or NULL if there is no room.
+*/
+void *slab_alloc(struct slab *s, uint32_t size)
+{
+	if (size == 0) return NULL;
+	uint32_t need = SLAB_HDR_SIZE + SLAB_ALIGN(size);
+	uint8_t *end = s->mem + s->size;
+	struct slab_block *blk = (struct slab_block *)s->mem;
+
+	while ((uint8_t *)blk < end)
+	{
+		if (blk->used == 0)
+		{
+			slab_join(s, blk);
+			if (blk->size >= need)
+			{
+				// Split the rest off into a new free block if it is worth keeping
+				if (blk->size - need >= SLAB_MIN_BLOCK)
+				{
+					struct slab_block *rest = (struct slab_block *)((uint8_t *)blk + need);
+					rest->size = blk->size - need;
+					rest->used = 0;
+					blk->size = need;
+				}
+				blk->used = 1;
+				s->used += blk->size;
+				s->blocks++;
+				if (s->used > s->high_water) s->high_water = s->used;
+				return (uint8_t *)blk + SLAB_HDR_SIZE;
+			}
+		}
+		blk = (struct slab_block *)((uint8_t *)blk + blk->size);
+	}
+	s->failures++;
+	return NULL;
+}
+
+/*
+*	Return a record to a slab
+*
+*	@param *s - pointer to the slab.
+*	@param *ptr - pointer to the record.
+*
+*/
+void slab_free(struct slab *s, void *ptr)
+{
+	if (ptr == NULL) return;
+	struct slab_block *blk = (struct slab_block *)((uint8_t *)ptr - SLAB_HDR_SIZE);
+	if (blk->used == 0) return;
+	blk->used = 0;
+	s->used -= blk->size;
+	s->blocks--;
+	slab_join(s, blk);
+	return;
+}
+
+/*
+*	Report how much of a slab is used and how broken up the free space is
+*
+*	@param *s - pointer to the slab.
+*	@param *stats - pointer to the struct to fill in.
+*
+*/
+void slab_get_stats(struct slab *s, struct slab_stats *stats)
+{
+	uint8_t *end = s->mem + s->size;
+	struct slab_block *blk = (struct slab_block *)s->mem;
+
+	stats->total = s->size;
+	stats->used = s->used;
+	stats->high_water = s->high_water;
+	stats->free = s->size - s->used;
+	stats->largest_free = 0;
+	stats->free_blocks = 0;
+	stats->blocks = s->blocks;
+
+	while ((uint8_t *)blk < end)
+	{
+		if (blk->used == 0)
+		{
+			slab_join(s, blk);
+			stats->free_blocks++;
+			if (blk->size - SLAB_HDR_SIZE > stats->largest_free) stats->largest_free = blk->size - SLAB_HDR_SIZE;
+		}
+		blk = (struct slab_block *)((uint8_t *)blk + blk->size);
+	}
+
+	if (stats->free > 0)
+	{
+		stats->fragmentation = 100 - (((stats->largest_free + SLAB_HDR_SIZE) * 100) / stats->free);
+	} else {
+		stats->fragmentation = 0;
+	}
+	return;
+}
@@ -0,0 +1,64 @@
+/**
+ * @file
+ * slab.h
+ *
+ * This file contains the slab memory allocator functions
+ *
+ */
+
+/*
+ * This file is part of the Zodiac FX firmware.
+ * Copyright (c) 2016 Northbound Networks.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Paul Zanna <paul@northboundnetworks.com>
+ *
+ */
+
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stdint.h>
+
+/* A block of memory that variable sized records are allocated from */
+struct slab
+{
+	uint8_t *mem;
+	uint32_t size;
+	uint32_t used;			// Bytes in allocated blocks, including their headers
+	uint32_t high_water;	// Most bytes that have been in use at once
+	uint16_t blocks;		// Number of allocated blocks
+	uint16_t failures;		// Number of allocations that could not be met
+};
+
+struct slab_stats
+{
+	uint32_t total;
+	uint32_t used;
+	uint32_t high_water;
+	uint32_t free;
+	uint32_t largest_free;	// Largest record that can be allocated
+	uint16_t free_blocks;	// Number of separate free areas
+	uint16_t blocks;
+	uint8_t fragmentation;	// Percentage of the free space outside of the largest free block
+};
+
+void slab_init(struct slab *s, void *mem, uint32_t size);
+void slab_reset(struct slab *s);
+void *slab_alloc(struct slab *s, uint32_t size);
+void slab_free(struct slab *s, void *ptr);
+void slab_get_stats(struct slab *s, struct slab_stats *stats);
+
+#endif /* SLAB_H_ */
@@ -50,11 +50,17 @@ struct ofp10_port_stats phys10_port_stats[4];
 struct ofp13_port_stats phys13_port_stats[4];
 uint8_t port_status[4];
 uint8_t last_port_status[4];
+uint8_t port_config[4];		// OFPPC_* flags set by the controller with a port mod
+uint8_t flood_mask[5];		// Ports to send a FLOOD to, indexed by the port the packet came in on (0 = none)
+uint8_t all_mask[5];		// Ports to send an ALL to, indexed by the port the packet came in on (0 = none)
+uint8_t meter_ingress_limit[4];		// Ingress limit codes requested by offloaded OpenFlow meters
+static uint8_t hw_ingress_limit[4] = {0xFF, 0xFF, 0xFF, 0xFF};	// Codes currently written to the switch
+static uint8_t hw_egress_limit[4] = {0xFF, 0xFF, 0xFF, 0xFF};
 extern uint8_t NativePortMatrix;
 extern bool masterselect;
 extern bool stackenabled;
-/** Buffer for ethernet packets */
-static volatile uint8_t gs_uc_eth_buffer[GMAC_FRAME_LENTGH_MAX];
+/** Buffer for ethernet packets, with headroom in front of the frame for pushing tags */
+static volatile uint8_t gs_uc_eth_buffer[PACKET_HEADROOM + GMAC_FRAME_LENTGH_MAX];
 
 /* SPI clock setting (Hz). */
 static uint32_t gs_ul_spi_clock = 500000;
@@ -511,6 +517,74 @@ void enableOF(void)
 	if (Zodiac_Config.of_port[3] == 1) switch_write(69,3);
 }
 
+/*
+*	Convert a rate in kbps to a KSZ8795 rate limit code
+*
+*	Rates from 1Mbps to 99Mbps are set in 1Mbps steps (codes 1 - 99) and
+*	rates below 1Mbps in 64kbps steps (codes 101 - 115). A code of 0
+*	disables the limit.
+*
+*	@param kbps - the rate in kilobits per second, 0 for no limit.
+*
+*/
+uint8_t ratelimit_encode(uint32_t kbps)
+{
+	if (kbps == 0 || kbps >= 100000) return 0;
+	if (kbps >= 1000) return (kbps / 1000);
+	if (kbps < 64) return 101;
+	return (100 + (kbps / 64));
+}
+
+/*
+*	Convert a KSZ8795 rate limit code back to a rate in kbps
+*
+*	@param code - the rate limit code.
+*
+*/
+uint32_t ratelimit_decode(uint8_t code)
+{
+	if (code >= 1 && code <= 99) return (code * 1000);
+	if (code >= 101 && code <= 115) return ((code - 100) * 64);
+	return 0;
+}
+
+/*
+*	Write the port rate limits to the switch
+*
+*	The ingress limit of a port is taken from the configuration, or if none
+*	is configured from the OpenFlow meter offloaded to that port. Registers
+*	are only written when the limit has changed.
+*
+*/
+void ratelimit_apply(void)
+{
+	uint8_t code;
+
+	for (int i=0;i<4;i++)
+	{
+		// Ignore invalid values, e.g. from an EEPROM written by older firmware
+		if (ratelimit_decode(Zodiac_Config.ingress_limit[i]) == 0) Zodiac_Config.ingress_limit[i] = 0;
+		if (ratelimit_decode(Zodiac_Config.egress_limit[i]) == 0) Zodiac_Config.egress_limit[i] = 0;
+
+		code = Zodiac_Config.ingress_limit[i];
+		if (code == 0) code = meter_ingress_limit[i];
+		if (code != hw_ingress_limit[i])
+		{
+			// Set the same limit on all 4 priority queues so the whole port is policed
+			for (int q=0;q<4;q++) switch_write(22 + (i*16) + q, code);	// Port Qn ingress data rate limit
+			hw_ingress_limit[i] = code;
+		}
+
+		code = Zodiac_Config.egress_limit[i];
+		if (code != hw_egress_limit[i])
+		{
+			for (int q=0;q<4;q++) switch_write(165 + (i*16) + q, code);	// Port Qn egress data rate limit
+			hw_egress_limit[i] = code;
+		}
+	}
+	return;
+}
+
 /*
 *	Update the port stats counters
 *
@@ -635,15 +709,101 @@ void update_port_status(void)
 	last_port_status[0] = port_status[0];
 	last_port_status[1] = port_status[1];
 	last_port_status[2] = port_status[2];
-	last_port_status[3] = port_status[2];
+	last_port_status[3] = port_status[3];
 	// Update port status
 	port_status[0] = (switch_read(30) & 32) >> 5;
 	port_status[1] = (switch_read(46) & 32) >> 5;
 	port_status[2] = (switch_read(62) & 32) >> 5;
 	port_status[3] = (switch_read(78) & 32) >> 5;
+	// Only rebuild the flood masks if a link has gone up or down
+	if (memcmp(last_port_status, port_status, sizeof(port_status)) != 0) update_port_masks();
+	return;
+}
+
+/*
+*	Rebuilds the FLOOD and ALL port masks
+*
+*	Called when a link changes state, the VLAN config changes or the
+*	controller changes a port's config. Ports that are not OpenFlow ports,
+*	have no link or are administratively down are left out.
+*
+*/
+void update_port_masks(void)
+{
+	uint8_t flood = 0;
+	uint8_t all = 0;
+
+	for (int x=0;x<4;x++)
+	{
+		if (Zodiac_Config.of_port[x] != 1 || port_status[x] == 0) continue;
+		if (port_config[x] & (OFPPC_PORT_DOWN | OFPPC_NO_FWD)) continue;
+		all |= (1<<x);
+		if (!(port_config[x] & OFPPC_NO_FLOOD)) flood |= (1<<x);
+	}
+
+	flood_mask[0] = flood;
+	all_mask[0] = all;
+	for (int x=0;x<4;x++)
+	{
+		flood_mask[x+1] = flood & ~(1<<x);
+		all_mask[x+1] = all & ~(1<<x);
+	}
+	return;
+}
+
+/*
+*	Clear the port config set by a controller
+*
+*	Called when a new controller takes over or the standalone bridge
+*	starts, so a port one controller disabled doesn't stay that way.
+*
+*/
+void port_config_clear(void)
+{
+	memset(port_config, 0, sizeof(port_config));
+	update_port_masks();
 	return;
 }
 
+/*
+*	Get the hardware address reported for a port
+*
+*	Each port gets a locally administered address made from the switch
+*	MAC, with the port number in the first byte so it can't be the same
+*	as a port address of another Zodiac FX.
+*
+*	@param port - the port number, starting from 0.
+*	@param *mac - pointer to the 6 byte buffer to put the address in.
+*
+*/
+void port_hw_addr(uint8_t port, uint8_t *mac)
+{
+	memcpy(mac, Zodiac_Config.MAC_address, 6);
+	mac[0] = (mac[0] | 0x02) ^ ((port + 1) << 2);
+	return;
+}
+
+/*
+*	Check if a received frame is dropped by the port's NO_RECV config
+*
+*	OpenFlow 1.0 still lets spanning tree frames in unless NO_RECV_STP
+*	is also set.
+*
+*	@param *frame - pointer to the frame.
+*	@param port - port the frame was received on, from 1.
+*
+*/
+static bool port_recv_blocked(uint8_t *frame, uint8_t port)
+{
+	static const uint8_t stp_mac[6] = {0x01, 0x80, 0xC2, 0x00, 0x00, 0x00};
+	uint8_t config = port_config[port-1];
+
+	if ((config & (OFPPC_NO_RECV | OFPPC_NO_RECV_STP)) == 0) return false;
+	if (OF_Version != 1) return (config & OFPPC_NO_RECV) != 0;
+	if (memcmp(frame, stp_mac, 6) == 0) return (config & OFPPC_NO_RECV_STP) != 0;
+	return (config & OFPPC_NO_RECV) != 0;
+}
+
 /*
 *	GMAC write function
 *
@@ -654,7 +814,8 @@ void update_port_status(void)
 */
 void gmac_write(uint8_t *p_buffer, uint16_t ul_size, uint8_t port)
 {
-	if (ul_size > GMAC_FRAME_LENTGH_MAX)
+	// Leave room for the tail tag
+	if (ul_size > GMAC_FRAME_LENTGH_MAX - 1)
 	{
 		return;
 	}
@@ -794,6 +955,7 @@ void switch_init(void)
 		switch_write(5,128);	// Enable 802.1q
 		disableOF(); // clear all port settings
 		if (Zodiac_Config.OFEnabled == OF_ENABLED) enableOF();
+		ratelimit_apply();	// Set the port rate limits
 		return;
 }
 /*
@@ -807,19 +969,20 @@ void task_switch(struct netif *netif)
 	uint32_t ul_rcv_size = 0;
 	uint8_t tag = 0;
 	int8_t in_port = 0;
+	uint8_t *rx_frame = (uint8_t *) gs_uc_eth_buffer + PACKET_HEADROOM;	// Frames are received after the headroom
 			
 	// Check if the slave device has a packet to send us
 	if(masterselect == false && ioport_get_pin_level(SPI_IRQ1) && stackenabled == true) MasterStackRcv();
 
 	/* Main packet processing loop */
-	uint32_t dev_read = gmac_dev_read(&gs_gmac_dev, (uint8_t *) gs_uc_eth_buffer, sizeof(gs_uc_eth_buffer), &ul_rcv_size);
+	uint32_t dev_read = gmac_dev_read(&gs_gmac_dev, rx_frame, GMAC_FRAME_LENTGH_MAX, &ul_rcv_size);
 	if (dev_read == GMAC_OK)
 	{
 		// If EtherType filtering is enabled the check that the frame has a valid EtherType
 		if (Zodiac_Config.ethtype_filter == 1)
 		{
 			uint16_t eth_prot;
-			memcpy(&eth_prot, gs_uc_eth_buffer + 12, 2);
+			memcpy(&eth_prot, rx_frame + 12, 2);
 			eth_prot = ntohs(eth_prot);
 			if (eth_prot != 0x0800 && eth_prot != 0x0806 && eth_prot != 0x86DD && eth_prot != 0x0842 && eth_prot != 0x8100 && eth_prot != 0x88E7 && eth_prot != 0x8847 && eth_prot != 0x88CC)
 			{
@@ -832,21 +995,23 @@ void task_switch(struct netif *netif)
 		{
 			if (ul_rcv_size > 0)
 			{
-				uint8_t* tail_tag = (uint8_t*)(gs_uc_eth_buffer + (int)(ul_rcv_size)-1);
+				uint8_t* tail_tag = (uint8_t*)(rx_frame + (int)(ul_rcv_size)-1);
 				uint8_t tag = *tail_tag + 1;
 				if (Zodiac_Config.OFEnabled == OF_ENABLED && Zodiac_Config.of_port[tag-1] == 1)
 				{
-					//MasterStackSend((uint8_t *) gs_uc_eth_buffer, ul_rcv_size);
+					//MasterStackSend(rx_frame, ul_rcv_size);
 					phys10_port_stats[tag-1].rx_packets++;
 					phys13_port_stats[tag-1].rx_packets++;
 					ul_rcv_size--; // remove the tail first
-					nnOF_tablelookup((uint8_t *) gs_uc_eth_buffer, &ul_rcv_size, tag);
+					if (port_recv_blocked(rx_frame, tag)) return;
+					struct packet_desc pkt = {rx_frame, ul_rcv_size, PACKET_HEADROOM, GMAC_FRAME_LENTGH_MAX - ul_rcv_size};
+					nnOF_tablelookup(&pkt, tag);
 					return;
 				} else {
 					TRACE("switch.c: %d byte received from controller", ul_rcv_size);
 					struct pbuf *p;
 					p = pbuf_alloc(PBUF_RAW, ul_rcv_size+1, PBUF_POOL);
-					memcpy(p->payload, &gs_uc_eth_buffer,(ul_rcv_size-1));
+					memcpy(p->payload, rx_frame,(ul_rcv_size-1));
 					p->len = ul_rcv_size-1;
 					p->tot_len = ul_rcv_size-1;
 					netif->input(p, netif);
@@ -41,8 +41,14 @@ int switch_read(uint8_t param1);
 int switch_write(uint8_t param1, uint8_t param2);
 void update_port_stats(void);
 void update_port_status(void);
+void update_port_masks(void);
+void port_config_clear(void);
+void port_hw_addr(uint8_t port, uint8_t *mac);
 void disableOF(void);
 void enableOF(void);
+uint8_t ratelimit_encode(uint32_t kbps);
+uint32_t ratelimit_decode(uint8_t code);
+void ratelimit_apply(void);
 void stacking_init(bool master);
 void MasterStackSend(uint8_t *p_uc_data, uint16_t ul_size);
 void MasterStackRcv(void);